@@ -16,13 +16,20 @@
  * limitations under the License.
  */
 
+#include "../cpu/cpu.h"
 #include "../cpu/ports.h"
 #include "../kernel/panic.h"
+#include "../klibc/dynarray.h"
+#include "../klibc/hashmap.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
 #include "../mm/vmm.h"
+#include "../sys/clock.h"
 #include "../sys/hpet.h"
 #include "../sys/pci.h"
+#include "../sys/timer.h"
 #include "madt.h"
+#include "srat.h"
 #include <lai/core.h>
 #include <lai/drivers/ec.h>
 #include <lai/helpers/sci.h>
@@ -36,6 +43,14 @@ static bool use_xsdt;
 static struct rsdt *rsdt;
 static uint8_t revision;
 
+// Every valid table by signature, in RSDT order for tables that appear more
+// than once like the SSDTs. Filled once by acpi_init() and only read after.
+struct acpi_sdt_set {
+	DYNARRAY_STRUCT(void *) tables;
+};
+
+static struct hashmap sdt_cache = HASHMAP_INIT;
+
 static void init_ec(void) {
 	LAI_CLEANUP_STATE lai_state_t state;
 	lai_init_state(&state);
@@ -65,6 +80,73 @@ static void init_ec(void) {
 	}
 }
 
+__attribute__((always_inline)) inline bool is_canonical(uint64_t addr) {
+	return ((addr <= 0x00007FFFFFFFFFFF) ||
+			((addr >= 0xFFFF800000000000) && (addr <= 0xFFFFFFFFFFFFFFFF)));
+}
+
+// Following function based on
+// https://github.com/managarm/lai/blob/master/helpers/pc-bios.c's function
+// lai_bios_calc_checksum()
+static uint8_t acpi_checksum(void *ptr, size_t size) {
+	uint8_t sum = 0, *_ptr = ptr;
+	for (size_t i = 0; i < size; i++)
+		sum += _ptr[i];
+	return sum;
+}
+
+static uint64_t sdt_key(const char *signature) {
+	uint32_t key;
+	memcpy(&key, signature, sizeof(key));
+	return key;
+}
+
+static void sdt_cache_add(acpi_header_t *table) {
+	uint64_t key = sdt_key(table->signature);
+	struct acpi_sdt_set *set = hashmap_get(&sdt_cache, key);
+	if (set == NULL) {
+		set = kcalloc(1, sizeof(struct acpi_sdt_set));
+		hashmap_put(&sdt_cache, key, set);
+	}
+	DYNARRAY_PUSHBACK(set->tables, (void *)table);
+}
+
+static void sdt_cache_init(void) {
+	const size_t entries =
+		(rsdt->header.length - sizeof(acpi_header_t)) / (use_xsdt ? 8 : 4);
+
+	for (size_t i = 0; i < entries; i++) {
+		uintptr_t addr;
+		if (use_xsdt)
+			addr = ((uint64_t *)rsdt->ptrs_start)[i];
+		else
+			addr = ((uint32_t *)rsdt->ptrs_start)[i];
+
+		acpi_header_t *table = (void *)addr + MEM_PHYS_OFFSET;
+		if (acpi_checksum(table, table->length)) {
+			printf("ACPI: Skipping %.4s with a bad checksum\n",
+				   table->signature);
+			continue;
+		}
+		sdt_cache_add(table);
+	}
+
+	// The DSDT is only pointed to by the FADT, it's cached under its
+	// signature so LAI finds it like any other table
+	acpi_fadt_t *facp = acpi_find_sdt("FACP", 0);
+	if (facp == NULL)
+		return;
+
+	uint64_t dsdt_addr = facp->dsdt;
+	if (is_canonical(facp->x_dsdt) && revision >= 2)
+		dsdt_addr = facp->x_dsdt;
+
+	acpi_header_t *dsdt = (void *)dsdt_addr + MEM_PHYS_OFFSET;
+	if (acpi_checksum(dsdt, dsdt->length))
+		printf("ACPI: DSDT checksum is wrong, using it anyway\n");
+	sdt_cache_add(dsdt);
+}
+
 void acpi_init(acpi_xsdp_t *rsdp) {
 	printf("ACPI: Revision: %hhu\n", rsdp->revision);
 	revision = rsdp->revision;
@@ -78,47 +160,30 @@ void acpi_init(acpi_xsdp_t *rsdp) {
 		rsdt = (struct rsdt *)((uintptr_t)rsdp->rsdt + MEM_PHYS_OFFSET);
 		printf("ACPI: Found RSDT at %llX\n", (uintptr_t)rsdt);
 	}
+	sdt_cache_init();
 	hpet_init();
+	cpu_calibrate_tsc();
+	clock_init();
 	pci_init();
+	init_madt();
+	init_srat();
+}
+
+// Interpreting the AML is the slow part and nothing before the drivers needs
+// it, so it's left to a boot task
+void acpi_namespace_init(void) {
 	lai_set_acpi_revision(revision);
 	lai_create_namespace();
 	lai_enable_acpi(1);
-	init_madt();
 	init_ec();
 }
 
-// Following function based on
-// https://github.com/managarm/lai/blob/master/helpers/pc-bios.c's function
-// lai_bios_calc_checksum()
-static uint8_t acpi_checksum(void *ptr, size_t size) {
-	uint8_t sum = 0, *_ptr = ptr;
-	for (size_t i = 0; i < size; i++)
-		sum += _ptr[i];
-	return sum;
-}
-
-// Find SDT by signature
+// Tables are looked up in the cache built by acpi_init()
 void *acpi_find_sdt(const char *signature, int index) {
-	int cnt = 0;
-
-	const size_t entries =
-		(rsdt->header.length - sizeof(acpi_header_t)) / (use_xsdt ? 8 : 4);
-
-	for (size_t i = 0; i < entries; i++) {
-		acpi_header_t *ptr;
-		if (use_xsdt) {
-			ptr = (acpi_header_t *)(uintptr_t)((uint64_t *)rsdt->ptrs_start)[i];
-		} else {
-			ptr = (acpi_header_t *)(uintptr_t)((uint32_t *)rsdt->ptrs_start)[i];
-		}
-
-		if (!memcmp(ptr->signature, signature, 4) &&
-			!acpi_checksum(ptr, ptr->length) && cnt++ == index) {
-			return (void *)ptr + MEM_PHYS_OFFSET;
-		}
-	}
-
-	return NULL;
+	struct acpi_sdt_set *set = hashmap_get(&sdt_cache, sdt_key(signature));
+	if (set == NULL || index < 0 || (size_t)index >= set->tables.length)
+		return NULL;
+	return set->tables.storage[index];
 }
 
 void laihost_log(int level, const char *msg) {
@@ -165,27 +230,8 @@ void laihost_unmap(void *pointer, size_t count) {
 	(void)count;
 }
 
-__attribute__((always_inline)) inline bool is_canonical(uint64_t addr) {
-	return ((addr <= 0x00007FFFFFFFFFFF) ||
-			((addr >= 0xFFFF800000000000) && (addr <= 0xFFFFFFFFFFFFFFFF)));
-}
-
 void *laihost_scan(const char *signature, size_t index) {
-	// The DSDT must be found using a pointer in the FADT
-	if (!memcmp(signature, "DSDT", 4)) {
-		acpi_fadt_t *facp = acpi_find_sdt("FACP", 0);
-		uint64_t dsdt_addr = 0;
-
-		if (is_canonical(facp->x_dsdt) && revision >= 2) {
-			dsdt_addr = facp->x_dsdt;
-		} else {
-			dsdt_addr = facp->dsdt;
-		}
-
-		return (void *)dsdt_addr + MEM_PHYS_OFFSET;
-	} else {
-		return acpi_find_sdt(signature, index);
-	}
+	return acpi_find_sdt(signature, index);
 }
 
 void laihost_outb(uint16_t port, uint8_t val) {
@@ -244,10 +290,10 @@ uint32_t laihost_pci_readd(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t fun,
 
 void laihost_sleep(uint64_t ms) {
 	// Convert to microseconds
-	hpet_usleep(ms * 1000);
+	timer_usleep(ms * 1000);
 }
 
 uint64_t laihost_timer(void) {
 	// Convert to 100 nanosecond units
-	return hpet_counter_value() / 100000000;
+	return clock_monotonic_ns() / 100;
 }
@@ -29,6 +29,7 @@ struct rsdt {
 } __attribute__((packed));
 
 void acpi_init(acpi_xsdp_t *rsdp);
+void acpi_namespace_init(void);
 void *acpi_find_sdt(const char *signature, int index);
 
 #endif
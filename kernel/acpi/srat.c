@@ -0,0 +1,140 @@
+/*
+ * Copyright 2021 Misha
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "srat.h"
+#include "../cpu/cpu.h"
+#include "../klibc/dynarray.h"
+#include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "madt.h"
+
+// Proximity domain of every node, nodes are numbered in order of appearance
+static uint32_t node_domains[PMM_MAX_NODES];
+static size_t node_count = 0;
+
+static uint8_t lapic_nodes[256] = {0};
+
+DYNARRAY_STATIC(struct pmm_node_range, srat_ranges);
+
+static size_t domain_to_node(uint32_t domain) {
+	for (size_t i = 0; i < node_count; i++)
+		if (node_domains[i] == domain)
+			return i;
+
+	if (node_count == PMM_MAX_NODES) {
+		printf("ACPI/SRAT: Too many proximity domains, folding domain %u "
+			   "into node 0\n",
+			   domain);
+		return 0;
+	}
+
+	node_domains[node_count] = domain;
+	return node_count++;
+}
+
+size_t srat_lapic_node(uint32_t lapic_id) {
+	return lapic_id < 256 ? lapic_nodes[lapic_id] : 0;
+}
+
+// Collect the node to node distances from the SLIT, if there is one
+static uint8_t *read_slit(void) {
+	struct slit *slit = acpi_find_sdt("SLIT", 0);
+	if (!slit)
+		return NULL;
+
+	uint8_t *distances = kmalloc(node_count * node_count);
+	for (size_t a = 0; a < node_count; a++) {
+		for (size_t b = 0; b < node_count; b++) {
+			uint64_t from = node_domains[a], to = node_domains[b];
+			if (from < slit->localities && to < slit->localities)
+				distances[a * node_count + b] =
+					slit->entries[from * slit->localities + to];
+			else
+				distances[a * node_count + b] = a == b ? 10 : 20;
+		}
+	}
+
+	return distances;
+}
+
+void init_srat(void) {
+	struct srat *srat = acpi_find_sdt("SRAT", 0);
+	if (!srat) {
+		printf("ACPI/SRAT: SRAT table can't be found, assuming one node\n");
+		return;
+	}
+
+	for (uint8_t *srat_ptr = (uint8_t *)srat->srat_entries_begin;
+		 (uintptr_t)srat_ptr < (uintptr_t)srat + srat->sdt.length;
+		 srat_ptr += *(srat_ptr + 1)) {
+		switch (*(srat_ptr)) {
+			case 0: {
+				// Processor local APIC affinity
+				struct srat_lapic *lapic = (void *)srat_ptr;
+				if (!(lapic->flags & SRAT_ENABLED))
+					break;
+				uint32_t domain = lapic->domain_low |
+								  (uint32_t)lapic->domain_high[0] << 8 |
+								  (uint32_t)lapic->domain_high[1] << 16 |
+								  (uint32_t)lapic->domain_high[2] << 24;
+				lapic_nodes[lapic->apic_id] = domain_to_node(domain);
+				break;
+			}
+			case 1: {
+				// Memory affinity
+				struct srat_memory *mem = (void *)srat_ptr;
+				if (!(mem->flags & SRAT_ENABLED))
+					break;
+				struct pmm_node_range range = {.base = mem->base,
+											   .length = mem->length,
+											   .node = domain_to_node(
+												   mem->domain)};
+				printf("ACPI/SRAT: Memory %llX-%llX on node %u\n",
+					   mem->base, mem->base + mem->length, range.node);
+				DYNARRAY_PUSHBACK(srat_ranges, range);
+				break;
+			}
+			case 2: {
+				// Processor local x2APIC affinity
+				struct srat_x2apic *x2apic = (void *)srat_ptr;
+				if (!(x2apic->flags & SRAT_ENABLED) || x2apic->x2apic_id >= 256)
+					break;
+				lapic_nodes[x2apic->x2apic_id] = domain_to_node(x2apic->domain);
+				break;
+			}
+		}
+	}
+
+	if (node_count == 0)
+		node_count = 1;
+	printf("ACPI/SRAT: Found %u NUMA node(s)\n", node_count);
+
+	for (size_t i = 0; i < madt_local_apics.length; i++)
+		printf("ACPI/SRAT: Local APIC 0x%X is on node %u\n",
+			   madt_local_apics.storage[i]->apic_id,
+			   srat_lapic_node(madt_local_apics.storage[i]->apic_id));
+
+	// Processors that are already running picked node 0 in cpu_init
+	for (size_t i = 0; i < cpu_count; i++)
+		cpu_locals[i].numa_node = srat_lapic_node(cpu_locals[i].lapic_id);
+
+	uint8_t *distances = read_slit();
+	pmm_numa_init(srat_ranges.storage, srat_ranges.length, node_count,
+				  distances);
+	kfree(distances);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "alternative.h"
+#include "../klibc/math.h"
+#include "../klibc/printf.h"
+#include "cpu.h"
+#include <cpuid.h>
+#include <stddef.h>
+
+struct alt_instr {
+	// Both relative to the field itself
+	int32_t orig;
+	int32_t repl;
+	uint16_t feature;
+	uint8_t orig_len;
+	uint8_t repl_len;
+} __attribute__((packed));
+
+// Bounds of the .altinstructions section, from the linker script
+extern struct alt_instr __alt_instructions[];
+extern struct alt_instr __alt_instructions_end[];
+
+uint64_t cpu_features = 0;
+
+// The recommended NOP of each length, padding is filled with as few as fit
+static const uint8_t nops[8][8] = {
+	{0x90},
+	{0x66, 0x90},
+	{0x0F, 0x1F, 0x00},
+	{0x0F, 0x1F, 0x40, 0x00},
+	{0x0F, 0x1F, 0x44, 0x00, 0x00},
+	{0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+	{0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+	{0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+// memcpy() has patched branches of its own, so the bytes are written one by
+// one
+static void patch_bytes(uint8_t *dest, const uint8_t *src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		((volatile uint8_t *)dest)[i] = src[i];
+}
+
+// Runs on the BSP before the APs are started and with interrupts off, so
+// nothing executes the code that changes. The kernel text is mapped read-only,
+// CR0.WP is cleared meanwhile to write it anyway.
+void alternatives_apply(void) {
+	size_t total = 0, patched = 0;
+	uint64_t rflags = cpu_irq_save();
+	uint64_t cr0 = read_cr("0");
+	write_cr("0", cr0 & ~(1 << 16));
+
+	for (struct alt_instr *alt = __alt_instructions;
+		 alt < __alt_instructions_end; alt++) {
+		total++;
+		if (!cpu_feature(alt->feature))
+			continue;
+
+		uint8_t *orig = (uint8_t *)&alt->orig + alt->orig;
+		const uint8_t *repl = (const uint8_t *)&alt->repl + alt->repl;
+		patch_bytes(orig, repl, alt->repl_len);
+		for (size_t off = alt->repl_len; off < alt->orig_len;) {
+			size_t len = MIN(alt->orig_len - off, sizeof(nops[0]));
+			patch_bytes(orig + off, nops[len - 1], len);
+			off += len;
+		}
+		patched++;
+	}
+
+	write_cr("0", cr0);
+	// Serializing, nothing fetched before the writes is executed after them
+	uint32_t a, b, c, d;
+	__cpuid(0, a, b, c, d);
+	cpu_irq_restore(rflags);
+
+	printf("alternatives: Patched %zu of %zu sites\n", patched, total);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ALTERNATIVE_H
+#define ALTERNATIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Capabilities the kernel decided to use, set by cpu_init() and mem_init().
+// They are plain numbers so that the ALTERNATIVE macros can paste them into
+// assembly.
+#define CPU_FEATURE_XSAVE 0
+#define CPU_FEATURE_XSAVEC 1
+#define CPU_FEATURE_XSAVEOPT 2
+#define CPU_FEATURE_XSAVES 3
+#define CPU_FEATURE_PCID 4
+#define CPU_FEATURE_INVPCID 5
+#define CPU_FEATURE_ERMS 6
+#define CPU_FEATURE_FSRM 7
+#define CPU_FEATURE_COUNT 8
+
+#define ALT_STR(X) #X
+#define ALT_XSTR(X) ALT_STR(X)
+
+// The original instruction is padded with NOPs to the length of the longest
+// replacement. An entry records where both are, lengths and the feature, and
+// alternatives_apply() copies the replacement over the original when the
+// feature is there. With several replacements the last one that applies wins.
+// Replacements run at the address of the original, so they mustn't contain
+// relative jumps or calls out of themselves.
+#define ALT_ENTRY(NUM, FEATURE)                                \
+	" .pushsection .altinstructions, \"a\"\n"                  \
+	" .long .Lalt_orig_%=-.\n"                                 \
+	" .long .Lalt_repl" #NUM "_%=-.\n"                         \
+	" .word " ALT_XSTR(FEATURE) "\n"                           \
+	" .byte .Lalt_pad_end_%=-.Lalt_orig_%=\n"                  \
+	" .byte .Lalt_repl" #NUM "_end_%=-.Lalt_repl" #NUM "_%=\n" \
+	" .popsection\n"
+
+#define ALT_REPL(NUM, NEW)                          \
+	" .pushsection .altinstr_replacement, \"ax\"\n" \
+	".Lalt_repl" #NUM "_%=:\n " NEW "\n"            \
+	".Lalt_repl" #NUM "_end_%=:\n"                  \
+	" .popsection\n"
+
+#define ALT_LEN(NUM) \
+	"(.Lalt_repl" #NUM "_end_%=-.Lalt_repl" #NUM "_%=)"
+#define ALT_ORIG_LEN "(.Lalt_orig_end_%=-.Lalt_orig_%=)"
+// GAS evaluates a true comparison to -1, and compares at the precedence of
+// addition
+#define ALT_MAX(A, B) "((" A ")-(((" B ")>(" A "))*((" B ")-(" A "))))"
+#define ALT_PAD(LEN)                                                 \
+	" .skip -(((" LEN ")>" ALT_ORIG_LEN ")*((" LEN ")-" ALT_ORIG_LEN \
+	")),0x90\n"
+
+#define ALT_ORIG(OLD)            \
+	".Lalt_orig_%=:\n " OLD "\n" \
+	".Lalt_orig_end_%=:\n"
+
+#define ALTERNATIVE(OLD, NEW, FEATURE)                      \
+	ALT_ORIG(OLD) ALT_PAD(ALT_LEN(1)) ".Lalt_pad_end_%=:\n" \
+		ALT_ENTRY(1, FEATURE) ALT_REPL(1, NEW)
+
+#define ALTERNATIVE_2(OLD, NEW1, FEATURE1, NEW2, FEATURE2) \
+	ALT_ORIG(OLD) ALT_PAD(ALT_MAX(ALT_LEN(1), ALT_LEN(2))) \
+		".Lalt_pad_end_%=:\n" ALT_ENTRY(1, FEATURE1)       \
+			ALT_ENTRY(2, FEATURE2) ALT_REPL(1, NEW1) ALT_REPL(2, NEW2)
+
+#define ALTERNATIVE_4(OLD, NEW1, FEATURE1, NEW2, FEATURE2, NEW3, FEATURE3, \
+					  NEW4, FEATURE4)                                      \
+	ALT_ORIG(OLD)                                                          \
+	ALT_PAD(ALT_MAX(ALT_MAX(ALT_LEN(1), ALT_LEN(2)),                       \
+					ALT_MAX(ALT_LEN(3), ALT_LEN(4))))                      \
+	".Lalt_pad_end_%=:\n" ALT_ENTRY(1, FEATURE1) ALT_ENTRY(2, FEATURE2)    \
+		ALT_ENTRY(3, FEATURE3) ALT_ENTRY(4, FEATURE4) ALT_REPL(1, NEW1)    \
+			ALT_REPL(2, NEW2) ALT_REPL(3, NEW3) ALT_REPL(4, NEW4)
+
+extern uint64_t cpu_features;
+
+static inline void cpu_feature_set(int feature) {
+	__atomic_or_fetch(&cpu_features, 1ULL << feature, __ATOMIC_RELAXED);
+}
+
+// Checks the feature every time, for code that isn't hot
+static inline bool cpu_feature(int feature) {
+	return (cpu_features >> feature) & 1;
+}
+
+// A branch patched at boot, false until alternatives_apply() ran. The jump
+// to the false path is replaced with NOPs when the feature is there.
+#define cpu_has(FEATURE)                                  \
+	({                                                    \
+		__label__ __no;                                   \
+		bool __has = true;                                \
+		asm goto(ALTERNATIVE("jmp %l[__no]", "", FEATURE) \
+				 :                                        \
+				 :                                        \
+				 :                                        \
+				 : __no);                                 \
+		if (0) {                                          \
+		__no:                                             \
+			__has = false;                                \
+		}                                                 \
+		__has;                                            \
+	})
+
+void alternatives_apply(void);
+
+#endif
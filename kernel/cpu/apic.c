@@ -16,20 +16,37 @@
 
 #include "apic.h"
 #include "../acpi/madt.h"
+#include "../klibc/hashmap.h"
+#include "../klibc/lock.h"
+#include "../klibc/printf.h"
 #include "../mm/vmm.h"
+#include "../sys/hpet.h"
 #include "../sys/mmio.h"
+#include "cpu.h"
+#include "irq.h"
 #include "isr.h"
 #include <lai/helpers/pm.h>
 #include <lai/helpers/sci.h>
 
 static uintptr_t lapic_addr = 0;
 
+// Timer ticks per second at a divide of 16, only used without TSC-deadline
+static uint64_t lapic_timer_frequency = 0;
+static void (*lapic_timer_handler)(void) = NULL;
+static void (*lapic_timer_sampler)(registers_t *r) = NULL;
+
+// In x2APIC mode register reg is MSR 0x800 + reg / 16
 static uint32_t lapic_read(uint32_t reg) {
+	if (cpu_x2apic)
+		return rdmsr(0x800 + (reg >> 4));
 	return mmind((void *)lapic_addr + MEM_PHYS_OFFSET + reg);
 }
 
 static void lapic_write(uint32_t reg, uint32_t value) {
-	mmoutd((void *)lapic_addr + MEM_PHYS_OFFSET + reg, value);
+	if (cpu_x2apic)
+		wrmsr(0x800 + (reg >> 4), value);
+	else
+		mmoutd((void *)lapic_addr + MEM_PHYS_OFFSET + reg, value);
 }
 
 static void lapic_set_nmi(uint8_t vec, uint8_t current_processor_id,
@@ -57,54 +74,175 @@ static void lapic_set_nmi(uint8_t vec, uint8_t current_processor_id,
 	}
 }
 
+// One-shot mode counts the initial count register down at the bus clock over
+// the divide, TSC-deadline mode fires once the TSC reaches IA32_TSC_DEADLINE
+static void lapic_timer_init(void) {
+	if (cpu_tsc_deadline) {
+		lapic_write(0x320, (2 << 17) | LAPIC_TIMER_VECTOR);
+		// The LVT write has to land before the deadline MSR is armed
+		asm volatile("mfence" ::: "memory");
+		wrmsr(0x6E0, 0);
+	} else {
+		lapic_write(0x3E0, 0x3);
+		lapic_write(0x320, LAPIC_TIMER_VECTOR);
+		lapic_write(0x380, 0);
+	}
+}
+
+static void lapic_timer_calibrate(void) {
+	lapic_write(0x3E0, 0x3);
+	lapic_write(0x320, (1 << 16) | LAPIC_TIMER_VECTOR);
+
+	uint64_t rflags = cpu_irq_save();
+	uint64_t hpet_start = hpet_counter_value();
+	lapic_write(0x380, 0xFFFFFFFF);
+	hpet_usleep(10000);
+	uint32_t ticks = 0xFFFFFFFF - lapic_read(0x390);
+	uint64_t hpet_end = hpet_counter_value();
+	cpu_irq_restore(rflags);
+
+	lapic_timer_frequency = (unsigned __int128)ticks * hpet_frequency() /
+							(hpet_end - hpet_start);
+	printf("APIC: Timer frequency: %llu kHz\n", lapic_timer_frequency / 1000);
+	lapic_timer_init();
+}
+
+static void lapic_timer_interrupt(void) {
+	if (lapic_timer_handler)
+		lapic_timer_handler();
+}
+
+void lapic_timer_set_handler(void (*handler)(void)) {
+	lapic_timer_handler = handler;
+}
+
+static void lapic_timer_sample_interrupt(registers_t *r) {
+	void (*sampler)(registers_t *) =
+		__atomic_load_n(&lapic_timer_sampler, __ATOMIC_ACQUIRE);
+	if (sampler)
+		sampler(r);
+	lapic_timer_interrupt();
+}
+
+// While there is a sampler the timer takes the full path, which saves the
+// interrupted registers, instead of the fast one
+void lapic_timer_set_sampler(void (*sampler)(registers_t *r)) {
+	if (sampler) {
+		__atomic_store_n(&lapic_timer_sampler, sampler, __ATOMIC_RELEASE);
+		isr_register_handler(LAPIC_TIMER_VECTOR, lapic_timer_sample_interrupt);
+		isr_clear_fast_handler(LAPIC_TIMER_VECTOR);
+	} else {
+		isr_register_fast_handler(LAPIC_TIMER_VECTOR, lapic_timer_interrupt,
+								  true);
+		__atomic_store_n(&lapic_timer_sampler, NULL, __ATOMIC_RELEASE);
+	}
+}
+
+// Fire the timer of the calling processor once, ns from now
+void lapic_timer_oneshot(uint64_t ns) {
+	if (cpu_tsc_deadline) {
+		uint64_t ticks =
+			(unsigned __int128)ns * cpu_tsc_frequency / 1000000000;
+		wrmsr(0x6E0, rdtsc() + ticks);
+		return;
+	}
+
+	uint64_t ticks =
+		(unsigned __int128)ns * lapic_timer_frequency / 1000000000;
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks > 0xFFFFFFFF)
+		ticks = 0xFFFFFFFF;
+	lapic_write(0x380, ticks);
+}
+
+void lapic_timer_stop(void) {
+	if (cpu_tsc_deadline)
+		wrmsr(0x6E0, 0);
+	else
+		lapic_write(0x380, 0);
+}
+
 void lapic_init(uint8_t processor_id) {
 	lapic_write(0x80, 0);
 	lapic_write(0xF0, lapic_read(0xF0) | 0x100);
-	lapic_write(0xE0, 0xF0000000);
-	lapic_write(0xD0, lapic_read(0x20));
+	// Flat logical destinations, x2APIC has no DFR and a read-only LDR
+	if (!cpu_x2apic) {
+		lapic_write(0xE0, 0xF0000000);
+		lapic_write(0xD0, lapic_read(0x20));
+	}
 	for (size_t i = 0; i < madt_nmis.length; i++) {
 		struct madt_nmi *nmi = madt_nmis.storage[i];
 		lapic_set_nmi(2, processor_id, nmi->processor, nmi->flags, nmi->lint);
 	}
+	lapic_timer_init();
 }
 
+// Registers are reached through a select and a data window, drivers probing
+// in parallel mustn't interleave them
+static lock_t ioapic_lock = {0};
+
 static uint32_t ioapic_read(uintptr_t ioapic_address, size_t reg) {
+	uint64_t rflags = lock_irqsave(&ioapic_lock);
 	mmoutd((void *)ioapic_address + MEM_PHYS_OFFSET, reg & 0xFF);
-	return mmind((void *)ioapic_address + MEM_PHYS_OFFSET + 16);
+	uint32_t data = mmind((void *)ioapic_address + MEM_PHYS_OFFSET + 16);
+	lock_irqrestore(&ioapic_lock, rflags);
+	return data;
 }
 
 static void ioapic_write(uintptr_t ioapic_address, size_t reg, uint32_t data) {
+	uint64_t rflags = lock_irqsave(&ioapic_lock);
 	mmoutd((void *)ioapic_address + MEM_PHYS_OFFSET, reg & 0xFF);
 	mmoutd((void *)ioapic_address + MEM_PHYS_OFFSET + 16, data);
+	lock_irqrestore(&ioapic_lock, rflags);
 }
 
 static uint32_t get_gsi_count(uintptr_t ioapic_address) {
 	return (ioapic_read(ioapic_address, 1) & 0xFF0000) >> 16;
 }
 
-static struct madt_ioapic *get_ioapic_by_gsi(uint32_t gsi) {
+// The I/O APIC of every GSI and the override of every ISA IRQ, filled by
+// apic_init() and only read after that
+static struct hashmap ioapic_by_gsi = HASHMAP_INIT;
+static struct hashmap iso_by_irq = HASHMAP_INIT;
+
+static void ioapic_index_init(void) {
 	for (size_t i = 0; i < madt_io_apics.length; i++) {
 		struct madt_ioapic *ioapic = madt_io_apics.storage[i];
-		if (ioapic->gsib <= gsi &&
-			ioapic->gsib + get_gsi_count(ioapic->addr) > gsi) {
-			return ioapic;
-		}
+		uint32_t count = get_gsi_count(ioapic->addr);
+		hashmap_reserve(&ioapic_by_gsi, ioapic_by_gsi.length + count);
+		for (uint32_t gsi = ioapic->gsib; gsi < ioapic->gsib + count; gsi++)
+			hashmap_put(&ioapic_by_gsi, gsi, ioapic);
 	}
 
-	return NULL;
+	// The first override of an IRQ wins, as it did for the linear scan
+	for (size_t i = madt_isos.length; i-- > 0;)
+		hashmap_put(&iso_by_irq, madt_isos.storage[i]->irq_source,
+					madt_isos.storage[i]);
+}
+
+static struct madt_ioapic *get_ioapic_by_gsi(uint32_t gsi) {
+	return hashmap_get(&ioapic_by_gsi, gsi);
 }
 
 void ioapic_redirect_gsi(uint32_t gsi, uint8_t vec, uint16_t flags) {
-	size_t io_apic = get_ioapic_by_gsi(gsi)->addr;
+	struct madt_ioapic *ioapic = get_ioapic_by_gsi(gsi);
+	if (ioapic == NULL) {
+		printf("apic: No I/O APIC handles GSI %u\n", gsi);
+		return;
+	}
+	size_t io_apic = ioapic->addr;
 
-	uint32_t low_index = 0x10 + (gsi - get_ioapic_by_gsi(gsi)->gsib) * 2;
+	uint32_t low_index = 0x10 + (gsi - ioapic->gsib) * 2;
 	uint32_t high_index = low_index + 1;
 
 	uint32_t high = ioapic_read(io_apic, high_index);
 
-	// Set APIC ID
+	// Send it to the processor setting it up until it's moved, if it can
+	// be a destination
+	size_t cpu = irq_target_cpu(this_cpu()->cpu_number);
 	high &= ~0xFF000000;
-	high |= ioapic_read(io_apic, 0) << 24;
+	high |= cpu_locals[cpu].lapic_id << 24;
 	ioapic_write(io_apic, high_index, high);
 
 	uint32_t low = ioapic_read(io_apic, low_index);
@@ -133,23 +271,53 @@ void ioapic_redirect_gsi(uint32_t gsi, uint8_t vec, uint16_t flags) {
 	}
 
 	ioapic_write(io_apic, low_index, low);
+	irq_register_gsi(vec, gsi, cpu);
 }
 
-void ioapic_redirect_irq(uint32_t irq, uint8_t vect) {
-	for (size_t i = 0; i < madt_isos.length; i++) {
-		if (madt_isos.storage[i]->irq_source == irq) {
-			ioapic_redirect_gsi(madt_isos.storage[i]->gsi, vect,
-								madt_isos.storage[i]->flags);
-			return;
-		}
-	}
+// Only for processors irq_cpu_targetable() allows
+void ioapic_set_gsi_target(uint32_t gsi, uint32_t lapic_id) {
+	struct madt_ioapic *ioapic = get_ioapic_by_gsi(gsi);
+	if (ioapic == NULL)
+		return;
+
+	uint32_t low_index = 0x10 + (gsi - ioapic->gsib) * 2;
+	uint32_t high_index = low_index + 1;
 
-	ioapic_redirect_gsi(irq, vect, 0);
+	// Masked while the destination changes, so a level triggered interrupt
+	// in flight isn't split between the old and new processor
+	uint32_t low = ioapic_read(ioapic->addr, low_index);
+	ioapic_write(ioapic->addr, low_index, low | (1 << 16));
+	uint32_t high = ioapic_read(ioapic->addr, high_index);
+	ioapic_write(ioapic->addr, high_index,
+				 (high & ~0xFF000000) | (lapic_id & 0xFF) << 24);
+	ioapic_write(ioapic->addr, low_index, low);
 }
 
-void apic_send_ipi(uint8_t lapic_id, uint8_t vector) {
-	lapic_write(0x310, ((uint32_t)lapic_id) << 24);
+void ioapic_redirect_irq(uint32_t irq, uint8_t vect) {
+	struct madt_iso *iso = hashmap_get(&iso_by_irq, irq);
+	if (iso != NULL)
+		ioapic_redirect_gsi(iso->gsi, vect, iso->flags);
+	else
+		ioapic_redirect_gsi(irq, vect, 0);
+}
+
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+	if (cpu_x2apic) {
+		// The ICR is a single MSR. Writing it isn't serializing, so stores
+		// the target will look at have to be made visible first.
+		asm volatile("mfence" : : : "memory");
+		wrmsr(0x830, (uint64_t)lapic_id << 32 | vector);
+		return;
+	}
+
+	// Both halves of the ICR, without an interrupt on this processor sending
+	// its own IPI in between
+	uint64_t rflags = cpu_irq_save();
+	while (lapic_read(0x300) & (1 << 12))
+		asm volatile("pause");
+	lapic_write(0x310, lapic_id << 24);
 	lapic_write(0x300, vector);
+	cpu_irq_restore(rflags);
 }
 
 void apic_eoi(void) {
@@ -167,7 +335,12 @@ void sci_interrupt(registers_t *reg) {
 
 void apic_init(void) {
 	lapic_addr = acpi_get_lapic();
+	ioapic_index_init();
+	isr_register_fast_handler(LAPIC_TIMER_VECTOR, lapic_timer_interrupt, true);
 	lapic_init(madt_local_apics.storage[0]->processor_id);
+	// Application processors are assumed to share the bus clock of the BSP
+	if (!cpu_tsc_deadline)
+		lapic_timer_calibrate();
 	// Register SCI interrupt
 	acpi_fadt_t *facp = acpi_find_sdt("FACP", 0);
 	ioapic_redirect_irq(facp->sci_irq, 73);
@@ -17,11 +17,23 @@
  * limitations under the License.
  */
 
+#include "reg.h"
 #include <stdint.h>
 
+#define LAPIC_TIMER_VECTOR 0xF0
+
 void apic_eoi(void);
 void apic_init(void);
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector);
 void ioapic_redirect_irq(uint32_t irq, uint8_t vect);
+void ioapic_redirect_gsi(uint32_t gsi, uint8_t vec, uint16_t flags);
+void ioapic_set_gsi_target(uint32_t gsi, uint32_t lapic_id);
 void lapic_init(uint8_t processor_id);
+// Per-CPU one-shot timer, handler runs on the processor that armed it
+void lapic_timer_set_handler(void (*handler)(void));
+// Have sampler look at the registers interrupted by the timer, NULL to stop
+void lapic_timer_set_sampler(void (*sampler)(registers_t *r));
+void lapic_timer_oneshot(uint64_t ns);
+void lapic_timer_stop(void);
 
 #endif
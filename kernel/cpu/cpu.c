@@ -16,37 +16,59 @@
  */
 
 #include "cpu.h"
+#include "../acpi/srat.h"
+#include "../kernel/boottrace.h"
 #include "../kernel/panic.h"
 #include "../klibc/alloc.h"
 #include "../klibc/asm.h"
 #include "../klibc/lock.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
+#include "../sched/sched.h"
+#include "../sys/clock.h"
+#include "../sys/gdt.h"
 #include "../sys/hpet.h"
+#include "../sys/timer.h"
+#include "alternative.h"
 #include "apic.h"
+#include "idle.h"
+#include "idt.h"
+#include "irqstat.h"
+#include "softirq.h"
 #include <cpuid.h>
 
 #define MAX_TSC_CALIBRATIONS 4
+#define IST_SIZE 16384
+#define SMP_STACK_SIZE 32768
+#define SMP_TIMEOUT_NS 1000000000
+
+struct cpu_local cpu_locals[MAX_CPUS];
+// Only the BSP until smp_wait(), then every processor that came up
+size_t cpu_count = 1;
+// Application processors started by smp_init() and those done with their
+// setup so far
+static size_t smp_started = 0;
+static size_t smp_online = 0;
 
 uint64_t cpu_tsc_frequency;
+bool cpu_tsc_invariant = false;
+bool cpu_tsc_deadline = false;
 
 size_t cpu_fpu_storage_size;
 
-void (*cpu_fpu_save)(void *);
-void (*cpu_fpu_restore)(void *);
-
-lock_t cpu_lock;
+#if !CONFIG_X86_ASSUME_PCID
+bool cpu_pcid = false;
+#endif
+#if !CONFIG_X86_ASSUME_X2APIC
+bool cpu_x2apic = false;
+#endif
+#if !CONFIG_X86_ASSUME_INVPCID
+bool cpu_invpcid = false;
+#endif
 
-static uint64_t rdmsr(uint32_t msr) {
-	uint32_t edx, eax;
-	asm volatile("rdmsr" : "=a"(eax), "=d"(edx) : "c"(msr) : "memory");
-	return ((uint64_t)edx << 32) | eax;
-}
-
-static void wrmsr(uint32_t msr, uint64_t value) {
-	uint32_t edx = value >> 32;
-	uint32_t eax = (uint32_t)value;
-	asm volatile("wrmsr" : : "a"(eax), "d"(edx), "c"(msr) : "memory");
-}
+static lock_t smp_call_lock;
 
 static void wrxcr(uint32_t i, uint64_t value) {
 	uint32_t edx = value >> 32;
@@ -54,54 +76,224 @@ static void wrxcr(uint32_t i, uint64_t value) {
 	asm volatile("xsetbv" : : "a"(eax), "d"(edx), "c"(i) : "memory");
 }
 
-static void xsave(void *region) {
-	asm volatile("xsave %0"
+// State components enabled in XCR0, saved and restored by the x* variants
+static uint64_t xsave_mask = 0;
+// XSAVEC and XSAVES write the compacted format, which XRSTOR(S) only take
+// with bit 63 of XCOMP_BV set
+static bool xsave_compacted = false;
+
+// FXSAVE until alternatives_apply() patches in the variant cpu_init() chose.
+// XSAVEOPT and XSAVES skip components that are in their init state or
+// unchanged since the XRSTOR(S) from the same area, XSAVEC only the former.
+void cpu_fpu_save(void *region) {
+	asm volatile(ALTERNATIVE_4("fxsave %0", "xsave %0", CPU_FEATURE_XSAVE,
+							   "xsavec %0", CPU_FEATURE_XSAVEC, "xsaveopt %0",
+							   CPU_FEATURE_XSAVEOPT, "xsaves %0",
+							   CPU_FEATURE_XSAVES)
 				 : "+m"(FLAT_PTR(region))
-				 : "a"(0xFFFFFFFF), "d"(0xFFFFFFFF)
+				 : "a"((uint32_t)xsave_mask), "d"((uint32_t)(xsave_mask >> 32))
 				 : "memory");
 }
 
-static void xrstor(void *region) {
-	asm volatile("xrstor %0"
+void cpu_fpu_restore(void *region) {
+	asm volatile(ALTERNATIVE_2("fxrstor %0", "xrstor %0", CPU_FEATURE_XSAVE,
+							   "xrstors %0", CPU_FEATURE_XSAVES)
 				 :
-				 : "m"(FLAT_PTR(region)), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF)
+				 : "m"(FLAT_PTR(region)), "a"((uint32_t)xsave_mask),
+				   "d"((uint32_t)(xsave_mask >> 32))
 				 : "memory");
 }
 
-static void fxsave(void *region) {
-	asm volatile("fxsave %0" : "+m"(FLAT_PTR(region)) : : "memory");
+// Run the work posted to this processor, if any
+static bool smp_handle_call(void) {
+	struct smp_call *call =
+		__atomic_exchange_n(&this_cpu()->call, NULL, __ATOMIC_ACQUIRE);
+	if (call == NULL)
+		return false;
+
+	call->func(call->arg);
+	__atomic_sub_fetch(&call->remaining, 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-static void fxrstor(void *region) {
-	asm volatile("fxrstor %0" : : "m"(FLAT_PTR(region)) : "memory");
+// Run func on every processor, including the calling one, and wait for all of
+// them to finish
+void smp_call_all(void (*func)(void *arg), void *arg) {
+	LOCK(smp_call_lock);
+
+	size_t self = this_cpu()->cpu_number;
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	struct smp_call call = {.func = func, .arg = arg, .remaining = count - 1};
+
+	for (size_t i = 0; i < count; i++) {
+		if (i != self) {
+			__atomic_store_n(&cpu_locals[i].call, &call, __ATOMIC_RELEASE);
+			idle_wake(i);
+		}
+	}
+
+	func(arg);
+
+	while (__atomic_load_n(&call.remaining, __ATOMIC_ACQUIRE))
+		asm volatile("pause");
+
+	UNLOCK(smp_call_lock);
 }
 
-static void cpu_start(void) {
-	LOCK(cpu_lock);
-	uint64_t rdi = 0;
-	asm("nop" : "=D"(rdi));
-	struct stivale2_smp_info *cpu_info = (void *)rdi;
-	cpu_init();
+// The bootloader passes the stivale2_smp_info of the processor in RDI. The
+// APs set themselves up in parallel, nothing here touches shared state that
+// isn't locked or the same for all of them.
+static void cpu_start(struct stivale2_smp_info *cpu_info) {
+	uint64_t start = rdtsc();
+	gdt_load();
+	set_idt();
+	cpu_init(cpu_info->extra_argument);
+	this_cpu()->smp_info = cpu_info;
+	cpu_init_tss();
+	BOOT_PHASE("ap_clock_sync", clock_sync_cpu());
+	irqstat_cpu_init();
+	this_cpu()->numa_node = srat_lapic_node(this_cpu()->lapic_id);
+	// Join the kernel pagemap so TLB shootdowns reach this processor
+	vmm_switch_pagemap(kernel_pagemap);
 	lapic_init(cpu_info->processor_id);
 	printf("CPU: Processor %d online!\n", cpu_info->lapic_id);
-	UNLOCK(cpu_lock);
-	for (;;)
-		asm("hlt");
+	asm volatile("sti");
+	sched_cpu_init();
+	boot_event_add("ap_start", start, rdtsc());
+	this_cpu()->online = true;
+	__atomic_add_fetch(&smp_online, 1, __ATOMIC_RELEASE);
+	// The idle thread runs work posted with smp_call_all(), tasklets and
+	// queued threads, and zeroes free pages ahead of time for pmm_allocz
+	for (;;) {
+		if (smp_handle_call() || softirq_run() || sched_idle() ||
+			pmm_zero_work())
+			continue;
+		asm volatile("cli");
+		struct cpu_local *local = this_cpu();
+		if (local->call == NULL && local->tasklets == NULL &&
+			!local->need_resched)
+			idle_wait();
+		asm volatile("sti");
+	}
+}
+
+// Fill a new FPU area with the reset state, the FCW and MXCSR of the legacy
+// region are loaded even for components XSTATE_BV marks as in init state
+void cpu_fpu_init_state(void *region) {
+	memset(region, 0, cpu_fpu_storage_size);
+	*(uint16_t *)region = 0x37F;
+	*(uint32_t *)(region + 24) = 0x1F80;
+	if (xsave_compacted)
+		*(uint64_t *)(region + 520) = (1ULL << 63) | xsave_mask; // XCOMP_BV
+}
+
+// Give this processor a TSS with stacks for the exceptions that must not run
+// on the interrupted stack, allocation has to work by now
+void cpu_init_tss(void) {
+	struct cpu_local *local = this_cpu();
+
+	// IST_DOUBLE_FAULT, IST_NMI and IST_MACHINE_CHECK
+	for (size_t i = 0; i < IST_MACHINE_CHECK; i++)
+		local->tss.ist[i] = (uintptr_t)alloc(IST_SIZE) + IST_SIZE;
+	local->tss.iopb = sizeof(struct tss);
+	gdt_load_tss(local->cpu_number, &local->tss);
+}
+
+// Measure the TSC against the HPET, which has to be initialized by now. The
+// runs are averaged to even out the cost of the HPET reads.
+void cpu_calibrate_tsc(void) {
+	uint64_t hpet_freq = hpet_frequency();
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < MAX_TSC_CALIBRATIONS; i++) {
+		uint64_t rflags = cpu_irq_save();
+		uint64_t hpet_start = hpet_counter_value();
+		uint64_t tsc_start = rdtsc();
+		hpet_usleep(10000);
+		uint64_t tsc_end = rdtsc();
+		uint64_t hpet_end = hpet_counter_value();
+		cpu_irq_restore(rflags);
+
+		total += (unsigned __int128)(tsc_end - tsc_start) * hpet_freq /
+				 (hpet_end - hpet_start);
+	}
+
+	cpu_tsc_frequency = total / MAX_TSC_CALIBRATIONS;
+	printf("CPU: TSC frequency: %llu kHz%s\n", cpu_tsc_frequency / 1000,
+		   cpu_tsc_invariant ? " (invariant)" : "");
 }
 
+// Start the APs without waiting for them, smp_wait() does that once the BSP
+// has nothing else to do
 void smp_init(struct stivale2_struct_tag_smp *smp_tag) {
 	printf("CPU: Total processor count: %d\n", smp_tag->cpu_count);
-	printf("CPU: Processor %d online!\n", smp_tag->smp_info[0].lapic_id);
+	printf("CPU: Processor %d online!\n", smp_tag->bsp_lapic_id);
+	this_cpu()->online = true;
+
 	for (size_t i = 0; i < smp_tag->cpu_count; ++i) {
-		uint8_t *stack = alloc(32768);
-		smp_tag->smp_info[i].target_stack = (uintptr_t)stack + sizeof(stack);
-		smp_tag->smp_info[i].goto_address = (uintptr_t)cpu_start;
+		struct stivale2_smp_info *info = &smp_tag->smp_info[i];
+		if (info->lapic_id == smp_tag->bsp_lapic_id)
+			continue;
+		if (smp_started + 1 >= MAX_CPUS) {
+			printf("CPU: Only %d processors are supported\n", MAX_CPUS);
+			break;
+		}
+
+		uint8_t *stack = alloc(SMP_STACK_SIZE);
+		info->target_stack = (uintptr_t)stack + SMP_STACK_SIZE;
+		info->extra_argument = ++smp_started;
+		// The AP starts as soon as it sees the address
+		__atomic_store_n(&info->goto_address, (uintptr_t)cpu_start,
+						 __ATOMIC_RELEASE);
 	}
-	// Wait 50 milliseconds
-	hpet_usleep(50000);
 }
 
-void cpu_init(void) {
+// Wait for the APs to come up, zeroing free pages for pmm_allocz meanwhile.
+// cpu_count then covers every processor up to the first that didn't make it.
+void smp_wait(void) {
+	uint64_t deadline = clock_monotonic_ns() + SMP_TIMEOUT_NS;
+
+	while (__atomic_load_n(&smp_online, __ATOMIC_ACQUIRE) < smp_started) {
+		if (clock_monotonic_ns() > deadline) {
+			printf("CPU: Only %zu of %zu processors came up\n",
+				   smp_online + 1, smp_started + 1);
+			break;
+		}
+		if (!pmm_zero_work())
+			asm volatile("pause");
+	}
+
+	size_t count = 1;
+	while (count <= smp_started &&
+		   __atomic_load_n(&cpu_locals[count].online, __ATOMIC_ACQUIRE))
+		count++;
+	__atomic_store_n(&cpu_count, count, __ATOMIC_RELEASE);
+	printf("CPU: %zu processors online\n", count);
+}
+
+// Set up the per-CPU area, the BSP is number 0 and the APs are numbered by
+// smp_init()
+void cpu_init(size_t cpu_number) {
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	__get_cpuid(1, &a, &b, &c, &d);
+	// Leaves 1 and 7 are read once for everything they report
+	uint32_t c1 = c, d1 = d;
+
+	// x2APIC mode when the processor has it, the local APIC registers become
+	// MSRs and IDs go past 255
+#if !CONFIG_X86_ASSUME_X2APIC
+	cpu_x2apic = (c1 & CPUID_X2APIC) != 0;
+#endif
+	if (cpu_x2apic)
+		wrmsr(0x1B, rdmsr(0x1B) | (1 << 11) | (1 << 10)); // IA32_APIC_BASE
+
+	struct cpu_local *local = &cpu_locals[cpu_number];
+	local->self = local;
+	local->cpu_number = cpu_number;
+	local->lapic_id = cpu_x2apic ? (uint32_t)rdmsr(0x802) : b >> 24;
+	wrmsr(0xC0000101, (uint64_t)local); // IA32_GS_BASE
+	wrmsr(0xC0000102, (uint64_t)local); // IA32_KERNEL_GS_BASE
+
 	// Firstly enable SSE/SSE2 as it's the baseline for x86_64
 	uint64_t cr0 = 0;
 	cr0 = read_cr("0");
@@ -119,42 +311,73 @@ void cpu_init(void) {
 	cr4 |= (1 << 2);
 	write_cr("4", cr4);
 
-	// Enable some modern minor x86_64 features, ported from Sigma OS
-	uint32_t a = 0, b = 0, c = 0, d = 0;
+	// An invariant TSC runs at a constant rate through P-, C- and T-state
+	// changes, only then is it usable as a clock
+	if (__get_cpuid(0x80000007, &a, &b, &c, &d))
+		cpu_tsc_invariant = (d & CPUID_INVARIANT_TSC) != 0;
+
+	cpu_tsc_deadline = (c1 & CPUID_TSC_DEADLINE) != 0;
+
+	uint32_t b7 = 0, c7 = 0;
 	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((b & CPUID_SMEP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 20); // Enable SMEP
-			write_cr("4", cr4);
-		}
+		b7 = b;
+		c7 = c;
 	}
 
-	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((b & CPUID_SMAP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 21); // Enable SMAP
-			write_cr("4", cr4);
-			asm("clac");
-		}
+	// Enable some modern minor x86_64 features, ported from Sigma OS
+	if ((b7 & CPUID_SMEP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 20); // Enable SMEP
+		write_cr("4", cr4);
 	}
 
-	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((c & CPUID_UMIP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 11); // Enable UMIP
-			write_cr("4", cr4);
-		}
+	if ((b7 & CPUID_SMAP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 21); // Enable SMAP
+		write_cr("4", cr4);
+		asm("clac");
 	}
 
-	// Initialize the PAT
+	if ((c7 & CPUID_UMIP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 11); // Enable UMIP
+		write_cr("4", cr4);
+	}
+
+	// Global pages keep the kernel mappings in the TLB across pagemap switches
+	if ((d1 & CPUID_PGE)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 7); // Enable PGE
+		write_cr("4", cr4);
+	}
+
+	// CR3 still holds the bootloader's pagemap with a PCID of 0, which is
+	// required to enable PCIDs
+#if !CONFIG_X86_ASSUME_PCID
+	cpu_pcid = (c1 & CPUID_PCID) != 0;
+#endif
+	if (cpu_pcid) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 17); // Enable PCID
+		write_cr("4", cr4);
+		cpu_feature_set(CPU_FEATURE_PCID);
+	}
+
+#if !CONFIG_X86_ASSUME_INVPCID
+	cpu_invpcid = (b7 & CPUID_INVPCID) != 0;
+#endif
+	if (cpu_invpcid)
+		cpu_feature_set(CPU_FEATURE_INVPCID);
+
+	// Initialize the PAT, entries 0 to 3 keep their WB, WT, UC- and UC
+	// defaults
 	uint64_t pat_msr = rdmsr(0x277);
 	pat_msr &= 0xFFFFFFFF;
-	// write-protect / write-combining
+	// write-protect / write-combining, entry 5 is VMM_CACHE_WC
 	pat_msr |= (uint64_t)0x0105 << 32;
 	wrmsr(0x277, pat_msr);
 
-	__get_cpuid(1, &a, &b, &c, &d);
-	if ((c & bit_XSAVE)) {
+	if (CONFIG_FPU_XSAVE && (c1 & bit_XSAVE)) {
 		cr4 = read_cr("4");
 		cr4 |= (1 << 18); // Enable XSAVE and x{get, set}bv
 		write_cr("4", cr4);
@@ -163,25 +386,40 @@ void cpu_init(void) {
 		xcr0 |= (1 << 0); // Save x87 state with xsave
 		xcr0 |= (1 << 1); // Save SSE state with xsave
 
-		if ((c & bit_AVX))
+		if ((c1 & bit_AVX))
 			xcr0 |= (1 << 2); // Enable AVX and save AVX state with xsave
 
-		if (__get_cpuid(7, &a, &b, &c, &d)) {
-			if ((b & bit_AVX512F)) {
-				xcr0 |= (1 << 5); // Enable AVX-512
-				xcr0 |= (1 << 6); // Enable management of ZMM{0 -> 15}
-				xcr0 |= (1 << 7); // Enable management of ZMM{16 -> 31}
-			}
+		if ((b7 & bit_AVX512F)) {
+			xcr0 |= (1 << 5); // Enable AVX-512
+			xcr0 |= (1 << 6); // Enable management of ZMM{0 -> 15}
+			xcr0 |= (1 << 7); // Enable management of ZMM{16 -> 31}
 		}
 		wrxcr(0, xcr0);
+		xsave_mask = xcr0;
 
-		cpu_fpu_storage_size = (size_t)c;
+		// Leaf 0xD gives the size for the components enabled in XCR0, in
+		// the standard format in EBX of subleaf 0 and compacted in subleaf 1
+		__cpuid_count(0xD, 0, a, b, c, d);
+		cpu_fpu_storage_size = b;
+		cpu_feature_set(CPU_FEATURE_XSAVE);
 
-		cpu_fpu_save = xsave;
-		cpu_fpu_restore = xrstor;
+		__cpuid_count(0xD, 1, a, b, c, d);
+		if ((a & CPUID_XSAVES)) {
+			// No supervisor state is used, XSAVES is only here for being
+			// both compacted and modified optimized
+			wrmsr(0xDA0, 0); // IA32_XSS
+			__cpuid_count(0xD, 1, a, b, c, d);
+			cpu_fpu_storage_size = b;
+			cpu_feature_set(CPU_FEATURE_XSAVES);
+			xsave_compacted = true;
+		} else if ((a & CPUID_XSAVEOPT)) {
+			cpu_feature_set(CPU_FEATURE_XSAVEOPT);
+		} else if ((a & CPUID_XSAVEC)) {
+			cpu_fpu_storage_size = b;
+			cpu_feature_set(CPU_FEATURE_XSAVEC);
+			xsave_compacted = true;
+		}
 	} else {
 		cpu_fpu_storage_size = 512; // Legacy size for fxsave
-		cpu_fpu_save = fxsave;
-		cpu_fpu_restore = fxrstor;
 	}
 }
@@ -18,19 +18,91 @@
  * limitations under the License.
  */
 
+#include "../sys/gdt.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stivale2.h>
 
+#define MAX_CPUS CONFIG_MAX_CPUS
+
+// Interrupt affinity masks have a bit per processor in a uint64_t
+#if MAX_CPUS > 64
+#error "CONFIG_MAX_CPUS can't be more than 64"
+#endif
+
+struct pagemap;
+struct irq_cpu_stats;
+struct tasklet;
+struct timer;
+struct thread;
+
+// Work posted to other processors by smp_call_all()
+struct smp_call {
+	void (*func)(void *arg);
+	void *arg;
+	size_t remaining;
+};
+
+// Per-CPU data, reachable through the GS base of each processor
+struct cpu_local {
+	struct cpu_local *self;
+	size_t cpu_number;
+	uint32_t lapic_id;
+	// Handed over by the bootloader, NULL on the BSP
+	struct stivale2_smp_info *smp_info;
+	// Set once the processor finished its setup
+	bool online;
+	size_t numa_node;
+	struct smp_call *call;
+	struct pagemap *pagemap;
+	struct irq_cpu_stats *irq_stats;
+	// Deferred interrupt work queued on this processor, see softirq.h
+	struct tasklet *tasklets;
+	bool in_softirq;
+	// Pending timers of this processor by deadline, see timer.h
+	struct timer *timers;
+	// Thread running here, see sched.h
+	struct thread *current;
+	bool need_resched;
+	struct tss tss;
+};
+
+extern struct cpu_local cpu_locals[MAX_CPUS];
+extern size_t cpu_count;
+
 extern uint64_t cpu_tsc_frequency;
 extern size_t cpu_fpu_storage_size;
 
-extern void (*cpu_fpu_save)(void *);
-extern void (*cpu_fpu_restore)(void *);
+extern bool cpu_tsc_invariant;
+extern bool cpu_tsc_deadline;
+
+// Features the configuration assumes are constants, their checks compile away
+#if CONFIG_X86_ASSUME_PCID
+#define cpu_pcid true
+#else
+extern bool cpu_pcid;
+#endif
+#if CONFIG_X86_ASSUME_X2APIC
+#define cpu_x2apic true
+#else
+extern bool cpu_x2apic;
+#endif
+#if CONFIG_X86_ASSUME_INVPCID
+#define cpu_invpcid true
+#else
+extern bool cpu_invpcid;
+#endif
 
 void smp_init(struct stivale2_struct_tag_smp *smp_tag);
-void cpu_init(void);
+void smp_wait(void);
+void cpu_init(size_t cpu_number);
+void cpu_init_tss(void);
+void cpu_fpu_init_state(void *region);
+void cpu_fpu_save(void *region);
+void cpu_fpu_restore(void *region);
+void cpu_calibrate_tsc(void);
+void smp_call_all(void (*func)(void *arg), void *arg);
 
 #define write_cr(reg, val) \
 	asm volatile("mov cr" reg ", %0" ::"r"(val) : "memory");
@@ -42,10 +114,76 @@ void cpu_init(void);
 		cr;                                                  \
 	})
 
+static inline struct cpu_local *this_cpu(void) {
+	struct cpu_local *ret;
+	asm volatile("mov %0, qword ptr gs:[0]" : "=r"(ret));
+	return ret;
+}
+
+// Access a field of this processor's cpu_local with a single GS relative
+// move, for fields of up to 8 bytes. Nothing stops a preempted thread from
+// moving to another processor in between two of these.
+#define this_cpu_read(FIELD)                                                 \
+	({                                                                       \
+		typeof(((struct cpu_local *)0)->FIELD) value_;                       \
+		asm volatile("mov %0, gs:[%c1]"                                      \
+					 : "=r"(value_)                                          \
+					 : "i"(offsetof(struct cpu_local, FIELD)));              \
+		value_;                                                              \
+	})
+
+#define this_cpu_write(FIELD, VALUE)                                         \
+	({                                                                       \
+		typeof(((struct cpu_local *)0)->FIELD) value_ = (VALUE);             \
+		asm volatile("mov gs:[%c0], %1"                                      \
+					 :                                                       \
+					 : "i"(offsetof(struct cpu_local, FIELD)), "r"(value_)   \
+					 : "memory");                                            \
+	})
+
+// Disable interrupts, returning the previous RFLAGS for cpu_irq_restore()
+static inline uint64_t cpu_irq_save(void) {
+	uint64_t rflags;
+	asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+	return rflags;
+}
+
+static inline void cpu_irq_restore(uint64_t rflags) {
+	if (rflags & (1 << 9))
+		asm volatile("sti" : : : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+	uint32_t edx, eax;
+	asm volatile("rdmsr" : "=a"(eax), "=d"(edx) : "c"(msr) : "memory");
+	return ((uint64_t)edx << 32) | eax;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+	uint32_t edx = value >> 32;
+	uint32_t eax = (uint32_t)value;
+	asm volatile("wrmsr" : : "a"(eax), "d"(edx), "c"(msr) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+	uint32_t edx, eax;
+	asm volatile("rdtsc" : "=a"(eax), "=d"(edx));
+	return ((uint64_t)edx << 32) | eax;
+}
+
 #define CPUID_INVARIANT_TSC (1 << 8)
 #define CPUID_TSC_DEADLINE (1 << 24)
 #define CPUID_SMEP (1 << 7)
 #define CPUID_SMAP (1 << 20)
 #define CPUID_UMIP (1 << 2)
+#define CPUID_PDPE1GB (1 << 26)
+#define CPUID_PGE (1 << 13)
+#define CPUID_PCID (1 << 17)
+#define CPUID_INVPCID (1 << 10)
+#define CPUID_X2APIC (1 << 21)
+#define CPUID_TSC_ADJUST (1 << 1)
+#define CPUID_XSAVEOPT (1 << 0)
+#define CPUID_XSAVEC (1 << 1)
+#define CPUID_XSAVES (1 << 3)
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "idle.h"
+#include "../klibc/printf.h"
+#include "../sys/clock.h"
+#include "../sys/timer.h"
+#include "apic.h"
+#include "cpu.h"
+#include "isr.h"
+#include <cpuid.h>
+#include <stdbool.h>
+
+#define CPUID_MONITOR (1 << 3)
+#define CPUID_MWAIT_EXTENSIONS (1 << 0)
+#define CPUID_MWAIT_BREAK_ON_IRQ (1 << 1)
+#define CPUID_ARAT (1 << 2)
+
+enum idle_state { IDLE_RUNNING, IDLE_HALTED, IDLE_MWAIT };
+
+// The wake word gets a monitored cache line to itself
+struct idle_cpu {
+	uint64_t wake;
+	enum idle_state state;
+} __attribute__((aligned(64)));
+
+// Target residency of C1 to C7 in ns, a C-state is only worth entering for
+// an idle period longer than this
+static const uint64_t cstate_residency_ns[] = {
+	0, 50000, 200000, 800000, 2000000, 5000000, 10000000};
+
+static struct idle_cpu idle_cpus[MAX_CPUS];
+static bool idle_mwait = false;
+static bool idle_break_on_irq = false;
+// MWAIT hints of the deepest sub-state of C1 to C7
+static uint8_t cstate_hints[7];
+static size_t cstate_count = 0;
+
+static void idle_ipi(void) {
+}
+
+void idle_init(void) {
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+
+	isr_register_fast_handler(IDLE_WAKE_VECTOR, idle_ipi, true);
+
+	__get_cpuid(1, &a, &b, &c, &d);
+	if (!(c & CPUID_MONITOR) || __get_cpuid_max(0, NULL) < 5) {
+		printf("idle: Using HLT\n");
+		return;
+	}
+
+	__cpuid(5, a, b, c, d);
+	if (!(c & CPUID_MWAIT_EXTENSIONS)) {
+		// Without the sub-state enumeration only C1 is known to work
+		cstate_hints[0] = 0;
+		cstate_count = 1;
+	} else {
+		// EDX has the number of sub-states of C0 to C7 in 4 bit fields
+		for (size_t i = 0; i < 7; i++) {
+			uint8_t substates = (d >> ((i + 1) * 4)) & 0xF;
+			if (substates == 0)
+				break;
+			cstate_hints[i] = (i << 4) | (substates - 1);
+			cstate_count = i + 1;
+		}
+	}
+	idle_break_on_irq = (c & CPUID_MWAIT_BREAK_ON_IRQ) != 0;
+
+	// Past C2 the LAPIC timer stops unless it's always running, the timer
+	// interrupt would never come
+	__cpuid(6, a, b, c, d);
+	if (!(a & CPUID_ARAT) && cstate_count > 2)
+		cstate_count = 2;
+
+	idle_mwait = cstate_count != 0;
+	printf("idle: Using MWAIT with %zu C-states\n", cstate_count);
+}
+
+// Deepest C-state whose target residency fits before the next timer
+static uint8_t idle_hint(void) {
+	struct timer *next = this_cpu()->timers;
+	uint64_t now = clock_monotonic_ns();
+	uint64_t expected = (uint64_t)-1;
+	if (next)
+		expected = next->deadline > now ? next->deadline - now : 0;
+
+	size_t cstate = 0;
+	while (cstate + 1 < cstate_count &&
+		   cstate_residency_ns[cstate + 1] <= expected)
+		cstate++;
+	return cstate_hints[cstate];
+}
+
+void idle_wait(void) {
+	struct idle_cpu *ic = &idle_cpus[this_cpu()->cpu_number];
+
+	// Either we see the wake word set here, or the waker sees the state and
+	// knows how to get us out
+	__atomic_store_n(&ic->state, idle_mwait ? IDLE_MWAIT : IDLE_HALTED,
+					 __ATOMIC_SEQ_CST);
+
+	if (idle_mwait) {
+		asm volatile("monitor" : : "a"(&ic->wake), "c"(0), "d"(0));
+		if (!__atomic_load_n(&ic->wake, __ATOMIC_SEQ_CST)) {
+			// With ECX bit 0 an interrupt ends MWAIT even while masked, it
+			// gets taken after the sti. Otherwise the sti shadow covers the
+			// MWAIT the way it does HLT.
+			if (idle_break_on_irq)
+				asm volatile("mwait" : : "a"(idle_hint()), "c"(1));
+			else
+				asm volatile("sti\n\tmwait" : : "a"(idle_hint()), "c"(0));
+		}
+	} else if (!__atomic_load_n(&ic->wake, __ATOMIC_SEQ_CST)) {
+		asm volatile("sti\n\thlt");
+	}
+
+	__atomic_store_n(&ic->state, IDLE_RUNNING, __ATOMIC_RELAXED);
+	__atomic_store_n(&ic->wake, 0, __ATOMIC_RELAXED);
+	asm volatile("sti");
+}
+
+void idle_wake(size_t cpu) {
+	struct idle_cpu *ic = &idle_cpus[cpu];
+
+	__atomic_store_n(&ic->wake, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ic->state, __ATOMIC_SEQ_CST) == IDLE_HALTED)
+		apic_send_ipi(cpu_locals[cpu].lapic_id, IDLE_WAKE_VECTOR);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stddef.h>
+
+// Sent to a processor halted in idle_wait() that can't be woken by a write
+#define IDLE_WAKE_VECTOR 0xFC
+
+void idle_init(void);
+// Sleep until an interrupt or idle_wake(), as deep as the next timer on this
+// processor allows. Called with interrupts disabled after checking there is
+// nothing to do, returns with them enabled.
+void idle_wait(void);
+// Get cpu out of idle_wait() to look for work again, a store to the line it
+// monitors when it's in MWAIT and an IPI when it's in HLT
+void idle_wake(size_t cpu);
+
+#endif
@@ -16,19 +16,40 @@
  */
 
 #include "idt.h"
+#include "../klibc/mem.h"
 
-idt_gate_t idt[256] = {0};
+idt_gate_t idt[256] __attribute__((aligned(16))) = {0};
 
+// Gates can change while other processors take interrupts through them. The
+// upper half only holds the top of the address, which is the same for all of
+// the kernel's stubs, so the lower half is written last in a single store and
+// a gate always points at either the old or the new stub.
 void set_idt_gate(int n, void *handler) {
 	uint64_t p = (uint64_t)handler;
 
-	idt[n].offset_lo = (uint16_t)p;
-	idt[n].selector = 8;
-	idt[n].ist = 0;
-	idt[n].flags = 0x8E;
-	idt[n].offset_mid = (uint16_t)(p >> 16);
-	idt[n].offset_hi = (uint32_t)(p >> 32);
-	idt[n].zero = 0;
+	idt_gate_t gate = {.offset_lo = (uint16_t)p,
+					   .selector = 8,
+					   .ist = 0,
+					   .flags = 0x8E,
+					   .offset_mid = (uint16_t)(p >> 16),
+					   .offset_hi = (uint32_t)(p >> 32),
+					   .zero = 0};
+	uint64_t words[2];
+	memcpy(words, &gate, sizeof(words));
+	uint64_t *dest = (uint64_t *)(uintptr_t)&idt[n];
+	__atomic_store_n(&dest[1], words[1], __ATOMIC_RELAXED);
+	__atomic_store_n(&dest[0], words[0], __ATOMIC_RELEASE);
+}
+
+void *get_idt_gate(int n) {
+	return (void *)((uint64_t)idt[n].offset_lo |
+					(uint64_t)idt[n].offset_mid << 16 |
+					(uint64_t)idt[n].offset_hi << 32);
+}
+
+// Have the gate switch to interrupt stack ist of the TSS, 0 for none
+void set_idt_ist(int n, uint8_t ist) {
+	idt[n].ist = ist;
 }
 
 void set_idt(void) {
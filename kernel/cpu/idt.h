@@ -36,6 +36,8 @@ typedef struct {
 } __attribute__((packed)) idt_register_t;
 
 void set_idt_gate(int n, void *handler);
+void *get_idt_gate(int n);
+void set_idt_ist(int n, uint8_t ist);
 void set_idt(void);
 
 #endif
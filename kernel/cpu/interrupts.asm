@@ -305,3 +305,81 @@ isr 252
 isr 253
 isr 254
 isr 255
+
+extern apic_eoi
+extern fast_isr_handlers
+extern fast_isr_early_eoi
+extern sched_irq_exit
+extern softirq_irq_exit
+
+; Entry for handlers registered with isr_register_fast_handler. Only the
+; general purpose registers a C call may clobber are saved and the handler is
+; called directly, with the stack aligned as the 9 pushes follow the 5 quadword
+; frame. The kernel is built with -mgeneral-regs-only, so no handler touches
+; the FPU or vector registers, which stay with whichever thread owns them. On
+; the way out tasklets the handler raised are run and then the scheduler gets
+; the interrupted RFLAGS.IF, so the timer can preempt, as on the full path.
+%macro fastIsr 1
+
+fastIsr%1:
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	cld
+	cmp byte [rel fast_isr_early_eoi + %1], 0
+	je %%late_eoi
+	call apic_eoi
+	call [rel fast_isr_handlers + %1 * 8]
+	jmp %%done
+%%late_eoi:
+	call [rel fast_isr_handlers + %1 * 8]
+	call apic_eoi
+%%done:
+	mov rdi, [rsp + 88]
+	shr rdi, 9
+	and edi, 1
+	call softirq_irq_exit
+	mov rdi, [rsp + 88]
+	shr rdi, 9
+	and edi, 1
+	call sched_irq_exit
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+	iretq
+
+%endmacro
+
+%macro fastIsrEntry 1
+	dq fastIsr%1
+%endmacro
+
+; Exceptions always take the full path, device and IPI vectors can go fast
+%assign vector 32
+%rep 224
+fastIsr vector
+%assign vector vector + 1
+%endrep
+
+section .data
+
+; Addresses of the fast stubs for vectors 32 to 255
+global fast_isr_stubs
+fast_isr_stubs:
+%assign vector 32
+%rep 224
+fastIsrEntry vector
+%assign vector vector + 1
+%endrep
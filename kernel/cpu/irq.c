@@ -0,0 +1,164 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "irq.h"
+#include "../klibc/lock.h"
+#include "../klibc/printf.h"
+#include "../sys/pci.h"
+#include "apic.h"
+#include "cpu.h"
+
+enum irq_source { IRQ_NONE, IRQ_GSI, IRQ_MSI };
+
+struct irq_desc {
+	enum irq_source source;
+	uint32_t gsi;
+	struct pci_device *dev;
+	size_t index;
+	size_t cpu;
+	// Set through irq_set_affinity or by the driver, the balancer only moves
+	// interrupts that aren't pinned
+	uint64_t affinity;
+	bool pinned;
+};
+
+static struct irq_desc irq_descs[256];
+static lock_t irq_lock = {0};
+
+static void irq_retarget(struct irq_desc *desc, uint8_t vector, size_t cpu) {
+	desc->cpu = cpu;
+	if (desc->source == IRQ_GSI)
+		ioapic_set_gsi_target(desc->gsi, cpu_locals[cpu].lapic_id);
+	else if (desc->source == IRQ_MSI)
+		pci_irq_route(desc->dev, desc->index, vector, cpu);
+}
+
+void irq_register_gsi(uint8_t vector, uint32_t gsi, size_t cpu) {
+	uint64_t rflags = lock_irqsave(&irq_lock);
+	irq_descs[vector] = (struct irq_desc){
+		.source = IRQ_GSI, .gsi = gsi, .cpu = cpu, .affinity = ~0ULL};
+	lock_irqrestore(&irq_lock, rflags);
+}
+
+void irq_register_msi(uint8_t vector, struct pci_device *dev, size_t index,
+					  size_t cpu, bool pinned) {
+	uint64_t rflags = lock_irqsave(&irq_lock);
+	irq_descs[vector] = (struct irq_desc){.source = IRQ_MSI,
+										  .dev = dev,
+										  .index = index,
+										  .cpu = cpu,
+										  .affinity = pinned ? 1ULL << cpu
+															 : ~0ULL,
+										  .pinned = pinned};
+	lock_irqrestore(&irq_lock, rflags);
+}
+
+bool irq_cpu_targetable(size_t cpu) {
+	return cpu_locals[cpu].lapic_id <= 0xFF;
+}
+
+size_t irq_target_cpu(size_t cpu) {
+	if (irq_cpu_targetable(cpu))
+		return cpu;
+	for (size_t i = 0; i < cpu_count; i++)
+		if (irq_cpu_targetable(i))
+			return i;
+	return 0;
+}
+
+// Number of balanced interrupts going to each processor
+static void irq_load(size_t *load) {
+	for (size_t i = 0; i < cpu_count; i++)
+		load[i] = 0;
+	for (size_t v = 0; v < 256; v++)
+		if (irq_descs[v].source != IRQ_NONE && irq_descs[v].cpu < cpu_count)
+			load[irq_descs[v].cpu]++;
+}
+
+// The least loaded processor in mask that can take device interrupts, or
+// SIZE_MAX if mask has none online
+static size_t irq_pick_cpu(const size_t *load, uint64_t mask) {
+	size_t best = (size_t)-1;
+	for (size_t i = 0; i < cpu_count; i++)
+		if ((mask & (1ULL << i)) && irq_cpu_targetable(i) &&
+			(best == (size_t)-1 || load[i] < load[best]))
+			best = i;
+	return best;
+}
+
+bool irq_set_affinity(uint8_t vector, uint64_t mask) {
+	size_t load[MAX_CPUS];
+
+	uint64_t rflags = lock_irqsave(&irq_lock);
+	struct irq_desc *desc = &irq_descs[vector];
+	if (desc->source == IRQ_NONE) {
+		lock_irqrestore(&irq_lock, rflags);
+		return false;
+	}
+
+	irq_load(load);
+	if (desc->cpu < cpu_count)
+		load[desc->cpu]--;
+	size_t cpu = irq_pick_cpu(load, mask);
+	if (cpu == (size_t)-1) {
+		lock_irqrestore(&irq_lock, rflags);
+		return false;
+	}
+
+	desc->affinity = mask;
+	desc->pinned = true;
+	irq_retarget(desc, vector, cpu);
+	lock_irqrestore(&irq_lock, rflags);
+	return true;
+}
+
+size_t irq_get_cpu(uint8_t vector) {
+	return irq_descs[vector].cpu;
+}
+
+void irq_balance(void) {
+	size_t load[MAX_CPUS];
+
+	uint64_t rflags = lock_irqsave(&irq_lock);
+
+	// Pinned interrupts stay where they are and count towards the load, the
+	// rest are handed out again one at a time
+	for (size_t i = 0; i < cpu_count; i++)
+		load[i] = 0;
+	for (size_t v = 0; v < 256; v++)
+		if (irq_descs[v].source != IRQ_NONE && irq_descs[v].pinned &&
+			irq_descs[v].cpu < cpu_count)
+			load[irq_descs[v].cpu]++;
+
+	size_t moved = 0;
+	for (size_t v = 0; v < 256; v++) {
+		struct irq_desc *desc = &irq_descs[v];
+		if (desc->source == IRQ_NONE || desc->pinned)
+			continue;
+		size_t cpu = irq_pick_cpu(load, desc->affinity);
+		if (cpu == (size_t)-1)
+			continue;
+		load[cpu]++;
+		if (cpu != desc->cpu) {
+			irq_retarget(desc, v, cpu);
+			moved++;
+		}
+	}
+
+	lock_irqrestore(&irq_lock, rflags);
+	printf("irq: Balanced interrupts over %zu processors, %zu moved\n",
+		   cpu_count, moved);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pci_device;
+
+// Let the balancer pick the processor of an interrupt
+#define IRQ_ANY_CPU ((size_t)-1)
+
+// Where each device interrupt comes from and which processor it's sent to,
+// so it can be moved. The IOAPIC and PCI code register their vectors here.
+void irq_register_gsi(uint8_t vector, uint32_t gsi, size_t cpu);
+void irq_register_msi(uint8_t vector, struct pci_device *dev, size_t index,
+					  size_t cpu, bool pinned);
+
+// IOAPIC and MSI destinations are 8-bit APIC IDs without interrupt remapping,
+// which isn't set up. Processors with higher x2APIC IDs only get IPIs.
+bool irq_cpu_targetable(size_t cpu);
+// cpu if device interrupts can go to it, else the first processor they can
+size_t irq_target_cpu(size_t cpu);
+
+// Send vector to one of the processors in mask, bit n standing for processor
+// n. The balancer leaves it there from then on.
+bool irq_set_affinity(uint8_t vector, uint64_t mask);
+size_t irq_get_cpu(uint8_t vector);
+
+// Spread every interrupt without an affinity of its own evenly over the
+// processors
+void irq_balance(void);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "irqstat.h"
+#include "../dev/dev.h"
+#include "../klibc/alloc.h"
+#include "../klibc/mem.h"
+#include "../klibc/printf.h"
+#include "../klibc/resource.h"
+#include "cpu.h"
+#include <liballoc.h>
+#include <stddef.h>
+
+// Each processor only writes its own counters, readers add them up without
+// stopping it, so a total can be a handler behind
+static bool irqstat_histogram = false;
+
+void irqstat_cpu_init(void) {
+	this_cpu()->irq_stats = alloc(sizeof(struct irq_cpu_stats));
+}
+
+void irqstat_record(uint8_t vector, uint64_t cycles) {
+	struct irq_cpu_stats *stats = this_cpu()->irq_stats;
+	if (stats == NULL)
+		return;
+
+	stats->vectors[vector].count++;
+	stats->vectors[vector].cycles += cycles;
+	if (cycles > stats->vectors[vector].max)
+		stats->vectors[vector].max = cycles;
+
+	if (irqstat_histogram) {
+		int bucket = cycles ? 63 - __builtin_clzll(cycles) - 8 : 0;
+		if (bucket < 0)
+			bucket = 0;
+		if (bucket >= IRQSTAT_BUCKETS)
+			bucket = IRQSTAT_BUCKETS - 1;
+		stats->histogram[vector][bucket]++;
+	}
+}
+
+// One line per vector that fired: the total, then the count on each processor
+// and the handler cycles
+static size_t format_vector(char *buf, size_t size, int vector) {
+	uint64_t count = 0, cycles = 0, max = 0;
+	for (size_t i = 0; i < cpu_count; i++) {
+		struct irq_cpu_stats *stats = cpu_locals[i].irq_stats;
+		if (stats == NULL)
+			continue;
+		count += stats->vectors[vector].count;
+		cycles += stats->vectors[vector].cycles;
+		if (stats->vectors[vector].max > max)
+			max = stats->vectors[vector].max;
+	}
+	if (count == 0)
+		return 0;
+
+	size_t len = snprintf(buf, size, "%3d %llu", vector, count);
+	for (size_t i = 0; i < cpu_count && len < size; i++) {
+		struct irq_cpu_stats *stats = cpu_locals[i].irq_stats;
+		len += snprintf(buf + len, size - len, " %llu",
+						stats ? stats->vectors[vector].count : 0);
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, " | %llu %llu %llu\n", cycles,
+						cycles / count, max);
+
+	if (irqstat_histogram && len < size) {
+		len += snprintf(buf + len, size - len, "    hist");
+		for (int b = 0; b < IRQSTAT_BUCKETS && len < size; b++) {
+			uint64_t n = 0;
+			for (size_t i = 0; i < cpu_count; i++)
+				if (cpu_locals[i].irq_stats)
+					n += cpu_locals[i].irq_stats->histogram[vector][b];
+			len += snprintf(buf + len, size - len, " %llu", n);
+		}
+		if (len < size)
+			len += snprintf(buf + len, size - len, "\n");
+	}
+
+	return len < size ? len : size - 1;
+}
+
+static const char header[] = "vector total per-cpu... | cycles avg max\n";
+
+// Room for any one vector's lines
+static size_t line_size(void) {
+	return 64 + cpu_count * 21 + (irqstat_histogram ? IRQSTAT_BUCKETS * 21 : 0);
+}
+
+void irqstat_dump(void) {
+	size_t size = line_size();
+	char *line = kmalloc(size);
+	if (line == NULL)
+		return;
+
+	printf("irqstat: %s", header);
+	for (int v = 0; v < 256; v++)
+		if (format_vector(line, size, v))
+			printf("irqstat: %s", line);
+	kfree(line);
+}
+
+static ssize_t irqstat_read(struct resource *this, void *buf, off_t loc,
+							size_t count) {
+	(void)this;
+
+	size_t line = line_size();
+	size_t size = sizeof(header) + 256 * line;
+	char *text = kmalloc(size);
+	if (text == NULL)
+		return -1;
+
+	size_t length = snprintf(text, size, "%s", header);
+	for (int v = 0; v < 256; v++)
+		length += format_vector(text + length, line, v);
+
+	if ((size_t)loc >= length) {
+		count = 0;
+	} else {
+		if (count > length - loc)
+			count = length - loc;
+		memcpy(buf, text + loc, count);
+	}
+
+	kfree(text);
+	return count;
+}
+
+// Expose the statistics as /dev/irqstat, devtmpfs has to be mounted
+void irqstat_init(bool histogram) {
+	irqstat_histogram = histogram;
+
+	struct resource *res = resource_create(sizeof(struct resource));
+	res->read = irqstat_read;
+	res->st.st_mode = S_IFCHR | 0444;
+	dev_add_new(res, "irqstat");
+}
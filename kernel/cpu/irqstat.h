@@ -0,0 +1,43 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Handler time buckets, bucket n counts handlers that took between 2^(n+8)
+// and 2^(n+9) cycles, the first and last ones also what's below and above
+#define IRQSTAT_BUCKETS 16
+
+struct irq_cpu_stats {
+	struct {
+		uint64_t count;
+		uint64_t cycles;
+		uint64_t max;
+	} vectors[256];
+	uint32_t histogram[256][IRQSTAT_BUCKETS];
+};
+
+// Give the calling processor its counters, before it takes interrupts
+void irqstat_cpu_init(void);
+void irqstat_record(uint8_t vector, uint64_t cycles);
+// Add /dev/irqstat, and record handler times in histograms if asked to
+void irqstat_init(bool histogram);
+void irqstat_dump(void);
+
+#endif
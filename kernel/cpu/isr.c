@@ -19,8 +19,15 @@
 #include "isr.h"
 #include "../kernel/panic.h"
 #include "../klibc/printf.h"
+#include "../klibc/trace.h"
+#include "../mm/vmm.h"
+#include "../sched/sched.h"
+#include "../sys/gdt.h"
 #include "apic.h"
+#include "cpu.h"
 #include "idt.h"
+#include "irqstat.h"
+#include "softirq.h"
 
 void isr_install(void) {
 	set_idt_gate(0, isr0);
@@ -279,7 +286,11 @@ void isr_install(void) {
 	set_idt_gate(253, isr253);
 	set_idt_gate(254, isr254);
 	set_idt_gate(255, isr255);
+	set_idt_ist(2, IST_NMI);
+	set_idt_ist(8, IST_DOUBLE_FAULT);
+	set_idt_ist(18, IST_MACHINE_CHECK);
 	set_idt();
+	irqstat_cpu_init();
 }
 
 static const char *exceptionMessages[] = {"Divide by zero",
@@ -320,7 +331,17 @@ static const char *exceptionMessages[] = {"Divide by zero",
 
 static eventHandlers_t eventHandlers[256] = {NULL};
 
+// Used by the stubs in interrupts.asm
+fastHandler_t fast_isr_handlers[256] = {NULL};
+uint8_t fast_isr_early_eoi[256] = {0};
+extern void *fast_isr_stubs[224];
+
 void isr_handler(registers_t *r) {
+	TRACEPOINT(TRACE_ISR, r->isrNumber, r->rip);
+	if (r->isrNumber == 14 && vmm_handle_fault(read_cr("2"), r->errorCode))
+		return;
+	if (r->isrNumber == 7 && sched_fpu_trap())
+		return;
 	if (r->isrNumber < 32) {
 		char x[72];
 		sprintf(x, "System Service Exception Not Handled: %s",
@@ -328,11 +349,52 @@ void isr_handler(registers_t *r) {
 		PANIC(x);
 		__builtin_unreachable();
 	}
-	if (eventHandlers[r->isrNumber] != NULL)
+	bool early_eoi = fast_isr_early_eoi[r->isrNumber];
+	if (early_eoi)
+		apic_eoi();
+	if (eventHandlers[r->isrNumber] != NULL) {
+		uint64_t start = rdtsc();
 		eventHandlers[r->isrNumber](r);
-	apic_eoi();
+		irqstat_record(r->isrNumber, rdtsc() - start);
+	}
+	if (!early_eoi)
+		apic_eoi();
+	softirq_irq_exit(r->rflags & (1 << 9));
+	sched_irq_exit(r->rflags & (1 << 9));
 }
 
 void isr_register_handler(int n, void *handler) {
 	eventHandlers[n] = handler;
 }
+
+void isr_set_early_eoi(int n, bool early_eoi) {
+	fast_isr_early_eoi[n] = early_eoi;
+}
+
+// Gates of the full path of vectors that were given a fast handler
+static void *full_isr_gates[256] = {NULL};
+
+void isr_register_fast_handler(int n, fastHandler_t handler, bool early_eoi) {
+	if (n < 32)
+		PANIC("Fast handlers are only for interrupts");
+	if (full_isr_gates[n] == NULL)
+		full_isr_gates[n] = get_idt_gate(n);
+	fast_isr_handlers[n] = handler;
+	fast_isr_early_eoi[n] = early_eoi;
+	// The IDT is shared, every processor takes the new entry from now on
+	set_idt_gate(n, fast_isr_stubs[n - 32]);
+}
+
+// The fast handler stays set for interrupts already on their way through it
+void isr_clear_fast_handler(int n) {
+	if (full_isr_gates[n] != NULL)
+		set_idt_gate(n, full_isr_gates[n]);
+}
+
+static int next_dynamic_vector = ISR_DYNAMIC_FIRST;
+
+int isr_alloc_vector(void) {
+	int vector =
+		__atomic_fetch_add(&next_dynamic_vector, 1, __ATOMIC_RELAXED);
+	return vector <= ISR_DYNAMIC_LAST ? vector : -1;
+}
@@ -19,6 +19,8 @@
  */
 
 #include "reg.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 void isr1(void);
 void isr2(void);
@@ -278,9 +280,29 @@ void isr254(void);
 void isr255(void);
 
 typedef void (*eventHandlers_t)(registers_t *);
+typedef void (*fastHandler_t)(void);
+
+// Vectors handed out to device interrupts, clear of the legacy IRQs, the SCI
+// and the IPIs at the top
+#define ISR_DYNAMIC_FIRST 0x50
+#define ISR_DYNAMIC_LAST 0xEF
 
 void isr_install(void);
 extern void isr_handler(registers_t *r);
 void isr_register_handler(int n, void *handler);
+// A free vector for a device interrupt, or -1 once they ran out
+int isr_alloc_vector(void);
+
+// Send the EOI before the handler runs rather than after, so the next
+// interrupt on the vector can be latched meanwhile. Only for edge triggered
+// vectors, a level triggered line would fire again at once.
+void isr_set_early_eoi(int n, bool early_eoi);
+// Enter handler through a stub that skips the full register save and the
+// common dispatcher, for IPIs and timers that don't look at the interrupted
+// state. Vectors from 32 up, with no interrupt statistics.
+void isr_register_fast_handler(int n, fastHandler_t handler, bool early_eoi);
+// Send the vector through the full dispatcher again, to the handler given to
+// isr_register_handler()
+void isr_clear_fast_handler(int n);
 
 #endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pmu.h"
+#include "../klibc/printf.h"
+#include "cpu.h"
+#include <cpuid.h>
+
+#define IA32_PERFEVTSEL0 0x186
+#define IA32_PMC0 0xC1
+#define IA32_FIXED_CTR0 0x309
+#define IA32_FIXED_CTR_CTRL 0x38D
+#define IA32_PERF_GLOBAL_CTRL 0x38F
+#define IA32_PERF_GLOBAL_OVF_CTRL 0x390
+
+// Count in ring 0 and enable
+#define PERFEVTSEL_OS (1 << 17)
+#define PERFEVTSEL_EN (1 << 22)
+
+// Bit 30 of an RDPMC index selects the fixed counters
+#define RDPMC_FIXED (1u << 30)
+
+struct pmu_event_desc {
+	const char *name;
+	uint8_t event;
+	uint8_t umask;
+	// Bit in CPUID 0xA EBX that is set when the event is missing, -1 if it
+	// isn't architectural
+	int8_t cpuid_bit;
+	// Fixed counter that counts it, -1 for none
+	int8_t fixed;
+};
+
+static const struct pmu_event_desc pmu_events[PMU_EVENT_COUNT] = {
+	[PMU_CYCLES] = {"cycles", 0x3C, 0x00, 0, 1},
+	[PMU_INSTRUCTIONS] = {"instructions", 0xC0, 0x00, 1, 0},
+	[PMU_LLC_MISSES] = {"llc-misses", 0x2E, 0x41, 4, -1},
+	[PMU_DTLB_MISSES] = {"dtlb-misses", 0x08, 0x01, -1, -1},
+	[PMU_BRANCH_MISSES] = {"branch-misses", 0xC5, 0x00, 6, -1},
+};
+
+static uint8_t pmu_version = 0;
+static uint8_t pmu_gp_count = 0;
+static uint8_t pmu_gp_width = 0;
+static uint8_t pmu_fixed_count = 0;
+static uint8_t pmu_fixed_width = 0;
+static uint32_t pmu_missing = 0;
+
+// The counter of every event on a processor, as an RDPMC index
+struct pmu_cpu {
+	uint32_t events;
+	uint32_t index[PMU_EVENT_COUNT];
+};
+
+static struct pmu_cpu pmu_cpus[MAX_CPUS];
+
+void pmu_init(void) {
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	if (!__get_cpuid(0, &a, &b, &c, &d) || a < 0xA)
+		return;
+	__get_cpuid(0xA, &a, &b, &c, &d);
+
+	pmu_version = a & 0xFF;
+	if (pmu_version == 0)
+		return;
+	pmu_gp_count = (a >> 8) & 0xFF;
+	pmu_gp_width = (a >> 16) & 0xFF;
+	// EBX only covers the events its length in EAX says it does
+	uint8_t known = (a >> 24) & 0xFF;
+	pmu_missing = known < 32 ? b | ~((1u << known) - 1) : b;
+	if (pmu_version >= 2) {
+		pmu_fixed_count = d & 0x1F;
+		pmu_fixed_width = (d >> 5) & 0xFF;
+	}
+
+	printf("PMU: Version %u, %u counters of %u bits, %u fixed of %u bits\n",
+		   pmu_version, pmu_gp_count, pmu_gp_width, pmu_fixed_count,
+		   pmu_fixed_width);
+}
+
+bool pmu_available(enum pmu_event event) {
+	const struct pmu_event_desc *desc = &pmu_events[event];
+	if (pmu_version == 0)
+		return false;
+	if (desc->cpuid_bit >= 0 && (pmu_missing & (1u << desc->cpuid_bit)))
+		return false;
+	return true;
+}
+
+const char *pmu_event_name(enum pmu_event event) {
+	return pmu_events[event].name;
+}
+
+static inline uint64_t rdpmc(uint32_t index) {
+	uint32_t eax, edx;
+	asm volatile("rdpmc" : "=a"(eax), "=d"(edx) : "c"(index));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+uint32_t pmu_start(uint32_t events) {
+	uint64_t rflags = cpu_irq_save();
+	struct pmu_cpu *pc = &pmu_cpus[this_cpu_read(cpu_number)];
+
+	if (pmu_version >= 2)
+		wrmsr(IA32_PERF_GLOBAL_CTRL, 0);
+
+	// Fixed counters first, they leave the general ones free
+	uint64_t fixed_ctrl = 0, global = 0;
+	size_t gp = 0;
+	pc->events = 0;
+	for (int e = 0; e < PMU_EVENT_COUNT; e++) {
+		const struct pmu_event_desc *desc = &pmu_events[e];
+		if (!(events & (1u << e)) || !pmu_available(e))
+			continue;
+
+		if (desc->fixed >= 0 && desc->fixed < pmu_fixed_count) {
+			// Ring 0 only
+			fixed_ctrl |= 1ULL << (desc->fixed * 4);
+			global |= 1ULL << (32 + desc->fixed);
+			wrmsr(IA32_FIXED_CTR0 + desc->fixed, 0);
+			pc->index[e] = RDPMC_FIXED | desc->fixed;
+		} else if (gp < pmu_gp_count) {
+			wrmsr(IA32_PERFEVTSEL0 + gp, 0);
+			wrmsr(IA32_PMC0 + gp, 0);
+			wrmsr(IA32_PERFEVTSEL0 + gp, desc->event | desc->umask << 8 |
+											 PERFEVTSEL_OS | PERFEVTSEL_EN);
+			global |= 1ULL << gp;
+			pc->index[e] = gp++;
+		} else {
+			continue;
+		}
+		pc->events |= 1u << e;
+	}
+
+	// Unused general counters are switched off, whatever set them up before
+	for (size_t i = gp; i < pmu_gp_count; i++)
+		wrmsr(IA32_PERFEVTSEL0 + i, 0);
+	if (pmu_fixed_count)
+		wrmsr(IA32_FIXED_CTR_CTRL, fixed_ctrl);
+	if (pmu_version >= 2) {
+		wrmsr(IA32_PERF_GLOBAL_OVF_CTRL, global);
+		wrmsr(IA32_PERF_GLOBAL_CTRL, global);
+	}
+
+	uint32_t started = pc->events;
+	cpu_irq_restore(rflags);
+	return started;
+}
+
+void pmu_stop(void) {
+	if (pmu_version == 0)
+		return;
+
+	uint64_t rflags = cpu_irq_save();
+	if (pmu_version >= 2)
+		wrmsr(IA32_PERF_GLOBAL_CTRL, 0);
+	for (size_t i = 0; i < pmu_gp_count; i++)
+		wrmsr(IA32_PERFEVTSEL0 + i, 0);
+	if (pmu_fixed_count)
+		wrmsr(IA32_FIXED_CTR_CTRL, 0);
+	pmu_cpus[this_cpu_read(cpu_number)].events = 0;
+	cpu_irq_restore(rflags);
+}
+
+void pmu_read(struct pmu_counters *counters) {
+	uint64_t rflags = cpu_irq_save();
+	struct pmu_cpu *pc = &pmu_cpus[this_cpu_read(cpu_number)];
+	for (int e = 0; e < PMU_EVENT_COUNT; e++)
+		counters->values[e] =
+			pc->events & (1u << e) ? rdpmc(pc->index[e]) : 0;
+	cpu_irq_restore(rflags);
+}
+
+void pmu_diff(struct pmu_counters *delta, const struct pmu_counters *before,
+			  const struct pmu_counters *after) {
+	for (int e = 0; e < PMU_EVENT_COUNT; e++) {
+		const struct pmu_event_desc *desc = &pmu_events[e];
+		uint8_t width = desc->fixed >= 0 && desc->fixed < pmu_fixed_count
+							? pmu_fixed_width
+							: pmu_gp_width;
+		uint64_t mask = width >= 64 || width == 0 ? ~0ULL : (1ULL << width) - 1;
+		delta->values[e] = (after->values[e] - before->values[e]) & mask;
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Events the architectural performance monitoring of Intel processors can
+// count. dTLB misses aren't architectural, the encoding used is the load walk
+// event from Sandy Bridge through Skylake.
+enum pmu_event {
+	PMU_CYCLES,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_DTLB_MISSES,
+	PMU_BRANCH_MISSES,
+	PMU_EVENT_COUNT
+};
+
+#define PMU_ALL ((1u << PMU_EVENT_COUNT) - 1)
+
+struct pmu_counters {
+	uint64_t values[PMU_EVENT_COUNT];
+};
+
+// Look the counters up with CPUID leaf 0xA, once at boot
+void pmu_init(void);
+// Whether the processor can count event at all
+bool pmu_available(enum pmu_event event);
+const char *pmu_event_name(enum pmu_event event);
+// Count the events in the mask on the calling processor from zero. Returns
+// the ones that got a counter, events already counting are started again.
+uint32_t pmu_start(uint32_t events);
+void pmu_stop(void);
+// Current counts of the calling processor, 0 for events it isn't counting
+void pmu_read(struct pmu_counters *counters);
+// after - before, for counters that may have wrapped in between
+void pmu_diff(struct pmu_counters *delta, const struct pmu_counters *before,
+			  const struct pmu_counters *after);
+
+#endif
@@ -37,6 +37,14 @@ void port_word_out(uint16_t port, uint16_t data) {
 	asm volatile("out %0, %1\n\t" : : "d"(port), "a"(data) : "memory");
 }
 
+void port_words_in(uint16_t port, void *buf, size_t count) {
+	asm volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+void port_words_out(uint16_t port, const void *buf, size_t count) {
+	asm volatile("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
 uint32_t port_dword_in(uint16_t port) {
 	uint32_t ret;
 	asm volatile("in %0, %1\n\t" : "=a"(ret) : "d"(port) : "memory");
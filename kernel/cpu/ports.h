@@ -18,12 +18,16 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 uint8_t port_byte_in(uint16_t port);
 void port_byte_out(uint16_t port, uint8_t data);
 uint16_t port_word_in(uint16_t port);
 void port_word_out(uint16_t port, uint16_t data);
+// Move count words between port and buf with a single string instruction
+void port_words_in(uint16_t port, void *buf, size_t count);
+void port_words_out(uint16_t port, const void *buf, size_t count);
 uint32_t port_dword_in(uint16_t port);
 void port_dword_out(uint16_t port, uint32_t data);
 
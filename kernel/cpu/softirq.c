@@ -0,0 +1,81 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "softirq.h"
+#include "cpu.h"
+#include <stddef.h>
+
+// Rounds of draining on interrupt exit before the rest is left to the idle
+// loop or the next interrupt, so a tasklet rescheduling itself can't hold the
+// interrupted code off forever
+#define SOFTIRQ_MAX_ROUNDS 8
+
+void tasklet_schedule(struct tasklet *t) {
+	if (__atomic_exchange_n(&t->scheduled, true, __ATOMIC_ACQ_REL))
+		return;
+
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *cpu = this_cpu();
+	t->next = cpu->tasklets;
+	cpu->tasklets = t;
+	cpu_irq_restore(rflags);
+}
+
+static bool softirq_drain(size_t rounds) {
+	struct cpu_local *cpu = this_cpu();
+	bool ran = false;
+
+	// Nested interrupts leave the draining to the outer one
+	if (cpu->in_softirq)
+		return false;
+	cpu->in_softirq = true;
+
+	uint64_t rflags = cpu_irq_save();
+	for (size_t round = 0; round < rounds && cpu->tasklets; round++) {
+		// The list is pushed to at the head, run it oldest first
+		struct tasklet *list = NULL;
+		for (struct tasklet *t = cpu->tasklets, *next; t; t = next) {
+			next = t->next;
+			t->next = list;
+			list = t;
+		}
+		cpu->tasklets = NULL;
+
+		asm volatile("sti");
+		for (struct tasklet *t = list, *next; t; t = next) {
+			next = t->next;
+			__atomic_store_n(&t->scheduled, false, __ATOMIC_RELEASE);
+			t->func(t->arg);
+		}
+		asm volatile("cli");
+		ran = true;
+	}
+	cpu_irq_restore(rflags);
+
+	cpu->in_softirq = false;
+	return ran;
+}
+
+bool softirq_run(void) {
+	return softirq_drain((size_t)-1);
+}
+
+void softirq_irq_exit(bool interrupts_were_enabled) {
+	// Code that had interrupts disabled can't be run over by tasklets, they
+	// wait until it enables them and takes another interrupt
+	if (interrupts_were_enabled && this_cpu_read(tasklets))
+		softirq_drain(SOFTIRQ_MAX_ROUNDS);
+}
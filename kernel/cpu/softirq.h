@@ -0,0 +1,44 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdbool.h>
+
+// Deferred work for interrupt handlers. The handler does what has to happen
+// at once and schedules a tasklet for the rest, which runs on the same
+// processor with interrupts enabled once the interrupt returns, or from the
+// idle loop. A tasklet scheduled again while it runs may run on another
+// processor at the same time, so the work must take its own locks.
+struct tasklet {
+	void (*func)(void *arg);
+	void *arg;
+	struct tasklet *next;
+	bool scheduled;
+};
+
+#define TASKLET_INIT(FUNC, ARG) \
+	{ .func = (FUNC), .arg = (ARG), .next = NULL, .scheduled = false }
+
+// Queue t on this processor unless it's already waiting to run
+void tasklet_schedule(struct tasklet *t);
+// Run the tasklets queued on this processor, returning whether there were any
+bool softirq_run(void);
+// Called on the way out of an interrupt handler
+void softirq_irq_exit(bool interrupts_were_enabled);
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ahci.h"
+#include "../cpu/irq.h"
+#include "../cpu/softirq.h"
+#include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
+#include "../sys/mmio.h"
+#include "../sys/pci.h"
+#include "ahcidef.h"
+#include "block.h"
+#include "idedef.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Every port with a disk on it is a block device. A request takes a command
+// slot, with NCQ the disk has up to 32 of them in flight and finishes them in
+// any order.
+struct ahci_port {
+	struct block_device blk;
+	void *regs;
+	// Whether the controller reaches memory above 4 GiB
+	bool s64a;
+	bool ncq;
+	size_t slots;
+	struct ahci_cmd_header *cmd_list;
+	struct ahci_cmd_table *tables[32];
+
+	lock_t lock;
+	// Slots issued to the disk and their requests
+	uint32_t busy;
+	struct block_request *reqs[32];
+};
+
+struct ahci_controller {
+	void *abar;
+	struct ahci_port *ports[32];
+	struct tasklet reap;
+};
+
+static size_t ahci_disk_count = 0;
+
+static inline uint32_t port_read(struct ahci_port *port, uint32_t reg) {
+	return mmind(port->regs + reg);
+}
+
+static inline void port_write(struct ahci_port *port, uint32_t reg,
+							  uint32_t value) {
+	mmoutd(port->regs + reg, value);
+}
+
+static void ahci_port_stop(struct ahci_port *port) {
+	port_write(port, AHCI_PX_CMD,
+			   port_read(port, AHCI_PX_CMD) &
+				   ~(AHCI_PX_CMD_ST | AHCI_PX_CMD_FRE));
+	while (port_read(port, AHCI_PX_CMD) & (AHCI_PX_CMD_CR | AHCI_PX_CMD_FR))
+		asm volatile("pause");
+}
+
+static void ahci_port_start(struct ahci_port *port) {
+	while (port_read(port, AHCI_PX_CMD) & AHCI_PX_CMD_CR)
+		asm volatile("pause");
+	port_write(port, AHCI_PX_CMD,
+			   port_read(port, AHCI_PX_CMD) | AHCI_PX_CMD_FRE |
+				   AHCI_PX_CMD_ST);
+}
+
+// Physical address of a buffer the controller can reach, which is below 4 GiB
+// unless it does 64-bit addressing
+static bool ahci_phys(struct ahci_port *port, uintptr_t virt, size_t len,
+					  uint64_t *phys) {
+	if (!vmm_virt_to_phys(kernel_pagemap, virt, phys))
+		return false;
+	return port->s64a || *phys + len <= 0x100000000;
+}
+
+// Describe the buffers of bio and the ones chained after it in a command
+// table, returning the number of PRDs or -1 if they don't fit
+static int ahci_build_prdt(struct ahci_port *port,
+						   struct ahci_cmd_table *table, struct bio *bio) {
+	int n = 0;
+
+	for (; bio; bio = bio->next) {
+		uintptr_t virt = (uintptr_t)bio->buf;
+		size_t left = bio->count * 512;
+
+		if (virt & 1)
+			return -1;
+
+		while (left) {
+			size_t chunk = MIN(left, PAGE_SIZE - (virt % PAGE_SIZE));
+			uint64_t phys;
+			if (!ahci_phys(port, virt, chunk, &phys))
+				return -1;
+
+			// Grow the last PRD while memory stays contiguous
+			struct ahci_prd *last = n ? &table->prdt[n - 1] : NULL;
+			uint64_t last_base =
+				last ? ((uint64_t)last->dbau << 32 | last->dba) : 0;
+			size_t last_size = last ? (last->dbc & 0x3FFFFF) + 1 : 0;
+
+			if (last && last_base + last_size == phys &&
+				last_size + chunk <= AHCI_PRD_MAX) {
+				last->dbc = last_size + chunk - 1;
+			} else {
+				if (n == (int)AHCI_PRDS_PER_TABLE)
+					return -1;
+				last = &table->prdt[n++];
+				last->dba = phys;
+				last->dbau = phys >> 32;
+				last->reserved = 0;
+				last->dbc = chunk - 1;
+			}
+
+			virt += chunk;
+			left -= chunk;
+		}
+	}
+
+	return n;
+}
+
+// Fill in slot for command on count sectors from lba. NCQ commands carry the
+// count in the feature registers and the slot as tag.
+static void ahci_fill_slot(struct ahci_port *port, int slot, uint8_t command,
+						   uint64_t lba, size_t count, int prds, bool write) {
+	struct ahci_fis_h2d *fis = (void *)port->tables[slot]->cfis;
+	memset(fis, 0, sizeof(struct ahci_fis_h2d));
+
+	fis->type = FIS_TYPE_REG_H2D;
+	fis->flags = 0x80;
+	fis->command = command;
+	fis->lba0 = lba;
+	fis->lba1 = lba >> 8;
+	fis->lba2 = lba >> 16;
+	fis->lba3 = lba >> 24;
+	fis->lba4 = lba >> 32;
+	fis->lba5 = lba >> 40;
+
+	if (command == ATA_CMD_IDENTIFY) {
+		fis->device = 0;
+	} else if (command == ATA_CMD_READ_FPDMA_QUEUED ||
+			   command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+		fis->device = 0x40;
+		fis->feature_low = count;
+		fis->feature_high = count >> 8;
+		fis->count_low = slot << 3;
+	} else {
+		fis->device = 0x40;
+		fis->count_low = count;
+		fis->count_high = count >> 8;
+	}
+
+	struct ahci_cmd_header *header = &port->cmd_list[slot];
+	header->flags = sizeof(struct ahci_fis_h2d) / sizeof(uint32_t) |
+					(write ? AHCI_CMD_WRITE : 0) | (uint32_t)prds << 16;
+	header->prdbc = 0;
+}
+
+// Run a command in slot 0 and wait for it, for setting up a disk before its
+// block device exists
+static bool ahci_exec_polled(struct ahci_port *port, uint8_t command,
+							 void *buf, size_t len) {
+	struct ahci_cmd_table *table = port->tables[0];
+	uint64_t phys;
+	if (!ahci_phys(port, (uintptr_t)buf, len, &phys))
+		return false;
+
+	table->prdt[0] = (struct ahci_prd){
+		.dba = phys, .dbau = phys >> 32, .reserved = 0, .dbc = len - 1};
+	ahci_fill_slot(port, 0, command, 0, 0, 1, false);
+
+	port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+	port_write(port, AHCI_PX_CI, 1);
+
+	while (port_read(port, AHCI_PX_CI) & 1) {
+		if (port_read(port, AHCI_PX_IS) & AHCI_PX_IS_TFES)
+			return false;
+		asm volatile("pause");
+	}
+
+	return !(port_read(port, AHCI_PX_TFD) & AHCI_TFD_ERR);
+}
+
+static void ahci_submit(struct block_device *this, struct block_request *req) {
+	struct ahci_port *port = (void *)this;
+
+	uint64_t rflags = lock_irqsave(&port->lock);
+
+	// The block layer keeps at most queue_depth requests here, so a slot is
+	// always free
+	int slot = __builtin_ctz(~port->busy);
+	int prds = ahci_build_prdt(port, port->tables[slot], req->bios);
+	if (prds < 0) {
+		lock_irqrestore(&port->lock, rflags);
+		printf("ahci: Buffer out of the controller's reach\n");
+		block_complete(this, req, false);
+		return;
+	}
+
+	uint8_t command;
+	if (port->ncq)
+		command = req->write ? ATA_CMD_WRITE_FPDMA_QUEUED
+							 : ATA_CMD_READ_FPDMA_QUEUED;
+	else
+		command = req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	ahci_fill_slot(port, slot, command, req->sector, req->count, prds,
+				   req->write);
+
+	port->busy |= 1U << slot;
+	port->reqs[slot] = req;
+	if (port->ncq)
+		port_write(port, AHCI_PX_SACT, 1U << slot);
+	port_write(port, AHCI_PX_CI, 1U << slot);
+
+	lock_irqrestore(&port->lock, rflags);
+}
+
+// Complete the requests whose slots the disk is done with. After a task file
+// error the port is restarted and the commands still in flight fail.
+static void ahci_reap(struct ahci_port *port) {
+	struct block_request *done[32];
+	bool ok[32];
+	size_t n = 0;
+
+	uint64_t rflags = lock_irqsave(&port->lock);
+
+	uint32_t is = port_read(port, AHCI_PX_IS);
+	port_write(port, AHCI_PX_IS, is);
+
+	uint32_t active = port_read(port, AHCI_PX_CI);
+	if (port->ncq)
+		active |= port_read(port, AHCI_PX_SACT);
+	uint32_t finished = port->busy & ~active;
+	uint32_t failed = 0;
+
+	if (is & AHCI_PX_IS_TFES) {
+		failed = port->busy & active;
+		ahci_port_stop(port);
+		port_write(port, AHCI_PX_SERR, 0xFFFFFFFF);
+		port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+		ahci_port_start(port);
+	}
+
+	for (uint32_t slots = finished | failed; slots; slots &= slots - 1) {
+		int slot = __builtin_ctz(slots);
+		done[n] = port->reqs[slot];
+		ok[n++] = !(failed & (1U << slot));
+		port->reqs[slot] = NULL;
+	}
+	port->busy &= ~(finished | failed);
+
+	lock_irqrestore(&port->lock, rflags);
+
+	if (failed)
+		printf("ahci: Task file error, status %x\n",
+			   port_read(port, AHCI_PX_TFD));
+	for (size_t i = 0; i < n; i++)
+		block_complete(&port->blk, done[i], ok[i]);
+}
+
+static void ahci_poll(struct block_device *this) {
+	ahci_reap((void *)this);
+}
+
+// The controller raises one interrupt for all ports, IS says which ones
+static void ahci_reap_tasklet(void *arg) {
+	struct ahci_controller *hba = arg;
+	uint32_t is = mmind(hba->abar + AHCI_IS);
+	for (uint32_t ports = is; ports; ports &= ports - 1) {
+		struct ahci_port *port = hba->ports[__builtin_ctz(ports)];
+		if (port)
+			ahci_reap(port);
+	}
+	mmoutd(hba->abar + AHCI_IS, is);
+}
+
+static void ahci_interrupt(void *arg) {
+	struct ahci_controller *hba = arg;
+	tasklet_schedule(&hba->reap);
+}
+
+static void *ahci_alloc_page(bool s64a) {
+	void *page = pmm_allocz(1);
+	if (page != NULL && !s64a && (uintptr_t)page + PAGE_SIZE > 0x100000000) {
+		pmm_free(page, 1);
+		return NULL;
+	}
+	return page;
+}
+
+static struct ahci_port *ahci_probe_port(void *abar, int index, uint32_t cap) {
+	void *regs = abar + AHCI_PORT(index);
+	if ((mmind(regs + AHCI_PX_SSTS) & 0x0F) != AHCI_SSTS_DET_PRESENT ||
+		mmind(regs + AHCI_PX_SIG) != AHCI_SIG_ATA)
+		return NULL;
+
+	struct ahci_port *port = block_device_create(sizeof(struct ahci_port));
+	port->regs = regs;
+	port->s64a = cap & AHCI_CAP_S64A;
+	port->slots = AHCI_CAP_NCS(cap);
+	port->lock = (lock_t){0};
+	port->busy = 0;
+
+	ahci_port_stop(port);
+
+	// The command list takes the first KiB of a page, received FISes follow
+	void *list = ahci_alloc_page(port->s64a);
+	if (list == NULL)
+		return NULL;
+	port->cmd_list = list + MEM_PHYS_OFFSET;
+	port_write(port, AHCI_PX_CLB, (uintptr_t)list);
+	port_write(port, AHCI_PX_CLBU, (uintptr_t)list >> 32);
+	port_write(port, AHCI_PX_FB, (uintptr_t)list + 1024);
+	port_write(port, AHCI_PX_FBU, ((uintptr_t)list + 1024) >> 32);
+
+	for (size_t i = 0; i < port->slots; i++) {
+		void *table = ahci_alloc_page(port->s64a);
+		if (table == NULL)
+			return NULL;
+		port->tables[i] = table + MEM_PHYS_OFFSET;
+		port->cmd_list[i].ctba = (uintptr_t)table;
+		port->cmd_list[i].ctbau = (uintptr_t)table >> 32;
+	}
+
+	// Until the controller's interrupt is set up completions are polled
+	port_write(port, AHCI_PX_IE, 0);
+	port_write(port, AHCI_PX_SERR, 0xFFFFFFFF);
+	port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+	ahci_port_start(port);
+
+	void *id_page = ahci_alloc_page(port->s64a);
+	if (id_page == NULL)
+		return NULL;
+	uint16_t *id = id_page + MEM_PHYS_OFFSET;
+	if (!ahci_exec_polled(port, ATA_CMD_IDENTIFY, id, 512)) {
+		printf("ahci: Port %d: IDENTIFY failed\n", index);
+		pmm_free(id_page, 1);
+		return NULL;
+	}
+
+	// Words 60-61 and 100-103 are the 28 and 48-bit sector counts, word 83
+	// bit 10 is 48-bit support, word 76 bit 8 NCQ with word 75 its depth
+	uint64_t sectors = id[60] | (uint32_t)id[61] << 16;
+	if (id[83] & (1 << 10))
+		sectors = id[100] | (uint32_t)id[101] << 16 | (uint64_t)id[102] << 32 |
+				  (uint64_t)id[103] << 48;
+	port->ncq = (cap & AHCI_CAP_SNCQ) && (id[76] & (1 << 8));
+	size_t depth =
+		port->ncq ? MIN(port->slots, (size_t)(id[75] & 0x1F) + 1) : 1;
+	pmm_free(id_page, 1);
+
+	// Every page of a request may need a PRD of its own. Bios only merge where
+	// their buffers meet at a page boundary, so a request of max_sectors spans
+	// at most one page more than it fills, however its buffers are aligned.
+	port->blk.sector_size = 512;
+	port->blk.sectors = sectors;
+	port->blk.max_sectors =
+		MIN((size_t)65536, (AHCI_PRDS_PER_TABLE - 1) * PAGE_SIZE / 512);
+	port->blk.page_merge = true;
+	port->blk.queue_depth = depth;
+	port->blk.submit = ahci_submit;
+	port->blk.poll = ahci_poll;
+
+	char name[] = "sda";
+	name[2] += ahci_disk_count++;
+	printf("ahci: Port %d: /dev/%s, %llu sectors, queue depth %zu%s\n", index,
+		   name, sectors, depth, port->ncq ? " (NCQ)" : "");
+	block_register(&port->blk, name);
+	return port;
+}
+
+static void ahci_controller_init(struct pci_device *dev) {
+	struct pci_bar bar = {0};
+	PciGetBar(&bar, dev->id, 5);
+	if (bar.u.address == NULL || (bar.flags & 0x1))
+		return;
+	void *abar = pci_map_bar(&bar, VMM_CACHE_UC);
+
+	// Memory space and bus mastering
+	uint16_t command = pci_dev_read(dev, 0x04, 2);
+	pci_dev_write(dev, 0x04, command | (1 << 1) | (1 << 2), 2);
+
+	mmoutd(abar + AHCI_GHC,
+		   (mmind(abar + AHCI_GHC) | AHCI_GHC_AE) & ~AHCI_GHC_IE);
+
+	uint32_t cap = mmind(abar + AHCI_CAP);
+	uint32_t pi = mmind(abar + AHCI_PI);
+	printf("ahci: Controller with %u command slots%s\n", AHCI_CAP_NCS(cap),
+		   cap & AHCI_CAP_SNCQ ? " and NCQ" : "");
+
+	struct ahci_controller *hba = alloc(sizeof(struct ahci_controller));
+	hba->abar = abar;
+	hba->reap = (struct tasklet)TASKLET_INIT(ahci_reap_tasklet, hba);
+	for (int i = 0; i < 32; i++)
+		if (pi & (1U << i))
+			hba->ports[i] = ahci_probe_port(abar, i, cap);
+
+	// Without MSI the ports stay polled
+	if (pci_irq_alloc(dev, 0, IRQ_ANY_CPU, ahci_interrupt, hba) < 0)
+		return;
+	for (int i = 0; i < 32; i++) {
+		if (hba->ports[i] == NULL)
+			continue;
+		port_write(hba->ports[i], AHCI_PX_IE,
+				   AHCI_PX_IS_DHRS | AHCI_PX_IS_SDBS | AHCI_PX_IS_TFES);
+		hba->ports[i]->blk.poll = NULL;
+	}
+	pci_irq_enable(dev);
+	mmoutd(abar + AHCI_GHC, mmind(abar + AHCI_GHC) | AHCI_GHC_IE);
+}
+
+void ahci_init(void) {
+	for (size_t i = 0; i < pci_devices.length; i++) {
+		struct pci_device *dev = pci_devices.storage[i];
+		if (dev != NULL && dev->classcode == 0x1 && dev->subclass == 0x06)
+			ahci_controller_init(dev);
+	}
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AHCI_DEF_H
+#define AHCI_DEF_H
+
+#include <stdint.h>
+
+// HBA registers, at the start of the memory BAR (ABAR)
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08
+#define AHCI_PI 0x0C
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SNCQ (1U << 30)
+#define AHCI_CAP_S64A (1U << 31)
+
+#define AHCI_GHC_IE (1U << 1)
+#define AHCI_GHC_AE (1U << 31)
+
+// Port registers, 0x80 bytes per port from 0x100
+#define AHCI_PORT(n) (0x100 + (n) * 0x80)
+#define AHCI_PX_CLB 0x00
+#define AHCI_PX_CLBU 0x04
+#define AHCI_PX_FB 0x08
+#define AHCI_PX_FBU 0x0C
+#define AHCI_PX_IS 0x10
+#define AHCI_PX_IE 0x14
+#define AHCI_PX_CMD 0x18
+#define AHCI_PX_TFD 0x20
+#define AHCI_PX_SIG 0x24
+#define AHCI_PX_SSTS 0x28
+#define AHCI_PX_SERR 0x30
+#define AHCI_PX_SACT 0x34
+#define AHCI_PX_CI 0x38
+
+#define AHCI_PX_CMD_ST (1U << 0)
+#define AHCI_PX_CMD_FRE (1U << 4)
+#define AHCI_PX_CMD_FR (1U << 14)
+#define AHCI_PX_CMD_CR (1U << 15)
+
+// Task file error, the other bits are completions
+#define AHCI_PX_IS_TFES (1U << 30)
+#define AHCI_PX_IS_DHRS (1U << 0)
+#define AHCI_PX_IS_SDBS (1U << 3)
+
+#define AHCI_SSTS_DET_PRESENT 3
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_TFD_ERR 0x01
+#define AHCI_TFD_DRQ 0x08
+#define AHCI_TFD_BSY 0x80
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+struct ahci_fis_h2d {
+	uint8_t type;
+	// Bit 7 marks a command, the rest is the port multiplier port
+	uint8_t flags;
+	uint8_t command;
+	uint8_t feature_low;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t device;
+	uint8_t lba3;
+	uint8_t lba4;
+	uint8_t lba5;
+	uint8_t feature_high;
+	uint8_t count_low;
+	uint8_t count_high;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+} __attribute__((packed));
+
+// One of the 32 slots of a port's command list
+struct ahci_cmd_header {
+	// FIS length in dwords in bits 0-4, bit 6 for writes, PRD count from 16
+	uint32_t flags;
+	uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+#define AHCI_CMD_WRITE (1U << 6)
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	// Byte count minus one, bit 31 asks for an interrupt
+	uint32_t dbc;
+} __attribute__((packed));
+
+// A command table takes a page, the PRDs fill what the FIS area leaves
+#define AHCI_PRDS_PER_TABLE ((4096 - 0x80) / sizeof(struct ahci_prd))
+// A PRD moves at most 4 MiB
+#define AHCI_PRD_MAX 0x400000
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_PRDS_PER_TABLE];
+} __attribute__((packed));
+
+#endif
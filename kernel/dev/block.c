@@ -0,0 +1,496 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "block.h"
+#include "../cpu/cpu.h"
+#include "../cpu/idle.h"
+#include "../klibc/aio.h"
+#include "../klibc/alloc.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "../mm/slab.h"
+#include "../mm/vmm.h"
+#include "../sched/sched.h"
+#include "dev.h"
+#include <liballoc.h>
+
+// Bios a read or write of a block device has in flight at once
+#define BLOCK_BATCH 16
+
+static struct slab_cache block_request_cache =
+	SLAB_CACHE_INIT("block_request", struct block_request, NULL);
+
+void *block_device_create(size_t actual_size) {
+	struct block_device *dev = resource_create(actual_size);
+
+	dev->sector_size = 512;
+	dev->sectors = 0;
+	dev->max_sectors = 128;
+	dev->queue_depth = 1;
+	dev->submit = NULL;
+	dev->poll = NULL;
+	dev->page_merge = false;
+	dev->queue_lock = (lock_t){0};
+	dev->queue = NULL;
+	dev->next_sector = 0;
+	dev->in_flight = 0;
+	dev->dispatching = false;
+	dev->stats = (struct block_stats){0};
+
+	return dev;
+}
+
+// Whether a request can go on from the buffer of bio a into that of b
+static bool buffers_join(struct block_device *dev, struct bio *a,
+						 struct bio *b) {
+	if (!dev->page_merge)
+		return true;
+	uintptr_t end = (uintptr_t)a->buf + a->count * dev->sector_size;
+	return end % PAGE_SIZE == 0 && (uintptr_t)b->buf % PAGE_SIZE == 0;
+}
+
+// Add bio to a pending request it continues or precedes. The caller holds the
+// queue lock.
+static bool merge(struct block_device *dev, struct bio *bio) {
+	for (struct block_request *req = dev->queue; req; req = req->next) {
+		if (req->write != bio->write ||
+			req->count + bio->count > dev->max_sectors)
+			continue;
+
+		if (req->sector + req->count == bio->sector &&
+			buffers_join(dev, req->last, bio)) {
+			bio->next = NULL;
+			req->last->next = bio;
+			req->last = bio;
+			req->count += bio->count;
+
+			// The next request may now continue this one too
+			struct block_request *next = req->next;
+			if (next && next->write == req->write &&
+				req->sector + req->count == next->sector &&
+				req->count + next->count <= dev->max_sectors &&
+				buffers_join(dev, req->last, next->bios)) {
+				req->last->next = next->bios;
+				req->last = next->last;
+				req->count += next->count;
+				req->next = next->next;
+				slab_free(&block_request_cache, next);
+			}
+			return true;
+		}
+
+		if (bio->sector + bio->count == req->sector &&
+			buffers_join(dev, bio, req->bios)) {
+			bio->next = req->bios;
+			req->bios = bio;
+			req->sector = bio->sector;
+			req->count += bio->count;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void enqueue(struct block_device *dev, struct block_request *req) {
+	struct block_request **link = &dev->queue;
+	while (*link && (*link)->sector < req->sector)
+		link = &(*link)->next;
+	req->next = *link;
+	*link = req;
+}
+
+// Take the first request at or after the last one dispatched, or the lowest
+// one once the sweep reached the end. The caller holds the queue lock.
+static struct block_request *elevator_next(struct block_device *dev) {
+	struct block_request **link = &dev->queue;
+	while (*link && (*link)->sector < dev->next_sector)
+		link = &(*link)->next;
+	if (*link == NULL)
+		link = &dev->queue;
+
+	struct block_request *req = *link;
+	if (req) {
+		*link = req->next;
+		dev->next_sector = req->sector + req->count;
+	}
+	return req;
+}
+
+// Hand requests to the driver while it has room. Only one caller dispatches at
+// a time, others leave their requests queued for it.
+static void dispatch(struct block_device *dev) {
+	uint64_t rflags = lock_irqsave(&dev->queue_lock);
+	if (dev->dispatching) {
+		lock_irqrestore(&dev->queue_lock, rflags);
+		return;
+	}
+	dev->dispatching = true;
+
+	for (;;) {
+		struct block_request *req = NULL;
+		if (dev->in_flight < dev->queue_depth)
+			req = elevator_next(dev);
+		if (req == NULL)
+			break;
+
+		dev->in_flight++;
+		dev->stats.requests++;
+		lock_irqrestore(&dev->queue_lock, rflags);
+		dev->submit(dev, req);
+		rflags = lock_irqsave(&dev->queue_lock);
+	}
+
+	dev->dispatching = false;
+	lock_irqrestore(&dev->queue_lock, rflags);
+}
+
+// A bio that neither merges nor gets a request of its own for lack of memory
+// ends as failed
+static void queue_bio(struct block_device *dev, struct bio *bio) {
+	// Allocated up front, the queue lock isn't held across allocations
+	struct block_request *req = slab_alloc(&block_request_cache);
+
+	uint64_t rflags = lock_irqsave(&dev->queue_lock);
+	dev->stats.bios++;
+	if (merge(dev, bio)) {
+		dev->stats.merges++;
+		lock_irqrestore(&dev->queue_lock, rflags);
+		slab_free(&block_request_cache, req);
+	} else if (req == NULL) {
+		lock_irqrestore(&dev->queue_lock, rflags);
+		bio->end(bio, false);
+	} else {
+		bio->next = NULL;
+		req->sector = bio->sector;
+		req->count = bio->count;
+		req->write = bio->write;
+		req->bios = bio;
+		req->last = bio;
+		enqueue(dev, req);
+		lock_irqrestore(&dev->queue_lock, rflags);
+	}
+}
+
+void block_submit(struct block_device *dev, struct bio *bio) {
+	queue_bio(dev, bio);
+	dispatch(dev);
+}
+
+void block_complete(struct block_device *dev, struct block_request *req,
+					bool ok) {
+	uint64_t rflags = lock_irqsave(&dev->queue_lock);
+	dev->in_flight--;
+	lock_irqrestore(&dev->queue_lock, rflags);
+
+	for (struct bio *bio = req->bios, *next; bio; bio = next) {
+		next = bio->next;
+		bio->end(bio, ok);
+	}
+	slab_free(&block_request_cache, req);
+
+	dispatch(dev);
+}
+
+// Bios someone waits for. A thread that may block sleeps until the last of
+// them ends, it's set as the waiter before any of them is queued.
+struct block_wait {
+	size_t pending;
+	bool failed;
+	struct thread *waiter;
+};
+
+#define BLOCK_WAIT_INIT \
+	{ .pending = 0, .failed = false, .waiter = block_waiter() }
+
+static struct thread *block_waiter(void) {
+	return sched_can_block() ? sched_current() : NULL;
+}
+
+static void block_wait_end(struct bio *bio, bool ok) {
+	struct block_wait *wait = bio->private;
+	// wait lives on the stack of a waiter that may return as soon as the
+	// count drops
+	struct thread *waiter = wait->waiter;
+	if (!ok)
+		__atomic_store_n(&wait->failed, true, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&wait->pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+		waiter)
+		sched_wake(waiter);
+}
+
+// Bios are only queued until the wait, so the ones before it can be merged
+static void block_wait_queue(struct block_device *dev, struct block_wait *wait,
+							 struct bio *bio) {
+	bio->end = block_wait_end;
+	bio->private = wait;
+	__atomic_add_fetch(&wait->pending, 1, __ATOMIC_RELAXED);
+	queue_bio(dev, bio);
+}
+
+static bool block_wait_done(struct block_wait *wait) {
+	return __atomic_load_n(&wait->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Polled devices are reaped until the bios are done. Otherwise a thread
+// sleeps until the interrupt ends the last bio, anything else halts in
+// between interrupts, or spins when they're disabled.
+static bool block_wait_all(struct block_device *dev, struct block_wait *wait) {
+	dispatch(dev);
+
+	while (!block_wait_done(wait)) {
+		if (dev->poll) {
+			dev->poll(dev);
+			asm volatile("pause");
+			continue;
+		}
+
+		uint64_t rflags = cpu_irq_save();
+		if (wait->waiter) {
+			// An end after the state is set finds the thread blocked and
+			// wakes it, one before is seen here
+			enum thread_state blocked = THREAD_BLOCKED;
+			__atomic_store_n(&wait->waiter->state, THREAD_BLOCKED,
+							 __ATOMIC_SEQ_CST);
+			if (!block_wait_done(wait) ||
+				!__atomic_compare_exchange_n(&wait->waiter->state, &blocked,
+											 THREAD_RUNNING, false,
+											 __ATOMIC_ACQ_REL,
+											 __ATOMIC_RELAXED))
+				sched_block();
+			cpu_irq_restore(rflags);
+		} else if (rflags & (1 << 9)) {
+			if (block_wait_done(wait))
+				cpu_irq_restore(rflags);
+			else
+				idle_wait();
+		} else {
+			asm volatile("pause");
+		}
+	}
+
+	return !__atomic_load_n(&wait->failed, __ATOMIC_RELAXED);
+}
+
+bool block_rw(struct block_device *dev, uint64_t sector, size_t count,
+			  void *buf, bool write) {
+	struct block_wait wait = BLOCK_WAIT_INIT;
+	struct bio bio = {
+		.sector = sector, .count = count, .buf = buf, .write = write};
+	block_wait_queue(dev, &wait, &bio);
+	return block_wait_all(dev, &wait);
+}
+
+// Position in a list of buffers, only moved while there are bytes left in it
+struct iov_cursor {
+	const struct iovec *iov;
+	size_t off;
+};
+
+// Skip used up and empty buffers, returning the bytes left in the current one
+static size_t iov_left(struct iov_cursor *c) {
+	while (c->off == c->iov->iov_len) {
+		c->iov++;
+		c->off = 0;
+	}
+	return c->iov->iov_len - c->off;
+}
+
+static void iov_copy(struct iov_cursor *c, void *buf, size_t n, bool to_iov) {
+	while (n) {
+		size_t chunk = MIN(n, iov_left(c));
+		void *p = c->iov->iov_base + c->off;
+		if (to_iov)
+			memcpy(p, buf, chunk);
+		else
+			memcpy(buf, p, chunk);
+		buf += chunk;
+		n -= chunk;
+		c->off += chunk;
+	}
+}
+
+// Whole sectors that sit in one buffer go to the device directly, a batch of
+// bios at a time so the queue gets to merge them. The odd partial sector goes
+// through a bounce buffer, read first and written back for writes.
+static ssize_t block_transfer(struct block_device *this,
+							  const struct iovec *iov, int iovcnt, off_t loc,
+							  bool write) {
+	size_t ss = this->sector_size;
+	off_t size = this->res.st.st_size;
+	struct block_wait wait = BLOCK_WAIT_INIT;
+	struct bio bios[BLOCK_BATCH];
+	size_t nbios = 0, left = 0, total = 0;
+	void *bounce = NULL;
+	bool ok = true;
+
+	for (int i = 0; i < iovcnt; i++)
+		left += iov[i].iov_len;
+	if (loc < 0)
+		return -1;
+	if (loc >= size)
+		return 0;
+	left = MIN(left, (size_t)(size - loc));
+
+	struct iov_cursor c = {.iov = iov, .off = 0};
+	while (left && ok) {
+		uint64_t sector = loc / ss;
+		size_t sector_off = loc % ss;
+		size_t in_iov = iov_left(&c);
+		size_t n;
+
+		if (sector_off == 0 && left >= ss && in_iov >= ss) {
+			size_t count = MIN(MIN(left, in_iov) / ss, this->max_sectors);
+			n = count * ss;
+			bios[nbios] = (struct bio){.sector = sector,
+									   .count = count,
+									   .buf = c.iov->iov_base + c.off,
+									   .write = write};
+			block_wait_queue(this, &wait, &bios[nbios]);
+			c.off += n;
+			if (++nbios == BLOCK_BATCH) {
+				ok = block_wait_all(this, &wait);
+				nbios = 0;
+			}
+		} else {
+			n = MIN(ss - sector_off, left);
+			if (bounce == NULL)
+				bounce = alloc(ss);
+			if (!write || n != ss)
+				ok = block_rw(this, sector, 1, bounce, false);
+			if (ok)
+				iov_copy(&c, bounce + sector_off, n, !write);
+			if (ok && write)
+				ok = block_rw(this, sector, 1, bounce, true);
+		}
+
+		loc += n;
+		left -= n;
+		total += n;
+	}
+
+	if (!block_wait_all(this, &wait))
+		ok = false;
+	free(bounce);
+
+	return ok ? (ssize_t)total : -1;
+}
+
+static ssize_t block_readv(struct resource *this, const struct iovec *iov,
+						   int iovcnt, off_t loc) {
+	return block_transfer((void *)this, iov, iovcnt, loc, false);
+}
+
+static ssize_t block_writev(struct resource *this, const struct iovec *iov,
+							int iovcnt, off_t loc) {
+	return block_transfer((void *)this, iov, iovcnt, loc, true);
+}
+
+static ssize_t block_read(struct resource *this, void *buf, off_t loc,
+						  size_t count) {
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+	return block_transfer((void *)this, &iov, 1, loc, false);
+}
+
+static ssize_t block_write(struct resource *this, const void *buf, off_t loc,
+						   size_t count) {
+	struct iovec iov = {.iov_base = (void *)buf, .iov_len = count};
+	return block_transfer((void *)this, &iov, 1, loc, true);
+}
+
+// Bios of an aio operation, which completes with the last of them
+struct block_aio {
+	struct aio_req *req;
+	size_t pending;
+	bool failed;
+	struct bio bios[];
+};
+
+static void block_aio_end(struct bio *bio, bool ok) {
+	struct block_aio *aio = bio->private;
+	if (!ok)
+		__atomic_store_n(&aio->failed, true, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&aio->pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	struct aio_req *req = aio->req;
+	ssize_t result = aio->failed ? -1 : (ssize_t)req->sqe.count;
+	kfree(aio);
+	aio_complete(req, result);
+}
+
+// Reads and writes of whole sectors go to the device as bios and complete
+// from its interrupt. The rest, devices that only finish requests when polled
+// and operations there's no memory for the bios of are left to a worker running
+// the synchronous path.
+static void block_aio(struct resource *this, struct aio_req *req) {
+	struct block_device *dev = (void *)this;
+	struct aio_sqe *sqe = &req->sqe;
+	size_t ss = dev->sector_size;
+	off_t size = dev->res.st.st_size;
+
+	if (sqe->opcode == AIO_FSYNC || dev->poll || sqe->loc < 0 ||
+		sqe->loc % ss || sqe->count % ss || sqe->loc >= size ||
+		sqe->count > (size_t)(size - sqe->loc)) {
+		aio_default(this, req);
+		return;
+	}
+	if (sqe->count == 0) {
+		aio_complete(req, 0);
+		return;
+	}
+
+	size_t sectors = sqe->count / ss;
+	size_t nbios = DIV_ROUNDUP(sectors, dev->max_sectors);
+	struct block_aio *aio =
+		kmalloc(sizeof(struct block_aio) + nbios * sizeof(struct bio));
+	if (aio == NULL) {
+		aio_default(this, req);
+		return;
+	}
+	aio->req = req;
+	aio->pending = nbios;
+	aio->failed = false;
+
+	uint64_t sector = sqe->loc / ss;
+	for (size_t i = 0; i < nbios; i++) {
+		size_t count = MIN(sectors - i * dev->max_sectors, dev->max_sectors);
+		aio->bios[i] = (struct bio){
+			.sector = sector + i * dev->max_sectors,
+			.count = count,
+			.buf = sqe->buf + i * dev->max_sectors * ss,
+			.write = sqe->opcode == AIO_WRITE,
+			.end = block_aio_end,
+			.private = aio};
+		queue_bio(dev, &aio->bios[i]);
+	}
+	dispatch(dev);
+}
+
+bool block_register(struct block_device *dev, const char *name) {
+	dev->res.st.st_size = dev->sectors * dev->sector_size;
+	dev->res.st.st_blocks = dev->sectors * dev->sector_size / 512;
+	dev->res.st.st_blksize = dev->sector_size;
+	dev->res.st.st_mode = S_IFBLK | 0660;
+	dev->res.st.st_nlink = 1;
+	dev->res.read = block_read;
+	dev->res.write = block_write;
+	dev->res.readv = block_readv;
+	dev->res.writev = block_writev;
+	dev->res.aio = block_aio;
+
+	return dev_add_new(&dev->res, name);
+}
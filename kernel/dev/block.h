@@ -0,0 +1,93 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "../klibc/lock.h"
+#include "../klibc/resource.h"
+#include "../klibc/types.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// I/O on consecutive sectors. The bio belongs to the block layer until end is
+// called, which may happen on any processor and in an interrupt handler.
+struct bio {
+	uint64_t sector;
+	size_t count;
+	void *buf;
+	bool write;
+	void (*end)(struct bio *bio, bool ok);
+	void *private;
+	struct bio *next;
+};
+
+// Bios merged into one transfer, in sector order
+struct block_request {
+	uint64_t sector;
+	size_t count;
+	bool write;
+	struct bio *bios;
+	struct bio *last;
+	struct block_request *next;
+};
+
+struct block_stats {
+	size_t bios;
+	size_t requests;
+	size_t merges;
+};
+
+// Drivers embed this at the start of their device and fill in the geometry and
+// submit before block_register adds it to devtmpfs
+struct block_device {
+	struct resource res;
+
+	size_t sector_size;
+	uint64_t sectors;
+	// Largest request, and how many requests the driver takes at once
+	size_t max_sectors;
+	size_t queue_depth;
+	// Start a request. The driver calls block_complete once it's done, which
+	// can be before submit returns.
+	void (*submit)(struct block_device *this, struct block_request *req);
+	// Optional, reaps finished requests for drivers that can't always rely on
+	// an interrupt. Called while waiting on the device.
+	void (*poll)(struct block_device *this);
+	// Only merge bios whose buffers meet at a page boundary, for controllers
+	// that take a list of pages rather than of arbitrary segments
+	bool page_merge;
+
+	lock_t queue_lock;
+	// Pending requests sorted by sector, dispatched in one sweep upwards from
+	// next_sector before wrapping around
+	struct block_request *queue;
+	uint64_t next_sector;
+	size_t in_flight;
+	bool dispatching;
+	struct block_stats stats;
+};
+
+void *block_device_create(size_t actual_size);
+bool block_register(struct block_device *dev, const char *name);
+void block_submit(struct block_device *dev, struct bio *bio);
+void block_complete(struct block_device *dev, struct block_request *req,
+					bool ok);
+bool block_rw(struct block_device *dev, uint64_t sector, size_t count,
+			  void *buf, bool write);
+
+#endif
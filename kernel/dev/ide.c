@@ -17,23 +17,47 @@
  */
 
 #include "ide.h"
+#include "../cpu/apic.h"
+#include "../cpu/isr.h"
 #include "../cpu/ports.h"
 #include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
 #include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "../klibc/trace.h"
+#include "../mm/pmm.h"
+#include "../mm/slab.h"
+#include "../mm/vmm.h"
+#include "../sched/workqueue.h"
 #include "../sys/hpet.h"
 #include "../sys/pci.h"
+#include "block.h"
+#include "dev.h"
 #include "idedef.h"
 #include <stdbool.h>
 #include <stdint.h>
 
 struct ide_device *ide_devices[4];
 
+static void ide_device_ctor(void *obj) {
+	memset(obj, 0, sizeof(struct ide_device));
+}
+
+static struct slab_cache ide_device_cache =
+	SLAB_CACHE_INIT("ide_device", struct ide_device, ide_device_ctor);
+
+// The device control and alternate status register is outside the block of
+// command registers
+static inline uint16_t ata_ctrl(uint16_t bus) {
+	return bus == 0x1F0 ? 0x3F6 : 0x376;
+}
+
 void ata_io_wait(uint16_t bus) {
-	port_byte_in(bus + ATA_REG_ALTSTATUS);
-	port_byte_in(bus + ATA_REG_ALTSTATUS);
-	port_byte_in(bus + ATA_REG_ALTSTATUS);
-	port_byte_in(bus + ATA_REG_ALTSTATUS);
+	port_byte_in(ata_ctrl(bus));
+	port_byte_in(ata_ctrl(bus));
+	port_byte_in(ata_ctrl(bus));
+	port_byte_in(ata_ctrl(bus));
 }
 
 int ata_wait(uint16_t bus, int advanced) {
@@ -91,12 +115,12 @@ struct ide_device *ide_device_init(bool Primary, bool Master) {
 		bus = 0x170;
 	}
 
-	struct ide_device *atadevice = alloc(sizeof(struct ide_device));
+	struct ide_device *atadevice = slab_alloc(&ide_device_cache);
 	atadevice->exists = 0;
 	atadevice->channel = Primary ? 0 : 1;
 	atadevice->drive = Master ? 0 : 1;
 	port_byte_out(bus + 1, 1);
-	port_byte_out(bus + 0x306, 0);
+	port_byte_out(ata_ctrl(bus), 0);
 
 	ata_select(bus, Master);
 	ata_io_wait(bus);
@@ -144,6 +168,27 @@ struct ide_device *ide_device_init(bool Primary, bool Master) {
 	ide_get_string(device->model, 40);
 	ide_get_string(device->firmware, 8);
 	ide_get_string(device->serial, 20);
+	atadevice->size = device->sectors_28;
+
+	// Word 49 bit 8 is DMA support
+	if (device->capabilities[0] & (1 << 8))
+		atadevice->dma = 1;
+
+	// Word 83 bit 10 is the 48-bit address feature set
+	if (device->command_sets[1] & (1 << 10)) {
+		atadevice->lba48 = 1;
+		atadevice->size = device->sectors_48;
+	}
+
+	// Move as many sectors per interrupt as the drive allows
+	uint8_t max_multiple = device->sectors_per_int & 0xFF;
+	if (max_multiple > 1) {
+		port_byte_out(bus + ATA_REG_SECCOUNT0, max_multiple);
+		port_byte_out(bus + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+		ata_wait(bus, 0);
+		if (!(port_byte_in(bus + ATA_REG_STATUS) & ATA_SR_ERR))
+			atadevice->multiple = max_multiple;
+	}
 
 	printf("ide: ATA device model: %s\n", device->model);
 
@@ -151,97 +196,523 @@ struct ide_device *ide_device_init(bool Primary, bool Master) {
 	return atadevice;
 }
 
-void ide_read_sector(uint32_t device_index, uint32_t lba, uint8_t *buffer) {
-	struct ide_device *device = ide_devices[device_index];
-	if (device->exists == 0) {
-		printf("ERROR: ide_read_sector() called with a device that does NOT "
-			   "exist\n");
-		return;
+// Select the drive and load the task file for count sectors from lba, then
+// issue command. ext picks the 48-bit register layout, irq whether the drive
+// interrupts when it wants attention instead of being polled.
+static void ata_issue(uint16_t bus, struct ide_device *device, uint64_t lba,
+					  size_t count, bool ext, uint8_t command, bool irq) {
+	port_byte_out(ata_ctrl(bus), irq ? 0x00 : 0x02); // nIEN
+	ata_wait_ready(bus);
+
+	if (ext) {
+		port_byte_out(bus + ATA_REG_HDDEVSEL, 0x40 | device->drive << 4);
+		// The high bytes go first, each register keeps its previous value
+		port_byte_out(bus + ATA_REG_SECCOUNT0, count >> 8);
+		port_byte_out(bus + ATA_REG_LBA0, lba >> 24);
+		port_byte_out(bus + ATA_REG_LBA1, lba >> 32);
+		port_byte_out(bus + ATA_REG_LBA2, lba >> 40);
+	} else {
+		port_byte_out(bus + ATA_REG_HDDEVSEL,
+					  0xE0 | device->drive << 4 | ((lba >> 24) & 0x0F));
+		port_byte_out(bus + ATA_REG_FEATURES, 0x00);
 	}
-	if (device->type == 1) {
-		printf("ERROR: ide_read_sector() called with a device that is a ATAPI "
-			   "device, which is not yet supported!\n");
-		return;
+
+	// A count of 0 means 256 sectors, or 65536 with 48-bit commands
+	port_byte_out(bus + ATA_REG_SECCOUNT0, count);
+	port_byte_out(bus + ATA_REG_LBA0, lba);
+	port_byte_out(bus + ATA_REG_LBA1, lba >> 8);
+	port_byte_out(bus + ATA_REG_LBA2, lba >> 16);
+	port_byte_out(bus + ATA_REG_COMMAND, command);
+}
+
+static inline bool ata_use_ext(struct ide_device *device, uint64_t lba,
+							   size_t count) {
+	return device->lba48 && (lba + count > 0x10000000 || count > 256);
+}
+
+static uint8_t ata_pio_command(struct ide_device *device, bool ext,
+							   bool write) {
+	bool multiple = device->multiple > 1;
+	if (write)
+		return ext ? (multiple ? ATA_CMD_WRITE_MULTIPLE_EXT
+							   : ATA_CMD_WRITE_PIO_EXT)
+				   : (multiple ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE_PIO);
+	return ext ? (multiple ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_PIO_EXT)
+			   : (multiple ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ_PIO);
+}
+
+// Where the next data block of a PIO command goes to or comes from, in a bio
+// and the ones chained after it
+struct pio_cursor {
+	struct bio *bio;
+	size_t off;
+	size_t left;
+};
+
+// Move the block of sectors the drive asked for with DRQ
+static void pio_block(struct pio_cursor *c, struct ide_device *device,
+					  uint16_t bus, bool write) {
+	size_t block = device->multiple > 1 ? device->multiple : 1;
+	size_t n = MIN(block, c->left);
+
+	for (size_t i = 0; i < n; i++) {
+		void *buf = c->bio->buf + c->off;
+		if (write)
+			port_words_out(bus, buf, 256);
+		else
+			port_words_in(bus, buf, 256);
+
+		c->off += 512;
+		if (c->off == c->bio->count * 512) {
+			c->bio = c->bio->next;
+			c->off = 0;
+		}
 	}
 
-	uint16_t bus;
-	if (device->channel == 0) {
-		bus = 0x1F0;
-	} else {
-		bus = 0x170;
+	c->left -= n;
+}
+
+static void ata_flush(uint16_t bus, bool ext) {
+	port_byte_out(bus + ATA_REG_COMMAND,
+				  ext ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+}
+
+// Run one polled PIO command on count sectors from lba. Commands use 48-bit LBA
+// where 28 bits aren't enough and READ/WRITE MULTIPLE when it's enabled.
+static bool ide_pio(struct ide_device *device, uint64_t lba, size_t count,
+					struct bio *bio, bool write) {
+	uint16_t bus = device->channel == 0 ? 0x1F0 : 0x170;
+	bool ext = ata_use_ext(device, lba, count);
+	struct pio_cursor c = {.bio = bio, .off = 0, .left = count};
+	bool ok = true;
+
+	ata_issue(bus, device, lba, count, ext,
+			  ata_pio_command(device, ext, write), false);
+
+	while (c.left) {
+		if (ata_wait(bus, 1)) {
+			printf("ide: Error during ATA %s\n", write ? "write" : "read");
+			ok = false;
+			break;
+		}
+		pio_block(&c, device, bus, write);
+	}
+
+	if (ok && write)
+		ata_flush(bus, ext);
+	ata_wait(bus, 0);
+
+	return ok;
+}
+
+// Bus master state of a channel, bmide is 0 where DMA isn't available. The
+// PRD table is one page below 4 GiB, rebuilt for each request.
+struct ide_dma_channel {
+	uint16_t bmide;
+	struct ide_prd *prdt;
+	uint32_t prdt_phys;
+};
+
+#define IDE_PRDT_ENTRIES (PAGE_SIZE / sizeof(struct ide_prd))
+
+static struct ide_dma_channel ide_dma[2] = {0};
+
+// Describe the buffers of bio and the ones chained after it in the channel's
+// PRD table. Fails when a buffer can't be reached by the controller, which
+// only takes 32-bit physical addresses, or the table runs out of entries.
+static bool ide_build_prdt(struct ide_dma_channel *chan, struct bio *bio) {
+	size_t n = 0;
+	uint32_t size = 0;
+
+	for (; bio; bio = bio->next) {
+		uint64_t virt = (uintptr_t)bio->buf;
+		size_t left = bio->count * 512;
+
+		if (virt & 1)
+			return false;
+
+		while (left) {
+			size_t chunk = MIN(left, PAGE_SIZE - (virt % PAGE_SIZE));
+			uint64_t phys;
+			if (!vmm_virt_to_phys(kernel_pagemap, virt, &phys) ||
+				phys + chunk > 0x100000000)
+				return false;
+
+			// Grow the last entry while memory stays contiguous and within
+			// its 64 KiB window
+			struct ide_prd *last = n ? &chan->prdt[n - 1] : NULL;
+			if (last && last->phys + size == phys &&
+				(last->phys >> 16) == ((phys + chunk - 1) >> 16)) {
+				size += chunk;
+			} else {
+				if (n == IDE_PRDT_ENTRIES)
+					return false;
+				last = &chan->prdt[n++];
+				last->phys = phys;
+				last->flags = 0;
+				size = chunk;
+			}
+			last->size = size; // 64 KiB wraps around to 0
+
+			virt += chunk;
+			left -= chunk;
+		}
 	}
-	port_byte_out(bus + ATA_REG_CONTROL, 0x02); // PIO mode
-	// Set device
+
+	chan->prdt[n - 1].flags = ATA_PRD_EOT;
+	return true;
+}
+
+// Start a DMA command over the PRD table built for it
+static void ide_dma_start(struct ide_device *device, uint64_t lba,
+						  size_t count, bool write, bool irq) {
+	struct ide_dma_channel *chan = &ide_dma[device->channel];
+	uint16_t bus = device->channel == 0 ? 0x1F0 : 0x170;
+	bool ext = ata_use_ext(device, lba, count);
+	uint8_t command;
+
+	if (write)
+		command = ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+	else
+		command = ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+
+	// The read bit means the controller writes to memory. Status bits are
+	// cleared by writing 1 to them, the others are kept.
+	uint8_t direction = write ? 0 : ATA_BM_CMD_READ;
+	port_dword_out(chan->bmide + ATA_BM_PRDT, chan->prdt_phys);
+	port_byte_out(chan->bmide + ATA_BM_COMMAND, direction);
+	port_byte_out(chan->bmide + ATA_BM_STATUS,
+				  port_byte_in(chan->bmide + ATA_BM_STATUS) | ATA_BM_SR_ERR |
+					  ATA_BM_SR_IRQ);
+
+	ata_issue(bus, device, lba, count, ext, command, irq);
+	port_byte_out(chan->bmide + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+}
+
+// Stop the controller once the drive is done, returning whether both were
+// happy with the transfer
+static bool ide_dma_finish(struct ide_device *device, uint8_t bm_status) {
+	struct ide_dma_channel *chan = &ide_dma[device->channel];
+	uint16_t bus = device->channel == 0 ? 0x1F0 : 0x170;
+
+	port_byte_out(chan->bmide + ATA_BM_COMMAND,
+				  port_byte_in(chan->bmide + ATA_BM_COMMAND) &
+					  ~ATA_BM_CMD_START);
 	ata_wait_ready(bus);
-	port_byte_out(bus + ATA_REG_HDDEVSEL,
-				  0xe0 | device->channel << 4 | (lba & 0x0f000000) >> 24);
-
-	port_byte_out(bus + ATA_REG_FEATURES, 0x00);
-	port_byte_out(bus + ATA_REG_SECCOUNT0, 1);
-	port_byte_out(bus + ATA_REG_LBA0, (lba & 0x000000ff) >> 0);
-	port_byte_out(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >> 8);
-	port_byte_out(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-	port_byte_out(bus + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-
-	if (ata_wait(bus, 1)) {
-		printf("ide: Error during ATA read");
+	uint8_t status = port_byte_in(bus + ATA_REG_STATUS);
+	port_byte_out(chan->bmide + ATA_BM_STATUS,
+				  port_byte_in(chan->bmide + ATA_BM_STATUS) | ATA_BM_SR_ERR |
+					  ATA_BM_SR_IRQ);
+
+	return !(bm_status & ATA_BM_SR_ERR) &&
+		   !(status & (ATA_SR_ERR | ATA_SR_DF));
+}
+
+// Run one DMA command, polling until the controller has gone through the table
+static bool ide_dma_transfer(struct ide_device *device, uint64_t lba,
+							 size_t count, bool write) {
+	struct ide_dma_channel *chan = &ide_dma[device->channel];
+	uint16_t bus = device->channel == 0 ? 0x1F0 : 0x170;
+
+	ide_dma_start(device, lba, count, write, false);
+
+	uint8_t bm_status;
+	while (((bm_status = port_byte_in(chan->bmide + ATA_BM_STATUS)) &
+			(ATA_BM_SR_ACTIVE | ATA_BM_SR_ERR)) == ATA_BM_SR_ACTIVE)
+		asm volatile("pause");
+
+	bool ok = ide_dma_finish(device, bm_status);
+	if (!ok)
+		printf("ide: Error during DMA %s\n", write ? "write" : "read");
+
+	if (ok && write) {
+		ata_flush(bus, ata_use_ext(device, lba, count));
+		ata_wait(bus, 0);
 	}
-	int size = 256;
 
-	for (int i = 0; i < size; ++i) {
-		buffer[i] = port_word_in(bus);
+	return ok;
+}
+
+// Set up bus mastering when the controller supports it, BAR4 holds the
+// registers of both channels 8 ports apart
+static void ide_dma_init(struct pci_device *controller) {
+	if (!(controller->progintf & 0x80))
+		return;
+
+	struct pci_bar bar = {0};
+	PciGetBar(&bar, controller->id, 4);
+	if (!(bar.flags & 0x1) || bar.u.port == 0)
+		return;
+
+	uint16_t command = pci_dev_read(controller, 0x04, 2);
+	pci_dev_write(controller, 0x04, command | (1 << 2), 2);
+
+	for (int i = 0; i < 2; i++) {
+		void *prdt = pmm_allocz(1);
+		if (prdt == NULL)
+			continue;
+		if ((uintptr_t)prdt + PAGE_SIZE > 0x100000000) {
+			pmm_free(prdt, 1);
+			continue;
+		}
+		ide_dma[i].bmide = bar.u.port + i * 8;
+		ide_dma[i].prdt = prdt + MEM_PHYS_OFFSET;
+		ide_dma[i].prdt_phys = (uintptr_t)prdt;
 	}
-	ata_wait(bus, 0);
+
+	printf("ide: Bus master DMA at port %x\n", bar.u.port);
 }
 
-void ide_write_sector(uint32_t device_index, uint32_t lba, uint8_t *buffer) {
+static struct ide_device *ide_ata_device(uint32_t device_index,
+										 const char *caller) {
 	struct ide_device *device = ide_devices[device_index];
 	if (device->exists == 0) {
-		printf("ERROR: ide_write_sector() called with a device that does NOT "
-			   "exist\n");
-		return;
+		printf("ERROR: %s() called with a device that does NOT exist\n",
+			   caller);
+		return NULL;
 	}
 	if (device->type == 1) {
-		printf("ERROR: ide_write_sector() called with a device that is a ATAPI "
-			   "device, which is not yet supported!\n");
+		printf("ERROR: %s() called with a device that is a ATAPI device, "
+			   "which is not yet supported!\n",
+			   caller);
+		return NULL;
+	}
+	return device;
+}
+
+// Polled single sector I/O, for before the channels are run by interrupts
+void ide_read_sector(uint32_t device_index, uint32_t lba, uint8_t *buffer) {
+	TRACEPOINT(TRACE_IDE_READ_SECTOR, device_index, lba);
+	struct ide_device *device = ide_ata_device(device_index, __func__);
+	struct bio bio = {.sector = lba, .count = 1, .buf = buffer};
+	if (device)
+		ide_pio(device, lba, 1, &bio, false);
+}
+
+void ide_write_sector(uint32_t device_index, uint32_t lba, uint8_t *buffer) {
+	struct ide_device *device = ide_ata_device(device_index, __func__);
+	struct bio bio = {.sector = lba, .count = 1, .buf = buffer};
+	if (device)
+		ide_pio(device, lba, 1, &bio, true);
+}
+
+// Disks go through the block layer, both drives on a channel share its
+// registers
+struct ide_disk {
+	struct block_device blk;
+	uint32_t device_index;
+};
+
+#define IDE_IRQ_VECTOR 46
+
+enum { IDE_IDLE, IDE_PIO, IDE_DMA, IDE_FLUSH };
+
+// Once interrupts are set up, a channel runs one command at a time and the
+// interrupt handler moves it along, starting the request of the other drive
+// when done. Before that requests are run polled by ide_submit.
+struct ide_channel {
+	lock_t lock;
+	int state;
+	struct ide_disk *disk;
+	struct block_request *req;
+	struct pio_cursor pio;
+	bool ext;
+	bool ok;
+	// The next request of each drive, disks take one at a time
+	struct ide_disk *pending[2];
+	struct block_request *pending_req[2];
+	int last_drive;
+};
+
+static struct ide_channel ide_channels[2] = {0};
+static bool ide_irq_mode = false;
+
+// Start the next waiting request if the channel is idle, taking the drives in
+// turns. The caller holds the channel lock.
+static void ide_start(struct ide_channel *chan) {
+	if (chan->state != IDE_IDLE)
+		return;
+
+	int drive = !chan->last_drive;
+	if (chan->pending_req[drive] == NULL)
+		drive = chan->last_drive;
+	if (chan->pending_req[drive] == NULL)
+		return;
+
+	struct ide_disk *disk = chan->pending[drive];
+	struct block_request *req = chan->pending_req[drive];
+	struct ide_device *device = ide_devices[disk->device_index];
+	uint16_t bus = device->channel == 0 ? 0x1F0 : 0x170;
+
+	chan->pending[drive] = NULL;
+	chan->pending_req[drive] = NULL;
+	chan->last_drive = drive;
+	chan->disk = disk;
+	chan->req = req;
+	chan->ext = ata_use_ext(device, req->sector, req->count);
+	chan->ok = true;
+
+	if (device->dma && ide_dma[device->channel].bmide &&
+		ide_build_prdt(&ide_dma[device->channel], req->bios)) {
+		chan->state = IDE_DMA;
+		ide_dma_start(device, req->sector, req->count, req->write, true);
 		return;
 	}
 
-	uint16_t bus;
-	if (device->channel == 0) {
-		bus = 0x1F0;
+	chan->state = IDE_PIO;
+	chan->pio = (struct pio_cursor){
+		.bio = req->bios, .off = 0, .left = req->count};
+	ata_issue(bus, device, req->sector, req->count, chan->ext,
+			  ata_pio_command(device, chan->ext, req->write), true);
+
+	// The first block of a write goes out without an interrupt, an error here
+	// is reported by one
+	if (req->write && !ata_wait(bus, 1))
+		pio_block(&chan->pio, device, bus, true);
+}
+
+static void ide_interrupt(int channel) {
+	struct ide_channel *chan = &ide_channels[channel];
+	uint16_t bus = channel == 0 ? 0x1F0 : 0x170;
+
+	LOCK(chan->lock);
+
+	if (chan->state == IDE_IDLE) {
+		// Reading the status acknowledges the interrupt
+		port_byte_in(bus + ATA_REG_STATUS);
+		UNLOCK(chan->lock);
+		return;
+	}
+
+	struct ide_device *device = ide_devices[chan->disk->device_index];
+	struct block_request *req = chan->req;
+	bool done = false;
+
+	if (chan->state == IDE_DMA) {
+		uint8_t bm_status = port_byte_in(ide_dma[channel].bmide + ATA_BM_STATUS);
+		if (!(bm_status & ATA_BM_SR_IRQ)) {
+			UNLOCK(chan->lock);
+			return;
+		}
+		chan->ok = ide_dma_finish(device, bm_status);
+		done = true;
 	} else {
-		bus = 0x170;
+		uint8_t status = port_byte_in(bus + ATA_REG_STATUS);
+		if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+			chan->ok = false;
+			done = true;
+		} else if (chan->state == IDE_FLUSH) {
+			done = true;
+		} else if (!req->write) {
+			pio_block(&chan->pio, device, bus, false);
+			done = chan->pio.left == 0;
+		} else if (chan->pio.left) {
+			pio_block(&chan->pio, device, bus, true);
+		} else {
+			done = true;
+		}
 	}
-	port_byte_out(bus + ATA_REG_CONTROL, 0x02);
 
-	ata_wait_ready(bus);
+	// Writes are followed by a cache flush, which interrupts when done
+	if (done && chan->ok && req->write && chan->state != IDE_FLUSH) {
+		chan->state = IDE_FLUSH;
+		ata_flush(bus, chan->ext);
+		done = false;
+	}
 
-	port_byte_out(bus + ATA_REG_HDDEVSEL,
-				  0xe0 | device->channel << 4 | (lba & 0x0f000000) >> 24);
-	ata_wait(bus, 0);
-	port_byte_out(bus + ATA_REG_FEATURES, 0x00);
-	port_byte_out(bus + ATA_REG_SECCOUNT0, 0x01);
-	port_byte_out(bus + ATA_REG_LBA0, (lba & 0x000000ff) >> 0);
-	port_byte_out(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >> 8);
-	port_byte_out(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-	port_byte_out(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-	ata_wait(bus, 0);
+	if (!done) {
+		UNLOCK(chan->lock);
+		return;
+	}
+
+	struct ide_disk *disk = chan->disk;
+	bool ok = chan->ok;
+	chan->state = IDE_IDLE;
+	chan->disk = NULL;
+	chan->req = NULL;
+	ide_start(chan);
+	UNLOCK(chan->lock);
+
+	if (!ok)
+		printf("ide: Error during ATA %s\n", req->write ? "write" : "read");
+	block_complete(&disk->blk, req, ok);
+}
+
+static void ide_primary_interrupt(registers_t *reg) {
+	(void)reg;
+	ide_interrupt(0);
+}
+
+static void ide_secondary_interrupt(registers_t *reg) {
+	(void)reg;
+	ide_interrupt(1);
+}
 
-	//Send the new sector
-	uint16_t *buffer2 = (uint16_t *)buffer;
-	for (size_t i = 0; i < 256; i++) {
-		port_word_out(bus, buffer2[i]);
+static void ide_submit(struct block_device *this, struct block_request *req) {
+	struct ide_disk *disk = (void *)this;
+	struct ide_device *device = ide_devices[disk->device_index];
+	struct ide_channel *chan = &ide_channels[device->channel];
+
+	uint64_t rflags = lock_irqsave(&chan->lock);
+
+	if (ide_irq_mode) {
+		chan->pending[device->drive] = disk;
+		chan->pending_req[device->drive] = req;
+		ide_start(chan);
+		lock_irqrestore(&chan->lock, rflags);
+		return;
 	}
 
-	port_byte_out(bus + 0x07, ATA_CMD_CACHE_FLUSH);
-	ata_wait(bus, 0);
+	// The whole request is one command, by DMA unless a buffer is out of the
+	// controller's reach
+	bool ok;
+	if (device->dma && ide_dma[device->channel].bmide &&
+		ide_build_prdt(&ide_dma[device->channel], req->bios))
+		ok = ide_dma_transfer(device, req->sector, req->count, req->write);
+	else
+		ok = ide_pio(device, req->sector, req->count, req->bios, req->write);
+	lock_irqrestore(&chan->lock, rflags);
+
+	block_complete(this, req, ok);
+}
+
+static void ide_register(uint32_t device_index) {
+	struct ide_device *device = ide_devices[device_index];
+	if (!device->exists || device->type != IDE_ATA)
+		return;
+
+	struct ide_disk *disk = block_device_create(sizeof(struct ide_disk));
+	disk->device_index = device_index;
+	disk->blk.sector_size = 512;
+	disk->blk.sectors = device->size;
+	disk->blk.max_sectors = device->lba48 ? 65536 : 256;
+	// Requests of whole pages always fit in a PRD table
+	if (device->dma && ide_dma[device->channel].bmide)
+		disk->blk.max_sectors = MIN(disk->blk.max_sectors,
+									IDE_PRDT_ENTRIES * PAGE_SIZE / 512);
+	disk->blk.submit = ide_submit;
+
+	char name[] = "hda";
+	name[2] += device_index;
+	block_register(&disk->blk, name);
+}
+
+// Master and slave share the bus of their channel and are probed in turn
+static void ide_probe_channels(size_t start, size_t end, void *arg) {
+	(void)arg;
+	for (size_t channel = start; channel < end; channel++) {
+		for (size_t drive = 0; drive < 2; drive++) {
+			size_t index = channel * 2 + drive;
+			ide_devices[index] = ide_device_init(channel == 0, drive == 0);
+			ide_read_sector(index, 0, alloc(512));
+		}
+	}
 }
 
 void ide_init(void) {
-	struct pci_device *ide_drive;
-	for (size_t i = 0; i < 100; i++) {
-		struct pci_device *dev = pci_devices[i];
+	struct pci_device *ide_drive = NULL;
+	for (size_t i = 0; i < pci_devices.length; i++) {
+		struct pci_device *dev = pci_devices.storage[i];
 		if (dev != NULL) {
 			if (dev->classcode == 0x1 && dev->subclass == 0x01) {
 				ide_drive = dev;
@@ -255,14 +726,21 @@ void ide_init(void) {
 	} else {
 		printf("ide: Found IDE controller\n");
 	}
-	ide_devices[0] = ide_device_init(true, true);  // Primary master
-	ide_devices[1] = ide_device_init(true, false); // Primary slave
-
-	ide_devices[2] = ide_device_init(false, true);	// Secondary master
-	ide_devices[3] = ide_device_init(false, false); // Secondary slave
+	ide_dma_init(ide_drive);
+
+	// The channels are independent buses, a drive slow to answer on one
+	// doesn't hold up the other
+	parallel_for(0, CONFIG_IDE_CHANNELS, ide_probe_channels, NULL);
+
+	// IRQ 14 and 15 belong to the primary and secondary channel
+	isr_register_handler(IDE_IRQ_VECTOR, ide_primary_interrupt);
+	ioapic_redirect_irq(14, IDE_IRQ_VECTOR);
+	if (CONFIG_IDE_CHANNELS > 1) {
+		isr_register_handler(IDE_IRQ_VECTOR + 1, ide_secondary_interrupt);
+		ioapic_redirect_irq(15, IDE_IRQ_VECTOR + 1);
+	}
+	ide_irq_mode = true;
 
-	ide_read_sector(0, 0, alloc(512));
-	ide_read_sector(1, 0, alloc(512));
-	ide_read_sector(2, 0, alloc(512));
-	ide_read_sector(3, 0, alloc(512));
+	for (uint32_t i = 0; i < CONFIG_IDE_CHANNELS * 2; i++)
+		ide_register(i);
 }
@@ -28,6 +28,11 @@
 #define ATA_CMD_WRITE_PIO_EXT 0x34
 #define ATA_CMD_WRITE_DMA 0xCA
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE 0xC6
 #define ATA_CMD_CACHE_FLUSH 0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET 0xA0
@@ -73,6 +78,21 @@
 #define ATA_REG_ALTSTATUS 0x0C
 #define ATA_REG_DEVADDRESS 0x0D
 
+// Bus master registers, from the channel's base in BAR4
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS 0x02
+#define ATA_BM_PRDT 0x04
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ 0x08
+
+#define ATA_BM_SR_ACTIVE 0x01
+#define ATA_BM_SR_ERR 0x02
+#define ATA_BM_SR_IRQ 0x04
+
+// Marks the last entry of a PRD table
+#define ATA_PRD_EOT 0x8000
+
 // Channels:
 #define ATA_PRIMARY 0x00
 #define ATA_SECONDARY 0x01
@@ -88,6 +108,14 @@ struct ide_channel_regs_t {
 	uint16_t nien;
 };
 
+// Physical region descriptor, one physically contiguous piece of a DMA transfer
+// that doesn't cross a 64 KiB boundary. A size of 0 means 64 KiB.
+struct ide_prd {
+	uint32_t phys;
+	uint16_t size;
+	uint16_t flags;
+} __attribute__((packed));
+
 struct ide_device {
 	// 0 (Empty) or 1 (This Drive really exists)
 	uint8_t exists;
@@ -104,7 +132,12 @@ struct ide_device {
 	// Command Sets Supported
 	uint32_t command_sets;
 	//Size in Sectors
-	uint32_t size;
+	uint64_t size;
+	// Whether 48-bit LBA commands and DMA work
+	uint8_t lba48;
+	uint8_t dma;
+	// Sectors per data block of READ/WRITE MULTIPLE, 0 when not enabled
+	uint16_t multiple;
 	//Device model
 	uint8_t model[41];
 };
@@ -116,6 +149,7 @@ struct ata_identify_t {
 	uint16_t unused2[3];
 	char firmware[8];
 	char model[40];
+	// Low byte is the most sectors per block for READ/WRITE MULTIPLE
 	uint16_t sectors_per_int;
 	uint16_t unused3;
 	uint16_t capabilities[2];
@@ -124,9 +158,11 @@ struct ata_identify_t {
 	uint16_t unused5[5];
 	uint16_t size_of_rw_mult;
 	uint32_t sectors_28;
-	uint16_t unused6[38];
+	uint16_t unused6[20];
+	uint16_t command_sets[6];
+	uint16_t unused7[12];
 	uint64_t sectors_48;
-	uint16_t unused7[152];
+	uint16_t unused8[152];
 } __attribute__((packed));
 
 #endif
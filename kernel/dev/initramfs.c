@@ -15,11 +15,16 @@
  */
 
 #include "initramfs.h"
+#include "../fs/tmpfs.h"
 #include "../fs/vfs.h"
 #include "../kernel/panic.h"
+#include "../klibc/decompress.h"
+#include "../klibc/dynarray.h"
 #include "../klibc/math.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
 #include "../klibc/string.h"
+#include "../sched/workqueue.h"
 #include "dev.h"
 #include <stdint.h>
 
@@ -64,6 +69,129 @@ static uint64_t octal_to_int(const char *s) {
 	return ret;
 }
 
+// Regular files found by the indexing pass, unpacked in parallel
+DYNARRAY_STATIC(struct ustar_header *, files);
+
+static void unpack_file(struct ustar_header *h) {
+	struct resource *r = vfs_open(h->name, O_WRONLY | O_CREAT | O_TRUNC,
+								  octal_to_int(h->mode) & 0777);
+	if (r == NULL) {
+		printf("initramfs: Failed to create `%s`\n", h->name);
+		return;
+	}
+
+	// The module stays loaded, so files on tmpfs read straight out of it
+	void *buf = (void *)h + 512;
+	uintptr_t size = octal_to_int(h->size);
+	if (!tmpfs_set_backing(r, buf, size))
+		r->write(r, buf, 0, size);
+	r->close(r);
+}
+
+static void unpack_files(size_t start, size_t end, void *arg) {
+	(void)arg;
+	for (size_t i = start; i < end; i++)
+		unpack_file(files.storage[i]);
+}
+
+// A compressed archive is unpacked sequentially as it's decompressed, only the
+// file being written and a window of output are in memory at a time
+struct ustar_stream {
+	union {
+		struct ustar_header header;
+		char block[512];
+	};
+	size_t header_fill;
+	struct resource *file;
+	off_t off;
+	// Bytes left of the current entry's data and of its padding after that
+	uint64_t data_left;
+	uint64_t padding_left;
+	size_t files;
+	bool done;
+};
+
+static void ustar_stream_entry(struct ustar_stream *s) {
+	struct ustar_header *h = &s->header;
+
+	if (strncmp(h->signature, "ustar", 5)) {
+		s->done = true;
+		return;
+	}
+
+	uint64_t size = octal_to_int(h->size);
+	s->data_left = size;
+	s->padding_left = ALIGN_UP(size, 512) - size;
+	s->off = 0;
+
+	switch (h->type) {
+		case USTAR_DIRECTORY: {
+			vfs_mkdir(NULL, h->name, octal_to_int(h->mode) & 0777, false);
+			break;
+		}
+		case USTAR_REGULAR:
+		case USTAR_NORMAL:
+		case USTAR_CONTIGOUS: {
+			s->file = vfs_open(h->name, O_WRONLY | O_CREAT | O_TRUNC,
+							   octal_to_int(h->mode) & 0777);
+			if (s->file == NULL)
+				printf("initramfs: Failed to create `%s`\n", h->name);
+			s->files++;
+			break;
+		}
+	}
+}
+
+static void ustar_stream_sink(void *ctx, const void *buf, size_t len) {
+	struct ustar_stream *s = ctx;
+
+	while (len && !s->done) {
+		size_t chunk;
+
+		if (s->data_left) {
+			chunk = MIN(len, s->data_left);
+			if (s->file)
+				s->file->write(s->file, buf, s->off, chunk);
+			s->off += chunk;
+			s->data_left -= chunk;
+		} else if (s->padding_left) {
+			chunk = MIN(len, s->padding_left);
+			s->padding_left -= chunk;
+		} else {
+			chunk = MIN(len, sizeof(s->block) - s->header_fill);
+			memcpy(s->block + s->header_fill, buf, chunk);
+			s->header_fill += chunk;
+			if (s->header_fill == sizeof(s->block)) {
+				s->header_fill = 0;
+				ustar_stream_entry(s);
+			}
+		}
+
+		if (s->file && !s->data_left) {
+			s->file->close(s->file);
+			s->file = NULL;
+		}
+
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+static void initramfs_stream(const void *data, size_t size,
+							 const char *format) {
+	struct ustar_stream s = {0};
+
+	printf("initramfs: Decompressing %s archive\n", format);
+	bool ok = decompress(data, size, ustar_stream_sink, &s);
+
+	if (s.file)
+		s.file->close(s.file);
+	if (!ok)
+		printf("initramfs: Archive is corrupt or truncated\n");
+
+	printf("initramfs: Loaded %zu files into VFS\n", s.files);
+}
+
 void initramfs_init(struct stivale2_struct_tag_modules *modules_tag) {
 	if (modules_tag->module_count < 1) {
 		PANIC("No initramfs found!");
@@ -77,6 +205,15 @@ void initramfs_init(struct stivale2_struct_tag_modules *modules_tag) {
 	printf("initramfs: Address: %p\n", initramfs_addr);
 	printf("initramfs: Size: %lld\n", initramfs_size);
 
+	const char *format =
+		decompress_format((void *)initramfs_addr, initramfs_size);
+	if (format != NULL) {
+		initramfs_stream((void *)initramfs_addr, initramfs_size, format);
+		return;
+	}
+
+	// Directories are made in archive order while indexing so that they exist
+	// before any file in them is created
 	struct ustar_header *h = (void *)initramfs_addr;
 	for (;;) {
 		if (strncmp(h->signature, "ustar", 5))
@@ -91,12 +228,7 @@ void initramfs_init(struct stivale2_struct_tag_modules *modules_tag) {
 			case USTAR_REGULAR:
 			case USTAR_NORMAL:
 			case USTAR_CONTIGOUS: {
-				struct resource *r =
-					vfs_open(h->name, O_WRONLY | O_CREAT | O_TRUNC,
-							 octal_to_int(h->mode) & 0777);
-				void *buf = (void *)h + 512;
-				r->write(r, buf, 0, size);
-				r->close(r);
+				DYNARRAY_PUSHBACK(files, h);
 				break;
 			}
 		}
@@ -107,5 +239,11 @@ void initramfs_init(struct stivale2_struct_tag_modules *modules_tag) {
 			break;
 	}
 
-	printf("initramfs: Loaded into VFS\n");
+	// Then the files are spread over the workers of all processors
+	parallel_for(0, files.length, unpack_files, NULL);
+
+	printf("initramfs: Loaded %zu files into VFS\n", files.length);
+
+	DYNARRAY_DEL(files);
+	files = (typeof(files)){0};
 }
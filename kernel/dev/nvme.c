@@ -0,0 +1,483 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nvme.h"
+#include "../cpu/cpu.h"
+#include "../cpu/softirq.h"
+#include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
+#include "../sys/mmio.h"
+#include "../sys/pci.h"
+#include "../sys/timer.h"
+#include "block.h"
+#include "nvmedef.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NVME_ADMIN_DEPTH 32
+#define NVME_IO_DEPTH 64
+
+struct nvme_controller;
+
+// A submission queue and the completion queue it posts to. Every processor
+// submits to its own pair, whose completion interrupt goes back to it.
+struct nvme_queue {
+	struct nvme_controller *ctrl;
+	uint16_t id;
+	uint16_t size;
+	struct nvme_command *sq;
+	volatile struct nvme_completion *cq;
+	void *sq_doorbell;
+	void *cq_doorbell;
+	uint16_t sq_tail;
+	uint16_t cq_head;
+	// Phase tag of new completions, flips every time around the queue
+	uint16_t phase;
+	// Completion interrupt, -1 when the queue is polled. The interrupt only
+	// schedules the reaping.
+	int vector;
+	struct tasklet reap;
+
+	lock_t lock;
+	// Command IDs in flight and their requests, with a PRP list page for each
+	// once a request needs one
+	uint64_t busy;
+	struct block_request *reqs[NVME_IO_DEPTH];
+	uint64_t *prp_lists[NVME_IO_DEPTH];
+};
+
+// The first namespace of a controller is its block device
+struct nvme_controller {
+	struct block_device blk;
+	struct pci_device *pci;
+	void *regs;
+	uint64_t cap;
+	uint32_t nsid;
+	struct nvme_queue admin;
+	size_t queue_count;
+	struct nvme_queue *queues[MAX_CPUS];
+};
+
+static size_t nvme_controller_count = 0;
+
+static bool nvme_queue_init(struct nvme_controller *ctrl, struct nvme_queue *q,
+							uint16_t id, uint16_t size) {
+	void *sq = pmm_allocz(DIV_ROUNDUP(size * sizeof(struct nvme_command),
+									  PAGE_SIZE));
+	void *cq = pmm_allocz(DIV_ROUNDUP(size * sizeof(struct nvme_completion),
+									  PAGE_SIZE));
+	if (sq == NULL || cq == NULL)
+		return false;
+
+	size_t stride = 4 << NVME_CAP_DSTRD(ctrl->cap);
+	*q = (struct nvme_queue){0};
+	q->ctrl = ctrl;
+	q->id = id;
+	q->size = size;
+	q->sq = sq + MEM_PHYS_OFFSET;
+	q->cq = cq + MEM_PHYS_OFFSET;
+	q->sq_doorbell = ctrl->regs + NVME_DOORBELLS + (2 * id) * stride;
+	q->cq_doorbell = ctrl->regs + NVME_DOORBELLS + (2 * id + 1) * stride;
+	q->phase = 1;
+	return true;
+}
+
+static inline uint64_t queue_phys(const volatile void *p) {
+	return (uintptr_t)p - MEM_PHYS_OFFSET;
+}
+
+static void nvme_push(struct nvme_queue *q, struct nvme_command *cmd) {
+	q->sq[q->sq_tail] = *cmd;
+	q->sq_tail = (q->sq_tail + 1) % q->size;
+	mmoutd(q->sq_doorbell, q->sq_tail);
+}
+
+static void nvme_advance(struct nvme_queue *q) {
+	if (++q->cq_head == q->size) {
+		q->cq_head = 0;
+		q->phase ^= 1;
+	}
+}
+
+// Run an admin command and wait for it, only during probing so nothing else
+// uses the admin queue
+static bool nvme_admin(struct nvme_controller *ctrl, struct nvme_command *cmd,
+					   uint32_t *result) {
+	struct nvme_queue *q = &ctrl->admin;
+	cmd->cid = q->sq_tail;
+	nvme_push(q, cmd);
+
+	volatile struct nvme_completion *c = &q->cq[q->cq_head];
+	while ((c->status & 1) != q->phase) {
+		if (mmind(ctrl->regs + NVME_CSTS) & NVME_CSTS_CFS)
+			return false;
+		asm volatile("pause");
+	}
+
+	uint16_t status = c->status >> 1;
+	if (result)
+		*result = c->result;
+	nvme_advance(q);
+	mmoutd(q->cq_doorbell, q->cq_head);
+
+	if (status)
+		printf("nvme: Admin command %x failed, status %x\n", cmd->opcode,
+			   status);
+	return status == 0;
+}
+
+static bool nvme_identify(struct nvme_controller *ctrl, uint8_t cns,
+						  uint32_t nsid, void *buf) {
+	struct nvme_command cmd = {0};
+	cmd.opcode = NVME_ADMIN_IDENTIFY;
+	cmd.nsid = nsid;
+	cmd.prp1 = (uintptr_t)buf - MEM_PHYS_OFFSET;
+	cmd.cdw10 = cns;
+	return nvme_admin(ctrl, &cmd, NULL);
+}
+
+// Wait for CSTS.RDY to become ready, for at most the timeout in CAP
+static bool nvme_wait_ready(struct nvme_controller *ctrl, bool ready) {
+	size_t timeout_ms = (NVME_CAP_TO(ctrl->cap) + 1) * 500;
+	for (size_t i = 0; i < timeout_ms; i++) {
+		uint32_t csts = mmind(ctrl->regs + NVME_CSTS);
+		if (csts & NVME_CSTS_CFS)
+			return false;
+		if (!!(csts & NVME_CSTS_RDY) == ready)
+			return true;
+		timer_usleep(1000);
+	}
+	return false;
+}
+
+// Describe the buffers of req by PRPs. The block layer only merges bios that
+// meet at a page boundary, so every page after the first starts at offset 0
+// and only the last can end early, as PRPs need.
+static bool nvme_build_prps(struct nvme_queue *q, int cid,
+							struct block_request *req,
+							struct nvme_command *cmd) {
+	size_t sector_size = q->ctrl->blk.sector_size;
+	size_t n = 0;
+
+	for (struct bio *bio = req->bios; bio; bio = bio->next) {
+		uintptr_t virt = (uintptr_t)bio->buf;
+		size_t left = bio->count * sector_size;
+
+		if (virt & 3)
+			return false;
+
+		while (left) {
+			size_t chunk = MIN(left, PAGE_SIZE - (virt % PAGE_SIZE));
+			uint64_t phys;
+			if (!vmm_virt_to_phys(kernel_pagemap, virt, &phys))
+				return false;
+
+			if (n == 0) {
+				cmd->prp1 = phys;
+			} else {
+				if (q->prp_lists[cid] == NULL) {
+					void *page = pmm_allocz(1);
+					if (page == NULL)
+						return false;
+					q->prp_lists[cid] = page + MEM_PHYS_OFFSET;
+				}
+				if (n - 1 == PAGE_SIZE / sizeof(uint64_t))
+					return false;
+				q->prp_lists[cid][n - 1] = phys;
+			}
+			n++;
+
+			virt += chunk;
+			left -= chunk;
+		}
+	}
+
+	// The second page goes in PRP2 itself, more than that in the list
+	if (n == 2)
+		cmd->prp2 = q->prp_lists[cid][0];
+	else if (n > 2)
+		cmd->prp2 = queue_phys(q->prp_lists[cid]);
+	return n != 0;
+}
+
+static void nvme_submit(struct block_device *this, struct block_request *req) {
+	struct nvme_controller *ctrl = (void *)this;
+
+	uint64_t rflags = cpu_irq_save();
+	struct nvme_queue *q =
+		ctrl->queues[this_cpu()->cpu_number % ctrl->queue_count];
+	LOCK(q->lock);
+
+	// The block layer keeps at most queue_depth requests here, which a single
+	// queue holds, so a command ID is always free
+	int cid = __builtin_ctzll(~q->busy);
+	struct nvme_command cmd = {0};
+	if (!nvme_build_prps(q, cid, req, &cmd)) {
+		UNLOCK(q->lock);
+		cpu_irq_restore(rflags);
+		printf("nvme: Can't describe buffer to the controller\n");
+		block_complete(this, req, false);
+		return;
+	}
+
+	cmd.opcode = req->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+	cmd.cid = cid;
+	cmd.nsid = ctrl->nsid;
+	cmd.cdw10 = req->sector;
+	cmd.cdw11 = req->sector >> 32;
+	cmd.cdw12 = req->count - 1;
+
+	q->busy |= 1ULL << cid;
+	q->reqs[cid] = req;
+	nvme_push(q, &cmd);
+
+	UNLOCK(q->lock);
+	cpu_irq_restore(rflags);
+}
+
+// Complete the requests the controller posted to q since the last time
+static void nvme_reap(struct nvme_queue *q) {
+	struct block_request *done[NVME_IO_DEPTH];
+	bool ok[NVME_IO_DEPTH];
+	size_t n = 0;
+
+	uint64_t rflags = lock_irqsave(&q->lock);
+
+	bool reaped = false;
+	for (;;) {
+		volatile struct nvme_completion *c = &q->cq[q->cq_head];
+		if ((c->status & 1) != q->phase)
+			break;
+
+		uint16_t cid = c->cid;
+		if (cid < NVME_IO_DEPTH && (q->busy & (1ULL << cid))) {
+			done[n] = q->reqs[cid];
+			ok[n++] = !(c->status >> 1);
+			q->reqs[cid] = NULL;
+			q->busy &= ~(1ULL << cid);
+		}
+		nvme_advance(q);
+		reaped = true;
+	}
+	if (reaped)
+		mmoutd(q->cq_doorbell, q->cq_head);
+
+	lock_irqrestore(&q->lock, rflags);
+
+	for (size_t i = 0; i < n; i++) {
+		if (!ok[i])
+			printf("nvme: I/O error at sector %llu\n", done[i]->sector);
+		block_complete(&q->ctrl->blk, done[i], ok[i]);
+	}
+}
+
+static void nvme_reap_tasklet(void *arg) {
+	nvme_reap(arg);
+}
+
+static void nvme_interrupt(void *arg) {
+	struct nvme_queue *q = arg;
+	tasklet_schedule(&q->reap);
+}
+
+static void nvme_poll(struct block_device *this) {
+	struct nvme_controller *ctrl = (void *)this;
+	for (size_t i = 0; i < ctrl->queue_count; i++)
+		nvme_reap(ctrl->queues[i]);
+}
+
+// Create I/O queue pair id, interrupting the processor it belongs to through
+// message id when the controller has that many
+static struct nvme_queue *nvme_create_queue(struct nvme_controller *ctrl,
+											uint16_t id, uint16_t size,
+											size_t irq_count) {
+	struct nvme_queue *q = alloc(sizeof(struct nvme_queue));
+	if (q == NULL || !nvme_queue_init(ctrl, q, id, size))
+		return NULL;
+
+	q->vector = -1;
+	q->reap = (struct tasklet)TASKLET_INIT(nvme_reap_tasklet, q);
+	if (id < irq_count)
+		q->vector = pci_irq_alloc(ctrl->pci, id, id - 1, nvme_interrupt, q);
+
+	struct nvme_command cmd = {0};
+	cmd.opcode = NVME_ADMIN_CREATE_CQ;
+	cmd.prp1 = queue_phys(q->cq);
+	cmd.cdw10 = (uint32_t)(size - 1) << 16 | id;
+	cmd.cdw11 = NVME_QUEUE_CONTIGUOUS;
+	if (q->vector >= 0)
+		cmd.cdw11 |= NVME_QUEUE_IRQ | (uint32_t)id << 16;
+	if (!nvme_admin(ctrl, &cmd, NULL))
+		return NULL;
+
+	cmd = (struct nvme_command){0};
+	cmd.opcode = NVME_ADMIN_CREATE_SQ;
+	cmd.prp1 = queue_phys(q->sq);
+	cmd.cdw10 = (uint32_t)(size - 1) << 16 | id;
+	cmd.cdw11 = (uint32_t)id << 16 | NVME_QUEUE_CONTIGUOUS;
+	if (!nvme_admin(ctrl, &cmd, NULL))
+		return NULL;
+
+	return q;
+}
+
+static void nvme_controller_init(struct pci_device *dev) {
+	struct pci_bar bar = {0};
+	PciGetBar(&bar, dev->id, 0);
+	if (bar.u.address == NULL || (bar.flags & 0x1))
+		return;
+
+	struct nvme_controller *ctrl =
+		block_device_create(sizeof(struct nvme_controller));
+	ctrl->pci = dev;
+	ctrl->regs = pci_map_bar(&bar, VMM_CACHE_UC);
+	ctrl->cap = mminq(ctrl->regs + NVME_CAP);
+	ctrl->queue_count = 0;
+
+	// Memory space and bus mastering
+	uint16_t command = pci_dev_read(dev, 0x04, 2);
+	pci_dev_write(dev, 0x04, command | (1 << 1) | (1 << 2), 2);
+
+	// Pages are 4 KiB, which the controller has to support as its minimum
+	if ((ctrl->cap >> 48) & 0xF) {
+		printf("nvme: Controller doesn't do 4 KiB pages\n");
+		return;
+	}
+
+	mmoutd(ctrl->regs + NVME_CC, mmind(ctrl->regs + NVME_CC) & ~NVME_CC_EN);
+	if (!nvme_wait_ready(ctrl, false)) {
+		printf("nvme: Controller didn't reset\n");
+		return;
+	}
+
+	uint16_t max_entries = NVME_CAP_MQES(ctrl->cap) + 1;
+	if (!nvme_queue_init(ctrl, &ctrl->admin, 0,
+						 MIN(max_entries, NVME_ADMIN_DEPTH)))
+		return;
+	mmoutd(ctrl->regs + NVME_AQA,
+		   (uint32_t)(ctrl->admin.size - 1) << 16 | (ctrl->admin.size - 1));
+	mmoutq(ctrl->regs + NVME_ASQ, queue_phys(ctrl->admin.sq));
+	mmoutq(ctrl->regs + NVME_ACQ, queue_phys(ctrl->admin.cq));
+
+	mmoutd(ctrl->regs + NVME_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	if (!nvme_wait_ready(ctrl, true)) {
+		printf("nvme: Controller didn't become ready\n");
+		return;
+	}
+
+	void *page = pmm_allocz(1);
+	if (page == NULL)
+		return;
+	page += MEM_PHYS_OFFSET;
+
+	struct nvme_id_controller *idc = page;
+	if (!nvme_identify(ctrl, NVME_IDENTIFY_CONTROLLER, 0, idc))
+		goto out;
+	uint32_t nn = idc->nn;
+	// What MDTS and a PRP list page allow, a page more when unaligned
+	size_t max_bytes = (PAGE_SIZE / sizeof(uint64_t)) * PAGE_SIZE;
+	if (idc->mdts)
+		max_bytes = MIN(max_bytes, PAGE_SIZE << idc->mdts);
+
+	// Only the first active namespace gets a block device, the I/O queues
+	// are sized for one
+	struct nvme_id_namespace *idn = page;
+	ctrl->nsid = 0;
+	for (uint32_t nsid = 1; nsid <= nn; nsid++) {
+		if (nvme_identify(ctrl, NVME_IDENTIFY_NAMESPACE, nsid, idn) &&
+			idn->nsze) {
+			ctrl->nsid = nsid;
+			break;
+		}
+	}
+	if (ctrl->nsid == 0) {
+		printf("nvme: Controller has no active namespace\n");
+		goto out;
+	}
+
+	uint8_t lbads = idn->lbaf[idn->flbas & 0xF].lbads;
+	if (lbads < 9 || lbads > 12) {
+		printf("nvme: Unsupported block size 2^%u\n", lbads);
+		goto out;
+	}
+	ctrl->blk.sector_size = 1 << lbads;
+	ctrl->blk.sectors = idn->nsze;
+
+	// One pair per processor if the controller has that many, each with its
+	// own message. Message 0 belongs to the admin queue.
+	size_t irq_count = pci_irq_count(dev);
+	size_t wanted = MIN(cpu_count, (size_t)MAX_CPUS);
+	struct nvme_command cmd = {0};
+	uint32_t granted;
+	cmd.opcode = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEATURE_QUEUES;
+	cmd.cdw11 = (uint32_t)(wanted - 1) << 16 | (wanted - 1);
+	if (!nvme_admin(ctrl, &cmd, &granted))
+		goto out;
+	wanted = MIN(wanted, (size_t)(granted & 0xFFFF) + 1);
+	wanted = MIN(wanted, (size_t)(granted >> 16) + 1);
+
+	uint16_t io_size = MIN(max_entries, NVME_IO_DEPTH);
+	for (size_t i = 0; i < wanted; i++) {
+		struct nvme_queue *q =
+			nvme_create_queue(ctrl, i + 1, io_size, irq_count);
+		if (q == NULL)
+			break;
+		ctrl->queues[ctrl->queue_count++] = q;
+	}
+	if (ctrl->queue_count == 0) {
+		printf("nvme: Couldn't create I/O queues\n");
+		goto out;
+	}
+	if (irq_count > 1)
+		pci_irq_enable(dev);
+
+	// Waiters only need to poll queues without an interrupt
+	bool polled = false;
+	for (size_t i = 0; i < ctrl->queue_count; i++)
+		polled |= ctrl->queues[i]->vector < 0;
+
+	ctrl->blk.max_sectors =
+		MIN((size_t)65536, max_bytes / ctrl->blk.sector_size);
+	ctrl->blk.queue_depth = io_size - 1;
+	ctrl->blk.page_merge = true;
+	ctrl->blk.submit = nvme_submit;
+	ctrl->blk.poll = polled ? nvme_poll : NULL;
+
+	char name[16];
+	snprintf(name, sizeof(name), "nvme%zun%u", nvme_controller_count++,
+			 ctrl->nsid);
+	printf("nvme: /dev/%s, %llu sectors of %zu bytes, %zu queues%s\n", name,
+		   ctrl->blk.sectors, ctrl->blk.sector_size, ctrl->queue_count,
+		   polled ? ", polled" : "");
+	block_register(&ctrl->blk, name);
+
+out:
+	pmm_free(page - MEM_PHYS_OFFSET, 1);
+}
+
+void nvme_init(void) {
+	for (size_t i = 0; i < pci_devices.length; i++) {
+		struct pci_device *dev = pci_devices.storage[i];
+		if (dev != NULL && dev->classcode == 0x1 && dev->subclass == 0x08 &&
+			dev->progintf == 0x02)
+			nvme_controller_init(dev);
+	}
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVME_DEF_H
+#define NVME_DEF_H
+
+#include <stdint.h>
+
+// Controller registers, at the start of BAR0
+#define NVME_CAP 0x00
+#define NVME_VS 0x08
+#define NVME_INTMS 0x0C
+#define NVME_CC 0x14
+#define NVME_CSTS 0x1C
+#define NVME_AQA 0x24
+#define NVME_ASQ 0x28
+#define NVME_ACQ 0x30
+#define NVME_DOORBELLS 0x1000
+
+// Largest queue minus one, doorbell stride as a power of 4 bytes and the
+// ready timeout in units of 500 ms
+#define NVME_CAP_MQES(cap) ((cap) & 0xFFFF)
+#define NVME_CAP_TO(cap) (((cap) >> 24) & 0xFF)
+#define NVME_CAP_DSTRD(cap) (((cap) >> 32) & 0xF)
+
+// 64 byte submission and 16 byte completion entries, 4 KiB pages
+#define NVME_CC_EN (1U << 0)
+#define NVME_CC_IOSQES (6U << 16)
+#define NVME_CC_IOCQES (4U << 20)
+
+#define NVME_CSTS_RDY (1U << 0)
+#define NVME_CSTS_CFS (1U << 1)
+
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+
+#define NVME_FEATURE_QUEUES 0x07
+
+// Queue flags of the create commands
+#define NVME_QUEUE_CONTIGUOUS (1U << 0)
+#define NVME_QUEUE_IRQ (1U << 1)
+
+struct nvme_command {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t cid;
+	uint32_t nsid;
+	uint64_t reserved;
+	uint64_t metadata;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __attribute__((packed));
+
+struct nvme_completion {
+	uint32_t result;
+	uint32_t reserved;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	// Phase tag in bit 0, status above
+	uint16_t status;
+} __attribute__((packed));
+
+// Identify data, only the fields in use
+struct nvme_id_controller {
+	uint8_t unused1[77];
+	// Largest transfer as a power of two of the minimum page size, 0 without
+	// a limit
+	uint8_t mdts;
+	uint8_t unused2[438];
+	uint32_t nn;
+	uint8_t unused3[3576];
+} __attribute__((packed));
+
+struct nvme_id_namespace {
+	uint64_t nsze;
+	uint64_t ncap;
+	uint64_t nuse;
+	uint8_t nsfeat;
+	uint8_t nlbaf;
+	// Low 4 bits index lbaf
+	uint8_t flbas;
+	uint8_t unused2[101];
+	// Metadata size, log2 of the block size and performance
+	struct {
+		uint16_t ms;
+		uint8_t lbads;
+		uint8_t rp;
+	} __attribute__((packed)) lbaf[16];
+	uint8_t unused3[3904];
+} __attribute__((packed));
+
+#endif
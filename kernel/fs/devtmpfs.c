@@ -15,17 +15,20 @@
  */
 
 #include "devtmpfs.h"
+#include "../klibc/aio.h"
 #include "../klibc/lock.h"
+#include "../klibc/math.h"
 #include "../klibc/mem.h"
 #include "../klibc/resource.h"
+#include "../mm/vmm.h"
+#include "filepages.h"
 #include "vfs.h"
 #include <liballoc.h>
 #include <stddef.h>
 
 struct tmpfs_resource {
 	struct resource res;
-	size_t allocated_size;
-	char *data;
+	struct file_pages pages;
 };
 
 static ino_t inode_counter = 1;
@@ -62,11 +65,15 @@ static ssize_t devtmpfs_read(struct resource *_this, void *buf, off_t off,
 	struct tmpfs_resource *this = (void *)_this;
 	LOCK(this->res.lock);
 
-	if (off + count > (size_t)this->res.st.st_size)
-		count -= (off + count) - this->res.st.st_size;
+	if (off >= this->res.st.st_size)
+		count = 0;
+	else if (off + count > (size_t)this->res.st.st_size)
+		count = this->res.st.st_size - off;
+
+	file_pages_read(&this->pages, buf, off, count);
 
-	memcpy(buf, this->data + off, count);
 	UNLOCK(this->res.lock);
+
 	return count;
 }
 
@@ -75,18 +82,78 @@ static ssize_t devtmpfs_write(struct resource *_this, const void *buf,
 	struct tmpfs_resource *this = (void *)_this;
 	LOCK(this->res.lock);
 
-	if (off + count > this->allocated_size) {
-		while (off + count > this->allocated_size)
-			this->allocated_size *= 2;
+	count = file_pages_write(&this->pages, buf, off, count);
+
+	if (off + count > (size_t)this->res.st.st_size)
+		this->res.st.st_size = off + count;
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
+
+	UNLOCK(this->res.lock);
+	return count;
+}
+
+static ssize_t devtmpfs_readv(struct resource *_this, const struct iovec *iov,
+							  int iovcnt, off_t off) {
+	struct tmpfs_resource *this = (void *)_this;
+	ssize_t total = 0;
+	LOCK(this->res.lock);
+
+	for (int i = 0; i < iovcnt && off < this->res.st.st_size; i++) {
+		size_t count =
+			MIN(iov[i].iov_len, (size_t)(this->res.st.st_size - off));
+		file_pages_read(&this->pages, iov[i].iov_base, off, count);
+		off += count;
+		total += count;
+	}
+
+	UNLOCK(this->res.lock);
+
+	return total;
+}
+
+static ssize_t devtmpfs_writev(struct resource *_this, const struct iovec *iov,
+							   int iovcnt, off_t off) {
+	struct tmpfs_resource *this = (void *)_this;
+	ssize_t total = 0;
+	LOCK(this->res.lock);
 
-		this->data = krealloc(this->data, this->allocated_size);
+	for (int i = 0; i < iovcnt; i++) {
+		size_t count = file_pages_write(&this->pages, iov[i].iov_base, off,
+										iov[i].iov_len);
+		off += count;
+		total += count;
+		if (count < iov[i].iov_len)
+			break;
 	}
 
-	memcpy(this->data + off, buf, count);
+	if (off > this->res.st.st_size)
+		this->res.st.st_size = off;
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
 
-	this->res.st.st_size += count;
 	UNLOCK(this->res.lock);
-	return count;
+	return total;
+}
+
+// Only whole pages of the file can be mapped, the part of the last one past
+// the end reads as zeroes
+static int devtmpfs_mmap(struct resource *_this, struct pagemap *pagemap,
+						 uint64_t virt, size_t length, off_t off, int prot,
+						 int flags) {
+	struct tmpfs_resource *this = (void *)_this;
+	uint64_t pte_flags = vmm_mmap_flags(virt, prot, flags);
+	if (pte_flags == 0)
+		return -1;
+
+	LOCK(this->res.lock);
+
+	bool ok = off >= 0 &&
+			  off + length <= ALIGN_UP(this->res.st.st_size, PAGE_SIZE) &&
+			  file_pages_mmap(&this->pages, pagemap, virt, length, off,
+							  pte_flags);
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
+
+	UNLOCK(this->res.lock);
+	return ok ? 0 : -1;
 }
 
 static int devtmpfs_close(struct resource *_this) {
@@ -104,8 +171,7 @@ static struct resource *devtmpfs_open(struct vfs_node *node, bool create,
 
 	struct tmpfs_resource *res = resource_create(sizeof(struct tmpfs_resource));
 
-	res->allocated_size = 4096;
-	res->data = kmalloc(res->allocated_size);
+	res->pages = (struct file_pages){0};
 	res->res.st.st_dev = node->backing_dev_id;
 	res->res.st.st_size = 0;
 	res->res.st.st_blocks = 0;
@@ -116,6 +182,10 @@ static struct resource *devtmpfs_open(struct vfs_node *node, bool create,
 	res->res.close = devtmpfs_close;
 	res->res.read = devtmpfs_read;
 	res->res.write = devtmpfs_write;
+	res->res.readv = devtmpfs_readv;
+	res->res.writev = devtmpfs_writev;
+	res->res.mmap = devtmpfs_mmap;
+	res->res.aio = aio_inline;
 
 	return (void *)res;
 }
@@ -134,8 +204,11 @@ static struct resource *devtmpfs_mkdir(struct vfs_node *node, mode_t mode) {
 	return (void *)res;
 }
 
-static struct vfs_node *devtmpfs_populate(struct vfs_node *node) {
+// Every entry is created through the VFS
+static struct vfs_node *devtmpfs_populate(struct vfs_node *node,
+										  uint64_t *cursor) {
 	(void)node;
+	(void)cursor;
 	return NULL;
 }
 
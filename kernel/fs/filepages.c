@@ -0,0 +1,174 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "filepages.h"
+#include "../klibc/mem.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
+#include <stdbool.h>
+
+#define FILE_PAGES_SHIFT 9
+#define FILE_PAGES_SLOTS (1 << FILE_PAGES_SHIFT)
+
+static void *page_new(void) {
+	void *page = pmm_allocz(1);
+	return page == NULL ? NULL : page + MEM_PHYS_OFFSET;
+}
+
+static bool index_fits(int height, size_t index) {
+	return height * FILE_PAGES_SHIFT >= 64 ||
+		   (index >> (height * FILE_PAGES_SHIFT)) == 0;
+}
+
+// Copy what the backing memory has for the page at off, the rest is left
+static void copy_backing(struct file_pages *pages, void *buf, off_t off,
+						 size_t count) {
+	if ((size_t)off >= pages->backing_size)
+		return;
+	if (count > pages->backing_size - off)
+		count = pages->backing_size - off;
+	memcpy(buf, pages->backing + off, count);
+}
+
+// Return the data page holding page index, with create set missing pages and
+// levels are allocated on the way, NULL is returned if that fails
+static void *find_page(struct file_pages *pages, size_t index, bool create) {
+	if (!index_fits(pages->height, index)) {
+		if (!create)
+			return NULL;
+
+		// An empty tree can start at any height, else the current root
+		// becomes the first slot of each new level
+		while (!index_fits(pages->height, index)) {
+			if (pages->root != NULL) {
+				void **node = page_new();
+				if (node == NULL)
+					return NULL;
+				node[0] = pages->root;
+				pages->root = node;
+			}
+			pages->height++;
+		}
+	}
+
+	void **slot = &pages->root;
+	for (int level = pages->height; level > 0; level--) {
+		if (*slot == NULL) {
+			if (!create || (*slot = page_new()) == NULL)
+				return NULL;
+		}
+		size_t shift = (level - 1) * FILE_PAGES_SHIFT;
+		slot = &((void **)*slot)[(index >> shift) & (FILE_PAGES_SLOTS - 1)];
+	}
+
+	if (*slot == NULL && create) {
+		*slot = page_new();
+		if (*slot == NULL)
+			return NULL;
+		copy_backing(pages, *slot, index * PAGE_SIZE, PAGE_SIZE);
+		pages->count++;
+	}
+
+	return *slot;
+}
+
+void file_pages_read(struct file_pages *pages, void *buf, off_t off,
+					 size_t count) {
+	while (count) {
+		size_t page_off = off % PAGE_SIZE;
+		size_t chunk = PAGE_SIZE - page_off;
+		if (chunk > count)
+			chunk = count;
+
+		void *page = find_page(pages, off / PAGE_SIZE, false);
+		if (page == NULL) {
+			memset(buf, 0, chunk);
+			copy_backing(pages, buf, off, chunk);
+		} else {
+			memcpy(buf, page + page_off, chunk);
+		}
+
+		buf += chunk;
+		off += chunk;
+		count -= chunk;
+	}
+}
+
+// Return how much was written, less than count if memory ran out
+size_t file_pages_write(struct file_pages *pages, const void *buf, off_t off,
+						size_t count) {
+	size_t written = 0;
+
+	while (written < count) {
+		size_t page_off = off % PAGE_SIZE;
+		size_t chunk = PAGE_SIZE - page_off;
+		if (chunk > count - written)
+			chunk = count - written;
+
+		void *page = find_page(pages, off / PAGE_SIZE, true);
+		if (page == NULL)
+			break;
+		memcpy(page + page_off, buf + written, chunk);
+
+		off += chunk;
+		written += chunk;
+	}
+
+	return written;
+}
+
+// Take back the first length bytes of a mapping that failed part way, with
+// the references taken on the pages mapped copy-on-write
+static void unmap_pages(struct file_pages *pages, struct pagemap *pagemap,
+						uint64_t virt, size_t length, off_t off,
+						uint64_t flags) {
+	if (flags & VMM_COW) {
+		for (size_t done = 0; done < length; done += PAGE_SIZE) {
+			void *page = find_page(pages, (off + done) / PAGE_SIZE, false);
+			__atomic_sub_fetch(
+				&pmm_get_page(page - MEM_PHYS_OFFSET)->refcount, 1,
+				__ATOMIC_RELEASE);
+		}
+	}
+
+	vmm_unmap_range(pagemap, virt, length);
+}
+
+// Map the pages from off at virt with the page flags from vmm_mmap_flags(),
+// allocating missing ones. The file holds a reference to the pages it maps
+// copy-on-write, so that writes through the mapping never take the page
+// itself.
+bool file_pages_mmap(struct file_pages *pages, struct pagemap *pagemap,
+					 uint64_t virt, size_t length, off_t off, uint64_t flags) {
+	if (off % PAGE_SIZE)
+		return false;
+
+	for (size_t done = 0; done < length; done += PAGE_SIZE) {
+		void *page = find_page(pages, (off + done) / PAGE_SIZE, true);
+		uintptr_t phys = (uintptr_t)page - MEM_PHYS_OFFSET;
+		if (page == NULL ||
+			!vmm_map_range(pagemap, virt + done, phys, PAGE_SIZE, flags)) {
+			unmap_pages(pages, pagemap, virt, done, off, flags);
+			return false;
+		}
+
+		if (flags & VMM_COW)
+			__atomic_add_fetch(&pmm_get_page((void *)phys)->refcount, 1,
+							   __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
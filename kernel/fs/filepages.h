@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FILEPAGES_H
+#define FILEPAGES_H
+
+#include "../klibc/types.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pagemap;
+
+// Contents of an in-memory file as a radix tree of separately allocated pages,
+// 512 slots per level. Holes have no page and read as zeroes, or as what's
+// there in the read-only backing memory if set, which a page gets a copy of
+// when it's first written. The owner serializes access.
+struct file_pages {
+	void *root;
+	// Number of levels above the data pages
+	int height;
+	// Number of data pages allocated
+	size_t count;
+	const void *backing;
+	size_t backing_size;
+};
+
+void file_pages_read(struct file_pages *pages, void *buf, off_t off,
+					 size_t count);
+size_t file_pages_write(struct file_pages *pages, const void *buf, off_t off,
+						size_t count);
+bool file_pages_mmap(struct file_pages *pages, struct pagemap *pagemap,
+					 uint64_t virt, size_t length, off_t off, uint64_t flags);
+
+#endif
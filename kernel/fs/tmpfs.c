@@ -15,17 +15,21 @@
  */
 
 #include "tmpfs.h"
+#include "../klibc/aio.h"
 #include "../klibc/lock.h"
+#include "../klibc/math.h"
 #include "../klibc/mem.h"
 #include "../klibc/resource.h"
+#include "../klibc/trace.h"
+#include "../mm/vmm.h"
+#include "filepages.h"
 #include "vfs.h"
 #include <liballoc.h>
 #include <stddef.h>
 
 struct tmpfs_resource {
 	struct resource res;
-	size_t allocated_size;
-	char *data;
+	struct file_pages pages;
 };
 
 struct tmpfs_mount_data {
@@ -34,7 +38,7 @@ struct tmpfs_mount_data {
 
 static struct vfs_node *tmpfs_mount(struct resource *device) {
 	(void)device;
-	struct vfs_node *mount_gate = alloc(sizeof(struct vfs_node));
+	struct vfs_node *mount_gate = slab_alloc(&vfs_node_cache);
 	mount_gate->fs = &tmpfs;
 	struct tmpfs_mount_data *mount_data =
 		alloc(sizeof(struct tmpfs_mount_data));
@@ -45,13 +49,16 @@ static struct vfs_node *tmpfs_mount(struct resource *device) {
 
 static ssize_t tmpfs_read(struct resource *_this, void *buf, off_t off,
 						  size_t count) {
+	TRACEPOINT(TRACE_TMPFS_READ, off, count);
 	struct tmpfs_resource *this = (void *)_this;
 	LOCK(this->res.lock);
 
-	if (off + count > (size_t)this->res.st.st_size)
-		count -= (off + count) - this->res.st.st_size;
+	if (off >= this->res.st.st_size)
+		count = 0;
+	else if (off + count > (size_t)this->res.st.st_size)
+		count = this->res.st.st_size - off;
 
-	memcpy(buf, this->data + off, count);
+	file_pages_read(&this->pages, buf, off, count);
 
 	UNLOCK(this->res.lock);
 
@@ -60,20 +67,103 @@ static ssize_t tmpfs_read(struct resource *_this, void *buf, off_t off,
 
 static ssize_t tmpfs_write(struct resource *_this, const void *buf, off_t off,
 						   size_t count) {
+	TRACEPOINT(TRACE_TMPFS_WRITE, off, count);
 	struct tmpfs_resource *this = (void *)_this;
 	LOCK(this->res.lock);
-	if (off + count > this->allocated_size) {
-		while (off + count > this->allocated_size)
-			this->allocated_size *= 2;
 
-		this->data = krealloc(this->data, this->allocated_size);
-	}
-	memcpy(this->data + off, buf, count);
-	this->res.st.st_size += count;
+	count = file_pages_write(&this->pages, buf, off, count);
+
+	if (off + count > (size_t)this->res.st.st_size)
+		this->res.st.st_size = off + count;
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
+
 	UNLOCK(this->res.lock);
 	return count;
 }
 
+// Let an empty tmpfs file read from data without copying it, the memory has to
+// stay around and unchanged. Pages are copied only once they're written to.
+bool tmpfs_set_backing(struct resource *_this, const void *data, size_t size) {
+	struct tmpfs_resource *this = (void *)_this;
+	if (_this->write != tmpfs_write)
+		return false;
+
+	LOCK(this->res.lock);
+	if (this->res.st.st_size != 0) {
+		UNLOCK(this->res.lock);
+		return false;
+	}
+	this->pages.backing = data;
+	this->pages.backing_size = size;
+	this->res.st.st_size = size;
+	UNLOCK(this->res.lock);
+	return true;
+}
+
+static ssize_t tmpfs_readv(struct resource *_this, const struct iovec *iov,
+						   int iovcnt, off_t off) {
+	struct tmpfs_resource *this = (void *)_this;
+	ssize_t total = 0;
+	LOCK(this->res.lock);
+
+	for (int i = 0; i < iovcnt && off < this->res.st.st_size; i++) {
+		size_t count =
+			MIN(iov[i].iov_len, (size_t)(this->res.st.st_size - off));
+		file_pages_read(&this->pages, iov[i].iov_base, off, count);
+		off += count;
+		total += count;
+	}
+
+	UNLOCK(this->res.lock);
+
+	return total;
+}
+
+static ssize_t tmpfs_writev(struct resource *_this, const struct iovec *iov,
+							int iovcnt, off_t off) {
+	struct tmpfs_resource *this = (void *)_this;
+	ssize_t total = 0;
+	LOCK(this->res.lock);
+
+	for (int i = 0; i < iovcnt; i++) {
+		size_t count = file_pages_write(&this->pages, iov[i].iov_base, off,
+										iov[i].iov_len);
+		off += count;
+		total += count;
+		if (count < iov[i].iov_len)
+			break;
+	}
+
+	if (off > this->res.st.st_size)
+		this->res.st.st_size = off;
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
+
+	UNLOCK(this->res.lock);
+	return total;
+}
+
+// Only whole pages of the file can be mapped, the part of the last one past
+// the end reads as zeroes
+static int tmpfs_mmap(struct resource *_this, struct pagemap *pagemap,
+					  uint64_t virt, size_t length, off_t off, int prot,
+					  int flags) {
+	struct tmpfs_resource *this = (void *)_this;
+	uint64_t pte_flags = vmm_mmap_flags(virt, prot, flags);
+	if (pte_flags == 0)
+		return -1;
+
+	LOCK(this->res.lock);
+
+	bool ok = off >= 0 &&
+			  off + length <= ALIGN_UP(this->res.st.st_size, PAGE_SIZE) &&
+			  file_pages_mmap(&this->pages, pagemap, virt, length, off,
+							  pte_flags);
+	this->res.st.st_blocks = this->pages.count * (PAGE_SIZE / 512);
+
+	UNLOCK(this->res.lock);
+	return ok ? 0 : -1;
+}
+
 static int tmpfs_close(struct resource *_this) {
 	struct tmpfs_resource *this = (void *)_this;
 	LOCK(this->res.lock);
@@ -90,8 +180,7 @@ static struct resource *tmpfs_open(struct vfs_node *node, bool create,
 	struct tmpfs_mount_data *mount_data = node->mount_data;
 	struct tmpfs_resource *res = resource_create(sizeof(struct tmpfs_resource));
 
-	res->allocated_size = 4096;
-	res->data = kmalloc(res->allocated_size);
+	res->pages = (struct file_pages){0};
 	res->res.st.st_dev = node->backing_dev_id;
 	res->res.st.st_size = 0;
 	res->res.st.st_blocks = 0;
@@ -102,6 +191,10 @@ static struct resource *tmpfs_open(struct vfs_node *node, bool create,
 	res->res.close = tmpfs_close;
 	res->res.read = tmpfs_read;
 	res->res.write = tmpfs_write;
+	res->res.readv = tmpfs_readv;
+	res->res.writev = tmpfs_writev;
+	res->res.mmap = tmpfs_mmap;
+	res->res.aio = aio_inline;
 
 	return (void *)res;
 }
@@ -122,8 +215,11 @@ static struct resource *tmpfs_mkdir(struct vfs_node *node, mode_t mode) {
 	return (void *)res;
 }
 
-static struct vfs_node *tmpfs_populate(struct vfs_node *node) {
+// Every entry is created through the VFS
+static struct vfs_node *tmpfs_populate(struct vfs_node *node,
+									   uint64_t *cursor) {
 	(void)node;
+	(void)cursor;
 	return NULL;
 }
 
@@ -18,6 +18,11 @@
 #define TMPFS_H
 
 #include "vfs.h"
+#include <stdbool.h>
+#include <stddef.h>
+
 extern struct filesystem tmpfs;
 
+bool tmpfs_set_backing(struct resource *res, const void *data, size_t size);
+
 #endif
@@ -16,19 +16,35 @@
 
 #include "vfs.h"
 #include "../dev/dev.h"
-#include "../klibc/dynarray.h"
+#include "../klibc/hashmap.h"
 #include "../klibc/lock.h"
 #include "../klibc/printf.h"
+#include "../klibc/mem.h"
 #include "../klibc/string.h"
+#include "../klibc/trace.h"
 #include <stdbool.h>
 #include <stddef.h>
 
-lock_t vfs_lock = {0};
+seqlock_t vfs_lock = {0};
 
-DYNARRAY_STATIC(struct filesystem *, filesystems);
+static void vfs_node_ctor(void *obj) {
+	memset(obj, 0, sizeof(struct vfs_node));
+}
+
+struct slab_cache vfs_node_cache =
+	SLAB_CACHE_INIT("vfs_node", struct vfs_node, vfs_node_ctor);
+
+// Installed filesystems in install order, indexed by name for mounting
+static struct list_node filesystems = LIST_INIT(filesystems);
+static struct hashmap filesystems_by_name = HASHMAP_STR_INIT;
 
 bool vfs_install_fs(struct filesystem *fs) {
-	DYNARRAY_PUSHBACK(filesystems, fs);
+	if (hashmap_get_str(&filesystems_by_name, fs->name) != NULL)
+		return false;
+	if (!hashmap_put_str(&filesystems_by_name, fs->name, fs))
+		return false;
+
+	list_push_back(&filesystems, &fs->link);
 	return true;
 }
 
@@ -115,130 +131,395 @@ static struct vfs_node root_node = {.name = "/",
 									.parent = NULL,
 									.child = NULL,
 									.next = NULL,
-									.backing_dev_id = 0};
-enum { NO_CREATE = 0, CREATE_SHALLOW, CREATE_DEEP };
+									.backing_dev_id = 0,
+									.populated = true};
+// Create flags for path2node(). Without CREATE_DEEP missing directories on
+// the way aren't made, CREATE_EXCL fails if the last component exists and
+// CREATE_DIR makes it a directory.
+enum {
+	NO_CREATE = 0,
+	CREATE_SHALLOW = 1 << 0,
+	CREATE_DEEP = 1 << 1,
+	CREATE_EXCL = 1 << 2,
+	CREATE_DIR = 1 << 3
+};
+
+// Links between nodes are read locklessly, writers publish them last
+static inline struct vfs_node *load_node(struct vfs_node **link) {
+	return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
 
-static struct vfs_node *path2node(struct vfs_node *parent, const char *_path,
-								  int create) {
-	bool last = false;
+static inline void publish_node(struct vfs_node **link, struct vfs_node *node) {
+	__atomic_store_n(link, node, __ATOMIC_RELEASE);
+}
 
-	if (_path == NULL)
-		return NULL;
+#define DENTRY_HASH_MIN 4096
+#define DENTRY_NEGATIVE_MAX 1024
+
+// Every node that lives in a directory is also chained in a global hash keyed
+// by that directory and its name, lookups never walk the sibling lists. Names
+// that were looked up and missed under the lock get negative nodes that stay
+// out of the sibling lists and are turned into the real node on creation.
+//
+// The table doubles once it holds twice as many nodes as it has buckets.
+// Nodes are moved one at a time, each in front of the ones moved before it,
+// so a walk still on an old chain ends. Old tables are never freed, lockless
+// walks may still be reading them.
+struct dentry_table {
+	size_t mask;
+	struct vfs_node **buckets;
+};
+
+static struct vfs_node *dentry_initial_buckets[DENTRY_HASH_MIN] = {0};
+static struct dentry_table dentry_initial = {
+	.mask = DENTRY_HASH_MIN - 1, .buckets = dentry_initial_buckets};
+static struct dentry_table *dentry_table = &dentry_initial;
+static size_t dentry_count = 0;
+
+// Negative nodes, reused in clock order once there are DENTRY_NEGATIVE_MAX of
+// them. Lookups that hit one mark it referenced so it gets another round, a
+// slot whose node became a real one is free.
+static struct vfs_node *dentry_negatives[DENTRY_NEGATIVE_MAX] = {0};
+static size_t dentry_negative_hand = 0;
+
+// FNV-1a
+static uint32_t name_hash(const char *name, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct vfs_node **dentry_bucket(struct dentry_table *table,
+									   struct vfs_node *dir, uint32_t hash) {
+	uint64_t key = ((uintptr_t)dir >> 4) * 0x9E3779B97F4A7C15 ^ hash;
+	return &table->buckets[(key ^ (key >> 32)) & table->mask];
+}
+
+static struct vfs_node *dentry_find(struct vfs_node *dir, const char *name,
+									size_t len, uint32_t hash) {
+	struct dentry_table *table =
+		__atomic_load_n(&dentry_table, __ATOMIC_ACQUIRE);
+	for (struct vfs_node *node = load_node(dentry_bucket(table, dir, hash));
+		 node; node = load_node(&node->hash_next)) {
+		if (node->parent == dir && node->name_hash == hash &&
+			node->name_len == len && !memcmp(node->name, name, len))
+			return node;
+	}
+	return NULL;
+}
+
+// The caller holds the write side of vfs_lock, as for everything changing
+// the hash below
+static void dentry_grow(void) {
+	struct dentry_table *old = dentry_table;
+	size_t size = (old->mask + 1) * 2;
+	struct dentry_table *new =
+		alloc(sizeof(struct dentry_table) + size * sizeof(struct vfs_node *));
+	if (new == NULL)
+		return;
+	new->mask = size - 1;
+	new->buckets = (void *)(new + 1);
+
+	for (size_t i = 0; i <= old->mask; i++) {
+		for (struct vfs_node *node = old->buckets[i], *next; node;
+			 node = next) {
+			next = node->hash_next;
+			struct vfs_node **bucket =
+				dentry_bucket(new, node->parent, node->name_hash);
+			publish_node(&node->hash_next, *bucket);
+			*bucket = node;
+		}
+	}
+
+	__atomic_store_n(&dentry_table, new, __ATOMIC_RELEASE);
+}
+
+static void dentry_add(struct vfs_node *dir, struct vfs_node *node) {
+	node->parent = dir;
+	node->name_len = strlen(node->name);
+	node->name_hash = name_hash(node->name, node->name_len);
+
+	struct vfs_node **bucket =
+		dentry_bucket(dentry_table, dir, node->name_hash);
+	node->hash_next = *bucket;
+	publish_node(bucket, node);
+
+	if (++dentry_count > 2 * (dentry_table->mask + 1))
+		dentry_grow();
+}
+
+static void dentry_remove(struct vfs_node *node) {
+	struct vfs_node **link =
+		dentry_bucket(dentry_table, node->parent, node->name_hash);
+	while (*link != node)
+		link = &(*link)->hash_next;
+	publish_node(link, node->hash_next);
+	dentry_count--;
+}
+
+// Advance the clock hand to a slot that's free or holds a negative node that
+// wasn't hit since the hand last passed it
+static struct vfs_node **dentry_negative_slot(void) {
+	for (;;) {
+		struct vfs_node **slot = &dentry_negatives[dentry_negative_hand];
+		dentry_negative_hand = (dentry_negative_hand + 1) % DENTRY_NEGATIVE_MAX;
+		struct vfs_node *node = *slot;
+		if (node == NULL || !node->negative ||
+			!__atomic_exchange_n(&node->referenced, false, __ATOMIC_RELAXED))
+			return slot;
+	}
+}
+
+// A reused node stays negative throughout. Lockless walks that meet it while
+// it's renamed may match it wrongly, they check vfs_lock before trusting a
+// miss.
+static void dentry_add_negative(struct vfs_node *dir, const char *name,
+								size_t len) {
+	if (len >= NAME_MAX)
+		return;
+
+	struct vfs_node **slot = dentry_negative_slot();
+	struct vfs_node *node = *slot;
+	if (node != NULL && node->negative) {
+		dentry_remove(node);
+	} else {
+		node = slab_alloc(&vfs_node_cache);
+		node->negative = true;
+	}
 
-	if (*_path == 0)
+	memcpy(node->name, name, len);
+	node->name[len] = 0;
+	node->referenced = false;
+	dentry_add(dir, node);
+	*slot = node;
+}
+
+// Link a node for name into dir, reusing its negative node if there is one.
+// The caller holds the write side of vfs_lock and checked that it's missing.
+static struct vfs_node *add_node(struct vfs_node *dir, const char *name,
+								 size_t len, struct vfs_node *negative) {
+	if (len >= NAME_MAX)
 		return NULL;
 
-	char *path = kmalloc(strlen(_path) + 1);
-	strcpy(path, _path);
+	struct vfs_node *node = negative;
+	if (node == NULL) {
+		node = slab_alloc(&vfs_node_cache);
+		memcpy(node->name, name, len);
+		node->name[len] = 0;
+	}
+
+	if (dir->child == NULL)
+		dir->last_child = node;
+	node->next = dir->child;
+	node->fs = dir->fs;
+	node->mount_data = dir->mount_data;
+	node->backing_dev_id = dir->backing_dev_id;
+	node->parent = dir;
 
-	// Get rid of trailing slashes
-	for (ssize_t i = strlen(path) - 1; i > 0; i--) {
-		if (path[i] == '/')
-			path[i] = 0;
-		else
-			break;
+	publish_node(&dir->child, node);
+
+	if (negative != NULL) {
+		__atomic_store_n(&node->negative, false, __ATOMIC_RELEASE);
+	} else {
+		dentry_add(dir, node);
 	}
 
-	struct vfs_node *cur_parent =
-		*path == '/' || parent == NULL ? &root_node : parent;
-	if (cur_parent->mount_gate)
-		cur_parent = cur_parent->mount_gate;
-	struct vfs_node *cur_node = cur_parent->child;
+	return node;
+}
 
-	while (*path == '/') {
-		path++;
-		if (!*path)
-			return &root_node;
+// Append the next entries the filesystem has for dir, or mark it populated
+// when there are none. Returns whether entries were added, the caller holds
+// the write side of vfs_lock.
+static bool populate_more(struct vfs_node *dir) {
+	if (dir->populated)
+		return false;
+
+	struct vfs_node *entries = dir->fs->populate(dir, &dir->populate_cursor);
+	if (entries == NULL) {
+		__atomic_store_n(&dir->populated, true, __ATOMIC_RELEASE);
+		return false;
 	}
 
-next:;
-	char *elem = path;
-	while (*path != 0) {
-		if (*path == '/') {
-			if (*(path + 1) == '/') {
-				path++;
-				continue;
-			} else {
-				break;
-			}
-		}
-		path++;
+	struct vfs_node *last = entries;
+	for (struct vfs_node *node = entries; node; node = node->next) {
+		node->fs = dir->fs;
+		node->mount_data = dir->mount_data;
+		node->backing_dev_id = dir->backing_dev_id;
+		dentry_add(dir, node);
+		last = node;
 	}
-	if (*path == '/')
-		*path++ = 0;
-	else /* path == 0 */
-		last = true;
 
-	if (cur_node == NULL)
-		goto epilogue;
+	publish_node(dir->last_child ? &dir->last_child->next : &dir->child,
+				 entries);
+	dir->last_child = last;
+	return true;
+}
 
-	for (;;) {
-		if (strcmp(cur_node->name, elem)) {
-			if (cur_node->next == NULL)
-				break;
-			cur_node = cur_node->next;
-			continue;
-		}
+static void make_dir(struct vfs_node *node, struct resource *parent_res,
+					 mode_t mode) {
+	// A new directory has nothing on the filesystem's side to populate
+	node->populated = true;
 
-		if (last) {
-			return cur_node;
-		}
+	// Lockless walks fall back to the lock until the resource is published
+	struct resource *res = node->fs->mkdir(node, mode);
+	__atomic_store_n(&node->res, res, __ATOMIC_RELEASE);
 
-		if (!S_ISDIR(cur_node->res->st.st_mode)) {
-			// errno = ENOTDIR;
-			return NULL;
-		}
+	struct vfs_node *dot = add_node(node, ".", 1, NULL);
+	__atomic_store_n(&dot->res, res, __ATOMIC_RELEASE);
+
+	struct vfs_node *dotdot = add_node(node, "..", 2, NULL);
+	__atomic_store_n(&dotdot->res, parent_res, __ATOMIC_RELEASE);
+}
 
-		if (cur_node->mount_gate != NULL)
-			cur_node = cur_node->mount_gate;
+// Walk a path from parent without copying it, components are slices of the
+// caller's string. With lockless NULL the caller holds the write side of
+// vfs_lock and the walk may populate directories and create nodes, mode is
+// used for the directories it makes. Else the walk doesn't change anything and
+// sets *lockless to WALK_BLOCKED when it would need to or meets a node that
+// isn't set up yet, or to WALK_NEGATIVE when it missed on a negative node.
+enum { WALK_OK = 0, WALK_BLOCKED, WALK_NEGATIVE };
+
+static struct vfs_node *path2node(struct vfs_node *parent, const char *path,
+								  int create, mode_t mode, int *lockless) {
+	TRACEPOINT(TRACE_PATH2NODE, parent, lockless != NULL);
+	if (path == NULL)
+		return NULL;
+
+	if (*path == 0)
+		return NULL;
 
-		if (cur_node->child == NULL) {
-			cur_node->child = cur_node->fs->populate(cur_node);
-			if (cur_node->child == NULL) {
-				// errno = ENOTDIR;
+	struct vfs_node *dir = *path == '/' || parent == NULL ? &root_node : parent;
+	// What `..` of a directory made here refers to, mount gates have none
+	struct resource *dir_res = __atomic_load_n(&dir->res, __ATOMIC_ACQUIRE);
+	if (load_node(&dir->mount_gate))
+		dir = load_node(&dir->mount_gate);
+
+	while (*path == '/')
+		path++;
+	if (*path == 0)
+		return &root_node;
+
+	for (;;) {
+		const char *elem = path;
+		size_t len = 0;
+		while (elem[len] != 0 && elem[len] != '/')
+			len++;
+
+		// Trailing and repeated slashes are skipped
+		path = elem + len;
+		while (*path == '/')
+			path++;
+		bool last = *path == 0;
+
+		uint32_t hash = name_hash(elem, len);
+		struct vfs_node *cur_node = dentry_find(dir, elem, len, hash);
+		// The entry may be further on in a directory that's read in part,
+		// negative nodes are only made once it's populated
+		if (cur_node == NULL &&
+			!__atomic_load_n(&dir->populated, __ATOMIC_ACQUIRE)) {
+			if (lockless) {
+				*lockless = WALK_BLOCKED;
 				return NULL;
 			}
+			while (cur_node == NULL && populate_more(dir))
+				cur_node = dentry_find(dir, elem, len, hash);
 		}
+		bool negative = cur_node != NULL &&
+						__atomic_load_n(&cur_node->negative, __ATOMIC_ACQUIRE);
+		if (negative &&
+			!__atomic_load_n(&cur_node->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&cur_node->referenced, true, __ATOMIC_RELAXED);
+
+		if (cur_node == NULL || negative) {
+			if (lockless) {
+				if (negative)
+					*lockless = WALK_NEGATIVE;
+				return NULL;
+			}
 
-		cur_parent = cur_node;
-		cur_node = cur_node->child;
-		goto next;
-	}
+			if (!create) {
+				if (!negative)
+					dentry_add_negative(dir, elem, len);
+				// if (last)
+				//     errno = ENOENT;
+				// else
+				//     errno = ENOTDIR;
+				return NULL;
+			}
+
+			if (!last && !(create & CREATE_DEEP))
+				return NULL;
 
-epilogue:
-	if (create) {
-		if (last) {
-			return vfs_new_node(cur_parent, elem);
-		} else {
-			if (create == CREATE_SHALLOW)
+			cur_node = add_node(dir, elem, len, cur_node);
+			if (cur_node == NULL)
 				return NULL;
-			cur_parent = vfs_mkdir(cur_parent, elem, 0755, false);
-			goto next;
+
+			if (!last || (create & CREATE_DIR))
+				make_dir(cur_node, dir_res, last ? mode : 0755);
+
+			if (last)
+				return cur_node;
+		} else if (last) {
+			return create & CREATE_EXCL ? NULL : cur_node;
+		}
+
+		struct resource *res =
+			__atomic_load_n(&cur_node->res, __ATOMIC_ACQUIRE);
+		if (res == NULL && lockless) {
+			*lockless = WALK_BLOCKED;
+			return NULL;
 		}
+
+		if (res == NULL || !S_ISDIR(res->st.st_mode)) {
+			// errno = ENOTDIR;
+			return NULL;
+		}
+
+		if (load_node(&cur_node->mount_gate) != NULL)
+			cur_node = load_node(&cur_node->mount_gate);
+
+		dir = cur_node;
+		dir_res = res;
 	}
+}
 
-	// if (last)
-	//     errno = ENOENT;
-	// else
-	//     errno = ENOTDIR;
-	return NULL;
+// Look a path up without taking vfs_lock. Real nodes are never removed so a
+// hit stays valid. A miss only counts if no writer ran meanwhile, since
+// writers move nodes between hash tables and reuse negative nodes.
+static struct vfs_node *vfs_lookup(struct vfs_node *parent, const char *path) {
+	unsigned seq = seq_read_begin(&vfs_lock);
+	int state = WALK_OK;
+
+	struct vfs_node *node = path2node(parent, path, NO_CREATE, 0, &state);
+	if (node != NULL ||
+		(state != WALK_BLOCKED && !seq_read_retry(&vfs_lock, seq)))
+		return node;
+
+	SEQ_WRITE_LOCK(vfs_lock);
+	node = path2node(parent, path, NO_CREATE, 0, NULL);
+	SEQ_WRITE_UNLOCK(vfs_lock);
+	return node;
 }
 
 static struct filesystem *fstype2fs(const char *fstype) {
-	for (size_t i = 0; i < filesystems.length; i++) {
-		if (!strcmp(filesystems.storage[i]->name, fstype))
-			return filesystems.storage[i];
-	}
-
-	return NULL;
+	return hashmap_get_str(&filesystems_by_name, fstype);
 }
 
 bool vfs_mount(const char *source, const char *target, const char *fstype) {
 	struct filesystem *fs = fstype2fs(fstype);
-	if (fs == NULL)
+	if (fs == NULL) {
+		printf("vfs: Unknown filesystem `%s`, installed:", fstype);
+		struct filesystem *installed;
+		LIST_FOR_EACH(installed, &filesystems, link)
+			printf(" %s", installed->name);
+		printf("\n");
 		return false;
+	}
 
-	struct vfs_node *tgt_node = path2node(NULL, target, NO_CREATE);
+	struct vfs_node *tgt_node = vfs_lookup(NULL, target);
 	if (tgt_node == NULL)
 		return false;
 
@@ -250,13 +531,13 @@ bool vfs_mount(const char *source, const char *target, const char *fstype) {
 	dev_t backing_dev_id;
 	struct resource *src_handle = NULL;
 	if (fs->needs_backing_device) {
-		struct vfs_node *backing_dev_node = path2node(NULL, source, NO_CREATE);
+		struct vfs_node *backing_dev_node = vfs_lookup(NULL, source);
 		if (backing_dev_node == NULL)
 			return false;
 		if (!S_ISCHR(backing_dev_node->res->st.st_mode) &&
 			!S_ISBLK(backing_dev_node->res->st.st_mode))
 			return false;
-		struct resource *src_handle = vfs_open(source, O_RDWR, 0);
+		src_handle = vfs_open(source, O_RDWR, 0);
 		if (src_handle == NULL)
 			return false;
 		backing_dev_id = backing_dev_node->res->st.st_rdev;
@@ -272,7 +553,9 @@ bool vfs_mount(const char *source, const char *target, const char *fstype) {
 
 	mount_gate->backing_dev_id = backing_dev_id;
 
-	tgt_node->mount_gate = mount_gate;
+	SEQ_WRITE_LOCK(vfs_lock);
+	publish_node(&tgt_node->mount_gate, mount_gate);
+	SEQ_WRITE_UNLOCK(vfs_lock);
 
 	printf("vfs: Mounted `%s` on `%s`, type: `%s`.\n", source, target, fstype);
 
@@ -281,96 +564,66 @@ bool vfs_mount(const char *source, const char *target, const char *fstype) {
 
 struct vfs_node *vfs_mkdir(struct vfs_node *parent, const char *name,
 						   mode_t mode, bool recurse) {
-	if (parent == NULL)
-		parent = &root_node;
-
-	struct vfs_node *new_dir = path2node(parent, name, NO_CREATE);
-
-	if (new_dir != NULL)
-		return NULL;
-
-	new_dir = path2node(parent, name, recurse ? CREATE_DEEP : CREATE_SHALLOW);
-
-	if (new_dir == NULL)
-		return NULL;
-
-	new_dir->res = new_dir->fs->mkdir(new_dir, mode);
+	int create = CREATE_EXCL | CREATE_DIR;
+	create |= recurse ? CREATE_DEEP : CREATE_SHALLOW;
 
-	struct vfs_node *dot = vfs_new_node(new_dir, ".");
-	dot->child = new_dir;
-	dot->res = new_dir->res;
-
-	struct vfs_node *dotdot = vfs_new_node(new_dir, "..");
-	dotdot->child = parent;
-	dotdot->res = parent->res;
-
-	return new_dir;
+	SEQ_WRITE_LOCK(vfs_lock);
+	struct vfs_node *ret = path2node(parent, name, create, mode, NULL);
+	SEQ_WRITE_UNLOCK(vfs_lock);
+	return ret;
 }
 
 struct vfs_node *vfs_new_node(struct vfs_node *parent, const char *name) {
-	if (parent == NULL)
-		parent = &root_node;
-
-	if (parent->mount_gate)
-		parent = parent->mount_gate;
-
-	struct vfs_node *new_node = path2node(parent, name, NO_CREATE);
-
-	if (new_node != NULL)
-		return NULL;
-
-	new_node = kmalloc(sizeof(struct vfs_node));
-
-	new_node->next = parent->child;
-	parent->child = new_node;
-
-	strcpy(new_node->name, name);
-	new_node->fs = parent->fs;
-	new_node->mount_data = parent->mount_data;
-	new_node->backing_dev_id = parent->backing_dev_id;
-	new_node->parent = parent;
-
-	return new_node;
+	SEQ_WRITE_LOCK(vfs_lock);
+	struct vfs_node *ret =
+		path2node(parent, name, CREATE_SHALLOW | CREATE_EXCL, 0, NULL);
+	SEQ_WRITE_UNLOCK(vfs_lock);
+	return ret;
 }
 
 struct vfs_node *vfs_new_node_deep(struct vfs_node *parent, const char *name) {
-	struct vfs_node *new_node = path2node(parent, name, NO_CREATE);
-
-	if (new_node != NULL)
-		return NULL;
-
-	new_node = path2node(parent, name, CREATE_DEEP);
-
-	return new_node;
+	SEQ_WRITE_LOCK(vfs_lock);
+	struct vfs_node *ret =
+		path2node(parent, name, CREATE_DEEP | CREATE_EXCL, 0, NULL);
+	SEQ_WRITE_UNLOCK(vfs_lock);
+	return ret;
 }
 
 struct resource *vfs_open(const char *path, int oflags, mode_t mode) {
-	LOCK(vfs_lock);
-
+	TRACEPOINT(TRACE_VFS_OPEN, oflags, mode);
 	bool create = oflags & O_CREAT;
-	struct vfs_node *path_node =
-		path2node(NULL, path, create ? CREATE_SHALLOW : NO_CREATE);
-	if (path_node == NULL) {
-		UNLOCK(vfs_lock);
-		return NULL;
+	struct resource *res = NULL;
+
+	// Opening a node that was opened before doesn't change the tree
+	if (!create) {
+		struct vfs_node *path_node = vfs_lookup(NULL, path);
+		if (path_node == NULL)
+			return NULL;
+		res = __atomic_load_n(&path_node->res, __ATOMIC_ACQUIRE);
 	}
 
-	if (path_node->res == NULL)
-		path_node->res = path_node->fs->open(path_node, create, mode);
+	if (res == NULL) {
+		SEQ_WRITE_LOCK(vfs_lock);
 
-	if (path_node->res == NULL) {
-		UNLOCK(vfs_lock);
-		return NULL;
-	}
+		struct vfs_node *path_node = path2node(
+			NULL, path, create ? CREATE_SHALLOW : NO_CREATE, 0, NULL);
+		if (path_node != NULL && path_node->res == NULL)
+			__atomic_store_n(&path_node->res,
+							 path_node->fs->open(path_node, create, mode),
+							 __ATOMIC_RELEASE);
+		if (path_node != NULL)
+			res = path_node->res;
 
-	struct resource *res = path_node->res;
+		SEQ_WRITE_UNLOCK(vfs_lock);
+
+		if (res == NULL)
+			return NULL;
+	}
 
 	LOCK(res->lock);
 	res->refcount++;
 	UNLOCK(res->lock);
 
-	UNLOCK(vfs_lock);
-
 	return res;
 }
 
@@ -389,18 +642,65 @@ void vfs_dump_nodes(struct vfs_node *node, const char *parent) {
 	}
 }
 
-bool vfs_stat(const char *path, struct stat *st) {
-	LOCK(vfs_lock);
+bool vfs_opendir(const char *path, struct vfs_dir *dir) {
+	struct vfs_node *node = vfs_lookup(NULL, path);
+	if (node == NULL)
+		return false;
 
-	struct vfs_node *node = path2node(NULL, path, NO_CREATE);
+	struct resource *res = __atomic_load_n(&node->res, __ATOMIC_ACQUIRE);
+	if (res == NULL || !S_ISDIR(res->st.st_mode)) {
+		// errno = ENOTDIR;
+		return false;
+	}
+
+	if (load_node(&node->mount_gate))
+		node = load_node(&node->mount_gate);
+
+	*dir = (struct vfs_dir){.dir = node, .last = NULL, .off = 0};
+	return true;
+}
+
+// Listing a populated directory only follows the child list. At the end of a
+// directory that isn't, the next entries are read from the filesystem and
+// appended after the last one listed.
+bool vfs_readdir(struct vfs_dir *dir, struct dirent *ent) {
+	struct vfs_node **link = dir->last ? &dir->last->next : &dir->dir->child;
+	struct vfs_node *node;
+
+	while ((node = load_node(link)) == NULL) {
+		if (__atomic_load_n(&dir->dir->populated, __ATOMIC_ACQUIRE))
+			return false;
+		SEQ_WRITE_LOCK(vfs_lock);
+		if (load_node(link) == NULL)
+			populate_more(dir->dir);
+		SEQ_WRITE_UNLOCK(vfs_lock);
+	}
+
+	struct resource *res = __atomic_load_n(&node->res, __ATOMIC_ACQUIRE);
+	ent->d_ino = res ? res->st.st_ino : 0;
+	ent->d_off = ++dir->off;
+	ent->d_reclen = sizeof(struct dirent);
+	ent->d_type = res ? IFTODT(res->st.st_mode) : DT_UNKNOWN;
+	memcpy(ent->d_name, node->name, node->name_len);
+	ent->d_name[node->name_len] = 0;
+
+	dir->last = node;
+	return true;
+}
+
+bool vfs_stat(const char *path, struct stat *st) {
+	struct vfs_node *node = vfs_lookup(NULL, path);
 	if (node == NULL) {
 		// errno = ENOENT;
-		UNLOCK(vfs_lock);
 		return false;
 	}
 
-	*st = node->res->st;
+	struct resource *res = __atomic_load_n(&node->res, __ATOMIC_ACQUIRE);
+	if (res == NULL)
+		return false;
 
-	UNLOCK(vfs_lock);
+	LOCK(res->lock);
+	*st = res->st;
+	UNLOCK(res->lock);
 	return true;
 }
@@ -18,20 +18,32 @@
 #define VFS_H
 
 #include "../klibc/alloc.h"
+#include "../klibc/list.h"
 #include "../klibc/lock.h"
 #include "../klibc/resource.h"
 #include "../klibc/types.h"
+#include "../mm/slab.h"
 #include <stdbool.h>
+#include <stdint.h>
 
-extern lock_t vfs_lock;
+// Writers changing the node tree take the write side, lookups are lockless.
+// Nodes are never freed and are published fully initialized.
+extern seqlock_t vfs_lock;
+extern struct slab_cache vfs_node_cache;
 
 struct filesystem {
 	const char *name;
+	// The device is handed to mount, reads and writes of it should go through
+	// mm/pagecache.h
 	bool needs_backing_device;
 	struct vfs_node *(*mount)(struct resource *device);
-	struct vfs_node *(*populate)(struct vfs_node *node);
+	// Read the next entries of a directory from where *cursor, 0 at first,
+	// says and move it on. They're returned as new nodes linked by next, NULL
+	// means the end was reached and the directory isn't populated again.
+	struct vfs_node *(*populate)(struct vfs_node *node, uint64_t *cursor);
 	struct resource *(*open)(struct vfs_node *node, bool new_node, mode_t mode);
 	struct resource *(*mkdir)(struct vfs_node *node, mode_t mode);
+	struct list_node link;
 };
 
 #define VFS_ROOT_INODE ((ino_t)0xffffffffffffffff)
@@ -46,6 +58,27 @@ struct vfs_node {
 	struct vfs_node *parent;
 	struct vfs_node *child;
 	struct vfs_node *next;
+	// Dentry hash, see vfs.c
+	struct vfs_node *hash_next;
+	uint32_t name_hash;
+	uint16_t name_len;
+	bool negative;
+	// Negative nodes hit since the reuse clock last passed them
+	bool referenced;
+	// Set on directories once all their entries are in the child list. Until
+	// then populate_cursor is where the filesystem left off and last_child,
+	// the first node added, stays at the end of the list.
+	bool populated;
+	uint64_t populate_cursor;
+	struct vfs_node *last_child;
+};
+
+// Position in a directory listing. Entries created while listing may be left
+// out, none is returned twice.
+struct vfs_dir {
+	struct vfs_node *dir;
+	struct vfs_node *last;
+	off_t off;
 };
 
 struct vfs_node *vfs_new_node(struct vfs_node *parent, const char *name);
@@ -58,5 +91,8 @@ struct vfs_node *vfs_mkdir(struct vfs_node *parent, const char *name,
 						   mode_t mode, bool recurse);
 struct resource *vfs_open(const char *path, int oflags, mode_t mode);
 bool vfs_stat(const char *path, struct stat *st);
+bool vfs_opendir(const char *path, struct vfs_dir *dir);
+// Fill ent with the next entry, false at the end of the directory
+bool vfs_readdir(struct vfs_dir *dir, struct dirent *ent);
 
 #endif
@@ -0,0 +1,569 @@
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.h"
+#include "../cpu/cpu.h"
+#include "../cpu/pmu.h"
+#include "../fs/vfs.h"
+#include "../klibc/alloc.h"
+#include "../klibc/math.h"
+#include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
+#include <liballoc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every processor keeps a latency sample of one in BENCH_SAMPLE_STRIDE ops
+#define BENCH_OPS 4096
+#define BENCH_BATCH 64
+#define BENCH_SAMPLE_STRIDE 4
+#define BENCH_SAMPLES (BENCH_OPS * 2 / BENCH_SAMPLE_STRIDE)
+#define BENCH_RING 256
+
+// The VFS benchmarks look up paths in a tree of BENCH_TREE_FANOUT^3 files and
+// move BENCH_IO_BYTES per processor through each tmpfs file
+#define BENCH_TREE_FANOUT 16
+#define BENCH_DEEP_DEPTH 64
+#define BENCH_IO_BYTES (16 * 1024 * 1024)
+#define BENCH_IO_CHUNK ((size_t)65536)
+#define BENCH_IO_BLOCK ((size_t)4096)
+
+struct bench_cpu {
+	uint64_t rng;
+	size_t ops;
+	size_t sample_count;
+	uint64_t samples[BENCH_SAMPLES];
+	// Producer/consumer ring, filled by this CPU and emptied by the next one
+	void *ring[BENCH_RING];
+	size_t head;
+	size_t tail;
+	// What the run cost in the events pmu_start() could count
+	struct pmu_counters pmu;
+	// Bytes read or written, for the throughput benchmarks
+	uint64_t bytes;
+	uint8_t *buf;
+};
+
+struct bench {
+	const char *name;
+	void (*func)(struct bench_cpu *cpu, size_t arg);
+	size_t arg;
+};
+
+static struct bench_cpu *bench_cpus;
+static uint64_t tsc_per_us;
+static size_t start_barrier;
+
+static struct vfs_node *bench_wide_dir;
+static struct vfs_node *bench_deep_dir;
+
+static uint64_t bench_rand(struct bench_cpu *cpu) {
+	cpu->rng ^= cpu->rng << 13;
+	cpu->rng ^= cpu->rng >> 7;
+	cpu->rng ^= cpu->rng << 17;
+	return cpu->rng;
+}
+
+static inline void bench_record(struct bench_cpu *cpu, uint64_t start) {
+	uint64_t cycles = rdtsc() - start;
+	if (cpu->ops++ % BENCH_SAMPLE_STRIDE == 0 &&
+		cpu->sample_count < BENCH_SAMPLES)
+		cpu->samples[cpu->sample_count++] = cycles;
+}
+
+static void bench_kmalloc_sweep(struct bench_cpu *cpu, size_t size) {
+	void *ptrs[BENCH_BATCH];
+
+	for (size_t round = 0; round < BENCH_OPS / BENCH_BATCH; round++) {
+		for (size_t i = 0; i < BENCH_BATCH; i++) {
+			uint64_t start = rdtsc();
+			ptrs[i] = kmalloc(size);
+			bench_record(cpu, start);
+		}
+		for (size_t i = 0; i < BENCH_BATCH; i++) {
+			uint64_t start = rdtsc();
+			kfree(ptrs[i]);
+			bench_record(cpu, start);
+		}
+	}
+}
+
+// Every CPU allocates into its own ring and frees what the previous CPU put in
+// its ring, so most frees are cross-CPU
+static void bench_kmalloc_remote(struct bench_cpu *cpu, size_t size) {
+	size_t self = this_cpu()->cpu_number;
+	struct bench_cpu *prev =
+		&bench_cpus[(self + cpu_count - 1) % cpu_count];
+
+	for (size_t i = 0; i < BENCH_OPS; i++) {
+		size_t head = __atomic_load_n(&cpu->head, __ATOMIC_RELAXED);
+		if (head - __atomic_load_n(&cpu->tail, __ATOMIC_ACQUIRE) <
+			BENCH_RING) {
+			uint64_t start = rdtsc();
+			cpu->ring[head % BENCH_RING] = kmalloc(size);
+			bench_record(cpu, start);
+			__atomic_store_n(&cpu->head, head + 1, __ATOMIC_RELEASE);
+		}
+
+		// Each ring has a single consumer, the next CPU
+		size_t tail = __atomic_load_n(&prev->tail, __ATOMIC_RELAXED);
+		if (tail != __atomic_load_n(&prev->head, __ATOMIC_ACQUIRE)) {
+			void *ptr = prev->ring[tail % BENCH_RING];
+			__atomic_store_n(&prev->tail, tail + 1, __ATOMIC_RELEASE);
+			uint64_t start = rdtsc();
+			kfree(ptr);
+			bench_record(cpu, start);
+		}
+	}
+}
+
+static void bench_krealloc_growth(struct bench_cpu *cpu, size_t max) {
+	for (size_t round = 0; round < BENCH_OPS / 16; round++) {
+		void *ptr = NULL;
+		for (size_t size = 16; size <= max; size *= 2) {
+			uint64_t start = rdtsc();
+			ptr = krealloc(ptr, size);
+			bench_record(cpu, start);
+		}
+		kfree(ptr);
+	}
+}
+
+static void bench_realloc_pages(struct bench_cpu *cpu, size_t max_pages) {
+	for (size_t round = 0; round < BENCH_OPS / 32; round++) {
+		void *ptr = NULL;
+		for (size_t pages = 1; pages <= max_pages; pages++) {
+			uint64_t start = rdtsc();
+			ptr = realloc(ptr, pages * PAGE_SIZE);
+			bench_record(cpu, start);
+		}
+		free(ptr);
+	}
+}
+
+static void bench_page_storm(struct bench_cpu *cpu, size_t max_pages) {
+	void *ptrs[BENCH_BATCH];
+	size_t counts[BENCH_BATCH];
+
+	for (size_t round = 0; round < BENCH_OPS / BENCH_BATCH; round++) {
+		for (size_t i = 0; i < BENCH_BATCH; i++) {
+			counts[i] = 1 + bench_rand(cpu) % max_pages;
+			uint64_t start = rdtsc();
+			ptrs[i] = pmm_alloc(counts[i]);
+			bench_record(cpu, start);
+		}
+		for (size_t i = 0; i < BENCH_BATCH; i++) {
+			if (ptrs[i] == NULL)
+				continue;
+			uint64_t start = rdtsc();
+			pmm_free(ptrs[i], counts[i]);
+			bench_record(cpu, start);
+		}
+	}
+}
+
+// All processors make their directories next to each other in one directory
+static void bench_vfs_mkdir_wide(struct bench_cpu *cpu, size_t count) {
+	size_t self = this_cpu()->cpu_number;
+	char name[32];
+
+	for (size_t i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "c%zu-%zu", self, i);
+		uint64_t start = rdtsc();
+		struct vfs_node *node = vfs_mkdir(bench_wide_dir, name, 0755, false);
+		bench_record(cpu, start);
+		if (node == NULL)
+			break;
+	}
+}
+
+// Chains of nested directories, BENCH_DEEP_DEPTH levels each
+static void bench_vfs_mkdir_deep(struct bench_cpu *cpu, size_t chains) {
+	size_t self = this_cpu()->cpu_number;
+	char name[32];
+
+	for (size_t i = 0; i < chains; i++) {
+		snprintf(name, sizeof(name), "c%zu-%zu", self, i);
+		struct vfs_node *node = bench_deep_dir;
+		for (size_t depth = 0; depth < BENCH_DEEP_DEPTH && node; depth++) {
+			uint64_t start = rdtsc();
+			node = vfs_mkdir(node, depth ? "d" : name, 0755, false);
+			bench_record(cpu, start);
+		}
+	}
+}
+
+static void bench_tree_path(char *buf, size_t size, uint64_t r,
+							const char *leaf) {
+	snprintf(buf, size, "/bench/tree/a%u/b%u/%s%u",
+			 (unsigned)(r % BENCH_TREE_FANOUT),
+			 (unsigned)(r / BENCH_TREE_FANOUT % BENCH_TREE_FANOUT), leaf,
+			 (unsigned)(r / (BENCH_TREE_FANOUT * BENCH_TREE_FANOUT) %
+						BENCH_TREE_FANOUT));
+}
+
+static void bench_vfs_open(struct bench_cpu *cpu, size_t arg) {
+	(void)arg;
+	char path[64];
+
+	for (size_t i = 0; i < BENCH_OPS; i++) {
+		bench_tree_path(path, sizeof(path), bench_rand(cpu), "f");
+		uint64_t start = rdtsc();
+		struct resource *res = vfs_open(path, O_RDONLY, 0);
+		if (res != NULL)
+			res->close(res);
+		bench_record(cpu, start);
+	}
+}
+
+// Stat files of the tree, or names next to them that don't exist
+static void bench_vfs_stat(struct bench_cpu *cpu, size_t miss) {
+	char path[64];
+	struct stat st;
+
+	for (size_t i = 0; i < BENCH_OPS; i++) {
+		bench_tree_path(path, sizeof(path), bench_rand(cpu), miss ? "x" : "f");
+		uint64_t start = rdtsc();
+		vfs_stat(path, &st);
+		bench_record(cpu, start);
+	}
+}
+
+// List a directory of the tree, each entry is an op. The entry goes in the
+// I/O buffer, it's too large for the stack.
+static void bench_vfs_readdir(struct bench_cpu *cpu, size_t arg) {
+	(void)arg;
+	struct dirent *ent = (void *)cpu->buf;
+	struct vfs_dir dir;
+	char path[64];
+
+	for (size_t i = 0; i < BENCH_OPS / BENCH_TREE_FANOUT; i++) {
+		uint64_t r = bench_rand(cpu);
+		snprintf(path, sizeof(path), "/bench/tree/a%u/b%u",
+				 (unsigned)(r % BENCH_TREE_FANOUT),
+				 (unsigned)(r / BENCH_TREE_FANOUT % BENCH_TREE_FANOUT));
+		if (!vfs_opendir(path, &dir))
+			continue;
+		for (;;) {
+			uint64_t start = rdtsc();
+			bool more = vfs_readdir(&dir, ent);
+			bench_record(cpu, start);
+			if (!more)
+				break;
+		}
+	}
+}
+
+// Every processor works on a file of its own, filled up front for reading
+static struct resource *bench_io_open(struct bench_cpu *cpu, size_t size) {
+	char path[48];
+	snprintf(path, sizeof(path), "/bench/io/c%zu-%zu",
+			 (size_t)this_cpu()->cpu_number, size);
+
+	struct resource *res = vfs_open(path, O_RDWR | O_CREAT, 0644);
+	if (res == NULL)
+		return NULL;
+
+	for (size_t off = res->st.st_size; off < size; off += BENCH_IO_CHUNK)
+		res->write(res, cpu->buf, off, MIN(size - off, BENCH_IO_CHUNK));
+	return res;
+}
+
+static void bench_tmpfs_io(struct bench_cpu *cpu, size_t size, bool write,
+						   bool random) {
+	struct resource *res = bench_io_open(cpu, size);
+	if (res == NULL)
+		return;
+
+	size_t chunk = MIN(size, random ? BENCH_IO_BLOCK : BENCH_IO_CHUNK);
+	off_t off = 0;
+
+	for (size_t done = 0; done < BENCH_IO_BYTES; done += chunk) {
+		if (random)
+			off = bench_rand(cpu) % (size / chunk) * chunk;
+		uint64_t start = rdtsc();
+		ssize_t ret = write ? res->write(res, cpu->buf, off, chunk)
+							: res->read(res, cpu->buf, off, chunk);
+		bench_record(cpu, start);
+		if (ret > 0)
+			cpu->bytes += ret;
+		off = (off + chunk) % size;
+	}
+
+	res->close(res);
+}
+
+static void bench_tmpfs_seq_read(struct bench_cpu *cpu, size_t size) {
+	bench_tmpfs_io(cpu, size, false, false);
+}
+
+static void bench_tmpfs_seq_write(struct bench_cpu *cpu, size_t size) {
+	bench_tmpfs_io(cpu, size, true, false);
+}
+
+static void bench_tmpfs_rand_read(struct bench_cpu *cpu, size_t size) {
+	bench_tmpfs_io(cpu, size, false, true);
+}
+
+static void bench_tmpfs_rand_write(struct bench_cpu *cpu, size_t size) {
+	bench_tmpfs_io(cpu, size, true, true);
+}
+
+static void bench_cpu_run(void *arg) {
+	struct bench *bench = arg;
+	struct bench_cpu *cpu = &bench_cpus[this_cpu()->cpu_number];
+
+	// Start all processors together so they actually contend
+	__atomic_sub_fetch(&start_barrier, 1, __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(&start_barrier, __ATOMIC_ACQUIRE))
+		asm volatile("pause");
+
+	struct pmu_counters before, after;
+	pmu_start(PMU_ALL);
+	pmu_read(&before);
+	bench->func(cpu, bench->arg);
+	pmu_read(&after);
+	pmu_stop();
+	pmu_diff(&cpu->pmu, &before, &after);
+}
+
+// Shell sort, the samples are too many for insertion sort and there is no
+// qsort in the kernel
+static void sort_samples(uint64_t *samples, size_t count) {
+	static const size_t gaps[] = {1750, 701, 301, 132, 57, 23, 10, 4, 1};
+
+	for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+		size_t gap = gaps[g];
+		for (size_t i = gap; i < count; i++) {
+			uint64_t value = samples[i];
+			size_t j = i;
+			for (; j >= gap && samples[j - gap] > value; j -= gap)
+				samples[j] = samples[j - gap];
+			samples[j] = value;
+		}
+	}
+}
+
+static inline uint64_t cycles_to_ns(uint64_t cycles) {
+	return cycles * 1000 / tsc_per_us;
+}
+
+static void bench_run(struct bench *bench, uint64_t *all_samples) {
+	size_t cpus = cpu_count;
+
+	for (size_t i = 0; i < cpus; i++) {
+		bench_cpus[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+		bench_cpus[i].ops = 0;
+		bench_cpus[i].sample_count = 0;
+		bench_cpus[i].bytes = 0;
+		bench_cpus[i].head = bench_cpus[i].tail = 0;
+	}
+
+	start_barrier = cpus;
+	uint64_t start = rdtsc();
+	smp_call_all(bench_cpu_run, bench);
+	uint64_t elapsed = rdtsc() - start;
+
+	// Whatever is left in the producer/consumer rings
+	for (size_t i = 0; i < cpus; i++)
+		for (size_t t = bench_cpus[i].tail; t != bench_cpus[i].head; t++)
+			kfree(bench_cpus[i].ring[t % BENCH_RING]);
+
+	size_t ops = 0, count = 0;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < cpus; i++) {
+		ops += bench_cpus[i].ops;
+		bytes += bench_cpus[i].bytes;
+		for (size_t j = 0; j < bench_cpus[i].sample_count; j++)
+			all_samples[count++] = bench_cpus[i].samples[j];
+	}
+
+	if (count == 0)
+		return;
+
+	sort_samples(all_samples, count);
+
+	uint64_t us = elapsed / tsc_per_us;
+	printf("bench: %-24s %3zu CPUs %10llu ops/s  p50 %6llu ns  p90 %6llu ns  "
+		   "p99 %7llu ns  max %8llu ns\n",
+		   bench->name, cpus, us ? (uint64_t)ops * 1000000 / us : 0,
+		   cycles_to_ns(all_samples[count / 2]),
+		   cycles_to_ns(all_samples[count * 9 / 10]),
+		   cycles_to_ns(all_samples[count * 99 / 100]),
+		   cycles_to_ns(all_samples[count - 1]));
+
+	// Throughput in hundredths of a MB/s
+	if (bytes && us) {
+		uint64_t rate = bytes / 10000 * 1000000 / us;
+		printf("bench: %-24s %llu.%02llu MB/s\n", "", rate / 100, rate % 100);
+	}
+
+	// Hardware events per operation, in hundredths
+	char line[160];
+	size_t len = 0;
+	for (int e = 0; e < PMU_EVENT_COUNT && ops; e++) {
+		uint64_t total = 0;
+		for (size_t i = 0; i < cpus; i++)
+			total += bench_cpus[i].pmu.values[e];
+		if (total == 0)
+			continue;
+		uint64_t per_op = total * 100 / ops;
+		len += snprintf(line + len, sizeof(line) - len, "  %llu.%02llu %s",
+						per_op / 100, per_op % 100, pmu_event_name(e));
+		if (len >= sizeof(line))
+			break;
+	}
+	if (len)
+		printf("bench: %-24s per op:%s\n", "", line);
+}
+
+static struct bench alloc_benches[] = {
+	{"kmalloc 16", bench_kmalloc_sweep, 16},
+	{"kmalloc 64", bench_kmalloc_sweep, 64},
+	{"kmalloc 256", bench_kmalloc_sweep, 256},
+	{"kmalloc 1024", bench_kmalloc_sweep, 1024},
+	{"kmalloc 4096", bench_kmalloc_sweep, 4096},
+	{"kmalloc 16384", bench_kmalloc_sweep, 16384},
+	{"kmalloc remote free 64", bench_kmalloc_remote, 64},
+	{"kmalloc remote free 1024", bench_kmalloc_remote, 1024},
+	{"krealloc 16 to 64K", bench_krealloc_growth, 65536},
+	{"realloc 1 to 32 pages", bench_realloc_pages, 32},
+	{"pmm single pages", bench_page_storm, 1},
+	{"pmm 1 to 16 pages", bench_page_storm, 16},
+};
+
+static struct bench vfs_benches[] = {
+	{"vfs_mkdir wide", bench_vfs_mkdir_wide, BENCH_OPS / 4},
+	{"vfs_mkdir deep", bench_vfs_mkdir_deep, BENCH_OPS / 4 / BENCH_DEEP_DEPTH},
+	{"vfs_open", bench_vfs_open, 0},
+	{"vfs_stat", bench_vfs_stat, false},
+	{"vfs_stat missing", bench_vfs_stat, true},
+	{"vfs_readdir", bench_vfs_readdir, 0},
+	{"tmpfs seq write 4K", bench_tmpfs_seq_write, 4096},
+	{"tmpfs seq read 4K", bench_tmpfs_seq_read, 4096},
+	{"tmpfs seq write 64K", bench_tmpfs_seq_write, 65536},
+	{"tmpfs seq read 64K", bench_tmpfs_seq_read, 65536},
+	{"tmpfs seq write 1M", bench_tmpfs_seq_write, 1048576},
+	{"tmpfs seq read 1M", bench_tmpfs_seq_read, 1048576},
+	{"tmpfs rand write 64K", bench_tmpfs_rand_write, 65536},
+	{"tmpfs rand read 64K", bench_tmpfs_rand_read, 65536},
+	{"tmpfs rand write 1M", bench_tmpfs_rand_write, 1048576},
+	{"tmpfs rand read 1M", bench_tmpfs_rand_read, 1048576},
+};
+
+static uint64_t *bench_setup(void) {
+	tsc_per_us = cpu_tsc_frequency / 1000000;
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+
+	bench_cpus = alloc(sizeof(struct bench_cpu) * cpu_count);
+	uint64_t *all_samples = alloc(sizeof(uint64_t) * BENCH_SAMPLES * cpu_count);
+	if (bench_cpus == NULL || all_samples == NULL) {
+		printf("bench: Out of memory\n");
+		free(all_samples);
+		free(bench_cpus);
+		return NULL;
+	}
+
+	printf("bench: TSC runs at %llu MHz\n", tsc_per_us);
+	return all_samples;
+}
+
+static void bench_teardown(uint64_t *all_samples) {
+	free(all_samples);
+	free(bench_cpus);
+}
+
+void alloc_bench(void) {
+	uint64_t *all_samples = bench_setup();
+	if (all_samples == NULL)
+		return;
+
+	for (size_t i = 0; i < sizeof(alloc_benches) / sizeof(alloc_benches[0]);
+		 i++)
+		bench_run(&alloc_benches[i], all_samples);
+
+	for (size_t i = 0; i < cpu_count; i++) {
+		struct alloc_arena_stats stats;
+		struct pmm_cache_stats pcache;
+		alloc_get_arena_stats(i, &stats);
+		pmm_get_cache_stats(i, &pcache);
+		printf("bench: CPU %zu kmalloc %zu bytes in use, %zu fragmented, "
+			   "%zu remote frees, %zu contended; page cache %zu hits, %zu "
+			   "misses\n",
+			   i, stats.inuse, stats.fragmented, stats.remote_frees,
+			   stats.contention, pcache.hits, pcache.misses);
+	}
+
+	bench_teardown(all_samples);
+}
+
+// Builds the tree the lookup benchmarks pick paths from. The path picks and
+// offsets come from the per-CPU generators, which bench_run() seeds the same
+// way every time, so runs on the same machine are reproducible.
+static bool bench_vfs_tree(void) {
+	bench_wide_dir = vfs_mkdir(NULL, "/bench/wide", 0755, true);
+	bench_deep_dir = vfs_mkdir(NULL, "/bench/deep", 0755, true);
+	if (bench_wide_dir == NULL || bench_deep_dir == NULL ||
+		vfs_mkdir(NULL, "/bench/io", 0755, false) == NULL)
+		return false;
+
+	char path[64];
+	for (size_t i = 0; i < BENCH_TREE_FANOUT * BENCH_TREE_FANOUT; i++) {
+		snprintf(path, sizeof(path), "/bench/tree/a%zu/b%zu",
+				 i % BENCH_TREE_FANOUT, i / BENCH_TREE_FANOUT);
+		if (vfs_mkdir(NULL, path, 0755, true) == NULL)
+			return false;
+	}
+
+	for (size_t i = 0; i < BENCH_TREE_FANOUT * BENCH_TREE_FANOUT *
+							   BENCH_TREE_FANOUT;
+		 i++) {
+		bench_tree_path(path, sizeof(path), i, "f");
+		struct resource *res = vfs_open(path, O_WRONLY | O_CREAT, 0644);
+		if (res == NULL)
+			return false;
+		res->close(res);
+	}
+	return true;
+}
+
+void vfs_bench(void) {
+	uint64_t *all_samples = bench_setup();
+	if (all_samples == NULL)
+		return;
+
+	bool ok = bench_vfs_tree();
+	for (size_t i = 0; i < cpu_count && ok; i++) {
+		bench_cpus[i].buf = alloc(BENCH_IO_CHUNK);
+		ok = bench_cpus[i].buf != NULL;
+	}
+
+	if (ok) {
+		for (size_t i = 0; i < sizeof(vfs_benches) / sizeof(vfs_benches[0]);
+			 i++)
+			bench_run(&vfs_benches[i], all_samples);
+	} else {
+		printf("bench: Can't set up the tree under /bench\n");
+	}
+
+	for (size_t i = 0; i < cpu_count; i++)
+		free(bench_cpus[i].buf);
+	bench_teardown(all_samples);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "boottrace.h"
+#include "../cpu/cpu.h"
+#include "../klibc/math.h"
+#include "../klibc/printf.h"
+#include "../serial/serial.h"
+
+struct boot_event {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	uint32_t cpu;
+};
+
+static struct boot_event boot_events[BOOT_EVENTS_MAX];
+static size_t boot_event_count = 0;
+
+// Until cpu_init() sets up GS everything runs on the BSP
+static uint32_t boot_cpu(void) {
+	if (rdmsr(0xC0000101) == 0) // IA32_GS_BASE
+		return 0;
+	return this_cpu_read(cpu_number);
+}
+
+static size_t boot_event_new(const char *name, uint64_t start) {
+	size_t event = __atomic_fetch_add(&boot_event_count, 1, __ATOMIC_RELAXED);
+	if (event >= BOOT_EVENTS_MAX)
+		return SIZE_MAX;
+
+	boot_events[event] = (struct boot_event){
+		.name = name, .start = start, .cpu = boot_cpu()};
+	return event;
+}
+
+size_t boot_phase_begin(const char *name) {
+	return boot_event_new(name, rdtsc());
+}
+
+void boot_phase_end(size_t event) {
+	if (event != SIZE_MAX)
+		__atomic_store_n(&boot_events[event].end, rdtsc(), __ATOMIC_RELEASE);
+}
+
+void boot_event_add(const char *name, uint64_t start, uint64_t end) {
+	size_t event = boot_event_new(name, start);
+	if (event != SIZE_MAX)
+		__atomic_store_n(&boot_events[event].end, end, __ATOMIC_RELEASE);
+}
+
+static uint64_t cycles_to_ns(uint64_t cycles) {
+	return (unsigned __int128)cycles * 1000000000 / cpu_tsc_frequency;
+}
+
+static void serial_out(char c, void *arg) {
+	(void)arg;
+	write_serial_char(c);
+}
+
+static void boot_timeline_json(size_t count, uint64_t base) {
+	bool first = true;
+	fctprintf(serial_out, NULL, "{\"traceEvents\":[");
+	for (size_t i = 0; i < count; i++) {
+		struct boot_event *e = &boot_events[i];
+		if (__atomic_load_n(&e->end, __ATOMIC_ACQUIRE) == 0)
+			continue;
+		uint64_t ts = cycles_to_ns(e->start - base);
+		uint64_t dur = cycles_to_ns(e->end - e->start);
+		fctprintf(serial_out, NULL,
+				  "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+				  "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+				  first ? "" : ",", e->name, e->cpu, ts / 1000, ts % 1000,
+				  dur / 1000, dur % 1000);
+		first = false;
+	}
+	fctprintf(serial_out, NULL, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+void boot_timeline_dump(bool json) {
+	size_t count = __atomic_load_n(&boot_event_count, __ATOMIC_ACQUIRE);
+	count = MIN(count, (size_t)BOOT_EVENTS_MAX);
+	if (count == 0 || cpu_tsc_frequency == 0)
+		return;
+
+	// Phases still running are left out
+	size_t order[BOOT_EVENTS_MAX];
+	size_t done = 0;
+	uint64_t base = UINT64_MAX, last = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct boot_event *e = &boot_events[i];
+		if (__atomic_load_n(&e->end, __ATOMIC_ACQUIRE) == 0)
+			continue;
+		base = MIN(base, e->start);
+		last = MAX(last, e->end);
+
+		// Insertion sort, longest first
+		size_t j = done++;
+		for (; j > 0; j--) {
+			struct boot_event *prev = &boot_events[order[j - 1]];
+			if (prev->end - prev->start >= e->end - e->start)
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	if (done == 0)
+		return;
+
+	uint64_t total = MAX(last - base, (uint64_t)1);
+	printf("boot: %zu phases over %llu us\n", done, cycles_to_ns(total) / 1000);
+	printf("boot: %-20s %4s %10s %10s %6s\n", "phase", "cpu", "start us",
+		   "took us", "%");
+	for (size_t i = 0; i < done; i++) {
+		struct boot_event *e = &boot_events[order[i]];
+		uint64_t took = e->end - e->start;
+		printf("boot: %-20s %4u %10llu %10llu %5llu%%\n", e->name, e->cpu,
+			   cycles_to_ns(e->start - base) / 1000, cycles_to_ns(took) / 1000,
+			   took * 100 / total);
+	}
+	if (count < __atomic_load_n(&boot_event_count, __ATOMIC_RELAXED))
+		printf("boot: %zu phases didn't fit\n",
+			   boot_event_count - BOOT_EVENTS_MAX);
+
+	if (json)
+		boot_timeline_json(count, base);
+}
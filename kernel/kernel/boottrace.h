@@ -0,0 +1,44 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BOOTTRACE_H
+#define BOOTTRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Boot phases are timed with the TSC from the first line of _start() on. The
+// frequency isn't known until acpi_init(), so cycles are only turned into
+// time when the timeline is printed.
+#define BOOT_EVENTS_MAX 256
+
+size_t boot_phase_begin(const char *name);
+void boot_phase_end(size_t event);
+// For phases that start before the per-CPU area is set up
+void boot_event_add(const char *name, uint64_t start, uint64_t end);
+// A breakdown sorted by duration, and with json a Chrome trace of every phase
+// written straight to the serial port
+void boot_timeline_dump(bool json);
+
+#define BOOT_PHASE(NAME, CALL)                       \
+	do {                                             \
+		size_t boot_event_ = boot_phase_begin(NAME); \
+		CALL;                                        \
+		boot_phase_end(boot_event_);                 \
+	} while (0)
+
+#endif
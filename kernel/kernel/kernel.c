@@ -17,24 +17,46 @@
  */
 
 #include "../acpi/acpi.h"
+#include "../cpu/alternative.h"
 #include "../cpu/apic.h"
 #include "../cpu/cpu.h"
+#include "../cpu/idle.h"
+#include "../cpu/irq.h"
+#include "../cpu/irqstat.h"
 #include "../cpu/isr.h"
 #include "../cpu/pic.h"
+#include "../cpu/pmu.h"
+#include "../cpu/softirq.h"
+#include "../dev/ahci.h"
+#include "../dev/ide.h"
 #include "../dev/initramfs.h"
+#include "../dev/nvme.h"
 #include "../fs/devtmpfs.h"
 #include "../fs/tmpfs.h"
 #include "../fs/vfs.h"
-#include "../dev/ide.h"
+#include "../klibc/lockstat.h"
+#include "../klibc/log.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "../klibc/rand.h"
 #include "../klibc/resource.h"
+#include "../klibc/string.h"
+#include "../klibc/trace.h"
+#include "../mm/pagecache.h"
 #include "../mm/pmm.h"
+#include "../mm/tlb.h"
 #include "../mm/vmm.h"
+#include "../sched/sched.h"
+#include "../sched/workqueue.h"
 #include "../serial/serial.h"
 #include "../sys/clock.h"
 #include "../sys/gdt.h"
-#include "../sys/hpet.h"
+#include "../sys/timer.h"
 #include "../video/video.h"
+#include "bench.h"
+#include "boottrace.h"
+#include "ksym.h"
+#include "profile.h"
 #include <liballoc.h>
 #include <stdint.h>
 #include <stivale2.h>
@@ -73,31 +95,116 @@ void *stivale2_get_tag(struct stivale2_struct *stivale2_struct, uint64_t id) {
 	}
 }
 
+static struct stivale2_struct_tag_modules *modules_tag = NULL;
+
+static void vfs_init(void) {
+	vfs_install_fs(&tmpfs);
+	vfs_install_fs(&devtmpfs);
+	vfs_mount("tmpfs", "/", "tmpfs");
+	vfs_mkdir(NULL, "/dev", 0755, true);
+	vfs_mount("devtmpfs", "/dev", "devtmpfs");
+}
+
+static void initramfs_load(void) {
+	initramfs_init(modules_tag);
+}
+
+// Probe steps that don't wait on each other run in parallel on all
+// processors, drivers register their devices with devtmpfs whether it's
+// mounted yet or not. Drivers configured out aren't built.
+static struct work_task acpi_task = {.name = "acpi",
+									 .func = acpi_namespace_init};
+#if CONFIG_IDE
+static struct work_task ide_task = {.name = "ide", .func = ide_init};
+#endif
+#if CONFIG_AHCI
+static struct work_task ahci_task = {.name = "ahci", .func = ahci_init};
+#endif
+#if CONFIG_NVME
+static struct work_task nvme_task = {.name = "nvme", .func = nvme_init};
+#endif
+static struct work_task vfs_task = {.name = "vfs", .func = vfs_init};
+static struct work_task initramfs_task = {
+	.name = "initramfs", .func = initramfs_load, .deps = {&vfs_task}};
+
+static struct work_task *boot_tasks[] = {&acpi_task,
+#if CONFIG_IDE
+										 &ide_task,
+#endif
+#if CONFIG_AHCI
+										 &ahci_task,
+#endif
+#if CONFIG_NVME
+										 &nvme_task,
+#endif
+										 &vfs_task, &initramfs_task};
+
+static void boot_probe(void) {
+	work_run_graph(boot_tasks, sizeof(boot_tasks) / sizeof(*boot_tasks));
+}
+
+// Check whether word appears as a whole word on the kernel command line
+static bool cmdline_has(struct stivale2_struct *stivale2_struct,
+						const char *word) {
+	struct stivale2_struct_tag_cmdline *cmdline_tag =
+		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_CMDLINE_ID);
+	if (cmdline_tag == NULL)
+		return false;
+
+	size_t len = strlen(word);
+	for (const char *arg = (const char *)cmdline_tag->cmdline; *arg;) {
+		const char *end = strchrnul(arg, ' ');
+		if ((size_t)(end - arg) == len && !strncmp(arg, word, len))
+			return true;
+		arg = *end ? end + 1 : end;
+	}
+
+	return false;
+}
+
 void _start(struct stivale2_struct *stivale2_struct) {
-	gdt_init();
+	BOOT_PHASE("mem", mem_init());
+	BOOT_PHASE("gdt", gdt_init());
 	struct stivale2_struct_tag_framebuffer *fb_str_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
-	video_init(fb_str_tag);
-	cpu_init();
+	BOOT_PHASE("video", video_init(fb_str_tag));
+	BOOT_PHASE("cpu", cpu_init(0));
+	rand_init();
+	pmu_init();
+	BOOT_PHASE("alternatives", alternatives_apply());
 	struct stivale2_struct_tag_memmap *memmap_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MEMMAP_ID);
-	pmm_init((void *)memmap_tag->memmap, memmap_tag->entries);
+	BOOT_PHASE("pmm",
+			   pmm_init((void *)memmap_tag->memmap, memmap_tag->entries));
 	struct stivale2_struct_tag_pmrs *pmrs_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_PMRS_ID);
-	vmm_init((void *)memmap_tag->memmap, memmap_tag->entries,
-			 (void *)pmrs_tag->pmrs, pmrs_tag->entries);
-	serial_install();
+	BOOT_PHASE("vmm", vmm_init((void *)memmap_tag->memmap, memmap_tag->entries,
+							   (void *)pmrs_tag->pmrs, pmrs_tag->entries));
+	struct stivale2_struct_tag_kernel_file *kernel_file_tag =
+		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_KERNEL_FILE_ID);
+	if (kernel_file_tag != NULL)
+		BOOT_PHASE("ksym", ksym_init((void *)kernel_file_tag->kernel_file));
+	BOOT_PHASE("pagecache", pagecache_init());
+	BOOT_PHASE("video_shadow", video_shadow_init());
+	BOOT_PHASE("serial_install", serial_install());
 	printf("Kernel build: %s\n", KVERSION);
-	isr_install();
+	BOOT_PHASE("tss", cpu_init_tss());
+	BOOT_PHASE("isr", isr_install());
+	BOOT_PHASE("tlb", tlb_init());
 	asm volatile("sti");
 	struct stivale2_struct_tag_rsdp *rsdp_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_RSDP_ID);
-	acpi_init((void *)rsdp_tag->rsdp);
-	pic_init();
-	apic_init();
+	BOOT_PHASE("acpi_tables", acpi_init((void *)rsdp_tag->rsdp));
+	BOOT_PHASE("pic", pic_init());
+	BOOT_PHASE("apic", apic_init());
+	BOOT_PHASE("serial", serial_init());
+	BOOT_PHASE("timer", timer_init());
+	BOOT_PHASE("idle", idle_init());
+	BOOT_PHASE("sched", sched_init());
+	BOOT_PHASE("log", log_init());
 	struct stivale2_struct_tag_smp *smp_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_SMP_ID);
-	smp_init(smp_tag);
+	BOOT_PHASE("smp_start", smp_init(smp_tag));
 	printf("Hello World!\n");
 	printf("A (4 bytes): %p\n", kmalloc(4));
 	void *ptr = kmalloc(8);
@@ -112,25 +219,50 @@ void _start(struct stivale2_struct *stivale2_struct) {
 	printf("D (32 bytes after C realloc): %p\n", ptr3);
 	printf("E (4 int calloc): %p\n", kcalloc(4, sizeof(int)));
 	printf("%llu\n", get_unix_timestamp());
-	hpet_usleep(1000 * 1000);
-	printf("%llu\n", get_unix_timestamp());
-	printf("HPET test works!\n");
-	ide_init();
-	vfs_install_fs(&tmpfs);
-	vfs_install_fs(&devtmpfs);
-	vfs_mount("tmpfs", "/", "tmpfs");
-	vfs_mkdir(NULL, "/dev", 0755, true);
-	vfs_mount("devtmpfs", "/dev", "devtmpfs");
-	struct stivale2_struct_tag_modules *modules_tag =
+	uint64_t sleep_start = clock_monotonic_ns();
+	timer_usleep(10000);
+	printf("Timer test: 10 ms sleep took %llu us\n",
+		   (clock_monotonic_ns() - sleep_start) / 1000);
+	BOOT_PHASE("smp_wait", smp_wait());
+	BOOT_PHASE("workqueue", workqueue_init());
+	trace_init();
+	if (cmdline_has(stivale2_struct, "trace"))
+		trace_enable(TRACE_ALL);
+	if (cmdline_has(stivale2_struct, "allocbench"))
+		alloc_bench();
+	modules_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MODULES_ID);
-	initramfs_init(modules_tag);
+	bool profile = cmdline_has(stivale2_struct, "profile");
+	if (profile)
+		profile_start(1000);
+	BOOT_PHASE("probe", boot_probe());
+	if (profile) {
+		profile_stop();
+		profile_dump();
+	}
+	if (cmdline_has(stivale2_struct, "vfsbench"))
+		vfs_bench();
+	if (cmdline_has(stivale2_struct, "irqbalance"))
+		irq_balance();
+	BOOT_PHASE("fbdev", video_dev_init());
+	BOOT_PHASE("lockstat", lockstat_init());
+	BOOT_PHASE("irqstat",
+			   irqstat_init(cmdline_has(stivale2_struct, "irqhist")));
+	if (cmdline_has(stivale2_struct, "boottime") ||
+		cmdline_has(stivale2_struct, "boottrace"))
+		boot_timeline_dump(cmdline_has(stivale2_struct, "boottrace"));
 	struct resource *h = vfs_open("/root/initramfs.txt", O_RDWR, 0644);
-	if (h == NULL)
-		return;
-	char buf[30] = {0};
-	h->read(h, buf, 0, strlen("Hello initramfs"));
-	printf("reading initramfs.txt: %s\n", buf);
+	if (h != NULL) {
+		char buf[30] = {0};
+		h->read(h, buf, 0, strlen("Hello initramfs"));
+		printf("reading initramfs.txt: %s\n", buf);
+	}
 	vfs_dump_nodes(NULL, "");
-	for (;;)
-		asm("hlt");
+	if (cmdline_has(stivale2_struct, "lockstat"))
+		lockstat_dump();
+	if (cmdline_has(stivale2_struct, "irqstat"))
+		irqstat_dump();
+	if (cmdline_has(stivale2_struct, "trace"))
+		trace_dump();
+	thread_exit();
 }
\ No newline at end of file
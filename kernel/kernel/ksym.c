@@ -0,0 +1,144 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ksym.h"
+#include "../klibc/mem.h"
+#include "../klibc/printf.h"
+#include "../klibc/string.h"
+#include <liballoc.h>
+#include <stdbool.h>
+
+struct elf64_header {
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint64_t entry;
+	uint64_t phoff;
+	uint64_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+};
+
+struct elf64_section {
+	uint32_t name;
+	uint32_t type;
+	uint64_t flags;
+	uint64_t addr;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t link;
+	uint32_t info;
+	uint64_t addralign;
+	uint64_t entsize;
+};
+
+struct elf64_symbol {
+	uint32_t name;
+	uint8_t info;
+	uint8_t other;
+	uint16_t shndx;
+	uint64_t value;
+	uint64_t size;
+};
+
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+
+static struct ksym *ksyms = NULL;
+static size_t ksym_count = 0;
+
+static void ksym_sort(void) {
+	// Shell sort, the table is only sorted once
+	static const size_t gaps[] = {701, 301, 132, 57, 23, 10, 4, 1};
+	for (size_t g = 0; g < sizeof(gaps) / sizeof(*gaps); g++) {
+		size_t gap = gaps[g];
+		for (size_t i = gap; i < ksym_count; i++) {
+			struct ksym sym = ksyms[i];
+			size_t j = i;
+			for (; j >= gap && ksyms[j - gap].addr > sym.addr; j -= gap)
+				ksyms[j] = ksyms[j - gap];
+			ksyms[j] = sym;
+		}
+	}
+}
+
+void ksym_init(void *elf) {
+	struct elf64_header *header = elf;
+	if (elf == NULL || memcmp(header->ident, "\x7F" "ELF", 4))
+		return;
+
+	struct elf64_section *sections = elf + header->shoff;
+	struct elf64_section *symtab = NULL;
+	for (size_t i = 0; i < header->shnum; i++)
+		if (sections[i].type == SHT_SYMTAB)
+			symtab = &sections[i];
+	if (symtab == NULL || symtab->link >= header->shnum) {
+		printf("ksym: The kernel has no symbol table\n");
+		return;
+	}
+
+	struct elf64_symbol *syms = elf + symtab->offset;
+	const char *strtab = elf + sections[symtab->link].offset;
+	size_t count = symtab->size / sizeof(struct elf64_symbol);
+
+	ksyms = kmalloc(count * sizeof(struct ksym));
+	if (ksyms == NULL)
+		return;
+
+	// The kernel may be loaded away from its link address, the distance is
+	// taken from this very function
+	uintptr_t slide = 0;
+	for (size_t i = 0; i < count; i++) {
+		if ((syms[i].info & 0xF) != STT_FUNC || syms[i].value == 0)
+			continue;
+		const char *name = strtab + syms[i].name;
+		if (!strcmp(name, "ksym_init"))
+			slide = (uintptr_t)ksym_init - syms[i].value;
+		ksyms[ksym_count++] = (struct ksym){
+			.addr = syms[i].value, .size = syms[i].size, .name = name};
+	}
+	for (size_t i = 0; i < ksym_count; i++)
+		ksyms[i].addr += slide;
+
+	ksym_sort();
+	printf("ksym: %zu function symbols\n", ksym_count);
+}
+
+const struct ksym *ksym_find(uintptr_t addr) {
+	// The last symbol starting at or below addr
+	size_t lo = 0, hi = ksym_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ksyms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	const struct ksym *sym = &ksyms[lo - 1];
+	// Size 0 symbols come from assembly, they reach up to the next one
+	if (sym->size && addr >= sym->addr + sym->size)
+		return NULL;
+	return sym;
+}
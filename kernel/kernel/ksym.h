@@ -0,0 +1,36 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KSYM_H
+#define KSYM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Function symbols of the kernel, sorted by address
+struct ksym {
+	uintptr_t addr;
+	uint64_t size;
+	const char *name;
+};
+
+// Read the symbol table of the kernel ELF the bootloader passed along, it
+// stays loaded with the kernel. Needs kmalloc.
+void ksym_init(void *elf);
+// The function addr is in, NULL if it isn't in any or there are no symbols
+const struct ksym *ksym_find(uintptr_t addr);
+
+#endif
@@ -16,6 +16,7 @@
  */
 
 #include "panic.h"
+#include "../klibc/log.h"
 #include "../klibc/printf.h"
 #include "../serial/serial.h"
 #include "../video/video.h"
@@ -24,6 +25,7 @@ __attribute__((noreturn)) void panic(const char *message, char *file,
 									 bool assert, size_t line) {
 	const void *rip = __builtin_return_address(0);
 	const void *rbp = __builtin_frame_address(0);
+	log_panic();
 	if (assert) {
 		clear_screen(0x00B800);
 		printf("*** ASSERTION FAILURE: %s\nFile: %s\nLine: %zu\nRIP: "
@@ -35,6 +37,7 @@ __attribute__((noreturn)) void panic(const char *message, char *file,
 			   "0x%p\nKernel Build: %s\n",
 			   message, file, line, rip, rbp, KVERSION);
 	}
+	serial_flush();
 	for (;;)
 		asm("cli\nhlt");
 }
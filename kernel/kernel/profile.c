@@ -0,0 +1,172 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profile.h"
+#include "../cpu/apic.h"
+#include "../cpu/cpu.h"
+#include "../klibc/alloc.h"
+#include "../klibc/hashmap.h"
+#include "../klibc/printf.h"
+#include "../sys/timer.h"
+#include "ksym.h"
+#include <liballoc.h>
+#include <stdbool.h>
+
+// The LAPIC timer hands every interrupt it takes to the sampler, which keeps
+// one per period. The periodic timer only makes sure there is one.
+struct profile_cpu {
+	uint64_t *samples;
+	size_t count;
+	size_t lost;
+	uint64_t next;
+	struct timer timer;
+};
+
+static struct profile_cpu profile_cpus[MAX_CPUS];
+static uint64_t profile_period_ns;
+static uint64_t profile_period_tsc;
+static bool profile_running = false;
+
+static void profile_sample(registers_t *r) {
+	struct profile_cpu *pc = &profile_cpus[this_cpu_read(cpu_number)];
+	uint64_t now = rdtsc();
+	if (pc->samples == NULL || now < pc->next)
+		return;
+
+	// The timer may fire a bit early, which mustn't skip a period
+	pc->next = now + profile_period_tsc - profile_period_tsc / 8;
+	if (pc->count < PROFILE_SAMPLES)
+		pc->samples[pc->count++] = r->rip;
+	else
+		pc->lost++;
+}
+
+static void profile_tick(void *arg) {
+	struct profile_cpu *pc = arg;
+	if (__atomic_load_n(&profile_running, __ATOMIC_ACQUIRE))
+		timer_add(&pc->timer, profile_period_ns);
+}
+
+static void profile_cpu_start(void *arg) {
+	(void)arg;
+	struct profile_cpu *pc = &profile_cpus[this_cpu_read(cpu_number)];
+	pc->timer = (struct timer)TIMER_INIT(profile_tick, pc);
+	timer_add(&pc->timer, profile_period_ns);
+}
+
+static void profile_cpu_stop(void *arg) {
+	(void)arg;
+	timer_cancel(&profile_cpus[this_cpu_read(cpu_number)].timer);
+}
+
+void profile_start(uint64_t hz) {
+	if (profile_running || hz == 0 || cpu_tsc_frequency == 0)
+		return;
+
+	for (size_t i = 0; i < cpu_count; i++) {
+		struct profile_cpu *pc = &profile_cpus[i];
+		if (pc->samples == NULL)
+			pc->samples = alloc(PROFILE_SAMPLES * sizeof(uint64_t));
+		pc->count = 0;
+		pc->lost = 0;
+		pc->next = 0;
+	}
+	profile_period_ns = 1000000000 / hz;
+	profile_period_tsc = cpu_tsc_frequency / hz;
+
+	__atomic_store_n(&profile_running, true, __ATOMIC_RELEASE);
+	lapic_timer_set_sampler(profile_sample);
+	smp_call_all(profile_cpu_start, NULL);
+	printf("profile: Sampling at %llu Hz\n", hz);
+}
+
+void profile_stop(void) {
+	if (!profile_running)
+		return;
+
+	__atomic_store_n(&profile_running, false, __ATOMIC_RELEASE);
+	smp_call_all(profile_cpu_stop, NULL);
+	lapic_timer_set_sampler(NULL);
+}
+
+struct profile_entry {
+	const struct ksym *sym;
+	size_t count;
+};
+
+void profile_dump(void) {
+	// Samples per function, counted in the map's values
+	struct hashmap counts = HASHMAP_INIT;
+	size_t total = 0, unknown = 0, lost = 0, cpus = 0;
+
+	for (size_t i = 0; i < MAX_CPUS; i++) {
+		struct profile_cpu *pc = &profile_cpus[i];
+		if (pc->samples == NULL)
+			continue;
+		cpus++;
+		lost += pc->lost;
+		for (size_t j = 0; j < pc->count; j++) {
+			const struct ksym *sym = ksym_find(pc->samples[j]);
+			total++;
+			if (sym == NULL) {
+				unknown++;
+				continue;
+			}
+			uintptr_t n = (uintptr_t)hashmap_get(&counts, (uintptr_t)sym);
+			hashmap_put(&counts, (uintptr_t)sym, (void *)(n + 1));
+		}
+	}
+
+	printf("profile: %zu samples on %zu processors, %zu lost\n", total, cpus,
+		   lost);
+	if (total == 0) {
+		hashmap_del(&counts);
+		return;
+	}
+
+	struct profile_entry *entries =
+		kmalloc((counts.length + 1) * sizeof(struct profile_entry));
+	if (entries == NULL) {
+		hashmap_del(&counts);
+		return;
+	}
+
+	// Insertion sort, most samples first
+	size_t length = 0;
+	struct hashmap_entry *e;
+	HASHMAP_FOR_EACH(&counts, e) {
+		struct profile_entry entry = {.sym = (void *)(uintptr_t)e->key,
+									  .count = (uintptr_t)e->value};
+		size_t j = length++;
+		for (; j > 0 && entries[j - 1].count < entry.count; j--)
+			entries[j] = entries[j - 1];
+		entries[j] = entry;
+	}
+	hashmap_del(&counts);
+
+	for (size_t i = 0; i < length && i < PROFILE_TOP; i++) {
+		size_t permille = entries[i].count * 1000 / total;
+		printf("profile: %3zu.%zu%% %8zu %s\n", permille / 10, permille % 10,
+			   entries[i].count, entries[i].sym->name);
+	}
+	if (unknown) {
+		size_t permille = unknown * 1000 / total;
+		printf("profile: %3zu.%zu%% %8zu [unknown]\n", permille / 10,
+			   permille % 10, unknown);
+	}
+
+	kfree(entries);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+// Samples kept per processor, later ones are counted as lost
+#define PROFILE_SAMPLES 16384
+// Functions listed by profile_dump()
+#define PROFILE_TOP 40
+
+// Sample the interrupted instruction on every processor hz times a second.
+// Code running with interrupts disabled is seen where it enables them again.
+void profile_start(uint64_t hz);
+void profile_stop(void);
+// Print the functions the samples fell in, most frequent first
+void profile_dump(void);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "aio.h"
+#include "../cpu/cpu.h"
+#include "../mm/slab.h"
+#include "../sched/sched.h"
+#include "math.h"
+#include "mem.h"
+#include <liballoc.h>
+
+static struct slab_cache aio_req_cache =
+	SLAB_CACHE_INIT("aio_req", struct aio_req, NULL);
+
+struct aio_ring *aio_ring_create(size_t entries) {
+	size_t size = 1;
+	while (size < entries)
+		size <<= 1;
+
+	struct aio_ring *ring = kmalloc(sizeof(struct aio_ring));
+	if (ring == NULL)
+		return NULL;
+	*ring = (struct aio_ring){0};
+	ring->sq_entries = size;
+	ring->cq_entries = size * 2;
+	ring->sqes = kmalloc(sizeof(struct aio_sqe) * ring->sq_entries);
+	ring->cqes = kmalloc(sizeof(struct aio_cqe) * ring->cq_entries);
+	if (ring->sqes == NULL || ring->cqes == NULL) {
+		aio_ring_destroy(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void aio_ring_destroy(struct aio_ring *ring) {
+	kfree(ring->sqes);
+	kfree(ring->cqes);
+	kfree(ring);
+}
+
+struct aio_sqe *aio_get_sqe(struct aio_ring *ring) {
+	size_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+	size_t tail = ring->sq_tail;
+	if (tail - head == ring->sq_entries)
+		return NULL;
+
+	struct aio_sqe *sqe = &ring->sqes[tail & (ring->sq_entries - 1)];
+	*sqe = (struct aio_sqe){0};
+	__atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+size_t aio_submit(struct aio_ring *ring) {
+	size_t head = ring->sq_head;
+	size_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+	size_t submitted = 0;
+
+	while (head != tail &&
+		   __atomic_load_n(&ring->in_flight, __ATOMIC_RELAXED) <
+			   ring->cq_entries) {
+		// Left queued for the next submit when out of memory
+		struct aio_req *req = slab_alloc(&aio_req_cache);
+		if (req == NULL)
+			break;
+		req->sqe = ring->sqes[head & (ring->sq_entries - 1)];
+		req->ring = ring;
+		req->private = NULL;
+
+		// The entry is copied, so the submitter can reuse it right away
+		__atomic_store_n(&ring->sq_head, ++head, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&ring->in_flight, 1, __ATOMIC_RELAXED);
+		submitted++;
+
+		struct resource *res = req->sqe.res;
+		if (res == NULL || req->sqe.opcode < AIO_READ ||
+			req->sqe.opcode > AIO_FSYNC)
+			aio_complete(req, -1);
+		else
+			res->aio(res, req);
+	}
+
+	return submitted;
+}
+
+void aio_complete(struct aio_req *req, ssize_t result) {
+	struct aio_ring *ring = req->ring;
+
+	uint64_t rflags = lock_irqsave(&ring->cq_lock);
+	size_t tail = ring->cq_tail;
+	ring->cqes[tail & (ring->cq_entries - 1)] =
+		(struct aio_cqe){.user_data = req->sqe.user_data, .result = result};
+	__atomic_store_n(&ring->cq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	struct thread *waiter = NULL;
+	if (ring->waiter && tail + 1 - ring->cq_head >= ring->wait_for) {
+		waiter = ring->waiter;
+		ring->waiter = NULL;
+	}
+	lock_irqrestore(&ring->cq_lock, rflags);
+
+	slab_free(&aio_req_cache, req);
+	if (waiter)
+		sched_wake(waiter);
+}
+
+size_t aio_wait(struct aio_ring *ring, size_t min) {
+	uint64_t rflags = lock_irqsave(&ring->cq_lock);
+	min = MIN(min, __atomic_load_n(&ring->in_flight, __ATOMIC_RELAXED));
+
+	// A completion posted after the thread is marked blocked wakes it, one
+	// posted before is counted here
+	while (ring->cq_tail - ring->cq_head < min) {
+		struct thread *self = sched_current();
+		ring->waiter = self;
+		ring->wait_for = min;
+		__atomic_store_n(&self->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+		UNLOCK(ring->cq_lock);
+		sched_block();
+		LOCK(ring->cq_lock);
+	}
+
+	size_t ready = ring->cq_tail - ring->cq_head;
+	lock_irqrestore(&ring->cq_lock, rflags);
+	return ready;
+}
+
+struct aio_cqe *aio_peek_cqe(struct aio_ring *ring) {
+	size_t head = ring->cq_head;
+	if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & (ring->cq_entries - 1)];
+}
+
+void aio_cqe_seen(struct aio_ring *ring) {
+	__atomic_store_n(&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&ring->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+// Resources have no write-back caches of their own, once a write completed
+// its data has been handed to the device
+static void aio_run(void *arg) {
+	struct aio_req *req = arg;
+	struct aio_sqe *sqe = &req->sqe;
+	struct resource *res = sqe->res;
+	ssize_t ret = 0;
+
+	switch (sqe->opcode) {
+		case AIO_READ:
+			ret = res->read(res, sqe->buf, sqe->loc, sqe->count);
+			break;
+		case AIO_WRITE:
+			ret = res->write(res, sqe->buf, sqe->loc, sqe->count);
+			break;
+	}
+
+	aio_complete(req, ret);
+}
+
+void aio_default(struct resource *this, struct aio_req *req) {
+	(void)this;
+	req->work = (struct work)WORK_INIT(aio_run, req);
+	work_submit(&req->work, WORK_ANY_CPU);
+}
+
+void aio_inline(struct resource *this, struct aio_req *req) {
+	(void)this;
+	aio_run(req);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include "../sched/workqueue.h"
+#include "lock.h"
+#include "resource.h"
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared submission and completion rings for asynchronous I/O on resources.
+// Operations are queued on the submission ring and started together by
+// aio_submit(), their results are posted to the completion ring in whatever
+// order they finish, from any processor and from interrupt handlers. They
+// aren't ordered against each other, an fsync only covers writes whose
+// completion was posted before it was submitted.
+
+enum { AIO_READ, AIO_WRITE, AIO_FSYNC };
+
+struct aio_sqe {
+	int opcode;
+	struct resource *res;
+	void *buf;
+	size_t count;
+	off_t loc;
+	// Handed back in the completion
+	uint64_t user_data;
+};
+
+struct aio_cqe {
+	uint64_t user_data;
+	// Bytes transferred, or -1
+	ssize_t result;
+};
+
+struct aio_ring;
+
+// Operation taken off the submission ring. It belongs to the resource until
+// it's passed to aio_complete().
+struct aio_req {
+	struct aio_sqe sqe;
+	struct aio_ring *ring;
+	// For resources to keep track of the operation with
+	struct work work;
+	void *private;
+};
+
+// The indices only ever grow, entries are at their value modulo the size of
+// the ring. Submission entries go from sq_head to sq_tail and completion
+// entries from cq_head to cq_tail.
+struct aio_ring {
+	struct aio_sqe *sqes;
+	size_t sq_entries;
+	size_t sq_head;
+	size_t sq_tail;
+
+	struct aio_cqe *cqes;
+	size_t cq_entries;
+	size_t cq_head;
+	size_t cq_tail;
+	lock_t cq_lock;
+
+	// Submitted operations whose completion hasn't been seen yet, at most
+	// cq_entries so that there's always room to post a completion
+	size_t in_flight;
+	// Thread blocked in aio_wait() until wait_for completions are ready
+	struct thread *waiter;
+	size_t wait_for;
+};
+
+// entries is rounded up to a power of two, the completion ring is twice as
+// large so more operations can be in flight than are queued at once. NULL when
+// out of memory.
+struct aio_ring *aio_ring_create(size_t entries);
+// Only once every completion has been seen
+void aio_ring_destroy(struct aio_ring *ring);
+// Next free submission entry, or NULL when the ring is full
+struct aio_sqe *aio_get_sqe(struct aio_ring *ring);
+// Start the queued operations, as many as there's room for in the completion
+// ring and memory for, and return how many were started
+size_t aio_submit(struct aio_ring *ring);
+// Wait until there are at least min completions, or as many as there are
+// operations in flight, and return how many there are. Only from a thread that
+// may block and isn't a worker, workers run operations of resources without
+// support for asynchronous I/O.
+size_t aio_wait(struct aio_ring *ring, size_t min);
+// Oldest completion, or NULL when there is none, released by aio_cqe_seen()
+struct aio_cqe *aio_peek_cqe(struct aio_ring *ring);
+void aio_cqe_seen(struct aio_ring *ring);
+
+// For resources, post the result of req and free it. Safe in interrupt
+// handlers.
+void aio_complete(struct aio_req *req, ssize_t result);
+// The default aio operation of resources, which is run by a worker with the
+// synchronous read and write
+void aio_default(struct resource *this, struct aio_req *req);
+// For resources whose read and write don't wait for hardware, the operation is
+// run right away by the submitter
+void aio_inline(struct resource *this, struct aio_req *req);
+
+#endif
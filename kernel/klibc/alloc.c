@@ -16,53 +16,68 @@
  */
 
 #include "alloc.h"
+#include "../cpu/cpu.h"
 #include "../mm/pmm.h"
 #include "../mm/vmm.h"
 #include "lock.h"
 #include "math.h"
 #include "mem.h"
 #include "string.h"
+#include <liballoc.h>
 
-struct alloc_metadata {
-	size_t pages;
-	size_t size;
-};
+// The page count of every block is kept in the descriptor of its first page,
+// so allocations don't need an in-band header
 
 void *alloc(size_t size) {
 	size_t page_count = DIV_ROUNDUP(size, PAGE_SIZE);
 
-	void *ptr = (char *)pmm_allocz(page_count + 1);
+	if (page_count == 0)
+		page_count = 1;
+
+	void *ptr = pmm_allocz(page_count);
 
 	if (!ptr)
 		return NULL;
 
-	ptr += MEM_PHYS_OFFSET;
-
-	struct alloc_metadata *metadata = ptr;
-	ptr += PAGE_SIZE;
+	pmm_get_page(ptr)->private = page_count;
 
-	metadata->pages = page_count;
-	metadata->size = size;
-
-	return ptr;
+	return ptr + MEM_PHYS_OFFSET;
 }
 
 void free(void *ptr) {
-	struct alloc_metadata *metadata = ptr - PAGE_SIZE;
+	if (!ptr)
+		return;
 
-	pmm_free((void *)metadata - MEM_PHYS_OFFSET, metadata->pages + 1);
+	ptr -= MEM_PHYS_OFFSET;
+	pmm_free(ptr, pmm_get_page(ptr)->private);
 }
 
 void *realloc(void *ptr, size_t new_size) {
 	if (!ptr)
 		return alloc(new_size);
 
-	// Reference metadata page
-	struct alloc_metadata *metadata = ptr - PAGE_SIZE;
+	void *phys = ptr - MEM_PHYS_OFFSET;
+	struct page *page = pmm_get_page(phys);
+	size_t old_pages = page->private;
+	size_t new_pages = DIV_ROUNDUP(new_size, PAGE_SIZE);
+
+	if (new_pages == 0)
+		new_pages = 1;
+
+	if (new_pages == old_pages)
+		return ptr;
+
+	// Shrinking and growing into free neighbouring pages happen in place
+	if (new_pages < old_pages) {
+		pmm_free(phys + new_pages * PAGE_SIZE, old_pages - new_pages);
+		page->private = new_pages;
+		return ptr;
+	}
 
-	if (DIV_ROUNDUP(metadata->size, PAGE_SIZE) ==
-		DIV_ROUNDUP(new_size, PAGE_SIZE)) {
-		metadata->size = new_size;
+	if (pmm_extend(phys, old_pages, new_pages - old_pages)) {
+		memset(ptr + old_pages * PAGE_SIZE, 0,
+			   (new_pages - old_pages) * PAGE_SIZE);
+		page->private = new_pages;
 		return ptr;
 	}
 
@@ -70,13 +85,7 @@ void *realloc(void *ptr, size_t new_size) {
 	if (new_ptr == NULL)
 		return NULL;
 
-	if (metadata->size > new_size) {
-		// Copy all the data from the old pointer to the new pointer, within the
-		// range specified by 'size'.
-		memcpy(new_ptr, ptr, new_size);
-	} else {
-		memcpy(new_ptr, ptr, metadata->size);
-	}
+	memcpy(new_ptr, ptr, old_pages * PAGE_SIZE);
 
 	free(ptr);
 
@@ -92,16 +101,43 @@ int liballoc_free(void *ptr, size_t size) {
 	return 0;
 }
 
-lock_t alloc_lock;
+// One lock per liballoc arena. Interrupts stay disabled while an arena is
+// held, so that an interrupt handler allocating on the same processor can't
+// deadlock against it.
+static lock_t arena_locks[LIBALLOC_ARENAS];
+static uint64_t arena_rflags[LIBALLOC_ARENAS];
+static size_t arena_contention[LIBALLOC_ARENAS];
+
+unsigned int liballoc_arena() {
+	return this_cpu_read(cpu_number) % LIBALLOC_ARENAS;
+}
 
-int liballoc_lock() {
-	LOCK(alloc_lock);
-	asm volatile("cli");
+int liballoc_lock(unsigned int arena) {
+	uint64_t rflags = cpu_irq_save();
+	if (!lock_try(&arena_locks[arena])) {
+		__atomic_add_fetch(&arena_contention[arena], 1, __ATOMIC_RELAXED);
+		LOCK(arena_locks[arena]);
+	}
+	arena_rflags[arena] = rflags;
 	return 0;
 }
 
-int liballoc_unlock() {
-	UNLOCK(alloc_lock);
-	asm volatile("sti");
+int liballoc_unlock(unsigned int arena) {
+	uint64_t rflags = arena_rflags[arena];
+	UNLOCK(arena_locks[arena]);
+	cpu_irq_restore(rflags);
 	return 0;
 }
+
+void alloc_get_arena_stats(unsigned int arena, struct alloc_arena_stats *stats) {
+	struct liballoc_stats raw;
+	liballoc_get_stats(arena, &raw);
+
+	stats->allocated = raw.allocated;
+	stats->inuse = raw.inuse;
+	stats->fragmented = raw.allocated - raw.inuse;
+	stats->blocks = raw.majors;
+	stats->remote_frees = raw.remote_frees;
+	stats->contention =
+		__atomic_load_n(&arena_contention[arena], __ATOMIC_RELAXED);
+}
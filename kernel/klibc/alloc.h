@@ -19,8 +19,21 @@
 
 #include <stddef.h>
 
+// Usage of a single kmalloc arena, in bytes unless noted otherwise
+struct alloc_arena_stats {
+	size_t allocated;
+	size_t inuse;
+	// Allocated from the PMM but not handed out
+	size_t fragmented;
+	size_t blocks;
+	size_t remote_frees;
+	// Number of times the arena lock was found taken
+	size_t contention;
+};
+
 void *alloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t new_size);
+void alloc_get_arena_stats(unsigned int arena, struct alloc_arena_stats *stats);
 
 #endif
@@ -19,8 +19,13 @@
  */
 
 #include "asm.h"
+#include "math.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define BITMAP_NOT_FOUND ((size_t)-1)
+#define BITMAP_WORD_BITS 64
 
 static inline bool bitmap_test(void *bitmap, size_t bit) {
 	bool ret;
@@ -49,4 +54,94 @@ static inline bool bitmap_unset(void *bitmap, size_t bit) {
 	return ret;
 }
 
+// Word granular helpers. The bitmap is treated as an array of 64 bit words,
+// which matches the bit order used by bt/bts/btr on little endian machines.
+
+static inline uint64_t bitmap_word_mask(size_t start, size_t end) {
+	// Mask of bits [start, end) within a single word, with 0 < end <= 64
+	uint64_t mask = ~(uint64_t)0 << (start % BITMAP_WORD_BITS);
+	if (end % BITMAP_WORD_BITS)
+		mask &= ~(~(uint64_t)0 << (end % BITMAP_WORD_BITS));
+	return mask;
+}
+
+static inline void bitmap_set_range(void *bitmap, size_t start, size_t count) {
+	uint64_t *words = bitmap;
+	size_t end = start + count;
+
+	while (start < end) {
+		size_t word_end = ALIGN_DOWN(start, BITMAP_WORD_BITS) + BITMAP_WORD_BITS;
+		if (word_end > end)
+			word_end = end;
+		words[start / BITMAP_WORD_BITS] |= bitmap_word_mask(start, word_end);
+		start = word_end;
+	}
+}
+
+static inline void bitmap_unset_range(void *bitmap, size_t start,
+									  size_t count) {
+	uint64_t *words = bitmap;
+	size_t end = start + count;
+
+	while (start < end) {
+		size_t word_end = ALIGN_DOWN(start, BITMAP_WORD_BITS) + BITMAP_WORD_BITS;
+		if (word_end > end)
+			word_end = end;
+		words[start / BITMAP_WORD_BITS] &= ~bitmap_word_mask(start, word_end);
+		start = word_end;
+	}
+}
+
+// Returns the index of the first bit in [start, limit) with the given value,
+// or limit if there is none. Words that cannot contain a match are skipped.
+static inline size_t bitmap_find(void *bitmap, size_t start, size_t limit,
+								 bool value) {
+	uint64_t *words = bitmap;
+
+	while (start < limit) {
+		uint64_t word = words[start / BITMAP_WORD_BITS];
+		if (!value)
+			word = ~word;
+		word &= ~(uint64_t)0 << (start % BITMAP_WORD_BITS);
+
+		if (word) {
+			size_t bit = ALIGN_DOWN(start, BITMAP_WORD_BITS) + __builtin_ctzll(word);
+			return bit < limit ? bit : limit;
+		}
+
+		start = ALIGN_DOWN(start, BITMAP_WORD_BITS) + BITMAP_WORD_BITS;
+	}
+
+	return limit;
+}
+
+static inline size_t bitmap_find_set(void *bitmap, size_t start,
+									 size_t limit) {
+	return bitmap_find(bitmap, start, limit, true);
+}
+
+static inline size_t bitmap_find_clear(void *bitmap, size_t start,
+									   size_t limit) {
+	return bitmap_find(bitmap, start, limit, false);
+}
+
+// Returns the first bit of a run of count clear bits within [start, limit),
+// or BITMAP_NOT_FOUND
+static inline size_t bitmap_find_clear_run(void *bitmap, size_t start,
+										   size_t limit, size_t count) {
+	while (start < limit) {
+		start = bitmap_find_clear(bitmap, start, limit);
+		if (limit - start < count)
+			break;
+
+		size_t end = bitmap_find_set(bitmap, start, start + count);
+		if (end - start == count)
+			return start;
+
+		start = end;
+	}
+
+	return BITMAP_NOT_FOUND;
+}
+
 #endif
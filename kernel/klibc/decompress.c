@@ -0,0 +1,90 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "decompress.h"
+#include "string.h"
+#include <liballoc.h>
+
+#define GZIP_MAGIC 0x8B1F
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define ZSTD_MAGIC 0xFD2FB528
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool window_init(struct decompress_window *w, size_t size,
+				 decompress_sink_t sink, void *ctx) {
+	w->buf = kmalloc(size);
+	w->size = size;
+	w->pos = 0;
+	w->flushed = 0;
+	w->sink = sink;
+	w->ctx = ctx;
+	return w->buf != NULL;
+}
+
+// Repeat len bytes starting dist bytes back, which may overlap what's copied
+bool window_copy(struct decompress_window *w, size_t dist, size_t len) {
+	if (dist == 0 || dist > w->pos || dist > w->size)
+		return false;
+
+	while (len--)
+		window_put(w, w->buf[(w->pos - dist) & (w->size - 1)]);
+	return true;
+}
+
+// Hand what's left to the sink and free the window
+void window_finish(struct decompress_window *w) {
+	if (w->pos != w->flushed)
+		w->sink(w->ctx, w->buf, w->pos - w->flushed);
+	kfree(w->buf);
+	w->buf = NULL;
+}
+
+// Recognize a compressed format by its magic bytes, NULL if there's none
+const char *decompress_format(const void *data, size_t size) {
+	const uint8_t *p = data;
+
+	if (size >= 2 && (p[0] | (p[1] << 8)) == GZIP_MAGIC)
+		return "gzip";
+	if (size < 4)
+		return NULL;
+
+	switch (read_le32(p)) {
+		case LZ4_MAGIC:
+		case LZ4_LEGACY_MAGIC:
+			return "lz4";
+		case ZSTD_MAGIC:
+			return "zstd";
+	}
+
+	return NULL;
+}
+
+bool decompress(const void *data, size_t size, decompress_sink_t sink,
+				void *ctx) {
+	const char *format = decompress_format(data, size);
+
+	if (format == NULL)
+		return false;
+	if (!strcmp(format, "gzip"))
+		return gunzip(data, size, sink, ctx);
+	if (!strcmp(format, "lz4"))
+		return lz4_decompress(data, size, sink, ctx);
+	return zstd_decompress(data, size, sink, ctx);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Decompressors run over input that is all in memory and hand their output to
+// a sink in pieces no larger than their window, so the whole output never has
+// to be held at once
+typedef void (*decompress_sink_t)(void *ctx, const void *buf, size_t len);
+
+// Large enough for the history of both deflate and LZ4, zstd frames say how
+// much they need
+#define DECOMPRESS_WINDOW ((size_t)65536)
+
+struct decompress_window {
+	uint8_t *buf;
+	// A power of two
+	size_t size;
+	// Total number of bytes output and how many of them were flushed
+	size_t pos;
+	size_t flushed;
+	decompress_sink_t sink;
+	void *ctx;
+};
+
+bool window_init(struct decompress_window *w, size_t size,
+				 decompress_sink_t sink, void *ctx);
+bool window_copy(struct decompress_window *w, size_t dist, size_t len);
+void window_finish(struct decompress_window *w);
+
+static inline void window_put(struct decompress_window *w, uint8_t byte) {
+	w->buf[w->pos++ & (w->size - 1)] = byte;
+	if ((w->pos & (w->size - 1)) == 0) {
+		w->sink(w->ctx, w->buf, w->size);
+		w->flushed = w->pos;
+	}
+}
+
+const char *decompress_format(const void *data, size_t size);
+bool decompress(const void *data, size_t size, decompress_sink_t sink,
+				void *ctx);
+bool gunzip(const void *data, size_t size, decompress_sink_t sink, void *ctx);
+bool lz4_decompress(const void *data, size_t size, decompress_sink_t sink,
+					void *ctx);
+bool zstd_decompress(const void *data, size_t size, decompress_sink_t sink,
+					 void *ctx);
+
+#endif
@@ -18,6 +18,7 @@
  * limitations under the License.
  */
 
+#include "mem.h"
 #include <liballoc.h>
 #include <stddef.h>
 
@@ -46,12 +47,34 @@
 #define DYNARRAY_DEL(THIS) \
 	{ kfree((THIS).storage); }
 
-#define DYNARRAY_GROW(THIS)                                                    \
+#define DYNARRAY_MIN_SIZE 4
+
+// Storage at least doubles when it grows, so pushes stay amortized constant
+#define DYNARRAY_RESERVE(THIS, COUNT)                                       \
+	{                                                                       \
+		size_t dynarray_want_ = (COUNT);                                    \
+		if (dynarray_want_ > (THIS).storage_size) {                         \
+			size_t dynarray_size_ = (THIS).storage_size * 2;                \
+			if (dynarray_size_ < DYNARRAY_MIN_SIZE)                         \
+				dynarray_size_ = DYNARRAY_MIN_SIZE;                         \
+			if (dynarray_size_ < dynarray_want_)                            \
+				dynarray_size_ = dynarray_want_;                            \
+			(THIS).storage =                                                \
+				krealloc((THIS).storage,                                    \
+						 dynarray_size_ * sizeof(typeof(*(THIS).storage))); \
+			(THIS).storage_size = dynarray_size_;                           \
+		}                                                                   \
+	}
+
+#define DYNARRAY_GROW(THIS) DYNARRAY_RESERVE(THIS, (THIS).storage_size + 1)
+
+// Storage is halved once only a quarter of it is used, so alternating pushes
+// and removes around a boundary don't reallocate every time
+#define DYNARRAY_SHRINK(THIS)                                                  \
 	{                                                                          \
-		if ((THIS).storage == NULL) {                                          \
-			DYNARRAY_INIT(THIS, 1);                                            \
-		} else {                                                               \
-			(THIS).storage_size *= 2;                                          \
+		if ((THIS).storage_size > DYNARRAY_MIN_SIZE &&                         \
+			(THIS).length <= (THIS).storage_size / 4) {                        \
+			(THIS).storage_size /= 2;                                          \
 			(THIS).storage =                                                   \
 				krealloc((THIS).storage, (THIS).storage_size *                 \
 											 sizeof(typeof(*(THIS).storage))); \
@@ -65,4 +88,24 @@
 		(THIS).storage[(THIS).length++] = ITEM;   \
 	}
 
+// Keeps the order of the remaining items
+#define DYNARRAY_REMOVE(THIS, INDEX)                    \
+	{                                                   \
+		size_t dynarray_index_ = (INDEX);               \
+		memmove(&(THIS).storage[dynarray_index_],       \
+				&(THIS).storage[dynarray_index_ + 1],   \
+				((THIS).length - dynarray_index_ - 1) * \
+					sizeof(typeof(*(THIS).storage)));   \
+		(THIS).length--;                                \
+		DYNARRAY_SHRINK(THIS);                          \
+	}
+
+// Moves the last item into the hole instead, for when order doesn't matter
+#define DYNARRAY_SWAP_REMOVE(THIS, INDEX)                                  \
+	{                                                                      \
+		size_t dynarray_index_ = (INDEX);                                  \
+		(THIS).storage[dynarray_index_] = (THIS).storage[--(THIS).length]; \
+		DYNARRAY_SHRINK(THIS);                                             \
+	}
+
 #endif
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hashmap.h"
+#include "mem.h"
+#include "string.h"
+#include "types.h"
+#include <liballoc.h>
+
+// Slots are probed in aligned groups of HASHMAP_GROUP, the metadata of a
+// group is loaded as one word and matched a byte lane at a time
+#define HASHMAP_GROUP 8
+#define HASHMAP_EMPTY 0x80
+#define HASHMAP_DELETED 0xFE
+
+#define LANES_LO 0x0101010101010101ULL
+#define LANES_HI 0x8080808080808080ULL
+
+static uint64_t hash_key(struct hashmap *map, uint64_t key) {
+	if (map->str_keys) {
+		// FNV-1a
+		const char *s = (const char *)(uintptr_t)key;
+		for (key = 14695981039346656037ULL; *s; s++) {
+			key ^= (uint8_t)*s;
+			key *= 1099511628211ULL;
+		}
+	}
+
+	// splitmix64's finalizer, both halves of the result are used
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+	return key ^ (key >> 31);
+}
+
+static bool keys_equal(struct hashmap *map, uint64_t a, uint64_t b) {
+	if (map->str_keys)
+		return !strcmp((const char *)(uintptr_t)a, (const char *)(uintptr_t)b);
+	return a == b;
+}
+
+static inline uint64_t group_load(struct hashmap *map, size_t group) {
+	uint64_t ctrl;
+	memcpy(&ctrl, &map->ctrl[group * HASHMAP_GROUP], sizeof(ctrl));
+	return ctrl;
+}
+
+// Lanes whose byte is h2. A lane above a real match can show up too, the key
+// comparison weeds those out.
+static inline uint64_t group_match(uint64_t ctrl, uint8_t h2) {
+	uint64_t x = ctrl ^ (LANES_LO * h2);
+	return (x - LANES_LO) & ~x & LANES_HI;
+}
+
+// Only the empty marker has the top bit set and the one below it clear
+static inline uint64_t group_match_empty(uint64_t ctrl) {
+	return ctrl & ~(ctrl << 1) & LANES_HI;
+}
+
+static inline uint64_t group_match_free(uint64_t ctrl) {
+	return ctrl & LANES_HI;
+}
+
+static inline size_t lane_index(uint64_t match) {
+	return __builtin_ctzll(match) / 8;
+}
+
+// Groups are visited in triangular steps, which reach every group of a power
+// of two sized table
+static ssize_t find_slot(struct hashmap *map, uint64_t key, uint64_t hash) {
+	if (map->capacity == 0)
+		return -1;
+
+	size_t mask = map->capacity / HASHMAP_GROUP - 1;
+	size_t group = (hash >> 7) & mask;
+	uint8_t h2 = hash & 0x7F;
+
+	for (size_t step = 1; step <= mask + 1; step++) {
+		uint64_t ctrl = group_load(map, group);
+		for (uint64_t match = group_match(ctrl, h2); match;
+			 match &= match - 1) {
+			size_t slot = group * HASHMAP_GROUP + lane_index(match);
+			if (keys_equal(map, map->entries[slot].key, key))
+				return slot;
+		}
+		if (group_match_empty(ctrl))
+			return -1;
+		group = (group + step) & mask;
+	}
+
+	return -1;
+}
+
+// The table must have a free slot
+static size_t free_slot(struct hashmap *map, uint64_t hash) {
+	size_t mask = map->capacity / HASHMAP_GROUP - 1;
+	size_t group = (hash >> 7) & mask;
+
+	for (size_t step = 1;; step++) {
+		uint64_t match = group_match_free(group_load(map, group));
+		if (match)
+			return group * HASHMAP_GROUP + lane_index(match);
+		group = (group + step) & mask;
+	}
+}
+
+static bool hashmap_resize(struct hashmap *map, size_t capacity) {
+	uint8_t *ctrl = kmalloc(capacity);
+	struct hashmap_entry *entries = kmalloc(capacity * sizeof(*entries));
+	if (ctrl == NULL || entries == NULL) {
+		kfree(ctrl);
+		kfree(entries);
+		return false;
+	}
+	memset(ctrl, HASHMAP_EMPTY, capacity);
+
+	struct hashmap old = *map;
+	map->ctrl = ctrl;
+	map->entries = entries;
+	map->capacity = capacity;
+	map->tombstones = 0;
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (old.ctrl[i] & 0x80)
+			continue;
+		uint64_t hash = hash_key(map, old.entries[i].key);
+		size_t slot = free_slot(map, hash);
+		map->ctrl[slot] = hash & 0x7F;
+		map->entries[slot] = old.entries[i];
+	}
+
+	kfree(old.ctrl);
+	kfree(old.entries);
+	return true;
+}
+
+// Used and deleted slots are kept to at most 7/8 of the table, so probes
+// end at an empty slot early
+bool hashmap_reserve(struct hashmap *map, size_t count) {
+	size_t capacity = map->capacity ? map->capacity : HASHMAP_GROUP;
+	while (count * 8 > capacity * 7)
+		capacity *= 2;
+
+	if (capacity == map->capacity)
+		return true;
+	return hashmap_resize(map, capacity);
+}
+
+void *hashmap_get(struct hashmap *map, uint64_t key) {
+	ssize_t slot = find_slot(map, key, hash_key(map, key));
+	return slot < 0 ? NULL : map->entries[slot].value;
+}
+
+bool hashmap_put(struct hashmap *map, uint64_t key, void *value) {
+	uint64_t hash = hash_key(map, key);
+
+	ssize_t slot = find_slot(map, key, hash);
+	if (slot >= 0) {
+		map->entries[slot].value = value;
+		return true;
+	}
+
+	if ((map->length + map->tombstones + 1) * 8 > map->capacity * 7) {
+		// Mostly deleted slots are rehashed in place rather than grown
+		size_t capacity = map->capacity ? map->capacity : HASHMAP_GROUP;
+		if ((map->length + 1) * 16 > capacity * 7)
+			capacity *= 2;
+		if (!hashmap_resize(map, capacity))
+			return false;
+	}
+
+	slot = free_slot(map, hash);
+	if (map->ctrl[slot] == HASHMAP_DELETED)
+		map->tombstones--;
+	map->ctrl[slot] = hash & 0x7F;
+	map->entries[slot] = (struct hashmap_entry){.key = key, .value = value};
+	map->length++;
+	return true;
+}
+
+bool hashmap_remove(struct hashmap *map, uint64_t key) {
+	ssize_t slot = find_slot(map, key, hash_key(map, key));
+	if (slot < 0)
+		return false;
+
+	// A probe stops at a group with an empty slot anyway, so the slot can
+	// become empty again unless the group is full
+	size_t group = slot / HASHMAP_GROUP;
+	if (group_match_empty(group_load(map, group))) {
+		map->ctrl[slot] = HASHMAP_EMPTY;
+	} else {
+		map->ctrl[slot] = HASHMAP_DELETED;
+		map->tombstones++;
+	}
+	map->length--;
+	return true;
+}
+
+void hashmap_del(struct hashmap *map) {
+	kfree(map->ctrl);
+	kfree(map->entries);
+	*map = (struct hashmap){.str_keys = map->str_keys};
+}
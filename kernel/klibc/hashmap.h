@@ -0,0 +1,72 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Open addressing hash map from 64 bit keys or C strings to pointers. Next to
+// the entries is a byte of metadata per slot, 7 bits of the hash or a marker
+// for empty and deleted slots, which is probed 8 slots at a time as one word
+// so a lookup usually touches a single entry. String keys are not copied and
+// must outlive their entry. Callers serialize access to a map.
+struct hashmap_entry {
+	uint64_t key;
+	void *value;
+};
+
+struct hashmap {
+	uint8_t *ctrl;
+	struct hashmap_entry *entries;
+	size_t capacity;
+	size_t length;
+	size_t tombstones;
+	bool str_keys;
+};
+
+#define HASHMAP_INIT {0}
+#define HASHMAP_STR_INIT {.str_keys = true}
+
+void *hashmap_get(struct hashmap *map, uint64_t key);
+bool hashmap_put(struct hashmap *map, uint64_t key, void *value);
+bool hashmap_remove(struct hashmap *map, uint64_t key);
+bool hashmap_reserve(struct hashmap *map, size_t count);
+void hashmap_del(struct hashmap *map);
+
+// Visit every entry, the map must not change meanwhile. Used slots are those
+// with the top bit of their metadata clear.
+#define HASHMAP_FOR_EACH(MAP, ENTRY)                                        \
+	for (size_t hashmap_i_ = 0; hashmap_i_ < (MAP)->capacity; hashmap_i_++) \
+		if (!((MAP)->ctrl[hashmap_i_] & 0x80) &&                            \
+			((ENTRY) = &(MAP)->entries[hashmap_i_]))
+
+static inline void *hashmap_get_str(struct hashmap *map, const char *key) {
+	return hashmap_get(map, (uintptr_t)key);
+}
+
+static inline bool hashmap_put_str(struct hashmap *map, const char *key,
+								   void *value) {
+	return hashmap_put(map, (uintptr_t)key, value);
+}
+
+static inline bool hashmap_remove_str(struct hashmap *map, const char *key) {
+	return hashmap_remove(map, (uintptr_t)key);
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// gzip and raw deflate (RFC 1951, RFC 1952), decoding Huffman codes a bit at
+// a time from canonical code counts like zlib's puff
+
+#include "decompress.h"
+#include "mem.h"
+
+#define MAX_BITS 15
+#define MAX_LIT_CODES 288
+#define MAX_DIST_CODES 30
+
+struct inflate_state {
+	const uint8_t *in;
+	const uint8_t *end;
+	uint32_t bitbuf;
+	int bitcount;
+	// Set once the input ran out, every read after returns zeroes
+	bool error;
+	struct decompress_window out;
+};
+
+struct huffman {
+	uint16_t counts[MAX_BITS + 1];
+	uint16_t symbols[MAX_LIT_CODES];
+};
+
+static const uint16_t length_base[29] = {
+	3,	4,	5,	6,	7,	8,	9,	10, 11,	 13,  15,  17,	19,	 23, 27,
+	31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+										 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+										 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+	1,	  2,	3,	  4,	5,	  7,	9,	  13,	 17,	25,
+	33,	  49,	65,	  97,	129,  193,	257,  385,	 513,	769,
+	1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,	 2,	 3,	 3,
+									   4, 4, 5, 5, 6, 6, 7,	 7,	 8,	 8,
+									   9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t bits(struct inflate_state *s, int need) {
+	uint32_t val = s->bitbuf;
+	while (s->bitcount < need) {
+		if (s->in == s->end) {
+			s->error = true;
+			return 0;
+		}
+		val |= (uint32_t)*s->in++ << s->bitcount;
+		s->bitcount += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcount -= need;
+	return val & ((1UL << need) - 1);
+}
+
+// Build the decoding tables from code lengths, false if the lengths don't
+// form a valid code
+static bool build(struct huffman *h, const uint8_t *lengths, size_t n) {
+	uint16_t offs[MAX_BITS + 1];
+
+	memset(h->counts, 0, sizeof(h->counts));
+	for (size_t sym = 0; sym < n; sym++)
+		h->counts[lengths[sym]]++;
+
+	int left = 1;
+	for (int len = 1; len <= MAX_BITS; len++) {
+		left <<= 1;
+		left -= h->counts[len];
+		if (left < 0)
+			return false;
+	}
+
+	offs[1] = 0;
+	for (int len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->counts[len];
+
+	for (size_t sym = 0; sym < n; sym++)
+		if (lengths[sym] != 0)
+			h->symbols[offs[lengths[sym]]++] = sym;
+
+	return true;
+}
+
+static int decode(struct inflate_state *s, const struct huffman *h) {
+	int code = 0, first = 0, index = 0;
+
+	for (int len = 1; len <= MAX_BITS; len++) {
+		code |= bits(s, 1);
+		int count = h->counts[len];
+		if (code - count < first)
+			return h->symbols[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+static bool stored(struct inflate_state *s) {
+	s->bitbuf = 0;
+	s->bitcount = 0;
+
+	if (s->end - s->in < 4)
+		return false;
+	uint16_t len = s->in[0] | (s->in[1] << 8);
+	uint16_t nlen = s->in[2] | (s->in[3] << 8);
+	s->in += 4;
+	if ((len ^ nlen) != 0xFFFF || s->end - s->in < len)
+		return false;
+
+	while (len--)
+		window_put(&s->out, *s->in++);
+	return true;
+}
+
+static bool codes(struct inflate_state *s, const struct huffman *lencode,
+				  const struct huffman *distcode) {
+	for (;;) {
+		int sym = decode(s, lencode);
+		if (sym < 0 || s->error)
+			return false;
+
+		if (sym < 256) {
+			window_put(&s->out, sym);
+		} else if (sym == 256) {
+			return true;
+		} else {
+			sym -= 257;
+			if (sym >= 29)
+				return false;
+			size_t len = length_base[sym] + bits(s, length_extra[sym]);
+
+			int dsym = decode(s, distcode);
+			if (dsym < 0 || dsym >= MAX_DIST_CODES)
+				return false;
+			size_t dist = dist_base[dsym] + bits(s, dist_extra[dsym]);
+
+			if (s->error || !window_copy(&s->out, dist, len))
+				return false;
+		}
+	}
+}
+
+static bool fixed(struct inflate_state *s) {
+	static struct huffman lencode, distcode;
+	static bool built = false;
+
+	if (!built) {
+		uint8_t lengths[MAX_LIT_CODES];
+		size_t sym = 0;
+		for (; sym < 144; sym++)
+			lengths[sym] = 8;
+		for (; sym < 256; sym++)
+			lengths[sym] = 9;
+		for (; sym < 280; sym++)
+			lengths[sym] = 7;
+		for (; sym < MAX_LIT_CODES; sym++)
+			lengths[sym] = 8;
+		build(&lencode, lengths, MAX_LIT_CODES);
+
+		for (sym = 0; sym < MAX_DIST_CODES; sym++)
+			lengths[sym] = 5;
+		build(&distcode, lengths, MAX_DIST_CODES);
+		built = true;
+	}
+
+	return codes(s, &lencode, &distcode);
+}
+
+static bool dynamic(struct inflate_state *s) {
+	static const uint8_t order[19] = {16, 17, 18, 0, 8,	 7, 9,	6, 10, 5,
+									  11, 4,  12, 3, 13, 2, 14, 1, 15};
+	uint8_t lengths[MAX_LIT_CODES + MAX_DIST_CODES];
+	struct huffman lencode, distcode;
+
+	size_t nlen = bits(s, 5) + 257;
+	size_t ndist = bits(s, 5) + 1;
+	size_t ncode = bits(s, 4) + 4;
+	if (nlen > MAX_LIT_CODES || ndist > MAX_DIST_CODES)
+		return false;
+
+	size_t index = 0;
+	for (; index < ncode; index++)
+		lengths[order[index]] = bits(s, 3);
+	for (; index < 19; index++)
+		lengths[order[index]] = 0;
+	if (s->error || !build(&lencode, lengths, 19))
+		return false;
+
+	for (index = 0; index < nlen + ndist;) {
+		int sym = decode(s, &lencode);
+		if (sym < 0 || s->error)
+			return false;
+
+		if (sym < 16) {
+			lengths[index++] = sym;
+			continue;
+		}
+
+		uint8_t len = 0;
+		size_t repeat;
+		if (sym == 16) {
+			if (index == 0)
+				return false;
+			len = lengths[index - 1];
+			repeat = 3 + bits(s, 2);
+		} else if (sym == 17) {
+			repeat = 3 + bits(s, 3);
+		} else {
+			repeat = 11 + bits(s, 7);
+		}
+
+		if (index + repeat > nlen + ndist)
+			return false;
+		while (repeat--)
+			lengths[index++] = len;
+	}
+
+	// The end of block code has to be there
+	if (lengths[256] == 0)
+		return false;
+
+	if (!build(&lencode, lengths, nlen) ||
+		!build(&distcode, lengths + nlen, ndist))
+		return false;
+
+	return codes(s, &lencode, &distcode);
+}
+
+static bool inflate(struct inflate_state *s) {
+	bool last;
+
+	do {
+		last = bits(s, 1);
+		bool ok;
+		switch (bits(s, 2)) {
+			case 0:
+				ok = stored(s);
+				break;
+			case 1:
+				ok = fixed(s);
+				break;
+			case 2:
+				ok = dynamic(s);
+				break;
+			default:
+				ok = false;
+				break;
+		}
+		if (!ok || s->error)
+			return false;
+	} while (!last);
+
+	return true;
+}
+
+// CRC32 of everything output, worked out as it goes to the real sink
+struct gunzip_sink {
+	decompress_sink_t sink;
+	void *ctx;
+	uint32_t crc;
+};
+
+static void gunzip_sink(void *ctx, const void *buf, size_t len) {
+	static uint32_t table[256];
+	static bool built = false;
+	struct gunzip_sink *s = ctx;
+	const uint8_t *p = buf;
+
+	if (!built) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		built = true;
+	}
+
+	uint32_t crc = ~s->crc;
+	for (size_t i = 0; i < len; i++)
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	s->crc = ~crc;
+
+	s->sink(s->ctx, buf, len);
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define GZIP_FHCRC (1 << 1)
+#define GZIP_FEXTRA (1 << 2)
+#define GZIP_FNAME (1 << 3)
+#define GZIP_FCOMMENT (1 << 4)
+
+bool gunzip(const void *data, size_t size, decompress_sink_t sink, void *ctx) {
+	const uint8_t *p = data, *end = p + size;
+
+	// Magic, compression method (8 is deflate) and flags, then mtime, extra
+	// flags and OS
+	if (size < 18 || p[0] != 0x1F || p[1] != 0x8B || p[2] != 8)
+		return false;
+	uint8_t flags = p[3];
+	p += 10;
+
+	if (flags & GZIP_FEXTRA) {
+		size_t xlen = p[0] | (p[1] << 8);
+		if ((size_t)(end - p) < xlen + 2)
+			return false;
+		p += xlen + 2;
+	}
+	for (int field = GZIP_FNAME; field <= GZIP_FCOMMENT; field <<= 1) {
+		if (!(flags & field))
+			continue;
+		while (p < end && *p)
+			p++;
+		p++;
+	}
+	if (flags & GZIP_FHCRC)
+		p += 2;
+	if (p >= end)
+		return false;
+
+	struct gunzip_sink check = {.sink = sink, .ctx = ctx};
+	struct inflate_state s = {.in = p, .end = end};
+	if (!window_init(&s.out, DECOMPRESS_WINDOW, gunzip_sink, &check))
+		return false;
+
+	bool ok = inflate(&s);
+	size_t out_size = s.out.pos;
+	window_finish(&s.out);
+
+	// The stream ends on a byte boundary followed by the CRC32 and the size
+	// modulo 2^32
+	if (!ok || s.end - s.in < 8)
+		return false;
+	return read_le32(s.in) == check.crc &&
+		   read_le32(s.in + 4) == (uint32_t)out_size;
+}
@@ -21,6 +21,9 @@
 //This lets you prefix malloc and friends
 #define PREFIX(func)		k ## func
 
+//Number of independent arenas, each with its own lock
+#define LIBALLOC_ARENAS		64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,7 +37,7 @@ extern "C" {
  * \return 0 if the lock was acquired successfully. Anything else is
  * failure.
  */
-extern int liballoc_lock();
+extern int liballoc_lock(unsigned int arena);
 
 /** This function unlocks what was previously locked by the liballoc_lock
  * function.  If it disabled interrupts, it enables interrupts. If it
@@ -42,7 +45,13 @@ extern int liballoc_lock();
  *
  * \return 0 if the lock was successfully released.
  */
-extern int liballoc_unlock();
+extern int liballoc_unlock(unsigned int arena);
+
+/** This function returns the arena the caller should allocate from,
+ * below LIBALLOC_ARENAS. Typically this is the index of the current
+ * processor.
+ */
+extern unsigned int liballoc_arena();
 
 /** This is the hook into the local system which allocates pages. It
  * accepts an integer parameter which is the number of pages
@@ -72,6 +81,21 @@ extern void    *PREFIX(calloc)(size_t, size_t);		///< The standard function.
 extern void     PREFIX(free)(void *);					///< The standard function.
 
 
+/** Usage of a single arena. Memory that is allocated from the system
+ * but not in use is lost to fragmentation.
+ */
+struct liballoc_stats
+{
+	size_t allocated;		///< Bytes acquired from the system.
+	size_t inuse;			///< Bytes handed out to callers.
+	size_t majors;			///< Number of blocks acquired from the system.
+	size_t remote_frees;	///< Frees queued by other processors.
+	size_t errors;			///< Bad or double frees.
+};
+
+extern void liballoc_get_stats(unsigned int arena, struct liballoc_stats *stats);
+
+
 #ifdef __cplusplus
 }
 #endif
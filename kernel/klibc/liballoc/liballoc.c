@@ -68,6 +68,7 @@ struct liballoc_major
 	unsigned int size;					///< The number of pages in the block.
 	unsigned int usage;					///< The number of bytes used in the block.
 	struct liballoc_minor *first;		///< A pointer to the first allocated memory in the block.	
+	struct liballoc_arena *arena;		///< The arena owning the block.
 };
 
 
@@ -83,21 +84,43 @@ struct	liballoc_minor
 	unsigned int magic;					///< A magic number to idenfity correctness.
 	unsigned int size; 					///< The size of the memory allocated. Could be 1 byte or more.
 	unsigned int req_size;				///< The size of memory requested.
+	struct liballoc_minor *remote;		///< Link in the owning arena's remote free queue.
 };
 
 
-static struct liballoc_major *l_memRoot = NULL;	///< The root memory block acquired from the system.
-static struct liballoc_major *l_bestBet = NULL; ///< The major with the most free memory.
+/** Every processor allocates from its own arena, so allocations on
+ * different processors never contend. Memory freed by a processor other
+ * than the owner of its arena is queued on the arena without taking its
+ * lock, and released by the owner the next time it takes the lock.
+ */
+struct liballoc_arena
+{
+	struct liballoc_major *memRoot;				///< The root memory block acquired from the system.
+	struct liballoc_major *bestBet;				///< The major with the most free memory.
+	unsigned long long allocated;				///< Running total of allocated memory.
+	unsigned long long inuse;					///< Running total of used memory.
+	long long warningCount;						///< Number of warnings encountered
+	long long errorCount;						///< Number of actual errors
+	long long possibleOverruns;					///< Number of possible overruns
+	unsigned long long remoteFrees;				///< Number of frees queued by other processors
+	struct liballoc_minor *remote;				///< Queue of frees from other processors
+};
 
-static unsigned int l_pageSize  = 4096;			///< The size of an individual page. Set up in liballoc_init.
-static unsigned int l_pageCount = 16;			///< The number of pages to request per chunk. Set up in liballoc_init.
-static unsigned long long l_allocated = 0;		///< Running total of allocated memory.
-static unsigned long long l_inuse	 = 0;		///< Running total of used memory.
 
+static struct liballoc_arena l_arenas[LIBALLOC_ARENAS];
 
-static long long l_warningCount = 0;		///< Number of warnings encountered
-static long long l_errorCount = 0;			///< Number of actual errors
-static long long l_possibleOverruns = 0;	///< Number of possible overruns
+#define ARENA_INDEX( arena )	((unsigned int)((arena) - l_arenas))
+
+#define l_memRoot			(arena->memRoot)
+#define l_bestBet			(arena->bestBet)
+#define l_allocated			(arena->allocated)
+#define l_inuse				(arena->inuse)
+#define l_warningCount		(arena->warningCount)
+#define l_errorCount		(arena->errorCount)
+#define l_possibleOverruns	(arena->possibleOverruns)
+
+static unsigned int l_pageSize  = 4096;			///< The size of an individual page. Set up in liballoc_init.
+static unsigned int l_pageCount = 16;			///< The number of pages to request per chunk. Set up in liballoc_init.
 
 
 
@@ -142,6 +165,7 @@ static void* liballoc_memcpy(void* s1, const void* s2, size_t n)
 #if defined DEBUG || defined INFO
 static void liballoc_dump()
 {
+	struct liballoc_arena *arena = &l_arenas[0];
 #ifdef DEBUG
 	struct liballoc_major *maj = l_memRoot;
 	struct liballoc_minor *min = NULL;
@@ -183,7 +207,7 @@ static void liballoc_dump()
 
 // ***************************************************************
 
-static struct liballoc_major *allocate_new_page( unsigned int size )
+static struct liballoc_major *allocate_new_page( struct liballoc_arena *arena, unsigned int size )
 {
 	unsigned int st;
 	struct liballoc_major *maj;
@@ -221,6 +245,7 @@ static struct liballoc_major *allocate_new_page( unsigned int size )
 		maj->size 	= st * l_pageSize;
 		maj->usage 	= sizeof(struct liballoc_major);
 		maj->first 	= NULL;
+		maj->arena 	= arena;
 
 		l_allocated += maj->size;
 
@@ -239,8 +264,97 @@ static struct liballoc_major *allocate_new_page( unsigned int size )
 	
 
 
+static struct liballoc_arena *liballoc_current( void )
+{
+	return &l_arenas[ liballoc_arena() ];
+}
+
+
+/** The arena a live allocation belongs to, or the caller's arena if
+ * the minor is not valid so that the error is accounted there.
+ */
+static struct liballoc_arena *liballoc_owner( struct liballoc_minor *min )
+{
+	if ( min->magic == LIBALLOC_MAGIC ) return min->block->arena;
+	return liballoc_current();
+}
+
+
+static void free_minor( struct liballoc_arena *arena, struct liballoc_minor *min )
+{
+	struct liballoc_major *maj;
+
+		maj = min->block;
+
+		l_inuse -= min->size;
+
+		maj->usage -= (min->size + sizeof( struct liballoc_minor ));
+		min->magic  = LIBALLOC_DEAD;		// No mojo.
+
+		if ( min->next != NULL ) min->next->prev = min->prev;
+		if ( min->prev != NULL ) min->prev->next = min->next;
+
+		if ( min->prev == NULL ) maj->first = min->next;	
+							// Might empty the block. This was the first
+							// minor.
+
+
+	// We need to clean up after the majors now....
+
+	if ( maj->first == NULL )	// Block completely unused.
+	{
+		if ( l_memRoot == maj ) l_memRoot = maj->next;
+		if ( l_bestBet == maj ) l_bestBet = NULL;
+		if ( maj->prev != NULL ) maj->prev->next = maj->next;
+		if ( maj->next != NULL ) maj->next->prev = maj->prev;
+		l_allocated -= maj->size;
+
+		liballoc_free( maj, maj->pages );
+	}
+	else
+	{
+		if ( l_bestBet != NULL )
+		{
+			int bestSize = l_bestBet->size  - l_bestBet->usage;
+			int majSize = maj->size - maj->usage;
+
+			if ( majSize > bestSize ) l_bestBet = maj;
+		}
+
+	}
+}
+
+
+/** Release everything other processors have queued on the arena. Must be
+ * called with the arena locked.
+ */
+static void drain_remote( struct liballoc_arena *arena )
+{
+	struct liballoc_minor *min = __atomic_exchange_n( &arena->remote, NULL, __ATOMIC_ACQUIRE );
+
+	while ( min != NULL )
+	{
+		struct liballoc_minor *next = min->remote;
+		free_minor( arena, min );
+		min = next;
+	}
+}
+
+
+static void queue_remote( struct liballoc_arena *arena, struct liballoc_minor *min )
+{
+	min->remote = __atomic_load_n( &arena->remote, __ATOMIC_RELAXED );
+	while ( !__atomic_compare_exchange_n( &arena->remote, &min->remote, min, 1,
+											__ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+		;
+	__atomic_add_fetch( &arena->remoteFrees, 1, __ATOMIC_RELAXED );
+}
+
+
+
 void *PREFIX(malloc)(size_t req_size)
 {
+	struct liballoc_arena *arena = liballoc_current();
 	int startedBet = 0;
 	unsigned long long bestSize = 0;
 	void *p = NULL;
@@ -258,7 +372,9 @@ void *PREFIX(malloc)(size_t req_size)
 				// So, ideally, we really want an alignment of 0 or 1 in order
 				// to save space.
 	
-	liballoc_lock();
+	liballoc_lock( ARENA_INDEX( arena ) );
+
+	drain_remote( arena );
 
 	if ( size == 0 )
 	{
@@ -268,7 +384,7 @@ void *PREFIX(malloc)(size_t req_size)
 							__builtin_return_address(0) );
 		FLUSH();
 		#endif
-		liballoc_unlock();
+		liballoc_unlock( ARENA_INDEX( arena ) );
 		return PREFIX(malloc)(1);
 	}
 	
@@ -284,10 +400,10 @@ void *PREFIX(malloc)(size_t req_size)
 		#endif
 			
 		// This is the first time we are being used.
-		l_memRoot = allocate_new_page( size );
+		l_memRoot = allocate_new_page( arena, size );
 		if ( l_memRoot == NULL )
 		{
-		  liballoc_unlock();
+		  liballoc_unlock( ARENA_INDEX( arena ) );
 		  #ifdef DEBUG
 		  printf( "liballoc: initial l_memRoot initialization failed\n", p); 
 		  FLUSH();
@@ -364,7 +480,7 @@ void *PREFIX(malloc)(size_t req_size)
 			}
 
 			// Create a new major block next to this one and...
-			maj->next = allocate_new_page( size );	// next one will be okay.
+			maj->next = allocate_new_page( arena, size );	// next one will be okay.
 			if ( maj->next == NULL ) break;			// no more memory.
 			maj->next->prev = maj;
 			maj = maj->next;
@@ -402,7 +518,7 @@ void *PREFIX(malloc)(size_t req_size)
 			printf( "CASE 2: returning %x\n", p); 
 			FLUSH();
 			#endif
-			liballoc_unlock();		// release the lock
+			liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 			return p;
 		}
 
@@ -438,7 +554,7 @@ void *PREFIX(malloc)(size_t req_size)
 			printf( "CASE 3: returning %x\n", p); 
 			FLUSH();
 			#endif
-			liballoc_unlock();		// release the lock
+			liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 			return p;
 		}
 		
@@ -485,7 +601,7 @@ void *PREFIX(malloc)(size_t req_size)
 						printf( "CASE 4.1: returning %x\n", p); 
 						FLUSH();
 						#endif
-						liballoc_unlock();		// release the lock
+						liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 						return p;
 					}
 				}
@@ -528,7 +644,7 @@ void *PREFIX(malloc)(size_t req_size)
 						FLUSH();
 						#endif
 						
-						liballoc_unlock();		// release the lock
+						liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 						return p;
 					}
 				}	// min->next != NULL
@@ -557,7 +673,7 @@ void *PREFIX(malloc)(size_t req_size)
 			}
 				
 			// we've run out. we need more...
-			maj->next = allocate_new_page( size );		// next one guaranteed to be okay
+			maj->next = allocate_new_page( arena, size );		// next one guaranteed to be okay
 			if ( maj->next == NULL ) break;			//  uh oh,  no more memory.....
 			maj->next->prev = maj;
 
@@ -570,7 +686,7 @@ void *PREFIX(malloc)(size_t req_size)
 
 
 	
-	liballoc_unlock();		// release the lock
+	liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 
 	#ifdef DEBUG
 	printf( "All cases exhausted. No memory available.\n");
@@ -594,12 +710,11 @@ void *PREFIX(malloc)(size_t req_size)
 
 void PREFIX(free)(void *ptr)
 {
+	struct liballoc_arena *arena;
 	struct liballoc_minor *min;
-	struct liballoc_major *maj;
 
 	if ( ptr == NULL ) 
 	{
-		l_warningCount += 1;
 		#if defined DEBUG || defined INFO
 		printf( "liballoc: WARNING: PREFIX(free)( NULL ) called from %x\n",
 							__builtin_return_address(0) );
@@ -610,10 +725,18 @@ void PREFIX(free)(void *ptr)
 
 	UNALIGN( ptr );
 
-	liballoc_lock();		// lockit
+	min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof( struct liballoc_minor ));
 
+	arena = liballoc_owner( min );
+	if ( arena != liballoc_current() )
+	{
+		queue_remote( arena, min );
+		return;
+	}
 
-	min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof( struct liballoc_minor ));
+	liballoc_lock( ARENA_INDEX( arena ) );		// lockit
+
+	drain_remote( arena );
 
 	
 	if ( min->magic != LIBALLOC_MAGIC ) 
@@ -657,7 +780,7 @@ void PREFIX(free)(void *ptr)
 		}
 			
 		// being lied to...
-		liballoc_unlock();		// release the lock
+		liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 		return;
 	}
 
@@ -669,44 +792,7 @@ void PREFIX(free)(void *ptr)
 	#endif
 	
 
-		maj = min->block;
-
-		l_inuse -= min->size;
-
-		maj->usage -= (min->size + sizeof( struct liballoc_minor ));
-		min->magic  = LIBALLOC_DEAD;		// No mojo.
-
-		if ( min->next != NULL ) min->next->prev = min->prev;
-		if ( min->prev != NULL ) min->prev->next = min->next;
-
-		if ( min->prev == NULL ) maj->first = min->next;	
-							// Might empty the block. This was the first
-							// minor.
-
-
-	// We need to clean up after the majors now....
-
-	if ( maj->first == NULL )	// Block completely unused.
-	{
-		if ( l_memRoot == maj ) l_memRoot = maj->next;
-		if ( l_bestBet == maj ) l_bestBet = NULL;
-		if ( maj->prev != NULL ) maj->prev->next = maj->next;
-		if ( maj->next != NULL ) maj->next->prev = maj->prev;
-		l_allocated -= maj->size;
-
-		liballoc_free( maj, maj->pages );
-	}
-	else
-	{
-		if ( l_bestBet != NULL )
-		{
-			int bestSize = l_bestBet->size  - l_bestBet->usage;
-			int majSize = maj->size - maj->usage;
-
-			if ( majSize > bestSize ) l_bestBet = maj;
-		}
-
-	}
+		free_minor( arena, min );
 	
 
 	#ifdef DEBUG
@@ -714,7 +800,7 @@ void PREFIX(free)(void *ptr)
 	FLUSH();
 	#endif
 	
-	liballoc_unlock();		// release the lock
+	liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 }
 
 
@@ -739,6 +825,7 @@ void* PREFIX(calloc)(size_t nobj, size_t size)
 
 void*   PREFIX(realloc)(void *p, size_t size)
 {
+	struct liballoc_arena *arena;
 	void *ptr;
 	struct liballoc_minor *min;
 	unsigned int real_size;
@@ -757,10 +844,11 @@ void*   PREFIX(realloc)(void *p, size_t size)
 	ptr = p;
 	UNALIGN(ptr);
 
-	liballoc_lock();		// lockit
-
 		min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof( struct liballoc_minor ));
 
+	arena = liballoc_owner( min );
+	liballoc_lock( ARENA_INDEX( arena ) );		// lockit
+
 		// Ensure it is a valid structure.
 		if ( min->magic != LIBALLOC_MAGIC ) 
 		{
@@ -803,7 +891,7 @@ void*   PREFIX(realloc)(void *p, size_t size)
 			}
 			
 			// being lied to...
-			liballoc_unlock();		// release the lock
+			liballoc_unlock( ARENA_INDEX( arena ) );		// release the lock
 			return NULL;
 		}	
 		
@@ -814,11 +902,11 @@ void*   PREFIX(realloc)(void *p, size_t size)
 		if ( real_size >= size ) 
 		{
 			min->req_size = size;
-			liballoc_unlock();
+			liballoc_unlock( ARENA_INDEX( arena ) );
 			return p;
 		}
 
-	liballoc_unlock();
+	liballoc_unlock( ARENA_INDEX( arena ) );
 
 	// If we got here then we're reallocating to a block bigger than us.
 	ptr = PREFIX(malloc)( size );					// We need to allocate new memory
@@ -830,4 +918,24 @@ void*   PREFIX(realloc)(void *p, size_t size)
 
 
 
+void liballoc_get_stats( unsigned int index, struct liballoc_stats *stats )
+{
+	struct liballoc_arena *arena = &l_arenas[ index ];
+	struct liballoc_major *maj;
+
+	liballoc_lock( index );
+
+	drain_remote( arena );
+
+	stats->allocated = l_allocated;
+	stats->inuse = l_inuse;
+	stats->majors = 0;
+	stats->remote_frees = arena->remoteFrees;
+	stats->errors = l_errorCount;
+
+	for ( maj = l_memRoot; maj != NULL; maj = maj->next )
+		stats->majors++;
+
+	liballoc_unlock( index );
+}
 
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIST_H
+#define LIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Intrusive doubly linked list, the node is embedded in the object so linking
+// never allocates. A list is a circular chain through its own head node.
+struct list_node {
+	struct list_node *next;
+	struct list_node *prev;
+};
+
+#define LIST_INIT(NAME) {.next = &(NAME), .prev = &(NAME)}
+
+#define LIST_ENTRY(NODE, TYPE, MEMBER) \
+	((TYPE *)((char *)(NODE) - offsetof(TYPE, MEMBER)))
+
+#define LIST_FOR_EACH(POS, HEAD, MEMBER)                       \
+	for (POS = LIST_ENTRY((HEAD)->next, typeof(*POS), MEMBER); \
+		 &POS->MEMBER != (HEAD);                               \
+		 POS = LIST_ENTRY(POS->MEMBER.next, typeof(*POS), MEMBER))
+
+static inline void list_init(struct list_node *head) {
+	head->next = head;
+	head->prev = head;
+}
+
+static inline bool list_empty(struct list_node *head) {
+	return head->next == head;
+}
+
+static inline void list_insert(struct list_node *node, struct list_node *prev,
+							   struct list_node *next) {
+	node->prev = prev;
+	node->next = next;
+	prev->next = node;
+	next->prev = node;
+}
+
+static inline void list_push_front(struct list_node *head,
+								   struct list_node *node) {
+	list_insert(node, head, head->next);
+}
+
+static inline void list_push_back(struct list_node *head,
+								  struct list_node *node) {
+	list_insert(node, head->prev, head);
+}
+
+static inline void list_remove(struct list_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node;
+	node->prev = node;
+}
+
+#endif
@@ -18,15 +18,246 @@
  * limitations under the License.
  */
 
+#include "../cpu/cpu.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef volatile bool lock_t;
+// Lock statistics, per place a lock is taken from. Only gathered when built
+// with LOCKSTAT defined (make LOCKSTAT=1), see lockstat.c.
+struct lockstat_site {
+	const char *name;
+	const char *file;
+	int line;
+	bool registered;
+	struct lockstat_site *next;
+	size_t acquisitions;
+	size_t contended;
+	// In TSC ticks
+	uint64_t spin_cycles;
+	uint64_t max_hold;
+};
 
-#define LOCK(name)                                     \
-	while (!__sync_bool_compare_and_swap(&name, 0, 1)) \
-		while (name)                                   \
+#ifdef LOCKSTAT
+#define LOCKSTAT_SITE(NAME)                                         \
+	({                                                              \
+		static struct lockstat_site lockstat_site_ = {              \
+			.name = NAME, .file = __FILE__, .line = __LINE__};      \
+		&lockstat_site_;                                            \
+	})
+
+void lockstat_register(struct lockstat_site *site);
+
+static inline void lockstat_acquired(struct lockstat_site *site,
+									 bool contended, uint64_t spin) {
+	if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+		lockstat_register(site);
+
+	__atomic_add_fetch(&site->acquisitions, 1, __ATOMIC_RELAXED);
+	if (contended) {
+		__atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->spin_cycles, spin, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void lockstat_released(struct lockstat_site *site,
+									 uint64_t acquired) {
+	uint64_t hold = rdtsc() - acquired;
+	uint64_t max = __atomic_load_n(&site->max_hold, __ATOMIC_RELAXED);
+	while (hold > max &&
+		   !__atomic_compare_exchange_n(&site->max_hold, &max, hold, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+#else
+#define LOCKSTAT_SITE(NAME) ((struct lockstat_site *)NULL)
+#endif
+
+// Ticket lock, processors get the lock in the order they asked for it and
+// spin on reads of the owner until their ticket comes up
+typedef struct {
+	union {
+		uint32_t value;
+		struct {
+			uint16_t owner;
+			uint16_t next;
+		};
+	};
+#ifdef LOCKSTAT
+	struct lockstat_site *site;
+	uint64_t acquired;
+#endif
+} lock_t;
+
+static inline void lock_acquire_at(lock_t *lock, struct lockstat_site *site) {
+	uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+#ifdef LOCKSTAT
+	bool contended = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != ticket;
+	uint64_t start = rdtsc();
+#else
+	(void)site;
+#endif
+
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		asm volatile("pause");
+
+#ifdef LOCKSTAT
+	lock->acquired = rdtsc();
+	lock->site = site;
+	lockstat_acquired(site, contended, lock->acquired - start);
+#endif
+}
+
+static inline bool lock_try_at(lock_t *lock, struct lockstat_site *site) {
+	uint32_t old = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+	uint16_t owner = old, next = old >> 16;
+	(void)site;
+
+	if (owner != next)
+		return false;
+
+	uint32_t new = old + (1U << 16);
+	if (!__atomic_compare_exchange_n(&lock->value, &old, new, false,
+									 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+
+#ifdef LOCKSTAT
+	lock->acquired = rdtsc();
+	lock->site = site;
+	lockstat_acquired(site, false, 0);
+#endif
+	return true;
+}
+
+static inline void lock_release(lock_t *lock) {
+#ifdef LOCKSTAT
+	struct lockstat_site *site = lock->site;
+	uint64_t acquired = lock->acquired;
+#endif
+
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+
+#ifdef LOCKSTAT
+	lockstat_released(site, acquired);
+#endif
+}
+
+// Take a lock with interrupts disabled, for locks also taken by interrupt
+// handlers. Returns the RFLAGS to give back to lock_irqrestore().
+static inline uint64_t lock_irqsave_at(lock_t *lock,
+									   struct lockstat_site *site) {
+	uint64_t rflags = cpu_irq_save();
+	lock_acquire_at(lock, site);
+	return rflags;
+}
+
+static inline void lock_irqrestore(lock_t *lock, uint64_t rflags) {
+	lock_release(lock);
+	cpu_irq_restore(rflags);
+}
+
+#define lock_acquire(lock) lock_acquire_at(lock, LOCKSTAT_SITE(#lock))
+#define lock_try(lock) lock_try_at(lock, LOCKSTAT_SITE(#lock))
+#define lock_irqsave(lock) lock_irqsave_at(lock, LOCKSTAT_SITE(#lock))
+
+#define LOCK(name) lock_acquire_at(&(name), LOCKSTAT_SITE(#name))
+#define UNLOCK(name) lock_release(&(name))
+
+// Sequence lock for read-mostly data. Writers serialize on the lock and keep
+// the count odd while changing the data, lockless readers check that it
+// didn't move to know that what they saw was consistent.
+typedef struct {
+	lock_t lock;
+	unsigned seq;
+} seqlock_t;
+
+static inline unsigned seq_read_begin(seqlock_t *seqlock) {
+	return __atomic_load_n(&seqlock->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline bool seq_read_retry(seqlock_t *seqlock, unsigned seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || __atomic_load_n(&seqlock->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seq_write_lock_at(seqlock_t *seqlock,
+									 struct lockstat_site *site) {
+	lock_acquire_at(&seqlock->lock, site);
+	__atomic_store_n(&seqlock->seq, seqlock->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_unlock(seqlock_t *seqlock) {
+	__atomic_store_n(&seqlock->seq, seqlock->seq + 1, __ATOMIC_RELEASE);
+	lock_release(&seqlock->lock);
+}
+
+#define SEQ_WRITE_LOCK(name) seq_write_lock_at(&(name), LOCKSTAT_SITE(#name))
+#define SEQ_WRITE_UNLOCK(name) seq_write_unlock(&(name))
+
+// MCS queued lock, for heavily contended locks. Every waiter spins on its own
+// node instead of the shared lock, the node has to stay around until released.
+struct mcs_node {
+	struct mcs_node *next;
+	bool locked;
+};
+
+typedef struct {
+	struct mcs_node *tail;
+#ifdef LOCKSTAT
+	struct lockstat_site *site;
+	uint64_t acquired;
+#endif
+} mcs_lock_t;
+
+static inline void mcs_acquire_at(mcs_lock_t *lock, struct mcs_node *node,
+								  struct lockstat_site *site) {
+	node->next = NULL;
+	node->locked = true;
+#ifdef LOCKSTAT
+	uint64_t start = rdtsc();
+#else
+	(void)site;
+#endif
+
+	struct mcs_node *prev =
+		__atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev != NULL) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
 			asm volatile("pause");
+	}
+
+#ifdef LOCKSTAT
+	lock->acquired = rdtsc();
+	lock->site = site;
+	lockstat_acquired(site, prev != NULL, lock->acquired - start);
+#endif
+}
+
+static inline void mcs_release(mcs_lock_t *lock, struct mcs_node *node) {
+#ifdef LOCKSTAT
+	lockstat_released(lock->site, lock->acquired);
+#endif
+
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (next == NULL) {
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		// A waiter swapped itself in but has yet to link to us
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			asm volatile("pause");
+	}
+
+	__atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
 
-#define UNLOCK(name) __sync_lock_release(&name)
+#define MCS_LOCK(name, node) \
+	mcs_acquire_at(&(name), &(node), LOCKSTAT_SITE(#name))
+#define MCS_UNLOCK(name, node) mcs_release(&(name), &(node))
 
 #endif
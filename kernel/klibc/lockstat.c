@@ -0,0 +1,119 @@
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lockstat.h"
+#include "../dev/dev.h"
+#include "lock.h"
+#include "mem.h"
+#include "printf.h"
+#include "resource.h"
+#include "types.h"
+#include <liballoc.h>
+#include <stddef.h>
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_LINE 160
+
+// Every site that was used at least once, newest first
+static struct lockstat_site *sites = NULL;
+
+void lockstat_register(struct lockstat_site *site) {
+	if (__atomic_exchange_n(&site->registered, true, __ATOMIC_ACQ_REL))
+		return;
+
+	struct lockstat_site *head = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+	do
+		site->next = head;
+	while (!__atomic_compare_exchange_n(&sites, &head, site, false,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static size_t format_site(char *buf, size_t size, struct lockstat_site *site) {
+	size_t contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+	uint64_t spin = __atomic_load_n(&site->spin_cycles, __ATOMIC_RELAXED);
+	int ret = snprintf(buf, size, "%s %s:%d %zu %zu %llu %llu %llu\n",
+					   site->name, site->file, site->line,
+					   __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED),
+					   contended, spin, contended ? spin / contended : 0,
+					   __atomic_load_n(&site->max_hold, __ATOMIC_RELAXED));
+	if (ret < 0)
+		return 0;
+	return (size_t)ret < size ? (size_t)ret : size - 1;
+}
+
+static const char header[] = "name site acquisitions contended spin_cycles "
+							 "avg_spin max_hold\n";
+
+void lockstat_dump(void) {
+	char line[LOCKSTAT_LINE];
+	printf("lockstat: %s", header);
+	for (struct lockstat_site *site =
+			 __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+		 site; site = site->next) {
+		format_site(line, sizeof(line), site);
+		printf("lockstat: %s", line);
+	}
+}
+
+static ssize_t lockstat_read(struct resource *this, void *buf, off_t loc,
+							 size_t count) {
+	(void)this;
+
+	size_t site_count = 0;
+	struct lockstat_site *head = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+	for (struct lockstat_site *site = head; site; site = site->next)
+		site_count++;
+
+	size_t size = sizeof(header) + site_count * LOCKSTAT_LINE;
+	char *text = kmalloc(size);
+	if (text == NULL)
+		return -1;
+
+	size_t length = snprintf(text, size, "%s", header);
+	for (struct lockstat_site *site = head; site; site = site->next)
+		length += format_site(text + length, LOCKSTAT_LINE, site);
+
+	if ((size_t)loc >= length) {
+		count = 0;
+	} else {
+		if (count > length - loc)
+			count = length - loc;
+		memcpy(buf, text + loc, count);
+	}
+
+	kfree(text);
+	return count;
+}
+
+// Expose the statistics as /dev/lockstat, devtmpfs has to be mounted
+void lockstat_init(void) {
+	struct resource *res = resource_create(sizeof(struct resource));
+	res->read = lockstat_read;
+	res->st.st_mode = S_IFCHR | 0444;
+	dev_add_new(res, "lockstat");
+}
+
+#else
+
+void lockstat_init(void) {
+}
+
+void lockstat_dump(void) {
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "log.h"
+#include "../cpu/cpu.h"
+#include "../cpu/softirq.h"
+#include "../sched/sched.h"
+#include "../video/video.h"
+#include "lock.h"
+#include "printf.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bytes of the ring of each processor, a power of two
+#define LOG_RING_SIZE 16384
+
+// Messages are 16 byte aligned so a header never wraps, the text can
+struct log_record {
+	uint64_t seq;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+// Only its processor writes a ring, with interrupts disabled, and only the
+// log thread consumes it
+struct log_ring {
+	uint64_t head;
+	uint64_t tail;
+	// Messages dropped while the ring was full, and how many were reported
+	size_t lost;
+	size_t lost_reported;
+	char buf[LOG_RING_SIZE];
+};
+
+struct log_writer {
+	struct log_ring *ring;
+	uint64_t pos;
+	uint64_t limit;
+};
+
+static struct log_ring log_rings[MAX_CPUS];
+static uint64_t log_seq = 0;
+static bool log_async = false;
+static struct thread *log_thread = NULL;
+
+// Serializes writing to the console and serial
+lock_t print_lock;
+
+static void log_wake(void *arg);
+static struct tasklet log_wake_tasklet = TASKLET_INIT(log_wake, NULL);
+
+static inline size_t log_record_size(size_t len) {
+	return (sizeof(struct log_record) + len + 15) & ~15ULL;
+}
+
+static void log_out_console(char c, void *arg) {
+	(void)arg;
+	_putchar(c);
+}
+
+static void log_out_ring(char c, void *arg) {
+	struct log_writer *w = arg;
+	if (w->pos < w->limit)
+		w->ring->buf[w->pos & (LOG_RING_SIZE - 1)] = c;
+	w->pos++;
+}
+
+static bool log_ring_pending(struct log_ring *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) !=
+		   __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+// Write out the oldest message of all rings, false when there's none. The
+// caller holds print_lock.
+static bool log_drain_one(void) {
+	struct log_ring *oldest = NULL;
+	uint64_t oldest_seq = UINT64_MAX;
+
+	for (size_t i = 0; i < MAX_CPUS; i++) {
+		struct log_ring *ring = &log_rings[i];
+		if (!log_ring_pending(ring))
+			continue;
+		struct log_record *rec =
+			(void *)&ring->buf[ring->tail & (LOG_RING_SIZE - 1)];
+		if (rec->seq < oldest_seq) {
+			oldest = ring;
+			oldest_seq = rec->seq;
+		}
+	}
+
+	if (oldest == NULL)
+		return false;
+
+	uint64_t tail = oldest->tail;
+	struct log_record *rec = (void *)&oldest->buf[tail & (LOG_RING_SIZE - 1)];
+	for (uint32_t i = 0; i < rec->len; i++)
+		_putchar(oldest->buf[(tail + sizeof(*rec) + i) & (LOG_RING_SIZE - 1)]);
+
+	size_t lost = __atomic_load_n(&oldest->lost, __ATOMIC_RELAXED);
+	if (lost != oldest->lost_reported) {
+		fctprintf(log_out_console, NULL, "log: %zu messages lost\n",
+				  lost - oldest->lost_reported);
+		oldest->lost_reported = lost;
+	}
+
+	__atomic_store_n(&oldest->tail, tail + log_record_size(rec->len),
+					 __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool log_pending(void) {
+	for (size_t i = 0; i < MAX_CPUS; i++)
+		if (log_ring_pending(&log_rings[i]))
+			return true;
+	return false;
+}
+
+static void log_drain(void) {
+	for (;;) {
+		uint64_t rflags = lock_irqsave(&print_lock);
+		bool drained = log_drain_one();
+		// Everything written since the last flush goes out in one go,
+		// scrolling included
+		if (!drained)
+			video_flush();
+		lock_irqrestore(&print_lock, rflags);
+		if (!drained)
+			return;
+	}
+}
+
+static void log_main(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		log_drain();
+
+		// A message published after the state is set finds the thread
+		// blocked and wakes it, one published before is seen here
+		uint64_t rflags = cpu_irq_save();
+		enum thread_state blocked = THREAD_BLOCKED;
+		__atomic_store_n(&log_thread->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+		if (!log_pending() ||
+			!__atomic_compare_exchange_n(&log_thread->state, &blocked,
+										 THREAD_RUNNING, false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			sched_block();
+		cpu_irq_restore(rflags);
+	}
+}
+
+// printf() may be called with scheduler locks held, so the log thread is
+// woken from a tasklet instead of right away
+static void log_wake(void *arg) {
+	(void)arg;
+	sched_wake(log_thread);
+}
+
+static int log_ring_write(const char *format, va_list va) {
+	uint64_t rflags = cpu_irq_save();
+	struct log_ring *ring = &log_rings[this_cpu_read(cpu_number)];
+
+	uint64_t head = ring->head;
+	struct log_writer w = {
+		.ring = ring,
+		.pos = head + sizeof(struct log_record),
+		.limit = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) +
+				 LOG_RING_SIZE};
+	int len = vfctprintf(log_out_ring, &w, format, va);
+
+	if (head + log_record_size(len) > w.limit) {
+		__atomic_store_n(&ring->lost, ring->lost + 1, __ATOMIC_RELAXED);
+	} else {
+		struct log_record *rec = (void *)&ring->buf[head & (LOG_RING_SIZE - 1)];
+		rec->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+		rec->len = len;
+		__atomic_store_n(&ring->head, head + log_record_size(len),
+						 __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&log_thread->state, __ATOMIC_SEQ_CST) ==
+			THREAD_BLOCKED)
+			tasklet_schedule(&log_wake_tasklet);
+	}
+
+	cpu_irq_restore(rflags);
+	return len;
+}
+
+int log_vprintf(const char *format, va_list va) {
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		return log_ring_write(format, va);
+
+	uint64_t rflags = lock_irqsave(&print_lock);
+	int len = vfctprintf(log_out_console, NULL, format, va);
+	video_flush();
+	lock_irqrestore(&print_lock, rflags);
+	return len;
+}
+
+void log_init(void) {
+	log_thread = thread_create("log", log_main, NULL, SCHED_ANY_CPU);
+	__atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+}
+
+void log_panic(void) {
+	if (!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+		return;
+
+	// The processor that panicked may hold print_lock, or another one that
+	// was stopped while writing, so after a while the lock is ignored
+	bool locked = false;
+	for (size_t i = 0; i < 1000000 && !locked; i++)
+		locked = lock_try(&print_lock);
+	while (log_drain_one())
+		;
+	video_flush();
+	if (locked)
+		UNLOCK(print_lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+// printf() goes through here. Until log_init() output is synchronous, after
+// it a message is only formatted into the ring of its processor and a thread
+// writes it out to the console and serial in the order messages were made.
+int log_vprintf(const char *format, va_list va);
+void log_init(void);
+// Write out everything logged so far and make logging synchronous, for a
+// kernel that won't get to schedule the log thread again
+void log_panic(void);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// LZ4 frames and the legacy format the Linux kernel boots from
+
+#include "decompress.h"
+
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK ((size_t)8 << 20)
+
+#define LZ4_FLG_VERSION(flg) ((flg) >> 6)
+#define LZ4_FLG_BLOCK_CHECKSUM (1 << 4)
+#define LZ4_FLG_CONTENT_SIZE (1 << 3)
+#define LZ4_FLG_CONTENT_CHECKSUM (1 << 2)
+#define LZ4_FLG_DICT_ID (1 << 0)
+
+#define LZ4_BLOCK_UNCOMPRESSED (1U << 31)
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Lengths of 15 continue in the following bytes
+static bool read_length(const uint8_t **p, const uint8_t *end, size_t *len) {
+	if (*len != 15)
+		return true;
+
+	uint8_t byte;
+	do {
+		if (*p == end)
+			return false;
+		byte = *(*p)++;
+		*len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+static bool block(struct decompress_window *out, const uint8_t *p,
+				  const uint8_t *end) {
+	while (p < end) {
+		uint8_t token = *p++;
+
+		size_t literals = token >> 4;
+		if (!read_length(&p, end, &literals) ||
+			(size_t)(end - p) < literals)
+			return false;
+		while (literals--)
+			window_put(out, *p++);
+
+		// The last sequence has no match
+		if (p == end)
+			return true;
+
+		if (end - p < 2)
+			return false;
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+
+		size_t match = token & 15;
+		if (!read_length(&p, end, &match) ||
+			!window_copy(out, offset, match + 4))
+			return false;
+	}
+
+	return true;
+}
+
+static bool frame(struct decompress_window *out, const uint8_t *p,
+				  const uint8_t *end) {
+	// Flags, block descriptor and header checksum
+	if (end - p < 3)
+		return false;
+	uint8_t flg = p[0];
+	if (LZ4_FLG_VERSION(flg) != 1 || (flg & LZ4_FLG_DICT_ID))
+		return false;
+	p += 2 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + 1;
+
+	for (;;) {
+		if (end - p < 4)
+			return false;
+		uint32_t size = read_le32(p);
+		p += 4;
+		if (size == 0)
+			break;
+
+		bool uncompressed = size & LZ4_BLOCK_UNCOMPRESSED;
+		size &= ~LZ4_BLOCK_UNCOMPRESSED;
+		if ((size_t)(end - p) < size)
+			return false;
+
+		if (uncompressed) {
+			for (uint32_t i = 0; i < size; i++)
+				window_put(out, p[i]);
+		} else if (!block(out, p, p + size)) {
+			return false;
+		}
+		p += size + ((flg & LZ4_FLG_BLOCK_CHECKSUM) ? 4 : 0);
+	}
+
+	return true;
+}
+
+static bool legacy(struct decompress_window *out, const uint8_t *p,
+				   const uint8_t *end) {
+	// Blocks follow until the input ends or something else starts
+	while (end - p >= 4) {
+		uint32_t size = read_le32(p);
+		if (size == LZ4_MAGIC || size == LZ4_LEGACY_MAGIC || size == 0)
+			break;
+		p += 4;
+		if ((size_t)(end - p) < size || size > LZ4_LEGACY_BLOCK)
+			return false;
+		if (!block(out, p, p + size))
+			return false;
+		p += size;
+	}
+
+	return true;
+}
+
+bool lz4_decompress(const void *data, size_t size, decompress_sink_t sink,
+					void *ctx) {
+	const uint8_t *p = data, *end = p + size;
+
+	if (size < 4)
+		return false;
+	uint32_t magic = read_le32(p);
+	if (magic != LZ4_MAGIC && magic != LZ4_LEGACY_MAGIC)
+		return false;
+
+	struct decompress_window out;
+	if (!window_init(&out, DECOMPRESS_WINDOW, sink, ctx))
+		return false;
+
+	bool ok = magic == LZ4_MAGIC ? frame(&out, p + 4, end)
+								 : legacy(&out, p + 4, end);
+	window_finish(&out);
+	return ok;
+}
@@ -16,9 +16,23 @@
  */
 
 #include "mem.h"
+#include "../cpu/alternative.h"
+#include <cpuid.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
+// Copies and fills of this size and more are written around the caches, they
+// would only evict everything in them
+#define MEM_NT_THRESHOLD ((size_t)1024 * 1024)
+// Without FSRM the string instructions take a while to get going, shorter
+// operations are done with plain moves
+#define MEM_ERMS_MIN 128
+
+#define CPUID_ERMS (1 << 9)
+#define CPUID_FSRM (1 << 4)
+
+static void *memcpy_generic(void *restrict dest, const void *restrict src,
+							size_t n) {
 	uint8_t *d = dest;
 	const uint8_t *s = src;
 
@@ -157,7 +171,7 @@ void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
 	return dest;
 }
 
-void *memset(void *dest, int c, size_t n) {
+static void *memset_generic(void *dest, int c, size_t n) {
 	uint8_t *s = dest;
 	size_t k;
 
@@ -227,6 +241,118 @@ void *memset(void *dest, int c, size_t n) {
 	return dest;
 }
 
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+	asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t c, size_t n) {
+	asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+static void *memcpy_erms(void *restrict dest, const void *restrict src,
+						 size_t n) {
+	if (n < MEM_ERMS_MIN)
+		return memcpy_generic(dest, src, n);
+	rep_movsb(dest, src, n);
+	return dest;
+}
+
+static void *memcpy_fsrm(void *restrict dest, const void *restrict src,
+						 size_t n) {
+	rep_movsb(dest, src, n);
+	return dest;
+}
+
+static void *memset_erms(void *dest, int c, size_t n) {
+	if (n < MEM_ERMS_MIN)
+		return memset_generic(dest, c, n);
+	rep_stosb(dest, c, n);
+	return dest;
+}
+
+typedef uint64_t __attribute__((__may_alias__)) u64_alias;
+
+static inline void movnti(void *dest, uint64_t value) {
+	asm volatile("movnti %0, %1" : "=m"(*(u64_alias *)dest) : "r"(value));
+}
+
+// Non-temporal stores go through write-combining buffers, they're ordered
+// with an sfence before anything else may look at the memory
+static void memcpy_nt(void *dest, const void *src, size_t n) {
+	uint8_t *d = dest;
+	const uint8_t *s = src;
+	size_t head = -(uintptr_t)d & 7;
+
+	memcpy_generic(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 32; n -= 32, d += 32, s += 32) {
+		movnti(d + 0, *(const u64_alias *)(s + 0));
+		movnti(d + 8, *(const u64_alias *)(s + 8));
+		movnti(d + 16, *(const u64_alias *)(s + 16));
+		movnti(d + 24, *(const u64_alias *)(s + 24));
+	}
+	asm volatile("sfence" : : : "memory");
+	memcpy_generic(d, s, n);
+}
+
+static void memset_nt(void *dest, uint8_t c, size_t n) {
+	uint8_t *d = dest;
+	uint64_t c64 = 0x0101010101010101ULL * c;
+	size_t head = -(uintptr_t)d & 7;
+
+	memset_generic(d, c, head);
+	d += head;
+	n -= head;
+
+	for (; n >= 32; n -= 32, d += 32) {
+		movnti(d + 0, c64);
+		movnti(d + 8, c64);
+		movnti(d + 16, c64);
+		movnti(d + 24, c64);
+	}
+	asm volatile("sfence" : : : "memory");
+	memset_generic(d, c, n);
+}
+
+// The string instruction versions are patched in by alternatives_apply(),
+// until then the generic ones are used
+void mem_init(void) {
+	uint32_t a, b, c, d;
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return;
+
+	if (b & CPUID_ERMS) {
+		cpu_feature_set(CPU_FEATURE_ERMS);
+		if (d & CPUID_FSRM)
+			cpu_feature_set(CPU_FEATURE_FSRM);
+	}
+}
+
+void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
+	if (n >= MEM_NT_THRESHOLD) {
+		memcpy_nt(dest, src, n);
+		return dest;
+	}
+	if (cpu_has(CPU_FEATURE_FSRM))
+		return memcpy_fsrm(dest, src, n);
+	if (cpu_has(CPU_FEATURE_ERMS))
+		return memcpy_erms(dest, src, n);
+	return memcpy_generic(dest, src, n);
+}
+
+void *memset(void *dest, int c, size_t n) {
+	if (n >= MEM_NT_THRESHOLD) {
+		memset_nt(dest, c, n);
+		return dest;
+	}
+	if (cpu_has(CPU_FEATURE_ERMS))
+		return memset_erms(dest, c, n);
+	return memset_generic(dest, c, n);
+}
+
 #ifdef __GNUC__
 typedef __attribute__((__may_alias__)) size_t WT;
 #define WS (sizeof(WT))
@@ -242,6 +368,12 @@ void *memmove(void *dest, const void *src, size_t n) {
 		return memcpy(d, s, n);
 
 	if (d < s) {
+		// Fast strings copy forward byte by byte as far as the result is
+		// concerned, which is what an overlap with d below s needs
+		if (cpu_has(CPU_FEATURE_ERMS) && n >= MEM_ERMS_MIN) {
+			rep_movsb(d, s, n);
+			return dest;
+		}
 #ifdef __GNUC__
 		if ((uintptr_t)s % WS == (uintptr_t)d % WS) {
 			while ((uintptr_t)d % WS) {
@@ -297,6 +429,12 @@ void *memchr(const void *src, int c, size_t n) {
 
 int memcmp(const void *vl, const void *vr, size_t n) {
 	const uint8_t *l = vl, *r = vr;
+#ifdef __GNUC__
+	// Equal words are skipped, the bytes of the first differing one decide
+	for (; n >= WS && *(const WT *)l == *(const WT *)r;
+		 n -= WS, l += WS, r += WS)
+		;
+#endif
 	for (; n && *l == *r; n--, l++, r++)
 		;
 	return n ? *l - *r : 0;
@@ -25,6 +25,8 @@
 #define HIGHS (ONES * (UCHAR_MAX / 2 + 1))
 #define HASZERO(x) (((x)-ONES) & ~(x)&HIGHS)
 
+// Pick the versions the processor runs fastest
+void mem_init(void);
 void *memcpy(void *restrict dest, const void *restrict src, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *vl, const void *vr, size_t n);
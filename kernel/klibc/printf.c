@@ -35,9 +35,14 @@
 
 #include "printf.h"
 
-#include "lock.h"
+#include "log.h"
 
 
+// The kernel is built with -mgeneral-regs-only, there are no floating point
+// types to print
+#define PRINTF_DISABLE_SUPPORT_FLOAT
+#define PRINTF_DISABLE_SUPPORT_EXPONENTIAL
+
 // define this globally (e.g. gcc -DPRINTF_INCLUDE_CONFIG_H ...) to include the
 // printf_config.h header file
 // default: undefined
@@ -861,19 +866,12 @@ static int _vsnprintf(out_fct_type out, char* buffer, const size_t maxlen, const
 
 ///////////////////////////////////////////////////////////////////////////////
 
-lock_t print_lock;
-
 int printf_(const char* format, ...)
 {
-  LOCK(print_lock);
-  asm volatile("cli");
   va_list va;
   va_start(va, format);
-  char buffer[1];
-  const int ret = _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  const int ret = log_vprintf(format, va);
   va_end(va);
-  UNLOCK(print_lock);
-  asm volatile("sti");
   return ret;
 }
 
@@ -900,8 +898,7 @@ int snprintf_(char* buffer, size_t count, const char* format, ...)
 
 int vprintf_(const char* format, va_list va)
 {
-  char buffer[1];
-  return _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  return log_vprintf(format, va);
 }
 
 
@@ -920,3 +917,10 @@ int fctprintf(void (*out)(char character, void* arg), void* arg, const char* for
   va_end(va);
   return ret;
 }
+
+
+int vfctprintf(void (*out)(char character, void* arg), void* arg, const char* format, va_list va)
+{
+  const out_fct_wrap_type out_fct_wrap = { out, arg };
+  return _vsnprintf(_out_fct, (char*)(uintptr_t)&out_fct_wrap, (size_t)-1, format, va);
+}
@@ -16,84 +16,153 @@
  */
 
 #include "rand.h"
+#include "../cpu/cpu.h"
 #include "../sys/clock.h"
+#include "mem.h"
 #include <cpuid.h>
+#include <stdbool.h>
 
-// Mersenne Twister
-// Based on mt19937ar.c found here:
-// http://www.math.sci.hiroshima-u.ac.jp/m-mat/MT/MT2002/CODES/mt19937ar.c
-
-#define W 64
-#define N 312
-#define M 156
-#define R 31
-
-#define A 0xB5026F5AA96619E9ULL
-#define U 29
-#define D 0x5555555555555555ULL
-#define S 17
-#define B 0x71D67FFFEDA60000ULL
-#define T 37
-#define C 0xFFF7EEE000000000ULL
-#define L 43
-#define F 6364136223846793005
-
-#define MASK_LOW ((1ULL << R) - 1)
-#define MASK_UPP (~MASK_LOW)
-
-static uint64_t state[N];
-static uint32_t index = N + 1;
-
-static void twist(void) {
-	for (uint32_t i = 0; i < N; ++i) {
-		uint64_t x = (state[i] & MASK_UPP) + (state[(i + 1) % N] & MASK_LOW);
-		uint64_t xa = x >> 1;
-		if (x & 1) {
-			xa ^= A;
-		}
-		state[i] = state[(i + M) % N] ^ xa;
-	}
-	index = 0;
+// xoshiro256** with a state per processor, so generating a number touches no
+// shared cache line and takes no lock. Each state is seeded from the hardware
+// when its processor first asks for a number.
+// Based on xoshiro256starstar.c found here:
+// https://prng.di.unimi.it/xoshiro256starstar.c
+
+// Attempts at RDSEED and RDRAND before falling back, both may run dry for a
+// moment when other processors use them
+#define RDSEED_RETRIES 64
+#define RDRAND_RETRIES 10
+
+struct rand_state {
+	uint64_t s[4];
+	bool seeded;
+} __attribute__((aligned(64)));
+
+static struct rand_state rand_states[MAX_CPUS];
+#if CONFIG_X86_ASSUME_RDSEED
+static const bool has_rdseed = true;
+#else
+static bool has_rdseed = false;
+#endif
+#if CONFIG_X86_ASSUME_RDRAND
+static const bool has_rdrand = true;
+#else
+static bool has_rdrand = false;
+#endif
+
+void rand_init(void) {
+	__attribute__((unused)) uint32_t a = 0, b = 0, c = 0, d = 0;
+
+#if !CONFIG_X86_ASSUME_RDRAND
+	if (__get_cpuid(1, &a, &b, &c, &d))
+		has_rdrand = c & bit_RDRND;
+#endif
+#if !CONFIG_X86_ASSUME_RDSEED
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		has_rdseed = b & bit_RDSEED;
+#endif
+}
+
+// The carry flag tells whether a number was available
+static bool rdseed(uint64_t *value) {
+	bool ok;
+	asm volatile("rdseed %0" : "=r"(*value), "=@ccc"(ok));
+	return ok;
+}
+
+static bool rdrand(uint64_t *value) {
+	bool ok;
+	asm volatile("rdrand %0" : "=r"(*value), "=@ccc"(ok));
+	return ok;
+}
+
+static uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
 }
 
 // Generate number that can be used as seed
 uint64_t get_rdseed(void) {
-	uint64_t rdseed;
-	uint32_t a = 0, b = 0, c = 0, d = 0;
-
-	// Use rdseed when possible
-	__get_cpuid(7, &a, &b, &c, &d);
-	if ((b & bit_RDSEED)) {
-		asm("rdseed %0" : "=r"(rdseed));
-	} else {
-		rdseed = get_unix_timestamp();
+	uint64_t value;
+
+	for (size_t i = 0; has_rdseed && i < RDSEED_RETRIES; i++) {
+		if (rdseed(&value))
+			return value;
+		asm volatile("pause");
 	}
+	for (size_t i = 0; has_rdrand && i < RDRAND_RETRIES; i++)
+		if (rdrand(&value))
+			return value;
+
+	// Without either, the time is all there is
+	value = rdtsc() ^ get_unix_timestamp() << 32;
+	return splitmix64(&value);
+}
+
+static void rand_seed_state(struct rand_state *st, uint64_t seed) {
+	// xoshiro must not start from all zeroes, which splitmix64 never gives
+	for (size_t i = 0; i < 4; i++)
+		st->s[i] = splitmix64(&seed);
+	st->seeded = true;
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(struct rand_state *st) {
+	uint64_t *s = st->s;
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
 
-	return rdseed;
+	return result;
 }
 
+// The state of this processor, seeded if needed. Interrupts are disabled
+// so a handler on the same processor can't use it at the same time.
+static struct rand_state *rand_this_state(void) {
+	struct rand_state *st = &rand_states[this_cpu_read(cpu_number)];
+	if (!st->seeded)
+		rand_seed_state(st, get_rdseed());
+	return st;
+}
+
+// Seeds the state of the calling processor only
 void srand(uint64_t seed) {
-	state[0] = seed;
-	index = N;
-	for (uint32_t i = 1; i < N; ++i) {
-		state[i] = F * (state[i - 1] ^ (state[i - 1] >> (W - 2))) + i;
-	}
+	uint64_t rflags = cpu_irq_save();
+	rand_seed_state(&rand_states[this_cpu_read(cpu_number)], seed);
+	cpu_irq_restore(rflags);
 }
 
 uint64_t rand(void) {
-	if (index >= N) {
-		if (index > N) {
-			srand(5489);
-		}
-		twist();
-	}
+	uint64_t rflags = cpu_irq_save();
+	uint64_t value = xoshiro_next(rand_this_state());
+	cpu_irq_restore(rflags);
+	return value;
+}
 
-	uint64_t y = state[index];
-	y ^= (y >> U) & D;
-	y ^= (y << S) & B;
-	y ^= (y << T) & C;
-	y ^= y >> L;
+void rand_fill(void *buf, size_t len) {
+	uint8_t *out = buf;
 
-	++index;
-	return y;
+	uint64_t rflags = cpu_irq_save();
+	struct rand_state *st = rand_this_state();
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		uint64_t value = xoshiro_next(st);
+		memcpy(out, &value, sizeof(value));
+		out += sizeof(value);
+	}
+	if (len) {
+		uint64_t value = xoshiro_next(st);
+		memcpy(out, &value, len);
+	}
+	cpu_irq_restore(rflags);
 }
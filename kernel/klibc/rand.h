@@ -18,10 +18,16 @@
 #ifndef RAND_H
 #define RAND_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+// Look up RDSEED and RDRAND once at boot
+void rand_init(void);
+// Fast pseudo-random numbers, not for keys
 uint64_t rand(void);
 void srand(uint64_t seed);
+void rand_fill(void *buf, size_t len);
+// A number from the hardware random source, to seed with
 uint64_t get_rdseed(void);
 
 #endif
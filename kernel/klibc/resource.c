@@ -1,8 +1,22 @@
 #include "resource.h"
+#include "../mm/slab.h"
+#include "aio.h"
+#include "lock.h"
 #include "types.h"
 #include <liballoc.h>
 #include <stddef.h>
 
+// Resources come in a handful of sizes, one per kind of backing object, so
+// each size gets its own slab cache
+#define RESOURCE_CACHES 8
+
+static struct {
+	size_t size;
+	struct slab_cache *cache;
+} resource_caches[RESOURCE_CACHES];
+
+static lock_t resource_cache_lock = {0};
+
 static int stub_close(struct resource *this) {
 	(void)this;
 	return -1;
@@ -32,8 +46,75 @@ static int stub_ioctl(struct resource *this, int request, ...) {
 	return -1;
 }
 
+static int stub_mmap(struct resource *this, struct pagemap *pagemap,
+					 uint64_t virt, size_t length, off_t loc, int prot,
+					 int flags) {
+	(void)this;
+	(void)pagemap;
+	(void)virt;
+	(void)length;
+	(void)loc;
+	(void)prot;
+	(void)flags;
+	return -1;
+}
+
+static ssize_t default_readv(struct resource *this, const struct iovec *iov,
+							 int iovcnt, off_t loc) {
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		ssize_t ret = this->read(this, iov[i].iov_base, loc, iov[i].iov_len);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		loc += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+static ssize_t default_writev(struct resource *this, const struct iovec *iov,
+							  int iovcnt, off_t loc) {
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		ssize_t ret = this->write(this, iov[i].iov_base, loc, iov[i].iov_len);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		loc += ret;
+		if ((size_t)ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+static struct slab_cache *resource_cache(size_t actual_size) {
+	struct slab_cache *ret = NULL;
+
+	if (actual_size > SLAB_MAX_OBJECT)
+		return NULL;
+
+	LOCK(resource_cache_lock);
+	for (size_t i = 0; i < RESOURCE_CACHES; i++) {
+		if (resource_caches[i].cache == NULL) {
+			resource_caches[i].size = actual_size;
+			resource_caches[i].cache = slab_cache_create(
+				"resource", actual_size, _Alignof(struct resource), NULL);
+		}
+		if (resource_caches[i].size == actual_size) {
+			ret = resource_caches[i].cache;
+			break;
+		}
+	}
+	UNLOCK(resource_cache_lock);
+
+	return ret;
+}
+
 void *resource_create(size_t actual_size) {
-	struct resource *new = kmalloc(actual_size);
+	struct slab_cache *cache = resource_cache(actual_size);
+	struct resource *new = cache ? slab_alloc(cache) : kmalloc(actual_size);
 
 	new->actual_size = actual_size;
 
@@ -41,6 +122,10 @@ void *resource_create(size_t actual_size) {
 	new->read = stub_read;
 	new->write = stub_write;
 	new->ioctl = stub_ioctl;
+	new->mmap = stub_mmap;
+	new->readv = default_readv;
+	new->writev = default_writev;
+	new->aio = aio_default;
 
 	return new;
 }
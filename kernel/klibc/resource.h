@@ -7,6 +7,9 @@
 
 // This is the base class for all kernel handles.
 
+struct aio_req;
+struct pagemap;
+
 struct resource {
 	size_t actual_size;
 
@@ -20,6 +23,20 @@ struct resource {
 	ssize_t (*write)(struct resource *this, const void *buf, off_t loc,
 					 size_t count);
 	int (*ioctl)(struct resource *this, int request, ...);
+	// Scatter/gather versions of read and write over consecutive bytes from
+	// loc, by default they call read and write once per buffer
+	ssize_t (*readv)(struct resource *this, const struct iovec *iov,
+					 int iovcnt, off_t loc);
+	ssize_t (*writev)(struct resource *this, const struct iovec *iov,
+					  int iovcnt, off_t loc);
+	// Map length bytes from loc, a multiple of the page size, at virt in
+	// pagemap. MAP_SHARED mappings access the resource's own memory,
+	// MAP_PRIVATE ones get a copy of each page written to.
+	int (*mmap)(struct resource *this, struct pagemap *pagemap, uint64_t virt,
+				size_t length, off_t loc, int prot, int flags);
+	// Start an operation of an aio ring, which is finished by aio_complete()
+	// and may be before this returns, see aio.h
+	void (*aio)(struct resource *this, struct aio_req *req);
 };
 
 void *resource_create(size_t actual_size);
@@ -18,18 +18,70 @@
 
 #include "string.h"
 #include "mem.h"
+#include <stdbool.h>
 
 // Mostly grabbed from Musl
-int strcmp(const char *l, const char *r) {
+
+#ifdef __GNUC__
+typedef size_t __attribute__((__may_alias__)) WT;
+#define WS (sizeof(WT))
+
+// The strings in a comparison may be aligned differently, so words are read
+// unaligned and only where they can't run into the next page, which may not
+// be mapped
+static inline bool word_in_page(const void *p) {
+	return ((uintptr_t)p & 4095) <= 4096 - WS;
+}
+#endif
+
+int strcmp(const char *_l, const char *_r) {
+	const uint8_t *l = (void *)_l, *r = (void *)_r;
+#ifdef __GNUC__
+	// Words that are equal and have no terminator in them are skipped, the
+	// bytes of the rest decide
+	for (;;) {
+		if (word_in_page(l) && word_in_page(r)) {
+			WT wl = *(const WT *)l;
+			if (wl != *(const WT *)r || HASZERO(wl))
+				break;
+			l += WS;
+			r += WS;
+		} else {
+			if (*l != *r || !*l)
+				return *l - *r;
+			l++;
+			r++;
+		}
+	}
+#endif
 	for (; *l == *r && *l; l++, r++)
 		;
-	return *(uint8_t *)l - *(uint8_t *)r;
+	return *l - *r;
 }
 
 int strncmp(const char *_l, const char *_r, size_t n) {
 	const uint8_t *l = (void *)_l, *r = (void *)_r;
 	if (!n--)
 		return 0;
+#ifdef __GNUC__
+	// As in strcmp, n stays above 0 so the byte loop has the last say
+	while (n >= WS) {
+		if (word_in_page(l) && word_in_page(r)) {
+			WT wl = *(const WT *)l;
+			if (wl != *(const WT *)r || HASZERO(wl))
+				break;
+			l += WS;
+			r += WS;
+			n -= WS;
+		} else {
+			if (!*l || *l != *r)
+				return *l - *r;
+			l++;
+			r++;
+			n--;
+		}
+	}
+#endif
 	for (; *l && *r && n && *l == *r; l++, r++, n--)
 		;
 	return *l - *r;
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+#include "../cpu/cpu.h"
+#include "../serial/serial.h"
+#include "alloc.h"
+#include "printf.h"
+#include <stddef.h>
+
+#ifdef TRACE
+
+struct trace_entry {
+	uint64_t tsc;
+	uint32_t event;
+	uint32_t reserved;
+	uint64_t a;
+	uint64_t b;
+};
+
+struct trace_ring {
+	size_t head;
+	struct trace_entry entries[TRACE_RING_SIZE];
+};
+
+uint32_t trace_mask = 0;
+
+// Each ring is only written by its own processor with interrupts disabled
+static struct trace_ring *trace_rings[MAX_CPUS];
+
+static const char *trace_names[TRACE_EVENT_COUNT] = {
+	[TRACE_PMM_ALLOC] = "pmm_alloc",
+	[TRACE_PMM_FREE] = "pmm_free",
+	[TRACE_VMM_MAP_PAGE] = "vmm_map_page",
+	[TRACE_PATH2NODE] = "path2node",
+	[TRACE_VFS_OPEN] = "vfs_open",
+	[TRACE_TMPFS_READ] = "tmpfs_read",
+	[TRACE_TMPFS_WRITE] = "tmpfs_write",
+	[TRACE_IDE_READ_SECTOR] = "ide_read_sector",
+	[TRACE_ISR] = "isr",
+};
+
+void trace_record(enum trace_event event, uint64_t a, uint64_t b) {
+	uint64_t rflags = cpu_irq_save();
+	struct trace_ring *ring = trace_rings[this_cpu_read(cpu_number)];
+	if (ring != NULL) {
+		struct trace_entry *e =
+			&ring->entries[ring->head++ & (TRACE_RING_SIZE - 1)];
+		*e = (struct trace_entry){
+			.tsc = rdtsc(), .event = event, .a = a, .b = b};
+	}
+	cpu_irq_restore(rflags);
+}
+
+void trace_init(void) {
+	// The rings come from the page allocator, which is traced itself, so
+	// nothing may be recorded meanwhile
+	uint32_t mask = __atomic_exchange_n(&trace_mask, 0, __ATOMIC_ACQ_REL);
+	for (size_t i = 0; i < cpu_count; i++)
+		if (trace_rings[i] == NULL)
+			trace_rings[i] = alloc(sizeof(struct trace_ring));
+	__atomic_store_n(&trace_mask, mask, __ATOMIC_RELEASE);
+}
+
+void trace_enable(uint32_t mask) {
+	__atomic_store_n(&trace_mask, mask & TRACE_ALL, __ATOMIC_RELEASE);
+}
+
+static void serial_out(char c, void *arg) {
+	(void)arg;
+	write_serial_char(c);
+}
+
+void trace_dump(void) {
+	trace_enable(0);
+
+	// Records still being written when tracing stopped are of no concern,
+	// what's printed is a moment's snapshot either way
+	uint64_t tsc_per_us = cpu_tsc_frequency / 1000000;
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+	for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct trace_ring *ring = trace_rings[cpu];
+		if (ring == NULL)
+			continue;
+
+		size_t head = ring->head;
+		size_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		fctprintf(serial_out, NULL, "trace: CPU %zu, %zu records, %zu lost\n",
+				  cpu, head - first, first);
+		for (size_t i = first; i < head; i++) {
+			struct trace_entry *e = &ring->entries[i & (TRACE_RING_SIZE - 1)];
+			fctprintf(serial_out, NULL, "trace: %zu %llu.%03llu %s %llx %llx\n",
+					  cpu, e->tsc / tsc_per_us / 1000,
+					  e->tsc / tsc_per_us % 1000, trace_names[e->event], e->a,
+					  e->b);
+		}
+	}
+}
+
+#else
+
+void trace_init(void) {
+}
+
+void trace_enable(uint32_t mask) {
+	(void)mask;
+}
+
+void trace_dump(void) {
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Static tracepoints, compiled in only when built with TRACE defined (make
+// TRACE=1). A tracepoint of an event that isn't enabled costs one branch on
+// trace_mask, enabled ones add a TSC stamped binary record to a ring of the
+// processor, see trace.c.
+enum trace_event {
+	TRACE_PMM_ALLOC,
+	TRACE_PMM_FREE,
+	TRACE_VMM_MAP_PAGE,
+	TRACE_PATH2NODE,
+	TRACE_VFS_OPEN,
+	TRACE_TMPFS_READ,
+	TRACE_TMPFS_WRITE,
+	TRACE_IDE_READ_SECTOR,
+	TRACE_ISR,
+	TRACE_EVENT_COUNT
+};
+
+#define TRACE_ALL ((1u << TRACE_EVENT_COUNT) - 1)
+
+// Records per processor, the oldest are overwritten
+#define TRACE_RING_SIZE 4096
+
+#ifdef TRACE
+extern uint32_t trace_mask;
+
+void trace_record(enum trace_event event, uint64_t a, uint64_t b);
+
+#define TRACEPOINT(EVENT, A, B)                                  \
+	do {                                                         \
+		if (__builtin_expect(                                    \
+				__atomic_load_n(&trace_mask, __ATOMIC_RELAXED) & \
+					(1u << (EVENT)),                             \
+				0))                                              \
+			trace_record(EVENT, (uint64_t)(A), (uint64_t)(B));   \
+	} while (0)
+#else
+#define TRACEPOINT(EVENT, A, B) \
+	do {                        \
+	} while (0)
+#endif
+
+// Give every processor a ring, after smp_wait()
+void trace_init(void);
+// Events to record from now on, 0 to stop
+void trace_enable(uint32_t mask);
+// Stop tracing and write every ring out to the serial port, oldest first
+void trace_dump(void);
+
+#endif
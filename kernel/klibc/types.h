@@ -44,6 +44,11 @@ struct timespec {
 	long tv_nsec;
 };
 
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
 #define O_ACCMODE 0x0007
 #define O_EXEC 1
 #define O_RDONLY 2
@@ -64,6 +69,14 @@ struct timespec {
 #define O_SYNC 0x2000
 #define O_CLOEXEC 0x4000
 
+#define PROT_NONE 0x00
+#define PROT_READ 0x01
+#define PROT_WRITE 0x02
+#define PROT_EXEC 0x04
+
+#define MAP_PRIVATE 0x01
+#define MAP_SHARED 0x02
+
 #define S_IFMT 0x0F000
 #define S_IFBLK 0x06000
 #define S_IFCHR 0x02000
@@ -81,6 +94,25 @@ struct timespec {
 #define S_ISLNK(m) (((m)&S_IFMT) == S_IFLNK)
 #define S_ISSOCK(m) (((m)&S_IFMT) == S_IFSOCK)
 
+#define DT_UNKNOWN 0
+#define DT_FIFO 1
+#define DT_CHR 2
+#define DT_DIR 4
+#define DT_BLK 6
+#define DT_REG 8
+#define DT_LNK 10
+#define DT_SOCK 12
+
+#define IFTODT(mode) (((mode)&S_IFMT) >> 12)
+
+struct dirent {
+	ino_t d_ino;
+	off_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1024];
+};
+
 struct stat {
 	dev_t st_dev;
 	ino_t st_ino;
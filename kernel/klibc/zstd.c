@@ -0,0 +1,889 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// zstd frames (RFC 8878), Huffman coded literals and FSE coded sequences read
+// back to front through the same bit reader
+
+#include "decompress.h"
+#include "mem.h"
+#include <liballoc.h>
+
+#define ZSTD_MAGIC 0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A50
+#define ZSTD_SKIPPABLE_MASK 0xFFFFFFF0
+
+// The RFC asks decoders to handle windows of up to 8 MiB
+#define ZSTD_WINDOW_MIN ((size_t)1 << 10)
+#define ZSTD_WINDOW_MAX ((size_t)8 << 20)
+#define ZSTD_BLOCK_MAX ((size_t)128 << 10)
+
+#define ZSTD_FHD_FCS(fhd) ((fhd) >> 6)
+#define ZSTD_FHD_SINGLE_SEGMENT (1 << 5)
+#define ZSTD_FHD_RESERVED (1 << 3)
+#define ZSTD_FHD_CHECKSUM (1 << 2)
+#define ZSTD_FHD_DICT_ID(fhd) ((fhd)&3)
+
+enum { BLOCK_RAW, BLOCK_RLE, BLOCK_COMPRESSED, BLOCK_RESERVED };
+enum { LITERALS_RAW, LITERALS_RLE, LITERALS_COMPRESSED, LITERALS_TREELESS };
+enum { MODE_PREDEFINED, MODE_RLE, MODE_FSE, MODE_REPEAT };
+
+#define HUF_MAX_BITS 11
+#define HUF_MAX_SYMBOLS 256
+#define HUF_WEIGHT_LOG 6
+
+#define FSE_MAX_LOG 9
+#define FSE_MAX_SYMBOLS 64
+#define LL_MAX_LOG 9
+#define ML_MAX_LOG 9
+#define OF_MAX_LOG 8
+#define LL_CODES 36
+#define ML_CODES 53
+#define OF_CODES 32
+
+static const uint32_t ll_base[LL_CODES] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 18, 20, 22, 24,
+	28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768,
+	65536};
+static const uint8_t ll_extra[LL_CODES] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4,
+	6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+static const uint32_t ml_base[ML_CODES] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
+	23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 37, 39, 41, 43, 47, 51,
+	59, 67, 83, 99, 131, 259, 515, 1027, 2051, 4099, 8195, 16387, 32771, 65539};
+static const uint8_t ml_extra[ML_CODES] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16};
+
+// The distributions the predefined mode stands for
+static const int16_t ll_default_probs[LL_CODES] = {
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1};
+static const int16_t ml_default_probs[ML_CODES] = {
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1,
+	-1, -1, -1, -1};
+static const int16_t of_default_probs[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1,
+	-1, -1, -1, -1};
+
+// Reads go from the end of the stream towards its start, pos counts the bits
+// still unread and may go below zero, which reads as zeroes
+struct bitstream {
+	const uint8_t *data;
+	size_t size;
+	int64_t pos;
+};
+
+struct fse_entry {
+	uint16_t baseline;
+	uint8_t symbol;
+	uint8_t bits;
+};
+
+struct fse_table {
+	int log;
+	struct fse_entry entries[1 << FSE_MAX_LOG];
+};
+
+struct fse_state {
+	const struct fse_table *table;
+	size_t state;
+};
+
+struct huf_entry {
+	uint8_t symbol;
+	uint8_t bits;
+};
+
+struct huf_table {
+	int max_bits;
+	struct huf_entry entries[1 << HUF_MAX_BITS];
+};
+
+struct xxh64 {
+	uint64_t v[4];
+	uint64_t total;
+	uint8_t buf[32];
+	size_t fill;
+};
+
+// What's kept between the blocks of a frame
+struct zstd {
+	struct decompress_window out;
+	decompress_sink_t sink;
+	void *ctx;
+	struct xxh64 hash;
+
+	uint32_t reps[3];
+	bool has_huf;
+	struct huf_table huf;
+	const struct fse_table *ll, *ml, *of;
+	struct fse_table ll_table, ml_table, of_table;
+	// Scratch for the table the Huffman weights are coded with
+	struct fse_table weights;
+
+	size_t literal_count;
+	uint8_t literals[ZSTD_BLOCK_MAX];
+};
+
+static struct fse_table ll_default, ml_default, of_default;
+
+static uint32_t read_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t *p) {
+	return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static int highbit(uint32_t x) {
+	return 31 - __builtin_clz(x);
+}
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+	return (acc ^ xxh64_round(0, val)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_init(struct xxh64 *h) {
+	h->v[0] = XXH_PRIME1 + XXH_PRIME2;
+	h->v[1] = XXH_PRIME2;
+	h->v[2] = 0;
+	h->v[3] = -XXH_PRIME1;
+	h->total = 0;
+	h->fill = 0;
+}
+
+static void xxh64_update(struct xxh64 *h, const uint8_t *p, size_t len) {
+	h->total += len;
+	while (len) {
+		size_t chunk = sizeof(h->buf) - h->fill;
+		if (chunk > len)
+			chunk = len;
+		memcpy(h->buf + h->fill, p, chunk);
+		h->fill += chunk;
+		p += chunk;
+		len -= chunk;
+
+		if (h->fill == sizeof(h->buf)) {
+			for (int i = 0; i < 4; i++)
+				h->v[i] = xxh64_round(h->v[i], read_le64(h->buf + i * 8));
+			h->fill = 0;
+		}
+	}
+}
+
+static uint64_t xxh64_digest(const struct xxh64 *h) {
+	uint64_t acc;
+
+	if (h->total >= sizeof(h->buf)) {
+		acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) +
+			  rotl64(h->v[3], 18);
+		for (int i = 0; i < 4; i++)
+			acc = xxh64_merge(acc, h->v[i]);
+	} else {
+		acc = XXH_PRIME5;
+	}
+	acc += h->total;
+
+	size_t i = 0;
+	for (; i + 8 <= h->fill; i += 8)
+		acc = rotl64(acc ^ xxh64_round(0, read_le64(h->buf + i)), 27) *
+				  XXH_PRIME1 +
+			  XXH_PRIME4;
+	if (i + 4 <= h->fill) {
+		acc = rotl64(acc ^ (read_le32(h->buf + i) * XXH_PRIME1), 23) *
+				  XXH_PRIME2 +
+			  XXH_PRIME3;
+		i += 4;
+	}
+	for (; i < h->fill; i++)
+		acc = rotl64(acc ^ (h->buf[i] * XXH_PRIME5), 11) * XXH_PRIME1;
+
+	acc ^= acc >> 33;
+	acc *= XXH_PRIME2;
+	acc ^= acc >> 29;
+	acc *= XXH_PRIME3;
+	return acc ^ (acc >> 32);
+}
+
+// Hash the output on its way to the real sink for the content checksum
+static void zstd_sink(void *ctx, const void *buf, size_t len) {
+	struct zstd *z = ctx;
+
+	xxh64_update(&z->hash, buf, len);
+	z->sink(z->ctx, buf, len);
+}
+
+// The n bits starting at bit pos, zeroes for any outside the stream
+static uint64_t bits_at(const struct bitstream *bs, int64_t pos, int n) {
+	if (pos < 0) {
+		if (-pos >= n)
+			return 0;
+		return bits_at(bs, 0, n + pos) << -pos;
+	}
+
+	uint64_t val = 0;
+	size_t byte = pos >> 3;
+	int shift = pos & 7;
+	for (int i = 0; i < n + shift; i += 8, byte++)
+		if (byte < bs->size)
+			val |= (uint64_t)bs->data[byte] << i;
+	return (val >> shift) & ((1ULL << n) - 1);
+}
+
+static uint64_t bits_read(struct bitstream *bs, int n) {
+	bs->pos -= n;
+	return bits_at(bs, bs->pos, n);
+}
+
+// The highest set bit of the last byte marks where a backward stream starts
+static bool bits_init(struct bitstream *bs, const uint8_t *p, size_t size) {
+	if (size == 0 || p[size - 1] == 0)
+		return false;
+	bs->data = p;
+	bs->size = size;
+	bs->pos = (size - 1) * 8 + highbit(p[size - 1]);
+	return true;
+}
+
+// Spread the symbols over the states and work out the bits each state reads
+// to get to the next one, false if the probabilities don't fill the table
+static bool fse_build(struct fse_table *t, const int16_t *probs, size_t n,
+					  int log) {
+	uint16_t next[FSE_MAX_SYMBOLS];
+	size_t size = (size_t)1 << log, high = size - 1;
+
+	// Symbols less likely than 1 in the table size go at the end
+	for (size_t sym = 0; sym < n; sym++) {
+		if (probs[sym] == -1) {
+			t->entries[high--].symbol = sym;
+			next[sym] = 1;
+		} else {
+			next[sym] = probs[sym];
+		}
+	}
+
+	size_t step = (size >> 1) + (size >> 3) + 3, pos = 0;
+	for (size_t sym = 0; sym < n; sym++) {
+		for (int i = 0; i < probs[sym]; i++) {
+			t->entries[pos].symbol = sym;
+			do
+				pos = (pos + step) & (size - 1);
+			while (pos > high);
+		}
+	}
+	if (pos != 0)
+		return false;
+
+	for (size_t state = 0; state < size; state++) {
+		struct fse_entry *e = &t->entries[state];
+		uint16_t x = next[e->symbol]++;
+		e->bits = log - highbit(x);
+		e->baseline = (x << e->bits) - size;
+	}
+
+	t->log = log;
+	return true;
+}
+
+// Read a table description, the probabilities packed in as few bits as the
+// probability left to hand out allows
+static bool fse_read(struct fse_table *t, const uint8_t **p,
+					 const uint8_t *end, int max_log, size_t max_symbols) {
+	struct bitstream bs = {.data = *p, .size = end - *p};
+	int16_t probs[FSE_MAX_SYMBOLS];
+	size_t n = 0;
+
+	if (*p == end)
+		return false;
+	int log = bits_at(&bs, 0, 4) + 5;
+	if (log > max_log)
+		return false;
+	size_t bit = 4;
+
+	int remaining = (1 << log) + 1, threshold = 1 << log, nbits = log + 1;
+	while (remaining > 1) {
+		if (n == max_symbols)
+			return false;
+
+		int max = 2 * threshold - 1 - remaining;
+		int count = bits_at(&bs, bit, nbits - 1);
+		if (count < max) {
+			bit += nbits - 1;
+		} else {
+			count = bits_at(&bs, bit, nbits);
+			if (count >= threshold)
+				count -= max;
+			bit += nbits;
+		}
+		count--;
+		remaining -= count < 0 ? -count : count;
+		probs[n++] = count;
+
+		// Zero probabilities are followed by how many more of them there are,
+		// two bits at a time
+		if (count == 0) {
+			size_t repeat;
+			do {
+				repeat = bits_at(&bs, bit, 2);
+				bit += 2;
+				if (n + repeat > max_symbols)
+					return false;
+				for (size_t i = 0; i < repeat; i++)
+					probs[n++] = 0;
+			} while (repeat == 3);
+		}
+
+		while (remaining < threshold) {
+			nbits--;
+			threshold >>= 1;
+		}
+	}
+
+	if (remaining != 1 || bit > bs.size * 8 || !fse_build(t, probs, n, log))
+		return false;
+	*p += (bit + 7) / 8;
+	return true;
+}
+
+static void fse_init(struct fse_state *s, const struct fse_table *t,
+					 struct bitstream *bs) {
+	s->table = t;
+	s->state = bits_read(bs, t->log);
+}
+
+static uint8_t fse_symbol(const struct fse_state *s) {
+	return s->table->entries[s->state].symbol;
+}
+
+static void fse_update(struct fse_state *s, struct bitstream *bs) {
+	const struct fse_entry *e = &s->table->entries[s->state];
+	s->state = e->baseline + bits_read(bs, e->bits);
+}
+
+static void fse_defaults(void) {
+	static bool built = false;
+
+	if (!built) {
+		fse_build(&ll_default, ll_default_probs, LL_CODES, 6);
+		fse_build(&ml_default, ml_default_probs, ML_CODES, 6);
+		fse_build(&of_default, of_default_probs, 29, 5);
+		built = true;
+	}
+}
+
+// The Huffman weights come either four bits each or FSE coded with two states
+// taking turns, the last weight is left out
+static bool huf_weights(struct zstd *z, const uint8_t **p, const uint8_t *end,
+						uint8_t *weights, size_t *count) {
+	if (*p == end)
+		return false;
+	uint8_t header = *(*p)++;
+	size_t n = 0;
+
+	if (header >= 128) {
+		n = header - 127;
+		if ((size_t)(end - *p) < (n + 1) / 2)
+			return false;
+		for (size_t i = 0; i < n; i++)
+			weights[i] = ((*p)[i / 2] >> ((i & 1) ? 0 : 4)) & 15;
+		*p += (n + 1) / 2;
+		*count = n;
+		return true;
+	}
+
+	if ((size_t)(end - *p) < header)
+		return false;
+	const uint8_t *q = *p, *q_end = q + header;
+	*p = q_end;
+	if (!fse_read(&z->weights, &q, q_end, HUF_WEIGHT_LOG, FSE_MAX_SYMBOLS))
+		return false;
+
+	struct bitstream bs;
+	struct fse_state a, b;
+	if (!bits_init(&bs, q, q_end - q))
+		return false;
+	fse_init(&a, &z->weights, &bs);
+	fse_init(&b, &z->weights, &bs);
+
+	// Once a state runs past the start, the other one has a last symbol
+	for (;;) {
+		if (n + 2 > HUF_MAX_SYMBOLS - 1)
+			return false;
+		weights[n++] = fse_symbol(&a);
+		fse_update(&a, &bs);
+		if (bs.pos < 0) {
+			weights[n++] = fse_symbol(&b);
+			break;
+		}
+
+		weights[n++] = fse_symbol(&b);
+		fse_update(&b, &bs);
+		if (bs.pos < 0) {
+			weights[n++] = fse_symbol(&a);
+			break;
+		}
+	}
+
+	*count = n;
+	return true;
+}
+
+// The last weight is whatever brings the total up to a power of two. Codes
+// are handed out from the lowest weight up and by symbol within a weight, so
+// a table indexed by the next max_bits bits finds each symbol's range
+static bool huf_read(struct zstd *z, const uint8_t **p, const uint8_t *end) {
+	uint8_t weights[HUF_MAX_SYMBOLS];
+	uint32_t rank[HUF_MAX_BITS + 1] = {0};
+	size_t n;
+
+	if (!huf_weights(z, p, end, weights, &n))
+		return false;
+
+	uint32_t total = 0;
+	for (size_t sym = 0; sym < n; sym++) {
+		if (weights[sym] > HUF_MAX_BITS)
+			return false;
+		if (weights[sym])
+			total += 1 << (weights[sym] - 1);
+	}
+	if (total == 0)
+		return false;
+
+	int max_bits = highbit(total) + 1;
+	uint32_t left = (1 << max_bits) - total;
+	if (max_bits > HUF_MAX_BITS || (left & (left - 1)))
+		return false;
+	weights[n++] = highbit(left) + 1;
+
+	for (size_t sym = 0; sym < n; sym++)
+		rank[weights[sym]]++;
+	uint32_t start = 0;
+	for (int w = 1; w <= max_bits; w++) {
+		uint32_t count = rank[w];
+		rank[w] = start;
+		start += count << (w - 1);
+	}
+
+	struct huf_table *t = &z->huf;
+	for (size_t sym = 0; sym < n; sym++) {
+		int w = weights[sym];
+		if (w == 0)
+			continue;
+		for (uint32_t i = 0; i < 1U << (w - 1); i++)
+			t->entries[rank[w]++] =
+				(struct huf_entry){.symbol = sym, .bits = max_bits + 1 - w};
+	}
+
+	t->max_bits = max_bits;
+	z->has_huf = true;
+	return true;
+}
+
+// Every bit of a literal stream has to be used by its last literal
+static bool huf_stream(const struct huf_table *t, const uint8_t *p,
+					   size_t size, uint8_t *out, size_t n) {
+	struct bitstream bs;
+
+	if (!bits_init(&bs, p, size))
+		return false;
+	for (size_t i = 0; i < n; i++) {
+		const struct huf_entry *e =
+			&t->entries[bits_at(&bs, bs.pos - t->max_bits, t->max_bits)];
+		out[i] = e->symbol;
+		bs.pos -= e->bits;
+	}
+
+	return bs.pos == 0;
+}
+
+static bool huf_streams(const struct huf_table *t, const uint8_t *p,
+						size_t size, uint8_t *out, size_t n) {
+	// Four streams start with the sizes of the first three
+	if (size < 6)
+		return false;
+	size_t sizes[4] = {p[0] | (p[1] << 8), p[2] | (p[3] << 8),
+					   p[4] | (p[5] << 8)};
+	p += 6;
+	size -= 6;
+	if (sizes[0] + sizes[1] + sizes[2] > size)
+		return false;
+	sizes[3] = size - sizes[0] - sizes[1] - sizes[2];
+
+	size_t each = (n + 3) / 4;
+	if (each * 3 > n)
+		return false;
+	for (int i = 0; i < 4; i++) {
+		size_t len = i < 3 ? each : n - each * 3;
+		if (!huf_stream(t, p, sizes[i], out, len))
+			return false;
+		p += sizes[i];
+		out += len;
+	}
+
+	return true;
+}
+
+static bool literals(struct zstd *z, const uint8_t **p, const uint8_t *end) {
+	if (*p == end)
+		return false;
+	const uint8_t *q = *p;
+	int type = q[0] & 3, format = (q[0] >> 2) & 3;
+	size_t header, regen, size;
+
+	if (type == LITERALS_RAW || type == LITERALS_RLE) {
+		header = format == 1 ? 2 : format == 3 ? 3 : 1;
+		if ((size_t)(end - q) < header)
+			return false;
+		if (format == 1)
+			regen = (q[0] >> 4) | (q[1] << 4);
+		else if (format == 3)
+			regen = (q[0] >> 4) | (q[1] << 4) | (q[2] << 12);
+		else
+			regen = q[0] >> 3;
+		size = type == LITERALS_RAW ? regen : 1;
+	} else {
+		header = format < 2 ? 3 : format + 2;
+		if ((size_t)(end - q) < header)
+			return false;
+		uint64_t val = q[0] | (q[1] << 8) | (q[2] << 16);
+		if (format == 2) {
+			val = read_le32(q);
+			regen = (val >> 4) & 0x3FFF;
+			size = val >> 18;
+		} else if (format == 3) {
+			val = read_le32(q) | ((uint64_t)q[4] << 32);
+			regen = (val >> 4) & 0x3FFFF;
+			size = val >> 22;
+		} else {
+			regen = (val >> 4) & 0x3FF;
+			size = val >> 14;
+		}
+	}
+
+	q += header;
+	if (regen > ZSTD_BLOCK_MAX || (size_t)(end - q) < size)
+		return false;
+	*p = q + size;
+	z->literal_count = regen;
+
+	switch (type) {
+		case LITERALS_RAW:
+			memcpy(z->literals, q, regen);
+			return true;
+		case LITERALS_RLE:
+			memset(z->literals, *q, regen);
+			return true;
+		case LITERALS_COMPRESSED:
+			if (!huf_read(z, &q, q + size))
+				return false;
+			size = *p - q;
+			break;
+		default:
+			// Treeless literals reuse the last block's tree
+			if (!z->has_huf)
+				return false;
+			break;
+	}
+
+	if (format == 0)
+		return huf_stream(&z->huf, q, size, z->literals, regen);
+	return huf_streams(&z->huf, q, size, z->literals, regen);
+}
+
+static bool seq_table(const struct fse_table **t, struct fse_table *own,
+					  const struct fse_table *predefined, int mode,
+					  const uint8_t **p, const uint8_t *end, int max_log,
+					  size_t max_symbols) {
+	switch (mode) {
+		case MODE_PREDEFINED:
+			*t = predefined;
+			return true;
+		case MODE_RLE:
+			if (*p == end || **p >= max_symbols)
+				return false;
+			own->log = 0;
+			own->entries[0] =
+				(struct fse_entry){.symbol = *(*p)++};
+			*t = own;
+			return true;
+		case MODE_FSE:
+			if (!fse_read(own, p, end, max_log, max_symbols))
+				return false;
+			*t = own;
+			return true;
+		default:
+			// The last block's table, which the first block doesn't have
+			return *t != NULL;
+	}
+}
+
+// A repeat offset is picked by offset values up to 3, shifted by one when
+// there are no literals, and moves to the front of the history
+static uint32_t seq_offset(struct zstd *z, uint32_t value, size_t literals) {
+	if (value > 3) {
+		z->reps[2] = z->reps[1];
+		z->reps[1] = z->reps[0];
+		z->reps[0] = value - 3;
+		return z->reps[0];
+	}
+
+	uint32_t index = value - 1 + (literals == 0);
+	if (index == 0)
+		return z->reps[0];
+
+	uint32_t offset = index == 3 ? z->reps[0] - 1 : z->reps[index];
+	if (index != 1)
+		z->reps[2] = z->reps[1];
+	z->reps[1] = z->reps[0];
+	z->reps[0] = offset;
+	return offset;
+}
+
+static bool sequences(struct zstd *z, const uint8_t *p, const uint8_t *end) {
+	const uint8_t *lit = z->literals, *lit_end = lit + z->literal_count;
+	size_t count;
+
+	if (p == end)
+		return false;
+	if (p[0] < 128) {
+		count = p[0];
+		p++;
+	} else if (p[0] < 255) {
+		if (end - p < 2)
+			return false;
+		count = ((p[0] - 128) << 8) + p[1];
+		p += 2;
+	} else {
+		if (end - p < 3)
+			return false;
+		count = p[1] + (p[2] << 8) + 0x7F00;
+		p += 3;
+	}
+
+	if (count != 0) {
+		if (p == end)
+			return false;
+		uint8_t modes = *p++;
+		if ((modes & 3) ||
+			!seq_table(&z->ll, &z->ll_table, &ll_default, modes >> 6, &p, end,
+					   LL_MAX_LOG, LL_CODES) ||
+			!seq_table(&z->of, &z->of_table, &of_default, (modes >> 4) & 3,
+					   &p, end, OF_MAX_LOG, OF_CODES) ||
+			!seq_table(&z->ml, &z->ml_table, &ml_default, (modes >> 2) & 3,
+					   &p, end, ML_MAX_LOG, ML_CODES))
+			return false;
+
+		struct bitstream bs;
+		struct fse_state ll, of, ml;
+		if (!bits_init(&bs, p, end - p))
+			return false;
+		fse_init(&ll, z->ll, &bs);
+		fse_init(&of, z->of, &bs);
+		fse_init(&ml, z->ml, &bs);
+
+		for (size_t i = 0; i < count; i++) {
+			uint8_t ofc = fse_symbol(&of), mlc = fse_symbol(&ml),
+					llc = fse_symbol(&ll);
+			uint32_t value = (1U << ofc) + bits_read(&bs, ofc);
+			size_t match = ml_base[mlc] + bits_read(&bs, ml_extra[mlc]);
+			size_t lits = ll_base[llc] + bits_read(&bs, ll_extra[llc]);
+			if (i + 1 < count) {
+				fse_update(&ll, &bs);
+				fse_update(&ml, &bs);
+				fse_update(&of, &bs);
+			}
+
+			uint32_t offset = seq_offset(z, value, lits);
+			if ((size_t)(lit_end - lit) < lits)
+				return false;
+			while (lits--)
+				window_put(&z->out, *lit++);
+			if (!window_copy(&z->out, offset, match))
+				return false;
+		}
+
+		if (bs.pos != 0)
+			return false;
+	}
+
+	while (lit < lit_end)
+		window_put(&z->out, *lit++);
+	return true;
+}
+
+static bool blocks(struct zstd *z, const uint8_t **p, const uint8_t *end) {
+	bool last;
+
+	do {
+		if (end - *p < 3)
+			return false;
+		uint32_t header = (*p)[0] | ((*p)[1] << 8) | ((*p)[2] << 16);
+		*p += 3;
+		last = header & 1;
+		size_t size = header >> 3;
+
+		switch ((header >> 1) & 3) {
+			case BLOCK_RAW:
+				if ((size_t)(end - *p) < size)
+					return false;
+				for (size_t i = 0; i < size; i++)
+					window_put(&z->out, (*p)[i]);
+				*p += size;
+				break;
+			case BLOCK_RLE:
+				// The size is how many times the one byte repeats
+				if (*p == end)
+					return false;
+				while (size--)
+					window_put(&z->out, **p);
+				*p += 1;
+				break;
+			case BLOCK_COMPRESSED: {
+				const uint8_t *block = *p;
+				if ((size_t)(end - block) < size || size > ZSTD_BLOCK_MAX ||
+					!literals(z, &block, *p + size) ||
+					!sequences(z, block, *p + size))
+					return false;
+				*p += size;
+				break;
+			}
+			default:
+				return false;
+		}
+	} while (!last);
+
+	return true;
+}
+
+static bool frame(struct zstd *z, const uint8_t **p, const uint8_t *end) {
+	static const uint8_t dict_id_sizes[4] = {0, 1, 2, 4};
+
+	if (*p == end)
+		return false;
+	uint8_t fhd = *(*p)++;
+	bool single = fhd & ZSTD_FHD_SINGLE_SEGMENT;
+	if (fhd & ZSTD_FHD_RESERVED)
+		return false;
+
+	// The window is a power of two with up to seven eighths added
+	uint64_t window = 0;
+	if (!single) {
+		if (*p == end)
+			return false;
+		uint8_t desc = *(*p)++;
+		window = (uint64_t)1 << (10 + (desc >> 3));
+		window += (window / 8) * (desc & 7);
+	}
+
+	// Dictionaries aren't supported, an ID of 0 is the same as none
+	size_t dict_size = dict_id_sizes[ZSTD_FHD_DICT_ID(fhd)];
+	size_t fcs_size = ZSTD_FHD_FCS(fhd) ? 1 << ZSTD_FHD_FCS(fhd) : single;
+	if ((size_t)(end - *p) < dict_size + fcs_size)
+		return false;
+	for (size_t i = 0; i < dict_size; i++)
+		if (*(*p)++)
+			return false;
+
+	uint64_t content = 0;
+	for (size_t i = 0; i < fcs_size; i++)
+		content |= (uint64_t)*(*p)++ << (i * 8);
+	if (fcs_size == 2)
+		content += 256;
+	if (single)
+		window = content;
+	if (window > ZSTD_WINDOW_MAX)
+		return false;
+
+	size_t size = ZSTD_WINDOW_MIN;
+	while (size < window)
+		size <<= 1;
+	if (!window_init(&z->out, size, zstd_sink, z))
+		return false;
+
+	xxh64_init(&z->hash);
+	z->reps[0] = 1;
+	z->reps[1] = 4;
+	z->reps[2] = 8;
+	z->has_huf = false;
+	z->ll = z->ml = z->of = NULL;
+
+	bool ok = blocks(z, p, end);
+	window_finish(&z->out);
+	if (!ok)
+		return false;
+
+	// The low half of the XXH64 of the content
+	if (fhd & ZSTD_FHD_CHECKSUM) {
+		if (end - *p < 4 ||
+			read_le32(*p) != (uint32_t)xxh64_digest(&z->hash))
+			return false;
+		*p += 4;
+	}
+	return true;
+}
+
+bool zstd_decompress(const void *data, size_t size, decompress_sink_t sink,
+					 void *ctx) {
+	const uint8_t *p = data, *end = p + size;
+
+	if (size < 4 || read_le32(p) != ZSTD_MAGIC)
+		return false;
+
+	struct zstd *z = kmalloc(sizeof(struct zstd));
+	if (z == NULL)
+		return false;
+	z->sink = sink;
+	z->ctx = ctx;
+	fse_defaults();
+
+	// Frames follow one another until the input ends or something else
+	// starts, skippable frames carry nothing to output
+	bool ok = true;
+	while (ok && end - p >= 4) {
+		uint32_t magic = read_le32(p);
+		p += 4;
+		if ((magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC) {
+			if (end - p < 4 || (size_t)(end - p - 4) < read_le32(p))
+				ok = false;
+			else
+				p += 4 + read_le32(p);
+		} else if (magic == ZSTD_MAGIC) {
+			ok = frame(z, &p, end);
+		} else {
+			break;
+		}
+	}
+
+	kfree(z);
+	return ok;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagecache.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PAGECACHE_BUCKETS 1024
+// Dirty pages written back per pass of pagecache_sync
+#define PAGECACHE_SYNC_BATCH 32
+
+struct cached_page {
+	struct resource *backing;
+	uint64_t index;
+	void *data;
+	bool dirty;
+	// Pinned pages are being used and can't be reclaimed
+	size_t pins;
+	struct cached_page *hash_next;
+	struct cached_page *lru_prev;
+	struct cached_page *lru_next;
+};
+
+// Nothing is allocated with cache_lock held, the PMM may call back into
+// pagecache_shrink
+static lock_t cache_lock = {0};
+static struct cached_page *buckets[PAGECACHE_BUCKETS] = {0};
+// Most recently used first
+static struct cached_page *lru_head = NULL;
+static struct cached_page *lru_tail = NULL;
+
+static struct slab_cache cached_page_cache =
+	SLAB_CACHE_INIT("cached_page", struct cached_page, NULL);
+
+static struct cached_page **bucket_of(struct resource *backing,
+									  uint64_t index) {
+	uint64_t key = ((uintptr_t)backing >> 4) ^ (index * 0x9E3779B97F4A7C15);
+	return &buckets[(key ^ (key >> 32)) % PAGECACHE_BUCKETS];
+}
+
+static struct cached_page *lookup(struct resource *backing, uint64_t index) {
+	for (struct cached_page *page = *bucket_of(backing, index); page;
+		 page = page->hash_next)
+		if (page->backing == backing && page->index == index)
+			return page;
+	return NULL;
+}
+
+static void lru_unlink(struct cached_page *page) {
+	if (page->lru_prev)
+		page->lru_prev->lru_next = page->lru_next;
+	else
+		lru_head = page->lru_next;
+	if (page->lru_next)
+		page->lru_next->lru_prev = page->lru_prev;
+	else
+		lru_tail = page->lru_prev;
+}
+
+static void lru_push(struct cached_page *page) {
+	page->lru_prev = NULL;
+	page->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = page;
+	else
+		lru_tail = page;
+	lru_head = page;
+}
+
+// The caller holds cache_lock
+static void pin(struct cached_page *page) {
+	page->pins++;
+	lru_unlink(page);
+	lru_push(page);
+}
+
+static void unpin(struct cached_page *page, bool dirty) {
+	LOCK(cache_lock);
+	if (dirty)
+		page->dirty = true;
+	page->pins--;
+	UNLOCK(cache_lock);
+}
+
+// Page sized reads and writes don't go past the end of the resource
+static size_t page_length(struct cached_page *page) {
+	off_t size = page->backing->st.st_size;
+	off_t off = page->index * PAGE_SIZE;
+	if (size <= 0)
+		return PAGE_SIZE;
+	return off >= size ? 0 : MIN(PAGE_SIZE, (size_t)(size - off));
+}
+
+// Return the page pinned. A missing page is filled with contents if given,
+// else read from the backing resource.
+static struct cached_page *get_page(struct resource *backing, uint64_t index,
+									const void *contents) {
+	LOCK(cache_lock);
+	struct cached_page *page = lookup(backing, index);
+	if (page != NULL) {
+		pin(page);
+		UNLOCK(cache_lock);
+		if (contents)
+			memcpy(page->data, contents, PAGE_SIZE);
+		return page;
+	}
+	UNLOCK(cache_lock);
+
+	struct cached_page *new = slab_alloc(&cached_page_cache);
+	void *data = pmm_alloc(1);
+	if (new == NULL || data == NULL) {
+		if (new)
+			slab_free(&cached_page_cache, new);
+		if (data)
+			pmm_free(data, 1);
+		return NULL;
+	}
+
+	new->backing = backing;
+	new->index = index;
+	new->data = data + MEM_PHYS_OFFSET;
+	new->dirty = false;
+	new->pins = 1;
+
+	if (contents) {
+		memcpy(new->data, contents, PAGE_SIZE);
+	} else {
+		ssize_t got = backing->read(backing, new->data, index * PAGE_SIZE,
+									page_length(new));
+		if (got < 0)
+			got = 0;
+		memset(new->data + got, 0, PAGE_SIZE - got);
+	}
+
+	// Someone else may have brought the page in meanwhile
+	LOCK(cache_lock);
+	page = lookup(backing, index);
+	if (page != NULL) {
+		pin(page);
+		UNLOCK(cache_lock);
+		if (contents)
+			memcpy(page->data, contents, PAGE_SIZE);
+		pmm_free(data, 1);
+		slab_free(&cached_page_cache, new);
+		return page;
+	}
+
+	struct cached_page **bucket = bucket_of(backing, index);
+	new->hash_next = *bucket;
+	*bucket = new;
+	lru_push(new);
+	UNLOCK(cache_lock);
+
+	return new;
+}
+
+ssize_t pagecache_read(struct resource *backing, void *buf, off_t loc,
+					   size_t count) {
+	off_t size = backing->st.st_size;
+	if (loc < 0)
+		return -1;
+	if (size > 0)
+		count = loc >= size ? 0 : MIN(count, (size_t)(size - loc));
+
+	size_t done = 0;
+	while (done < count) {
+		size_t page_off = loc % PAGE_SIZE;
+		size_t chunk = MIN(PAGE_SIZE - page_off, count - done);
+
+		struct cached_page *page = get_page(backing, loc / PAGE_SIZE, NULL);
+		if (page == NULL)
+			break;
+		memcpy(buf + done, page->data + page_off, chunk);
+		unpin(page, false);
+
+		loc += chunk;
+		done += chunk;
+	}
+
+	return done;
+}
+
+ssize_t pagecache_write(struct resource *backing, const void *buf, off_t loc,
+						size_t count) {
+	off_t size = backing->st.st_size;
+	if (loc < 0)
+		return -1;
+	if (size > 0)
+		count = loc >= size ? 0 : MIN(count, (size_t)(size - loc));
+
+	size_t done = 0;
+	while (done < count) {
+		size_t page_off = loc % PAGE_SIZE;
+		size_t chunk = MIN(PAGE_SIZE - page_off, count - done);
+
+		// Whole pages don't have to be read first
+		struct cached_page *page;
+		if (chunk == PAGE_SIZE) {
+			page = get_page(backing, loc / PAGE_SIZE, buf + done);
+		} else {
+			page = get_page(backing, loc / PAGE_SIZE, NULL);
+			if (page != NULL)
+				memcpy(page->data + page_off, buf + done, chunk);
+		}
+		if (page == NULL)
+			break;
+		unpin(page, true);
+
+		loc += chunk;
+		done += chunk;
+	}
+
+	return done;
+}
+
+// Write a pinned page whose dirty bit was taken back, which is set again if
+// that fails
+static bool write_back(struct cached_page *page) {
+	size_t len = page_length(page);
+	ssize_t ret = page->backing->write(page->backing, page->data,
+									   page->index * PAGE_SIZE, len);
+	bool ok = ret == (ssize_t)len;
+	unpin(page, !ok);
+	return ok;
+}
+
+// Write back the dirty pages of backing, or of every resource if it's NULL
+void pagecache_sync(struct resource *backing) {
+	struct cached_page *batch[PAGECACHE_SYNC_BATCH];
+	size_t count;
+
+	do {
+		count = 0;
+		LOCK(cache_lock);
+		for (struct cached_page *page = lru_tail;
+			 page && count < PAGECACHE_SYNC_BATCH; page = page->lru_prev) {
+			if (!page->dirty || (backing && page->backing != backing))
+				continue;
+			page->dirty = false;
+			page->pins++;
+			batch[count++] = page;
+		}
+		UNLOCK(cache_lock);
+
+		for (size_t i = 0; i < count; i++)
+			if (!write_back(batch[i]))
+				count = 0;
+	} while (count == PAGECACHE_SYNC_BATCH);
+}
+
+// Free up to count pages starting from the least recently used, dirty ones are
+// written back first
+size_t pagecache_shrink(size_t count) {
+	size_t freed = 0;
+
+	while (freed < count) {
+		LOCK(cache_lock);
+		struct cached_page *page = lru_tail;
+		while (page && page->pins)
+			page = page->lru_prev;
+
+		if (page == NULL) {
+			UNLOCK(cache_lock);
+			break;
+		}
+
+		if (page->dirty) {
+			page->dirty = false;
+			page->pins++;
+			UNLOCK(cache_lock);
+			if (!write_back(page))
+				break;
+			continue;
+		}
+
+		struct cached_page **link = bucket_of(page->backing, page->index);
+		while (*link != page)
+			link = &(*link)->hash_next;
+		*link = page->hash_next;
+		lru_unlink(page);
+		UNLOCK(cache_lock);
+
+		pmm_free(page->data - MEM_PHYS_OFFSET, 1);
+		slab_free(&cached_page_cache, page);
+		freed++;
+	}
+
+	return freed;
+}
+
+void pagecache_init(void) {
+	pmm_add_shrinker(pagecache_shrink);
+}
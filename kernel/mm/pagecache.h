@@ -0,0 +1,36 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "../klibc/resource.h"
+#include "../klibc/types.h"
+#include <stddef.h>
+
+// Page cache in front of resources that are slow to read, like block devices
+// backing a filesystem. Pages are looked up by (resource, page index), kept in
+// LRU order and written back when they're dirty, either by pagecache_sync or
+// before they're reclaimed once the PMM runs out of memory.
+void pagecache_init(void);
+ssize_t pagecache_read(struct resource *backing, void *buf, off_t loc,
+					   size_t count);
+ssize_t pagecache_write(struct resource *backing, const void *buf, off_t loc,
+						size_t count);
+void pagecache_sync(struct resource *backing);
+size_t pagecache_shrink(size_t count);
+
+#endif
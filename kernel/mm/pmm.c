@@ -16,15 +16,161 @@
  */
 
 #include "pmm.h"
+#include "../cpu/cpu.h"
+#include "../kernel/panic.h"
 #include "../klibc/bitman.h"
+#include "../klibc/lock.h"
 #include "../klibc/math.h"
 #include "../klibc/mem.h"
+#include "../klibc/trace.h"
 #include "vmm.h"
 #include <stivale2.h>
 
+// Free blocks are linked through their own first page
+struct free_block {
+	struct free_block *next;
+	struct free_block *prev;
+};
+
+// Single pages are served from per-CPU magazines, which are refilled from and
+// drained to the buddy allocator PMM_MAGAZINE_BATCH pages at a time
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+struct pmm_magazine {
+	size_t count;
+	void *pages[PMM_MAGAZINE_SIZE];
+	struct pmm_cache_stats stats;
+};
+
+// Pages zeroed ahead of time by idle processors, handed out by pmm_allocz
+#define PMM_ZERO_POOL_SIZE 1024
+
+// Caches that give memory back when an allocation would fail
+#define PMM_MAX_SHRINKERS 4
+
+static mcs_lock_t pmm_lock = {0};
+static lock_t zero_pool_lock = {0};
+static void *zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t zero_pool_count = 0;
+static struct pmm_magazine magazines[MAX_CPUS];
 static void *bitmap;
-static size_t last_used_index = 0;
+static struct page *pages;
+static size_t page_count = 0;
 static uintptr_t highest_page = 0;
+static struct free_block *free_lists[PMM_MAX_NODES][PMM_MAX_ORDER] = {NULL};
+static size_t node_count = 1;
+// Nodes to try for each node, nearest first
+static uint8_t node_fallback[PMM_MAX_NODES][PMM_MAX_NODES] = {{0}};
+static size_t (*shrinkers[PMM_MAX_SHRINKERS])(size_t count);
+static size_t shrinker_count = 0;
+static bool shrinking = false;
+
+static inline struct free_block *pfn_to_block(size_t pfn) {
+	return (struct free_block *)(pfn * PAGE_SIZE + MEM_PHYS_OFFSET);
+}
+
+static inline size_t block_to_pfn(struct free_block *block) {
+	return ((uintptr_t)block - MEM_PHYS_OFFSET) / PAGE_SIZE;
+}
+
+static inline size_t order_for(size_t count) {
+	size_t order = 0;
+	while (((size_t)1 << order) < count)
+		order++;
+	return order;
+}
+
+static void list_insert(size_t pfn, size_t order) {
+	struct free_block *block = pfn_to_block(pfn);
+	struct free_block **list = &free_lists[pages[pfn].node][order];
+
+	block->prev = NULL;
+	block->next = *list;
+	if (block->next)
+		block->next->prev = block;
+	*list = block;
+
+	pages[pfn].flags |= PAGE_FREE;
+	pages[pfn].order = order;
+}
+
+static void list_remove(size_t pfn, size_t order) {
+	struct free_block *block = pfn_to_block(pfn);
+
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		free_lists[pages[pfn].node][order] = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+
+	pages[pfn].flags &= ~PAGE_FREE;
+}
+
+// Return a naturally aligned block to the free lists, merging it with its
+// buddy for as long as the buddy is free, of the same order and on the same
+// node
+static void buddy_free_block(size_t pfn, size_t order) {
+	while (order < PMM_MAX_ORDER - 1) {
+		size_t buddy = pfn ^ ((size_t)1 << order);
+
+		if (buddy >= page_count || !(pages[buddy].flags & PAGE_FREE) ||
+			pages[buddy].order != order || pages[buddy].node != pages[pfn].node)
+			break;
+
+		list_remove(buddy, order);
+		pfn &= ~((size_t)1 << order);
+		order++;
+	}
+
+	list_insert(pfn, order);
+}
+
+// Split an arbitrary page range into the largest naturally aligned blocks
+static void buddy_free_node_range(size_t pfn, size_t count) {
+	while (count) {
+		size_t order = pfn ? (size_t)__builtin_ctzll(pfn) : PMM_MAX_ORDER - 1;
+
+		if (order > PMM_MAX_ORDER - 1)
+			order = PMM_MAX_ORDER - 1;
+		while (((size_t)1 << order) > count)
+			order--;
+
+		buddy_free_block(pfn, order);
+		pfn += (size_t)1 << order;
+		count -= (size_t)1 << order;
+	}
+}
+
+// Like buddy_free_node_range(), but never lets a block span two nodes
+static void buddy_free_range(size_t pfn, size_t count) {
+	if (node_count == 1) {
+		buddy_free_node_range(pfn, count);
+		return;
+	}
+
+	while (count) {
+		size_t run = 1;
+		while (run < count && pages[pfn + run].node == pages[pfn].node)
+			run++;
+
+		buddy_free_node_range(pfn, run);
+		pfn += run;
+		count -= run;
+	}
+}
+
+// Hand every run of pages that are clear in the bitmap to the buddy allocator
+static void buddy_seed(void) {
+	for (size_t pfn = 1; pfn < page_count;) {
+		size_t start = bitmap_find_clear(bitmap, pfn, page_count);
+		pfn = bitmap_find_set(bitmap, start, page_count);
+
+		if (pfn > start)
+			buddy_free_range(start, pfn - start);
+	}
+}
 
 void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 	// First, calculate how big the bitmap needs to be
@@ -40,21 +186,27 @@ void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 			highest_page = top;
 	}
 
-	size_t bitmap_size = ALIGN_UP((highest_page / PAGE_SIZE) / 8, PAGE_SIZE);
+	page_count = highest_page / PAGE_SIZE;
 
-	// Second, find a location with enough free pages to host the bitmap
+	size_t bitmap_size = ALIGN_UP(DIV_ROUNDUP(page_count, 8), PAGE_SIZE);
+	size_t pages_size = ALIGN_UP(page_count * sizeof(struct page), PAGE_SIZE);
+
+	// Second, find a location with enough free pages to host the bitmap and
+	// the page descriptors
 	for (size_t i = 0; i < memmap_entries; i++) {
 		if (memmap[i].type != STIVALE2_MMAP_USABLE)
 			continue;
 
-		if (memmap[i].length >= bitmap_size) {
+		if (memmap[i].length >= bitmap_size + pages_size) {
 			bitmap = (void *)memmap[i].base + MEM_PHYS_OFFSET;
+			pages = (void *)bitmap + bitmap_size;
 
 			// Initialise entire bitmap to 1 (non-free)
 			memset(bitmap, 0xFF, bitmap_size);
+			memset(pages, 0, pages_size);
 
-			memmap[i].length -= bitmap_size;
-			memmap[i].base += bitmap_size;
+			memmap[i].length -= bitmap_size + pages_size;
+			memmap[i].base += bitmap_size + pages_size;
 
 			break;
 		}
@@ -65,42 +217,307 @@ void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 		if (memmap[i].type != STIVALE2_MMAP_USABLE)
 			continue;
 
-		for (uintptr_t j = 0; j < memmap[i].length; j += PAGE_SIZE)
-			bitmap_unset(bitmap, (memmap[i].base + j) / PAGE_SIZE);
+		bitmap_unset_range(bitmap, memmap[i].base / PAGE_SIZE,
+						   memmap[i].length / PAGE_SIZE);
 	}
+
+	// Finally, hand every run of free pages to the buddy allocator. Page 0 is
+	// never handed out, as its address is indistinguishable from NULL.
+	bitmap_set(bitmap, 0);
+	buddy_seed();
+}
+
+static void set_page_node(uintptr_t base, size_t length, size_t node) {
+	size_t start = base / PAGE_SIZE;
+	size_t end = (base + length) / PAGE_SIZE;
+
+	if (end > page_count)
+		end = page_count;
+
+	for (size_t pfn = start; pfn < end; pfn++)
+		pages[pfn].node = node;
 }
 
-static void *inner_alloc(size_t count, size_t limit) {
-	size_t p = 0;
+// Assign memory ranges to nodes and rebuild the free lists per node. Pages not
+// covered by any range stay on node 0. distances is a count * count matrix as
+// found in the ACPI SLIT, or NULL if all nodes are equally far apart.
+void pmm_numa_init(const struct pmm_node_range *ranges, size_t range_count,
+				   size_t count, const uint8_t *distances) {
+	ASSERT(count > 0 && count <= PMM_MAX_NODES);
+
+	uint64_t rflags = cpu_irq_save();
+	struct mcs_node qnode;
+	MCS_LOCK(pmm_lock, qnode);
+
+	// Give cached pages back, they may now belong to another node
+	for (size_t i = 0; i < MAX_CPUS; i++) {
+		while (magazines[i].count)
+			bitmap_unset(bitmap,
+						 (size_t)magazines[i].pages[--magazines[i].count] /
+							 PAGE_SIZE);
+	}
+
+	for (size_t node = 0; node < PMM_MAX_NODES; node++) {
+		for (size_t order = 0; order < PMM_MAX_ORDER; order++) {
+			for (struct free_block *block = free_lists[node][order]; block;
+				 block = block->next)
+				pages[block_to_pfn(block)].flags &= ~PAGE_FREE;
+			free_lists[node][order] = NULL;
+		}
+	}
+
+	for (size_t i = 0; i < range_count; i++)
+		if (ranges[i].node < count)
+			set_page_node(ranges[i].base, ranges[i].length, ranges[i].node);
 
-	while (last_used_index < limit) {
-		if (!bitmap_test(bitmap, last_used_index++)) {
-			if (++p == count) {
-				size_t page = last_used_index - count;
-				for (size_t i = page; i < last_used_index; i++) {
-					bitmap_set(bitmap, i);
-				}
-				return (void *)(page * PAGE_SIZE);
+	// Sort every node's fallback list by distance, stable so that nodes at
+	// equal distance are tried in index order
+	for (size_t node = 0; node < count; node++) {
+		for (size_t i = 0; i < count; i++)
+			node_fallback[node][i] = i;
+
+		for (size_t i = 1; i < count && distances; i++) {
+			uint8_t other = node_fallback[node][i];
+			size_t j = i;
+			while (j > 0 && distances[node * count + node_fallback[node][j - 1]] >
+								distances[node * count + other]) {
+				node_fallback[node][j] = node_fallback[node][j - 1];
+				j--;
 			}
+			node_fallback[node][j] = other;
+		}
+	}
+
+	node_count = count;
+	buddy_seed();
+
+	MCS_UNLOCK(pmm_lock, qnode);
+	cpu_irq_restore(rflags);
+}
+
+// Takes the free pages [start, start + count) out of whatever buddy blocks
+// contain them, giving the parts of those blocks outside of the range back
+static void buddy_carve(size_t start, size_t count) {
+	size_t end = start + count;
+
+	for (size_t pfn = start; pfn < end;) {
+		size_t head = pfn, order = 0;
+		for (; order < PMM_MAX_ORDER; order++) {
+			head = pfn & ~(((size_t)1 << order) - 1);
+			if ((pages[head].flags & PAGE_FREE) && pages[head].order == order)
+				break;
+		}
+
+		ASSERT(order < PMM_MAX_ORDER);
+
+		size_t block_end = head + ((size_t)1 << order);
+		list_remove(head, order);
+
+		if (head < pfn)
+			buddy_free_range(head, pfn - head);
+		if (block_end > end)
+			buddy_free_range(end, block_end - end);
+
+		pfn = block_end;
+	}
+}
+
+static void *buddy_alloc(size_t count, size_t node) {
+	size_t order = order_for(count);
+	size_t current = PMM_MAX_ORDER;
+	struct free_block **lists = NULL;
+
+	// Prefer the requested node, then the others from nearest to farthest
+	for (size_t i = 0; i < node_count && current >= PMM_MAX_ORDER; i++) {
+		lists = free_lists[node_fallback[node][i]];
+		current = order;
+		while (current < PMM_MAX_ORDER && lists[current] == NULL)
+			current++;
+	}
+
+	if (current >= PMM_MAX_ORDER) {
+		// No naturally aligned block is large enough, but the pages may still
+		// be free as an unaligned run spanning several smaller blocks
+		size_t pfn = bitmap_find_clear_run(bitmap, 1, page_count, count);
+		if (pfn == BITMAP_NOT_FOUND)
+			return NULL;
+
+		buddy_carve(pfn, count);
+		bitmap_set_range(bitmap, pfn, count);
+		return (void *)(pfn * PAGE_SIZE);
+	}
+
+	size_t pfn = block_to_pfn(lists[current]);
+	list_remove(pfn, current);
+
+	// Split the block down to the requested order
+	while (current > order) {
+		current--;
+		list_insert(pfn + ((size_t)1 << current), current);
+	}
+
+	// Give back the pages we rounded up for
+	if (((size_t)1 << order) > count)
+		buddy_free_range(pfn + count, ((size_t)1 << order) - count);
+
+	bitmap_set_range(bitmap, pfn, count);
+
+	return (void *)(pfn * PAGE_SIZE);
+}
+
+static void buddy_free(void *ptr, size_t count) {
+	size_t page = (size_t)ptr / PAGE_SIZE;
+	ASSERT(bitmap_find_clear(bitmap, page, page + count) == page + count);
+	bitmap_unset_range(bitmap, page, count);
+	buddy_free_range(page, count);
+}
+
+static void magazine_refill(struct pmm_magazine *mag, size_t node) {
+	struct mcs_node qnode;
+	MCS_LOCK(pmm_lock, qnode);
+	while (mag->count < PMM_MAGAZINE_BATCH) {
+		void *page = buddy_alloc(1, node);
+		if (page == NULL)
+			break;
+		mag->pages[mag->count++] = page;
+	}
+	MCS_UNLOCK(pmm_lock, qnode);
+	mag->stats.refills++;
+}
+
+static void magazine_drain(struct pmm_magazine *mag) {
+	struct mcs_node qnode;
+	MCS_LOCK(pmm_lock, qnode);
+	while (mag->count > PMM_MAGAZINE_SIZE - PMM_MAGAZINE_BATCH)
+		buddy_free(mag->pages[--mag->count], 1);
+	MCS_UNLOCK(pmm_lock, qnode);
+	mag->stats.drains++;
+}
+
+static void *zero_pool_take(void) {
+	void *ret = NULL;
+	uint64_t rflags = cpu_irq_save();
+	LOCK(zero_pool_lock);
+	if (zero_pool_count)
+		ret = zero_pool[--zero_pool_count];
+	UNLOCK(zero_pool_lock);
+	cpu_irq_restore(rflags);
+	return ret;
+}
+
+// Zero a page with non-temporal stores, so the zeroing CPU's cache is not
+// filled with lines nobody is going to read back soon
+static void zero_page_nt(void *page) {
+	uint64_t *ptr = page;
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+		asm volatile("movnti %0, %1" : "=m"(ptr[i]) : "r"((uint64_t)0));
+		asm volatile("movnti %0, %1" : "=m"(ptr[i + 1]) : "r"((uint64_t)0));
+		asm volatile("movnti %0, %1" : "=m"(ptr[i + 2]) : "r"((uint64_t)0));
+		asm volatile("movnti %0, %1" : "=m"(ptr[i + 3]) : "r"((uint64_t)0));
+	}
+	asm volatile("sfence" : : : "memory");
+}
+
+void pmm_add_shrinker(size_t (*shrink)(size_t count)) {
+	ASSERT(shrinker_count < PMM_MAX_SHRINKERS);
+	shrinkers[shrinker_count++] = shrink;
+}
+
+// Ask the shrinkers for count pages, they take their own locks and may do I/O
+// so this only runs with interrupts enabled and on one processor at a time
+static bool shrink(size_t count, uint64_t rflags) {
+	if (!(rflags & (1 << 9)))
+		return false;
+	if (__atomic_exchange_n(&shrinking, true, __ATOMIC_ACQUIRE))
+		return false;
+
+	size_t freed = 0;
+	for (size_t i = 0; i < shrinker_count && freed < count; i++)
+		freed += shrinkers[i](count - freed);
+
+	__atomic_store_n(&shrinking, false, __ATOMIC_RELEASE);
+	return freed != 0;
+}
+
+void *pmm_alloc_node(size_t count, size_t node) {
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *local = this_cpu();
+	void *ret;
+
+	if (node >= node_count)
+		node = 0;
+
+	// Magazines only ever hold pages of their own processor's node
+	if (count == 1 && node == local->numa_node) {
+		struct pmm_magazine *mag = &magazines[local->cpu_number];
+
+		if (mag->count == 0) {
+			mag->stats.misses++;
+			magazine_refill(mag, node);
 		} else {
-			p = 0;
+			mag->stats.hits++;
 		}
+
+		ret = mag->count ? mag->pages[--mag->count] : NULL;
+	} else {
+		struct mcs_node qnode;
+		MCS_LOCK(pmm_lock, qnode);
+		ret = buddy_alloc(count, node);
+		MCS_UNLOCK(pmm_lock, qnode);
 	}
 
-	return NULL;
+	cpu_irq_restore(rflags);
+
+	// Pages parked in the zeroed pool are the last resort
+	if (ret == NULL && count == 1)
+		ret = zero_pool_take();
+
+	if (ret == NULL && shrink(count, rflags))
+		return pmm_alloc_node(count, node);
+
+	return ret;
 }
 
 void *pmm_alloc(size_t count) {
-	size_t l = last_used_index;
-	void *ret = inner_alloc(count, highest_page / PAGE_SIZE);
-	if (ret == NULL) {
-		last_used_index = 0;
-		ret = inner_alloc(count, l);
-	}
+	void *ret = pmm_alloc_node(count, this_cpu()->numa_node);
+	TRACEPOINT(TRACE_PMM_ALLOC, count, ret);
 	return ret;
 }
 
+// Called from the idle loop, tops up the zeroed page pool by one page.
+// Returns false if there was nothing to do.
+bool pmm_zero_work(void) {
+	if (__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) >=
+		PMM_ZERO_POOL_SIZE)
+		return false;
+
+	void *page = pmm_alloc(1);
+	if (page == NULL)
+		return false;
+
+	zero_page_nt(page + MEM_PHYS_OFFSET);
+
+	uint64_t rflags = cpu_irq_save();
+	LOCK(zero_pool_lock);
+	bool stored = zero_pool_count < PMM_ZERO_POOL_SIZE;
+	if (stored)
+		zero_pool[zero_pool_count++] = page;
+	UNLOCK(zero_pool_lock);
+	cpu_irq_restore(rflags);
+
+	if (!stored)
+		pmm_free(page, 1);
+
+	return stored;
+}
+
 void *pmm_allocz(size_t count) {
+	if (count == 1) {
+		void *ret = zero_pool_take();
+		if (ret != NULL)
+			return ret;
+	}
+
 	char *ret = (char *)pmm_alloc(count);
 
 	if (ret == NULL)
@@ -114,7 +531,57 @@ void *pmm_allocz(size_t count) {
 }
 
 void pmm_free(void *ptr, size_t count) {
-	size_t page = (size_t)ptr / PAGE_SIZE;
-	for (size_t i = page; i < page + count; i++)
-		bitmap_unset(bitmap, i);
+	TRACEPOINT(TRACE_PMM_FREE, ptr, count);
+	uint64_t rflags = cpu_irq_save();
+
+	struct cpu_local *local = this_cpu();
+
+	if (count == 1 && pages[(size_t)ptr / PAGE_SIZE].node == local->numa_node) {
+		struct pmm_magazine *mag = &magazines[local->cpu_number];
+
+		// Pages sitting in a magazine are still marked as used
+		ASSERT(bitmap_test(bitmap, (size_t)ptr / PAGE_SIZE));
+
+		if (mag->count == PMM_MAGAZINE_SIZE)
+			magazine_drain(mag);
+		mag->pages[mag->count++] = ptr;
+	} else {
+		struct mcs_node qnode;
+		MCS_LOCK(pmm_lock, qnode);
+		buddy_free(ptr, count);
+		MCS_UNLOCK(pmm_lock, qnode);
+	}
+
+	cpu_irq_restore(rflags);
+}
+
+// Try to grow the allocation [ptr, ptr + count pages) in place by extra pages
+bool pmm_extend(void *ptr, size_t count, size_t extra) {
+	size_t start = (size_t)ptr / PAGE_SIZE + count;
+	bool ret = false;
+
+	if (start + extra > page_count)
+		return false;
+
+	uint64_t rflags = cpu_irq_save();
+	struct mcs_node qnode;
+	MCS_LOCK(pmm_lock, qnode);
+
+	if (bitmap_find_set(bitmap, start, start + extra) == start + extra) {
+		buddy_carve(start, extra);
+		bitmap_set_range(bitmap, start, extra);
+		ret = true;
+	}
+
+	MCS_UNLOCK(pmm_lock, qnode);
+	cpu_irq_restore(rflags);
+	return ret;
+}
+
+struct page *pmm_get_page(void *ptr) {
+	return &pages[(size_t)ptr / PAGE_SIZE];
+}
+
+void pmm_get_cache_stats(size_t cpu, struct pmm_cache_stats *stats) {
+	*stats = magazines[cpu].stats;
 }
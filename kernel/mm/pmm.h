@@ -18,12 +18,57 @@
  * limitations under the License.
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stivale2.h>
 
+// Blocks of up to 2^(PMM_MAX_ORDER - 1) pages are tracked by the buddy
+// allocator
+#define PMM_MAX_ORDER 20
+
+// Memory is split into at most PMM_MAX_NODES NUMA nodes
+#define PMM_MAX_NODES 8
+
+#define PAGE_FREE (1 << 0)
+
+// Per physical page descriptor, indexed by page frame number
+struct page {
+	uint8_t flags;
+	uint8_t order;
+	uint8_t node;
+	// Left to the owner of an allocated page, alloc() keeps its block sizes here
+	uint32_t private;
+	// Number of pagemaps sharing the page copy-on-write besides its owner
+	uint32_t refcount;
+};
+
+// Physical memory range belonging to a NUMA node
+struct pmm_node_range {
+	uintptr_t base;
+	size_t length;
+	size_t node;
+};
+
+// Per-CPU single page cache counters
+struct pmm_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t refills;
+	size_t drains;
+};
+
 void *pmm_alloc(size_t count);
+void *pmm_alloc_node(size_t count, size_t node);
 void *pmm_allocz(size_t count);
 void pmm_free(void *ptr, size_t count);
+bool pmm_extend(void *ptr, size_t count, size_t extra);
+struct page *pmm_get_page(void *ptr);
 void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries);
+void pmm_get_cache_stats(size_t cpu, struct pmm_cache_stats *stats);
+bool pmm_zero_work(void);
+void pmm_add_shrinker(size_t (*shrink)(size_t count));
+void pmm_numa_init(const struct pmm_node_range *ranges, size_t range_count,
+				   size_t count, const uint8_t *distances);
 
 #endif
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "slab.h"
+#include "../kernel/panic.h"
+#include "../klibc/math.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <liballoc.h>
+#include <stdint.h>
+
+// Every slab is a single page starting with this header, followed by the
+// objects themselves
+struct slab {
+	struct slab *next;
+	struct slab *prev;
+	struct slab_cache *cache;
+	size_t inuse;
+	void *free;
+};
+
+static inline size_t slab_stride(struct slab_cache *cache) {
+	size_t stride = ALIGN_UP(cache->size, cache->align);
+	return stride < sizeof(void *) ? sizeof(void *) : stride;
+}
+
+static void slab_list_insert(struct slab **list, struct slab *slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (slab->next)
+		slab->next->prev = slab;
+	*list = slab;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *slab) {
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static struct slab *slab_new(struct slab_cache *cache) {
+	void *page = pmm_alloc(1);
+	if (page == NULL)
+		return NULL;
+
+	struct slab *slab = page + MEM_PHYS_OFFSET;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+
+	size_t stride = slab_stride(cache);
+	uintptr_t obj = ALIGN_UP((uintptr_t)slab + sizeof(struct slab), cache->align);
+
+	// Thread the free list through the objects, lowest address first
+	void **link = &slab->free;
+	for (; obj + stride <= (uintptr_t)slab + PAGE_SIZE; obj += stride) {
+		*link = (void *)obj;
+		link = (void **)obj;
+	}
+	*link = NULL;
+
+	return slab;
+}
+
+// Move up to count objects from the shared slabs to a processor's cache, with
+// the cache lock held
+static void slab_refill(struct slab_cache *cache, struct slab_cpu_cache *cpu,
+						size_t count) {
+	while (cpu->count < count) {
+		struct slab *slab = cache->partial;
+
+		if (slab == NULL) {
+			slab = cache->empty;
+			if (slab)
+				slab_list_remove(&cache->empty, slab);
+			else if ((slab = slab_new(cache)) == NULL)
+				return;
+			slab_list_insert(&cache->partial, slab);
+		}
+
+		while (slab->free && cpu->count < count) {
+			void *obj = slab->free;
+			slab->free = *(void **)obj;
+			slab->inuse++;
+			cpu->objects[cpu->count++] = obj;
+		}
+
+		if (slab->free == NULL) {
+			slab_list_remove(&cache->partial, slab);
+			slab_list_insert(&cache->full, slab);
+		}
+	}
+}
+
+// Give an object back to its slab, with the cache lock held. At most one
+// empty slab is kept around, the others go back to the PMM.
+static void slab_release(struct slab_cache *cache, void *obj) {
+	struct slab *slab = (void *)ALIGN_DOWN((uintptr_t)obj, PAGE_SIZE);
+	ASSERT(slab->cache == cache);
+
+	if (slab->free == NULL) {
+		slab_list_remove(&cache->full, slab);
+		slab_list_insert(&cache->partial, slab);
+	}
+
+	*(void **)obj = slab->free;
+	slab->free = obj;
+
+	if (--slab->inuse == 0) {
+		slab_list_remove(&cache->partial, slab);
+		if (cache->empty == NULL)
+			slab_list_insert(&cache->empty, slab);
+		else
+			pmm_free((void *)slab - MEM_PHYS_OFFSET, 1);
+	}
+}
+
+struct slab_cache *slab_cache_create(const char *name, size_t size,
+									 size_t align, void (*ctor)(void *obj)) {
+	struct slab_cache *cache = kcalloc(1, sizeof(struct slab_cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->name = name;
+	cache->size = size;
+	cache->align = align;
+	cache->ctor = ctor;
+
+	return cache;
+}
+
+void *slab_alloc(struct slab_cache *cache) {
+	ASSERT(cache->size <= SLAB_MAX_OBJECT);
+
+	uint64_t rflags = cpu_irq_save();
+	struct slab_cpu_cache *cpu = &cache->cpu[this_cpu()->cpu_number];
+
+	if (cpu->count == 0) {
+		LOCK(cache->lock);
+		slab_refill(cache, cpu, SLAB_CPU_CACHE / 2);
+		UNLOCK(cache->lock);
+	}
+
+	void *obj = cpu->count ? cpu->objects[--cpu->count] : NULL;
+	cpu_irq_restore(rflags);
+
+	if (obj && cache->ctor)
+		cache->ctor(obj);
+
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *obj) {
+	if (obj == NULL)
+		return;
+
+	uint64_t rflags = cpu_irq_save();
+	struct slab_cpu_cache *cpu = &cache->cpu[this_cpu()->cpu_number];
+
+	if (cpu->count == SLAB_CPU_CACHE) {
+		LOCK(cache->lock);
+		while (cpu->count > SLAB_CPU_CACHE / 2)
+			slab_release(cache, cpu->objects[--cpu->count]);
+		UNLOCK(cache->lock);
+	}
+
+	cpu->objects[cpu->count++] = obj;
+	cpu_irq_restore(rflags);
+}
@@ -0,0 +1,61 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../cpu/cpu.h"
+#include "../klibc/lock.h"
+#include "vmm.h"
+#include <stddef.h>
+
+// Objects are carved out of single page slabs, so they must be small enough
+// for a few of them to share a page
+#define SLAB_MAX_OBJECT (PAGE_SIZE / 4)
+
+// Number of free objects each processor keeps ahead of the shared slabs
+#define SLAB_CPU_CACHE 8
+
+struct slab;
+
+struct slab_cpu_cache {
+	size_t count;
+	void *objects[SLAB_CPU_CACHE];
+};
+
+struct slab_cache {
+	const char *name;
+	size_t size;
+	size_t align;
+	// Run on every object handed out by slab_alloc()
+	void (*ctor)(void *obj);
+	lock_t lock;
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;
+	struct slab_cpu_cache cpu[MAX_CPUS];
+};
+
+#define SLAB_CACHE_INIT(NAME, TYPE, CTOR) \
+	{ .name = NAME, .size = sizeof(TYPE), .align = _Alignof(TYPE), .ctor = CTOR }
+
+struct slab_cache *slab_cache_create(const char *name, size_t size,
+									 size_t align, void (*ctor)(void *obj));
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tlb.h"
+#include "../cpu/alternative.h"
+#include "../cpu/apic.h"
+#include "../cpu/cpu.h"
+#include "../cpu/isr.h"
+#include "pmm.h"
+#include "vmm.h"
+
+// Invalidation request posted by a processor to the others sharing a pagemap,
+// a processor has at most one request in flight
+struct tlb_shootdown {
+	struct pagemap *pagemap;
+	size_t count;
+	bool full;
+	uint64_t addrs[TLB_FLUSH_THRESHOLD];
+	// Processors yet to acknowledge the request
+	uint64_t pending;
+};
+
+static struct tlb_shootdown shootdowns[MAX_CPUS];
+// Per target processor, the initiators whose request it has to handle
+static uint64_t tlb_requests[MAX_CPUS];
+static struct tlb_stats tlb_stats[MAX_CPUS];
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+	struct {
+		uint64_t pcid;
+		uint64_t addr;
+	} desc = {pcid, addr};
+	asm volatile("invpcid %0, %1" : : "r"(type), "m"(desc) : "memory");
+}
+
+// Flush everything including global entries
+static void tlb_flush_global(void) {
+	if (CONFIG_X86_ASSUME_INVPCID || cpu_has(CPU_FEATURE_INVPCID)) {
+		invpcid(2, 0, 0);
+	} else {
+		uint64_t cr4 = read_cr("4");
+		write_cr("4", cr4 & ~(1 << 7));
+		write_cr("4", cr4);
+	}
+}
+
+static void tlb_flush_local(struct pagemap *pagemap, bool full,
+							const uint64_t *addrs, size_t count) {
+	size_t self = this_cpu()->cpu_number;
+
+	if (pagemap == kernel_pagemap && full) {
+		tlb_flush_global();
+	} else if (pagemap == kernel_pagemap || this_cpu()->pagemap == pagemap) {
+		// Reloading CR3 flushes the current PCID, invlpg drops global entries
+		if (full) {
+			write_cr("3", read_cr("3"));
+		} else {
+			for (size_t i = 0; i < count; i++)
+				asm volatile("invlpg [%0]" : : "r"(addrs[i]) : "memory");
+		}
+	} else if ((CONFIG_X86_ASSUME_PCID || cpu_has(CPU_FEATURE_PCID)) &&
+			   pagemap->pcid) {
+		// Entries tagged with the PCID of a pagemap we switched away from
+		if (!CONFIG_X86_ASSUME_INVPCID && !cpu_has(CPU_FEATURE_INVPCID)) {
+			__atomic_or_fetch(&pagemap->stale, 1UL << self, __ATOMIC_RELEASE);
+		} else if (full) {
+			invpcid(1, pagemap->pcid, 0);
+		} else {
+			for (size_t i = 0; i < count; i++)
+				invpcid(0, pagemap->pcid, addrs[i]);
+		}
+	}
+}
+
+static void tlb_handle_requests(void) {
+	size_t self = this_cpu()->cpu_number;
+	uint64_t requests =
+		__atomic_exchange_n(&tlb_requests[self], 0, __ATOMIC_ACQUIRE);
+
+	while (requests) {
+		struct tlb_shootdown *shootdown = &shootdowns[__builtin_ctzll(requests)];
+		requests &= requests - 1;
+
+		tlb_flush_local(shootdown->pagemap, shootdown->full, shootdown->addrs,
+						shootdown->count);
+		tlb_stats[self].received++;
+		__atomic_and_fetch(&shootdown->pending, ~(1UL << self),
+						   __ATOMIC_RELEASE);
+	}
+}
+
+// The IPI is edge triggered and the handler only needs the shootdown tables,
+// so it takes the fast path with the EOI first
+void tlb_init(void) {
+	isr_register_fast_handler(TLB_SHOOTDOWN_VECTOR, tlb_handle_requests, true);
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uint64_t virt, uint64_t size) {
+	if (batch->full)
+		return;
+
+	if (batch->count + size / PAGE_SIZE > TLB_FLUSH_THRESHOLD) {
+		batch->full = true;
+		return;
+	}
+
+	for (uint64_t p = 0; p < size; p += PAGE_SIZE)
+		batch->addrs[batch->count++] = virt + p;
+}
+
+// Defer freeing a page table until the flush, paging structure caches may
+// hold it so the whole TLB has to go
+void tlb_batch_free_table(struct tlb_batch *batch, void *table) {
+	*(uintptr_t *)(table + MEM_PHYS_OFFSET) = batch->tables;
+	batch->tables = (uintptr_t)table;
+	batch->full = true;
+}
+
+// Wait until every processor has handled the last shootdown of this one
+void tlb_wait(void) {
+	size_t self = this_cpu()->cpu_number;
+	struct tlb_shootdown *shootdown = &shootdowns[self];
+
+	if (!__atomic_load_n(&shootdown->pending, __ATOMIC_ACQUIRE))
+		return;
+
+	uint64_t start = rdtsc();
+	while (__atomic_load_n(&shootdown->pending, __ATOMIC_ACQUIRE)) {
+		// The processors we wait for may be waiting on us with interrupts off
+		tlb_handle_requests();
+		asm volatile("pause");
+	}
+	tlb_stats[self].wait_cycles += rdtsc() - start;
+}
+
+// Invalidate the batch here and on every other processor using the pagemap.
+// Remote processors are only interrupted, tlb_wait() has to be called before
+// reusing memory that was unmapped, except for page tables freed by the batch.
+void tlb_batch_flush(struct pagemap *pagemap, struct tlb_batch *batch) {
+	if (!batch->count && !batch->full)
+		return;
+
+	uint64_t rflags = cpu_irq_save();
+	size_t self = this_cpu()->cpu_number;
+
+	tlb_flush_local(pagemap, batch->full, batch->addrs, batch->count);
+
+	// Order the page table updates before reading who could have cached them
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t targets =
+		__atomic_load_n(&pagemap->active, __ATOMIC_RELAXED) & ~(1UL << self);
+
+	if (targets) {
+		tlb_wait();
+
+		struct tlb_shootdown *shootdown = &shootdowns[self];
+		shootdown->pagemap = pagemap;
+		shootdown->full = batch->full;
+		shootdown->count = batch->count;
+		for (size_t i = 0; i < batch->count; i++)
+			shootdown->addrs[i] = batch->addrs[i];
+		__atomic_store_n(&shootdown->pending, targets, __ATOMIC_RELEASE);
+
+		struct tlb_stats *stats = &tlb_stats[self];
+		stats->shootdowns++;
+		stats->targets += __builtin_popcountll(targets);
+		if (batch->full)
+			stats->full_flushes++;
+		else
+			stats->pages += batch->count;
+
+		while (targets) {
+			size_t cpu = __builtin_ctzll(targets);
+			targets &= targets - 1;
+			__atomic_or_fetch(&tlb_requests[cpu], 1UL << self,
+							  __ATOMIC_RELEASE);
+			apic_send_ipi(cpu_locals[cpu].lapic_id, TLB_SHOOTDOWN_VECTOR);
+		}
+	}
+
+	cpu_irq_restore(rflags);
+
+	if (batch->tables) {
+		tlb_wait();
+		while (batch->tables) {
+			void *table = (void *)batch->tables;
+			batch->tables = *(uintptr_t *)(table + MEM_PHYS_OFFSET);
+			pmm_free(table, 1);
+		}
+	}
+
+	batch->count = 0;
+	batch->full = false;
+}
+
+void tlb_get_stats(size_t cpu, struct tlb_stats *stats) {
+	*stats = tlb_stats[cpu];
+}
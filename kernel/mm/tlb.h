@@ -0,0 +1,59 @@
+#ifndef TLB_H
+#define TLB_H
+
+/*
+ * Copyright 2021 NSG650
+ * Copyright 2021 Sebastian
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Above this many pages a full TLB flush is cheaper than invlpg
+#define TLB_FLUSH_THRESHOLD 64
+
+#define TLB_SHOOTDOWN_VECTOR 0xFD
+
+struct pagemap;
+
+// Invalidations are collected while a range is being changed and issued once
+// at the end, either page by page or as a full flush over the threshold
+struct tlb_batch {
+	size_t count;
+	bool full;
+	uint64_t addrs[TLB_FLUSH_THRESHOLD];
+	// Page tables to free once no processor can still be walking them
+	uintptr_t tables;
+};
+
+// Per-CPU shootdown counters, wait_cycles is in TSC ticks
+struct tlb_stats {
+	size_t shootdowns;
+	size_t targets;
+	size_t pages;
+	size_t full_flushes;
+	size_t received;
+	uint64_t wait_cycles;
+};
+
+void tlb_init(void);
+void tlb_batch_add(struct tlb_batch *batch, uint64_t virt, uint64_t size);
+void tlb_batch_free_table(struct tlb_batch *batch, void *table);
+void tlb_batch_flush(struct pagemap *pagemap, struct tlb_batch *batch);
+void tlb_wait(void);
+void tlb_get_stats(size_t cpu, struct tlb_stats *stats);
+
+#endif
@@ -16,97 +16,695 @@
  */
 
 #include "vmm.h"
+#include "../cpu/cpu.h"
 #include "../klibc/alloc.h"
+#include "../klibc/lock.h"
 #include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "../klibc/trace.h"
+#include "../klibc/types.h"
 #include "pmm.h"
+#include "tlb.h"
+#include <cpuid.h>
+
+#define PTE_ADDR_MASK ((uint64_t)0x000FFFFFFFFFF000)
+#define PTE_LARGE_PAT (1 << 12)
+#define PTE_SMALL_PAT (1 << 7)
+
+#define CR3_NOFLUSH (1UL << 63)
+#define MAX_PCID 4096
 
 struct pagemap *kernel_pagemap = NULL;
 
+#if CONFIG_X86_ASSUME_PDPE1GB
+static const bool gib_pages = true;
+#else
+static bool gib_pages = false;
+#endif
+
+static lock_t pcid_lock;
+static uint16_t next_pcid = 1;
+
+// Page tables are numbered by level, 4 being the PML4 and 1 the page table.
+// An entry at level n maps level_size(n) bytes.
+static inline uint64_t level_size(int level) {
+	return (uint64_t)PAGE_SIZE << (9 * (level - 1));
+}
+
+static inline size_t level_index(uint64_t virt, int level) {
+	return (virt >> (12 + 9 * (level - 1))) & 0x1FF;
+}
+
+static inline uint64_t leaf_addr_mask(int level) {
+	return PTE_ADDR_MASK & ~(level_size(level) - 1);
+}
+
+static inline uint64_t *table_of(uint64_t entry) {
+	return (uint64_t *)((entry & PTE_ADDR_MASK) + MEM_PHYS_OFFSET);
+}
+
+static inline bool is_leaf(uint64_t entry, int level) {
+	return level == 1 || (entry & VMM_LARGE);
+}
+
+// Mapping flags are given in the 4 KiB page layout, large pages move the PAT
+// bit to bit 12 as bit 7 selects the page size
+static inline uint64_t leaf_flags(uint64_t flags, int level) {
+	if (level == 1)
+		return flags;
+	if (flags & PTE_SMALL_PAT)
+		flags = (flags & ~PTE_SMALL_PAT) | PTE_LARGE_PAT;
+	return flags | VMM_LARGE;
+}
+
+static inline uint64_t small_flags(uint64_t entry, int level) {
+	uint64_t flags = entry & ~leaf_addr_mask(level);
+	if (level == 1)
+		return flags;
+	flags &= ~VMM_LARGE;
+	if (flags & PTE_LARGE_PAT)
+		flags = (flags & ~PTE_LARGE_PAT) | PTE_SMALL_PAT;
+	return flags;
+}
+
+static bool table_empty(uint64_t *table) {
+	for (size_t i = 0; i < 512; i++)
+		if (table[i] & VMM_PRESENT)
+			return false;
+	return true;
+}
+
+static void free_table(uint64_t *table, int level, struct tlb_batch *batch) {
+	if (level > 1) {
+		for (size_t i = 0; i < 512; i++)
+			if ((table[i] & VMM_PRESENT) && !is_leaf(table[i], level))
+				free_table(table_of(table[i]), level - 1, batch);
+	}
+	tlb_batch_free_table(batch, (void *)table - MEM_PHYS_OFFSET);
+}
+
+// Replace a large page by a table of pages one level down mapping the same
+// memory with the same flags
+static bool split_leaf(uint64_t *entry, int level) {
+	uint64_t *table = pmm_allocz(1);
+	if (table == NULL)
+		return false;
+
+	uint64_t phys = *entry & leaf_addr_mask(level);
+	uint64_t flags = leaf_flags(small_flags(*entry, level), level - 1);
+	uint64_t *virt_table = (void *)table + MEM_PHYS_OFFSET;
+
+	for (size_t i = 0; i < 512; i++)
+		virt_table[i] = (phys + i * level_size(level - 1)) | flags;
+
+	// Present + writable + user (0b111), the leaves decide the permissions
+	*entry = (uintptr_t)table | 0b111;
+	return true;
+}
+
+// Return the entry mapping virt at the given level. With create set, missing
+// tables are allocated and large pages in the way are split, otherwise NULL is
+// returned in either case.
+static uint64_t *walk(struct pagemap *pagemap, uint64_t virt, int target,
+					  bool create) {
+	uint64_t *table = pagemap->top_level + MEM_PHYS_OFFSET;
+
+	for (int level = 4; level > target; level--) {
+		uint64_t *entry = &table[level_index(virt, level)];
+
+		if (!(*entry & VMM_PRESENT)) {
+			if (!create)
+				return NULL;
+			void *next = pmm_allocz(1);
+			if (next == NULL)
+				return NULL;
+			// Present + writable + user (0b111)
+			*entry = (uintptr_t)next | 0b111;
+		} else if (is_leaf(*entry, level)) {
+			if (!create || !split_leaf(entry, level))
+				return NULL;
+		}
+
+		table = table_of(*entry);
+	}
+
+	return &table[level_index(virt, target)];
+}
+
+// Find the leaf entry mapping virt, whatever its size
+static uint64_t *find_leaf(struct pagemap *pagemap, uint64_t virt,
+						   int *level) {
+	uint64_t *table = pagemap->top_level + MEM_PHYS_OFFSET;
+
+	for (int l = 4; l >= 1; l--) {
+		uint64_t *entry = &table[level_index(virt, l)];
+		if (!(*entry & VMM_PRESENT))
+			return NULL;
+		if (l < 4 && is_leaf(*entry, l)) {
+			*level = l;
+			return entry;
+		}
+		table = table_of(*entry);
+	}
+
+	return NULL;
+}
+
+// Part of [virt, virt + length) covered by the entry of virt at level
+static inline uint64_t entry_chunk(uint64_t virt, uint64_t length, int level) {
+	uint64_t chunk = level_size(level) - (virt & (level_size(level) - 1));
+	return chunk < length ? chunk : length;
+}
+
+// Map a range into the table at level, filling consecutive entries and only
+// descending where the range can't be covered by a leaf of this size
+static bool map_level(uint64_t *table, int level, uint64_t virt, uint64_t phys,
+					  uint64_t length, uint64_t flags,
+					  struct tlb_batch *batch) {
+	while (length) {
+		uint64_t size = level_size(level);
+		uint64_t chunk = entry_chunk(virt, length, level);
+		uint64_t *entry = &table[level_index(virt, level)];
+
+		bool leaf = level == 1 || level == 2 || (level == 3 && gib_pages);
+		if (leaf && chunk == size && !((virt | phys) & (size - 1))) {
+			uint64_t old = *entry;
+			if ((old & VMM_PRESENT) && !is_leaf(old, level))
+				free_table(table_of(old), level - 1, batch);
+
+			*entry = phys | leaf_flags(flags, level);
+			if (old & VMM_PRESENT)
+				tlb_batch_add(batch, virt, size);
+		} else {
+			if (!(*entry & VMM_PRESENT)) {
+				void *next = pmm_allocz(1);
+				if (next == NULL)
+					return false;
+				// Present + writable + user (0b111)
+				*entry = (uintptr_t)next | 0b111;
+			} else if (is_leaf(*entry, level)) {
+				if (!split_leaf(entry, level))
+					return false;
+			}
+
+			if (!map_level(table_of(*entry), level - 1, virt, phys, chunk,
+						   flags, batch))
+				return false;
+		}
+
+		virt += chunk;
+		phys += chunk;
+		length -= chunk;
+	}
+
+	return true;
+}
+
+// Unmap a range from the table at level, freeing tables left empty
+static bool unmap_level(uint64_t *table, int level, uint64_t virt,
+						uint64_t length, struct tlb_batch *batch) {
+	while (length) {
+		uint64_t size = level_size(level);
+		uint64_t chunk = entry_chunk(virt, length, level);
+		uint64_t *entry = &table[level_index(virt, level)];
+
+		if (*entry & VMM_PRESENT) {
+			if (is_leaf(*entry, level) && chunk == size) {
+				*entry = 0;
+				tlb_batch_add(batch, virt, size);
+			} else {
+				if (is_leaf(*entry, level) && !split_leaf(entry, level))
+					return false;
+
+				uint64_t *next = table_of(*entry);
+				if (!unmap_level(next, level - 1, virt, chunk, batch))
+					return false;
+
+				// Top level kernel entries are shared by all pagemaps
+				bool shared = level == 4 && virt >= MEM_PHYS_OFFSET;
+				if (!shared && table_empty(next)) {
+					*entry = 0;
+					tlb_batch_free_table(batch, (void *)next - MEM_PHYS_OFFSET);
+				}
+			}
+		}
+
+		virt += chunk;
+		length -= chunk;
+	}
+
+	return true;
+}
+
+// Collapse the table below the entry at level into a single large page if it
+// maps a contiguous, suitably aligned range with identical flags
+static void try_merge(struct pagemap *pagemap, uint64_t virt, int level,
+					  struct tlb_batch *batch) {
+	uint64_t *entry = walk(pagemap, virt, level, false);
+	if (entry == NULL || !(*entry & VMM_PRESENT) || is_leaf(*entry, level))
+		return;
+
+	uint64_t *table = table_of(*entry);
+	uint64_t first = table[0];
+	if (!(first & VMM_PRESENT) || !is_leaf(first, level - 1))
+		return;
+
+	uint64_t phys = first & leaf_addr_mask(level - 1);
+	if (phys & (level_size(level) - 1))
+		return;
+
+	for (size_t i = 1; i < 512; i++)
+		if (table[i] != ((phys + i * level_size(level - 1)) |
+						 (first & ~leaf_addr_mask(level - 1))))
+			return;
+
+	*entry = phys | leaf_flags(small_flags(first, level - 1), level);
+	tlb_batch_free_table(batch, (void *)table - MEM_PHYS_OFFSET);
+}
+
+bool vmm_map_range(struct pagemap *pagemap, uint64_t virt, uint64_t phys,
+				   uint64_t length, uint64_t flags) {
+	struct tlb_batch batch = {0};
+	bool ret = map_level(pagemap->top_level + MEM_PHYS_OFFSET, 4, virt, phys,
+						 length, flags, &batch);
+	tlb_batch_flush(pagemap, &batch);
+	return ret;
+}
+
+bool vmm_unmap_range(struct pagemap *pagemap, uint64_t virt, uint64_t length) {
+	struct tlb_batch batch = {0};
+	bool ret = unmap_level(pagemap->top_level + MEM_PHYS_OFFSET, 4, virt,
+						   length, &batch);
+	tlb_batch_flush(pagemap, &batch);
+	return ret;
+}
+
+// Change the flags of every page mapped in a range, splitting large pages that
+// straddle its edges and merging them back where the flags become uniform
+bool vmm_protect_range(struct pagemap *pagemap, uint64_t virt,
+					   uint64_t length, uint64_t flags) {
+	struct tlb_batch batch = {0};
+	uint64_t start = virt, end = virt + length;
+	bool ret = true;
+
+	while (virt < end) {
+		int level;
+		uint64_t *entry = find_leaf(pagemap, virt, &level);
+
+		if (entry == NULL) {
+			virt += PAGE_SIZE;
+			continue;
+		}
+
+		uint64_t size = level_size(level);
+		if ((virt & (size - 1)) || end - virt < size) {
+			if (walk(pagemap, virt, level - 1, true) == NULL) {
+				ret = false;
+				break;
+			}
+			continue;
+		}
+
+		// Shared pages stay read-only until written to, and the memory type
+		// is kept unless a new one is given
+		uint64_t new_flags = flags | (*entry & (VMM_COW | VMM_ANON));
+		if (!(flags & VMM_CACHE_MASK))
+			new_flags |= small_flags(*entry, level) & VMM_CACHE_MASK;
+		if (new_flags & VMM_COW)
+			new_flags &= ~VMM_WRITE;
+
+		*entry =
+			(*entry & leaf_addr_mask(level)) | leaf_flags(new_flags, level);
+		tlb_batch_add(&batch, virt, size);
+		virt += size;
+	}
+
+	for (uint64_t p = ALIGN_DOWN(start, level_size(2)); p < end;
+		 p += level_size(2))
+		try_merge(pagemap, p, 2, &batch);
+	if (gib_pages)
+		for (uint64_t p = ALIGN_DOWN(start, level_size(3)); p < end;
+			 p += level_size(3))
+			try_merge(pagemap, p, 3, &batch);
+
+	tlb_batch_flush(pagemap, &batch);
+	return ret;
+}
+
+static void add_region(struct pagemap *pagemap, uint64_t virt, uint64_t phys,
+					   uint64_t length, uint64_t flags, int type) {
+	struct vmm_region region = {.base = ALIGN_DOWN(virt, PAGE_SIZE),
+								.phys = ALIGN_DOWN(phys, PAGE_SIZE),
+								.length = ALIGN_UP(length, PAGE_SIZE),
+								.flags = flags,
+								.type = type};
+
+	LOCK(pagemap->lock);
+	DYNARRAY_PUSHBACK(pagemap->regions, region);
+	UNLOCK(pagemap->lock);
+}
+
+// Reserve a range backed by zeroed pages allocated on first touch
+void vmm_map_lazy(struct pagemap *pagemap, uint64_t virt, uint64_t length,
+				  uint64_t flags) {
+	add_region(pagemap, virt, 0, length, flags, VMM_LAZY_ANON);
+}
+
+// Reserve a range mapping phys linearly, mapped in chunks of up to 2 MiB as
+// they are touched
+void vmm_map_lazy_phys(struct pagemap *pagemap, uint64_t virt, uint64_t phys,
+					   uint64_t length, uint64_t flags) {
+	add_region(pagemap, virt, phys, length, flags, VMM_LAZY_PHYS);
+}
+
+static struct vmm_region *find_region(struct pagemap *pagemap, uint64_t addr) {
+	for (size_t i = 0; i < pagemap->regions.length; i++) {
+		struct vmm_region *region = &pagemap->regions.storage[i];
+		if (addr >= region->base && addr - region->base < region->length)
+			return region;
+	}
+	return NULL;
+}
+
+static bool resolve_fault(struct pagemap *pagemap, uint64_t addr) {
+	LOCK(pagemap->lock);
+
+	struct vmm_region *region = find_region(pagemap, addr);
+	if (region == NULL) {
+		UNLOCK(pagemap->lock);
+		return false;
+	}
+
+	// Another processor may have resolved the same fault meanwhile
+	int level;
+	bool ret = true;
+	if (find_leaf(pagemap, addr, &level) == NULL) {
+		if (region->type == VMM_LAZY_PHYS) {
+			uint64_t start = ALIGN_DOWN(addr, level_size(2));
+			uint64_t end = start + level_size(2);
+			if (start < region->base)
+				start = region->base;
+			if (end > region->base + region->length)
+				end = region->base + region->length;
+			ret = vmm_map_range(pagemap, start,
+								region->phys + (start - region->base),
+								end - start, region->flags);
+		} else {
+			void *page = pmm_allocz(1);
+			ret = page != NULL &&
+				  vmm_map_range(pagemap, ALIGN_DOWN(addr, PAGE_SIZE),
+								(uintptr_t)page, PAGE_SIZE,
+								region->flags | VMM_ANON);
+		}
+	}
+
+	UNLOCK(pagemap->lock);
+	return ret;
+}
+
+// Give a write fault on a copy-on-write page its own copy, or the page itself
+// once every other pagemap sharing it has copied it
+static bool resolve_cow(struct pagemap *pagemap, uint64_t addr) {
+	LOCK(pagemap->lock);
+
+	int level;
+	uint64_t *entry = find_leaf(pagemap, addr, &level);
+	if (entry == NULL || !(*entry & VMM_COW)) {
+		UNLOCK(pagemap->lock);
+		return false;
+	}
+
+	void *old = (void *)(*entry & PTE_ADDR_MASK);
+	uint64_t flags = (*entry & ~PTE_ADDR_MASK & ~VMM_COW) | VMM_WRITE;
+	struct page *page = pmm_get_page(old);
+
+	// The copy is made before letting go of the page, as the last pagemap
+	// holding it may start writing to it right after
+	void *copy = NULL;
+	if (__atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE)) {
+		copy = pmm_alloc(1);
+		if (copy == NULL) {
+			UNLOCK(pagemap->lock);
+			return false;
+		}
+		memcpy(copy + MEM_PHYS_OFFSET, old + MEM_PHYS_OFFSET, PAGE_SIZE);
+	}
+
+	uint32_t refs = __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE);
+	while (refs &&
+		   !__atomic_compare_exchange_n(&page->refcount, &refs, refs - 1, false,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		;
+
+	if (refs == 0) {
+		// We ended up as the only user of the page
+		if (copy != NULL)
+			pmm_free(copy, 1);
+		copy = old;
+	}
+
+	struct tlb_batch batch = {0};
+	*entry = (uintptr_t)copy | flags;
+	tlb_batch_add(&batch, ALIGN_DOWN(addr, PAGE_SIZE), PAGE_SIZE);
+	tlb_batch_flush(pagemap, &batch);
+
+	UNLOCK(pagemap->lock);
+	return true;
+}
+
+// Page flags for mapping a resource at virt with mmap(), 0 if that can't be
+// done. Write faults on copy-on-write pages are only resolved in the lower
+// half, so private writable mappings have to be there.
+uint64_t vmm_mmap_flags(uint64_t virt, int prot, int flags) {
+	int type = flags & (MAP_SHARED | MAP_PRIVATE);
+	if ((type != MAP_SHARED && type != MAP_PRIVATE) || prot == PROT_NONE ||
+		(virt & (PAGE_SIZE - 1)))
+		return 0;
+
+	uint64_t ret = VMM_PRESENT;
+	if (!(prot & PROT_EXEC))
+		ret |= VMM_NX;
+	if (prot & PROT_WRITE) {
+		if (type == MAP_SHARED)
+			ret |= VMM_WRITE;
+		else if (virt < MEM_PHYS_OFFSET)
+			ret |= VMM_COW | VMM_ANON;
+		else
+			return 0;
+	}
+	return ret;
+}
+
+// Find the physical address behind virt, for handing buffers to devices.
+// Returns false if nothing is mapped there yet.
+bool vmm_virt_to_phys(struct pagemap *pagemap, uint64_t virt, uint64_t *phys) {
+	// The kernel image and the direct map are linear
+	if (virt >= KERNEL_BASE) {
+		*phys = virt - KERNEL_BASE;
+		return true;
+	}
+	if (virt >= MEM_PHYS_OFFSET) {
+		*phys = virt - MEM_PHYS_OFFSET;
+		return true;
+	}
+
+	LOCK(pagemap->lock);
+	int level;
+	uint64_t *entry = find_leaf(pagemap, virt, &level);
+	if (entry != NULL)
+		*phys = (*entry & leaf_addr_mask(level)) |
+				(virt & (level_size(level) - 1));
+	UNLOCK(pagemap->lock);
+
+	return entry != NULL;
+}
+
+// Called on page faults, returns whether the fault was resolved by mapping a
+// lazy region or copying a copy-on-write page. The kernel half is shared so
+// its regions live in kernel_pagemap.
+bool vmm_handle_fault(uint64_t addr, uint64_t error) {
+	struct pagemap *pagemap = this_cpu()->pagemap;
+
+	if (pagemap == NULL)
+		return false;
+
+	// Accesses to present pages can only be writes to shared ones
+	if (error & VMM_PRESENT)
+		return (error & VMM_WRITE) && addr < MEM_PHYS_OFFSET &&
+			   resolve_cow(pagemap, addr);
+
+	if (addr >= MEM_PHYS_OFFSET)
+		pagemap = kernel_pagemap;
+
+	return resolve_fault(pagemap, addr);
+}
+
 void vmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries,
 			  struct stivale2_pmr *pmrs, size_t pmr_entries) {
+#if !CONFIG_X86_ASSUME_PDPE1GB
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	if (__get_cpuid(0x80000001, &a, &b, &c, &d))
+		gib_pages = d & CPUID_PDPE1GB;
+#endif
+
 	kernel_pagemap = vmm_new_pagemap();
-	for (uint64_t p = 0; p < 4096UL * 1024 * 1024; p += 0x200000) {
-		vmm_map_page(kernel_pagemap, p, p, 0b11 | 1UL << 63, true);
-		vmm_map_page(kernel_pagemap, p + MEM_PHYS_OFFSET, p, 0b11 | 1UL << 63,
-					 true);
-	}
+
+	// The low 4 GiB are only mapped where the memory map has entries, the
+	// holes with MMIO in them are mapped when first accessed
+	const uint64_t low_memory = 4096UL * 1024 * 1024;
+	vmm_map_lazy_phys(kernel_pagemap, 0, 0, low_memory, 0b11 | VMM_NX);
+	vmm_map_lazy_phys(kernel_pagemap, MEM_PHYS_OFFSET, 0, low_memory,
+					  0b11 | VMM_NX | VMM_GLOBAL);
+
 	for (size_t i = 0; i < pmr_entries; i++) {
 		uint64_t virt = pmrs[i].base;
 		uint64_t phys = virt - KERNEL_BASE;
 		uint64_t pf =
-			(pmrs[i].permissions & STIVALE2_PMR_EXECUTABLE ? 0 : 1UL << 63) |
-			(pmrs[i].permissions & STIVALE2_PMR_WRITABLE ? 1 << 1 : 0) | 1;
-		for (uint64_t p = 0; p < pmrs[i].length; p += PAGE_SIZE) {
-			vmm_map_page(kernel_pagemap, virt + p, phys + p, pf, false);
-		}
+			(pmrs[i].permissions & STIVALE2_PMR_EXECUTABLE ? 0 : VMM_NX) |
+			(pmrs[i].permissions & STIVALE2_PMR_WRITABLE ? 1 << 1 : 0) |
+			VMM_GLOBAL | 1;
+		vmm_map_range(kernel_pagemap, virt, phys,
+					  ALIGN_UP(pmrs[i].length, PAGE_SIZE), pf);
 	}
+
 	for (size_t i = 0; i < memmap_entries; i++) {
 		uint64_t aligned_base = ALIGN_DOWN(memmap[i].base, 0x200000);
 		uint64_t aligned_top =
 			ALIGN_UP(memmap[i].base + memmap[i].length, 0x200000);
-		uint64_t aligned_length = aligned_top - aligned_base;
 
-		for (uint64_t p = 0; p < aligned_length; p += 0x200000) {
-			uint64_t page = aligned_base + p;
-			vmm_map_page(kernel_pagemap, page, page, 0b11 | 1UL << 63, true);
-			vmm_map_page(kernel_pagemap, MEM_PHYS_OFFSET + page, page,
-						 0b11 | 1UL << 63, true);
-		}
+		uint64_t aligned_length = aligned_top - aligned_base;
+		vmm_map_range(kernel_pagemap, aligned_base, aligned_base,
+					  aligned_length, 0b11 | VMM_NX);
+		vmm_map_range(kernel_pagemap, MEM_PHYS_OFFSET + aligned_base,
+					  aligned_base, aligned_length, 0b11 | VMM_NX | VMM_GLOBAL);
 	}
 	vmm_switch_pagemap(kernel_pagemap);
 }
 
+// The set of processors which may cache entries of a pagemap is kept so that
+// TLB shootdowns only interrupt those. A processor joins before loading the
+// pagemap, and only leaves if switching away flushed its entries: pagemaps
+// with a PCID keep them, and the kernel half of kernel_pagemap is global.
 void vmm_switch_pagemap(struct pagemap *pagemap) {
-	asm volatile("mov cr3, %0" : : "r"(pagemap->top_level) : "memory");
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *cpu = this_cpu();
+	struct pagemap *old = cpu->pagemap;
+	uint64_t bit = 1UL << cpu->cpu_number;
+	uint64_t cr3 = (uintptr_t)pagemap->top_level;
+
+	__atomic_or_fetch(&pagemap->active, bit, __ATOMIC_SEQ_CST);
+	cpu->pagemap = pagemap;
+
+	if (cpu_pcid && pagemap->pcid) {
+		cr3 |= pagemap->pcid;
+		if (!(__atomic_fetch_and(&pagemap->stale, ~bit, __ATOMIC_ACQ_REL) &
+			  bit))
+			cr3 |= CR3_NOFLUSH;
+	}
+	asm volatile("mov cr3, %0" : : "r"(cr3) : "memory");
+
+	if (old != NULL && old != pagemap && old != kernel_pagemap &&
+		!(cpu_pcid && old->pcid))
+		__atomic_and_fetch(&old->active, ~bit, __ATOMIC_RELEASE);
+	cpu_irq_restore(rflags);
 }
 
+// New pagemaps share the kernel half of kernel_pagemap. PCIDs are handed out
+// once, pagemaps created after they run out are flushed on every switch.
 struct pagemap *vmm_new_pagemap(void) {
 	struct pagemap *pagemap = alloc(sizeof(struct pagemap));
 	pagemap->top_level = pmm_allocz(1);
+
+	if (kernel_pagemap != NULL) {
+		uint64_t *top = pagemap->top_level + MEM_PHYS_OFFSET;
+		uint64_t *kernel_top = kernel_pagemap->top_level + MEM_PHYS_OFFSET;
+		for (size_t i = 256; i < 512; i++)
+			top[i] = kernel_top[i];
+	}
+
+	LOCK(pcid_lock);
+	if (next_pcid < MAX_PCID)
+		pagemap->pcid = next_pcid++;
+	UNLOCK(pcid_lock);
+
 	return pagemap;
 }
 
-static uint64_t *get_next_level(uint64_t *current_level, size_t entry) {
-	uint64_t *ret;
-	if (current_level[entry] & 1) {
-		// Present flag set
-		ret = (uint64_t *)(size_t)(current_level[entry] & ~((uint64_t)0xFFF));
-	} else {
-		// Allocate a table for the next level
-		ret = pmm_allocz(1);
-		// Present + writable + user (0b111)
-		current_level[entry] = (size_t)ret | 0b111;
+// Copy a table of the lower half for vmm_fork_pagemap(). Private pages become
+// read-only and shared in both pagemaps, everything else is mapped as is.
+static bool clone_table(uint64_t *table, uint64_t *clone, int level,
+						uint64_t virt, struct tlb_batch *batch) {
+	for (size_t i = 0; i < (level == 4 ? 256 : 512); i++) {
+		uint64_t entry = table[i];
+		uint64_t entry_virt = virt + i * level_size(level);
+
+		if (!(entry & VMM_PRESENT))
+			continue;
+
+		if (level < 4 && is_leaf(entry, level)) {
+			if (level == 1 && (entry & VMM_ANON)) {
+				if (entry & VMM_WRITE) {
+					entry = (entry & ~VMM_WRITE) | VMM_COW;
+					table[i] = entry;
+					tlb_batch_add(batch, entry_virt, PAGE_SIZE);
+				}
+				if (entry & VMM_COW)
+					__atomic_add_fetch(
+						&pmm_get_page((void *)(entry & PTE_ADDR_MASK))->refcount,
+						1, __ATOMIC_RELEASE);
+			}
+			clone[i] = entry;
+			continue;
+		}
+
+		void *child = pmm_allocz(1);
+		if (child == NULL)
+			return false;
+		clone[i] = (uintptr_t)child | (entry & ~PTE_ADDR_MASK);
+
+		if (!clone_table(table_of(entry), table_of(clone[i]), level - 1,
+						 entry_virt, batch))
+			return false;
 	}
 
-	return ret;
+	return true;
 }
 
-bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
-				  uint64_t phys_addr, uint64_t flags, bool hugepages) {
-	size_t pml4_entry = (virt_addr & ((uint64_t)0x1FF << 39)) >> 39;
-	size_t pml3_entry = (virt_addr & ((uint64_t)0x1FF << 30)) >> 30;
-	size_t pml2_entry = (virt_addr & ((uint64_t)0x1FF << 21)) >> 21;
-	size_t pml1_entry = (virt_addr & ((uint64_t)0x1FF << 12)) >> 12;
+// Duplicate a pagemap fork-style, its lazy regions included. If this fails
+// pages already made copy-on-write stay so, the next write to them copies
+// them once.
+struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap) {
+	struct pagemap *fork = vmm_new_pagemap();
+	uint64_t *fork_top = fork->top_level + MEM_PHYS_OFFSET;
+	struct tlb_batch batch = {0};
 
-	uint64_t *pml4, *pml3, *pml2, *pml1;
+	LOCK(pagemap->lock);
 
-	pml4 = pagemap->top_level;
-	pml3 = get_next_level(pml4, pml4_entry);
-	if (pml3 == NULL)
-		return false;
-	pml2 = get_next_level(pml3, pml3_entry);
-	if (pml2 == NULL)
-		return false;
+	bool ret = clone_table(pagemap->top_level + MEM_PHYS_OFFSET, fork_top, 4,
+						   0, &batch);
+	if (ret)
+		for (size_t i = 0; i < pagemap->regions.length; i++)
+			DYNARRAY_PUSHBACK(fork->regions, pagemap->regions.storage[i]);
 
-	if (hugepages) {
-		pml2[pml2_entry] = phys_addr | flags | (1 << 7);
-		return true;
+	tlb_batch_flush(pagemap, &batch);
+	UNLOCK(pagemap->lock);
+
+	if (!ret) {
+		for (size_t i = 0; i < 256; i++)
+			if (fork_top[i] & VMM_PRESENT)
+				free_table(table_of(fork_top[i]), 3, &batch);
+		tlb_batch_flush(fork, &batch);
+		pmm_free(fork->top_level, 1);
+		free(fork);
+		return NULL;
 	}
 
-	pml1 = get_next_level(pml2, pml2_entry);
-	if (pml1 == NULL)
-		return false;
+	return fork;
+}
 
-	pml1[pml1_entry] = phys_addr | flags;
-	return true;
+bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
+				  uint64_t phys_addr, uint64_t flags, bool hugepages) {
+	TRACEPOINT(TRACE_VMM_MAP_PAGE, virt_addr, phys_addr);
+	return vmm_map_range(pagemap, virt_addr, phys_addr,
+						 hugepages ? 0x200000 : PAGE_SIZE, flags);
 }
@@ -18,6 +18,8 @@
  * limitations under the License.
  */
 
+#include "../klibc/dynarray.h"
+#include "../klibc/lock.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -27,15 +29,73 @@
 #define MEM_PHYS_OFFSET ((uint64_t)0xFFFF800000000000)
 #define KERNEL_BASE ((uint64_t)0xFFFFFFFF80000000)
 
+#define VMM_PRESENT (1 << 0)
+#define VMM_WRITE (1 << 1)
+#define VMM_USER (1 << 2)
+#define VMM_LARGE (1 << 7)
+#define VMM_GLOBAL (1 << 8)
+// Available to software, a copy-on-write page and a private page, from an
+// anonymous region or a private mapping of a resource
+#define VMM_COW (1 << 9)
+#define VMM_ANON (1 << 10)
+#define VMM_NX (1UL << 63)
+
+// Memory type of a mapping, selecting one of the PAT entries set up by
+// cpu_init(). Like the other flags they're given in the 4 KiB page layout.
+#define VMM_CACHE_WB 0
+#define VMM_CACHE_WT (1 << 3)
+#define VMM_CACHE_UC ((1 << 3) | (1 << 4))
+#define VMM_CACHE_WC ((1 << 7) | (1 << 3))
+#define VMM_CACHE_MASK ((1 << 7) | (1 << 4) | (1 << 3))
+
+// Lazy regions are mapped on first access, either to fresh zeroed pages or
+// linearly to the physical range starting at phys
+#define VMM_LAZY_ANON 0
+#define VMM_LAZY_PHYS 1
+
+struct vmm_region {
+	uint64_t base;
+	uint64_t length;
+	uint64_t phys;
+	uint64_t flags;
+	int type;
+};
+
 struct pagemap {
 	void *top_level;
+	// Protects the lazy regions and serializes resolving faults in them
+	lock_t lock;
+	DYNARRAY_STRUCT(struct vmm_region) regions;
+	// Processors which may have entries of the pagemap in their TLB, by CPU
+	// number
+	uint64_t active;
+	// Processors which missed a shootdown while not using the pagemap, they
+	// flush its PCID when switching back to it
+	uint64_t stale;
+	// TLB tag of the pagemap, 0 if it has none and is flushed on every switch
+	uint16_t pcid;
 };
 
+extern struct pagemap *kernel_pagemap;
+
 void vmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries,
 			  struct stivale2_pmr *pmrs, size_t pmr_entries);
 void vmm_switch_pagemap(struct pagemap *pagemap);
 struct pagemap *vmm_new_pagemap(void);
+struct pagemap *vmm_fork_pagemap(struct pagemap *pagemap);
 bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
 				  uint64_t phys_addr, uint64_t flags, bool hugepages);
+bool vmm_map_range(struct pagemap *pagemap, uint64_t virt, uint64_t phys,
+				   uint64_t length, uint64_t flags);
+bool vmm_unmap_range(struct pagemap *pagemap, uint64_t virt, uint64_t length);
+bool vmm_protect_range(struct pagemap *pagemap, uint64_t virt,
+					   uint64_t length, uint64_t flags);
+void vmm_map_lazy(struct pagemap *pagemap, uint64_t virt, uint64_t length,
+				  uint64_t flags);
+void vmm_map_lazy_phys(struct pagemap *pagemap, uint64_t virt, uint64_t phys,
+					   uint64_t length, uint64_t flags);
+uint64_t vmm_mmap_flags(uint64_t virt, int prot, int flags);
+bool vmm_virt_to_phys(struct pagemap *pagemap, uint64_t virt, uint64_t *phys);
+bool vmm_handle_fault(uint64_t addr, uint64_t error);
 
 #endif
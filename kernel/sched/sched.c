@@ -0,0 +1,421 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sched.h"
+#include "../cpu/cpu.h"
+#include "../cpu/idle.h"
+#include "../cpu/softirq.h"
+#include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../klibc/printf.h"
+#include "../kernel/panic.h"
+#include "../sys/timer.h"
+#include <liballoc.h>
+
+#define SCHED_STACK_SIZE 32768
+#define SCHED_QUANTUM_NS 10000000
+
+struct run_queue {
+	lock_t lock;
+	struct thread *head;
+	struct thread *tail;
+	size_t length;
+	// Threads that aren't pinned, which other processors may take
+	size_t stealable;
+};
+
+struct sched_cpu {
+	struct run_queue queue;
+	struct thread *idle;
+	// Thread whose state is in the FPU registers, saved when it's switched out
+	struct thread *fpu_owner;
+	// Thread switched away from, finished once its stack is no longer in use
+	struct thread *prev;
+	struct timer tick;
+};
+
+static struct sched_cpu sched_cpus[MAX_CPUS];
+static uint64_t next_tid = 0;
+
+void sched_switch(uint64_t *prev_rsp, uint64_t next_rsp);
+
+static void rq_push(struct run_queue *rq, struct thread *t) {
+	LOCK(rq->lock);
+	t->next = NULL;
+	if (rq->tail)
+		rq->tail->next = t;
+	else
+		rq->head = t;
+	rq->tail = t;
+	__atomic_store_n(&rq->length, rq->length + 1, __ATOMIC_RELAXED);
+	if (!t->pinned)
+		__atomic_store_n(&rq->stealable, rq->stealable + 1, __ATOMIC_RELAXED);
+	UNLOCK(rq->lock);
+}
+
+// The first thread on rq, or the first one that isn't pinned when stealing
+static struct thread *rq_pop(struct run_queue *rq, bool steal) {
+	if (__atomic_load_n(&rq->length, __ATOMIC_RELAXED) == 0)
+		return NULL;
+
+	LOCK(rq->lock);
+	struct thread **link = &rq->head, *prev = NULL;
+	while (*link && steal && (*link)->pinned) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+
+	struct thread *t = *link;
+	if (t) {
+		*link = t->next;
+		if (rq->tail == t)
+			rq->tail = prev;
+		__atomic_store_n(&rq->length, rq->length - 1, __ATOMIC_RELAXED);
+		if (!t->pinned)
+			__atomic_store_n(&rq->stealable, rq->stealable - 1,
+							 __ATOMIC_RELAXED);
+	}
+	UNLOCK(rq->lock);
+	return t;
+}
+
+// Take a thread from the processor with the most threads to spare
+static struct thread *steal(size_t self) {
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	size_t victim = self, longest = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t length =
+			__atomic_load_n(&sched_cpus[i].queue.stealable, __ATOMIC_RELAXED);
+		if (i != self && length > longest) {
+			victim = i;
+			longest = length;
+		}
+	}
+
+	if (victim == self)
+		return NULL;
+	return rq_pop(&sched_cpus[victim].queue, true);
+}
+
+static void sched_finish_switch(void) {
+	struct sched_cpu *sc = &sched_cpus[this_cpu()->cpu_number];
+	struct thread *prev = sc->prev;
+
+	if (prev == NULL)
+		return;
+	sc->prev = NULL;
+
+	bool dead = __atomic_load_n(&prev->state, __ATOMIC_RELAXED) == THREAD_DEAD;
+	__atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+	if (dead) {
+		free(prev->stack);
+		free(prev->fpu_state);
+		kfree(prev);
+	}
+}
+
+// Switch to the next runnable thread, with interrupts disabled. The current
+// thread keeps running if it's runnable and nothing else is.
+static void schedule(void) {
+	struct cpu_local *cpu = this_cpu();
+	struct sched_cpu *sc = &sched_cpus[cpu->cpu_number];
+	struct thread *prev = cpu->current;
+
+	cpu->need_resched = false;
+
+	struct thread *next = rq_pop(&sc->queue, false);
+	if (next == NULL)
+		next = steal(cpu->cpu_number);
+	if (next == NULL) {
+		if (__atomic_load_n(&prev->state, __ATOMIC_RELAXED) == THREAD_RUNNING)
+			return;
+		next = sc->idle;
+	}
+
+	if (prev != sc->idle &&
+		__atomic_load_n(&prev->state, __ATOMIC_RELAXED) == THREAD_RUNNING) {
+		__atomic_store_n(&prev->state, THREAD_RUNNABLE, __ATOMIC_RELAXED);
+		rq_push(&sc->queue, prev);
+	}
+
+	__atomic_store_n(&next->state, THREAD_RUNNING, __ATOMIC_RELAXED);
+	if (next == prev)
+		return;
+
+	// A thread just stolen or woken may still be switching out elsewhere
+	while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+		asm volatile("pause");
+
+	next->cpu = cpu->cpu_number;
+	next->on_cpu = true;
+
+	// The FPU state is only saved if the thread used it in this slice, and
+	// only loaded once the next thread touches it and takes a #NM
+	if (sc->fpu_owner == prev) {
+		cpu_fpu_save(prev->fpu_state);
+		sc->fpu_owner = NULL;
+	}
+	write_cr("0", read_cr("0") | (1 << 3)); // Set CR0.TS
+
+	sc->prev = prev;
+	cpu->current = next;
+	sched_switch(&prev->rsp, next->rsp);
+	sched_finish_switch();
+}
+
+static void thread_start(void) {
+	sched_finish_switch();
+	asm volatile("sti");
+	struct thread *t = this_cpu()->current;
+	t->entry(t->arg);
+	thread_exit();
+}
+
+// The frame sched_switch pops: r15 to rbx, RFLAGS with interrupts off, and a
+// return into thread_start with the stack aligned as after a call
+static void thread_init_stack(struct thread *t, void (*entry)(void *arg),
+							  void *arg) {
+	t->entry = entry;
+	t->arg = arg;
+	t->stack = alloc(SCHED_STACK_SIZE);
+
+	uint64_t *sp = t->stack + SCHED_STACK_SIZE;
+	*--sp = 0;
+	*--sp = (uint64_t)thread_start;
+	*--sp = 0x2;
+	for (size_t i = 0; i < 6; i++)
+		*--sp = 0;
+	t->rsp = (uint64_t)sp;
+}
+
+static struct thread *thread_alloc(const char *name) {
+	struct thread *t = kcalloc(1, sizeof(struct thread));
+	t->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+	t->name = name;
+
+	// XSAVE areas have to be 64 byte aligned, alloc() hands out pages
+	t->fpu_state = alloc(cpu_fpu_storage_size);
+	cpu_fpu_init_state(t->fpu_state);
+	return t;
+}
+
+// Processor with the fewest threads queued
+static size_t least_loaded(void) {
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	size_t best = 0, best_length = (size_t)-1;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t length =
+			__atomic_load_n(&sched_cpus[i].queue.length, __ATOMIC_RELAXED);
+		if (cpu_locals[i].current != sched_cpus[i].idle)
+			length++;
+		if (length < best_length) {
+			best = i;
+			best_length = length;
+		}
+	}
+
+	return best;
+}
+
+// Get an idle processor to pick up a thread queued on it
+static void sched_kick(size_t cpu) {
+	struct cpu_local *target = &cpu_locals[cpu];
+
+	if (target->current != sched_cpus[cpu].idle)
+		return;
+	if (target == this_cpu())
+		target->need_resched = true;
+	else
+		idle_wake(cpu);
+}
+
+struct thread *thread_create(const char *name, void (*entry)(void *arg),
+							 void *arg, size_t cpu) {
+	struct thread *t = thread_alloc(name);
+	thread_init_stack(t, entry, arg);
+	t->state = THREAD_RUNNABLE;
+	t->pinned = cpu != SCHED_ANY_CPU;
+	t->cpu = t->pinned ? cpu : least_loaded();
+
+	uint64_t rflags = cpu_irq_save();
+	rq_push(&sched_cpus[t->cpu].queue, t);
+	sched_kick(t->cpu);
+	cpu_irq_restore(rflags);
+	return t;
+}
+
+void thread_exit(void) {
+	asm volatile("cli");
+	__atomic_store_n(&this_cpu()->current->state, THREAD_DEAD,
+					 __ATOMIC_RELAXED);
+	schedule();
+	__builtin_unreachable();
+}
+
+struct thread *sched_current(void) {
+	return this_cpu_read(current);
+}
+
+bool sched_can_block(void) {
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *cpu = this_cpu();
+	bool ret = cpu->current != NULL &&
+			   cpu->current != sched_cpus[cpu->cpu_number].idle;
+	cpu_irq_restore(rflags);
+	return ret;
+}
+
+void sched_yield(void) {
+	uint64_t rflags = cpu_irq_save();
+	schedule();
+	cpu_irq_restore(rflags);
+}
+
+void sched_block(void) {
+	schedule();
+}
+
+void sched_wake(struct thread *t) {
+	uint64_t rflags = cpu_irq_save();
+	enum thread_state expected = THREAD_BLOCKED;
+	if (__atomic_compare_exchange_n(&t->state, &expected, THREAD_RUNNABLE,
+									false, __ATOMIC_ACQ_REL,
+									__ATOMIC_RELAXED)) {
+		rq_push(&sched_cpus[t->cpu].queue, t);
+		sched_kick(t->cpu);
+	}
+	cpu_irq_restore(rflags);
+}
+
+static bool sched_has_work(size_t self) {
+	if (__atomic_load_n(&sched_cpus[self].queue.length, __ATOMIC_RELAXED))
+		return true;
+
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < count; i++)
+		if (__atomic_load_n(&sched_cpus[i].queue.stealable, __ATOMIC_RELAXED))
+			return true;
+	return false;
+}
+
+bool sched_idle(void) {
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *cpu = this_cpu();
+	bool ran = false;
+
+	if (cpu->current != NULL && sched_has_work(cpu->cpu_number)) {
+		schedule();
+		ran = true;
+	}
+
+	cpu_irq_restore(rflags);
+	return ran;
+}
+
+void sched_irq_exit(bool interrupts_were_enabled) {
+	// Tasklets run on the stack of the interrupted thread, they aren't
+	// switched away from
+	if (!interrupts_were_enabled || !this_cpu_read(need_resched) ||
+		this_cpu_read(in_softirq) || this_cpu_read(current) == NULL)
+		return;
+	schedule();
+}
+
+// Kernel code is built with -mgeneral-regs-only, so interrupt handlers never
+// get here and load the state of a thread they interrupted
+bool sched_fpu_trap(void) {
+	struct cpu_local *cpu = this_cpu();
+	if (cpu->current == NULL)
+		return false;
+
+	asm volatile("clts");
+	sched_cpus[cpu->cpu_number].fpu_owner = cpu->current;
+	cpu_fpu_restore(cpu->current->fpu_state);
+	return true;
+}
+
+static void sched_tick(void *arg) {
+	struct sched_cpu *sc = arg;
+	if (__atomic_load_n(&sc->queue.length, __ATOMIC_RELAXED))
+		this_cpu()->need_resched = true;
+	timer_add(&sc->tick, SCHED_QUANTUM_NS);
+}
+
+// The code running on this processor becomes a thread, its registers are
+// still live in the FPU
+static struct thread *sched_adopt(const char *name) {
+	struct cpu_local *cpu = this_cpu();
+	struct sched_cpu *sc = &sched_cpus[cpu->cpu_number];
+	struct thread *t = thread_alloc(name);
+
+	t->state = THREAD_RUNNING;
+	t->cpu = cpu->cpu_number;
+	t->pinned = true;
+	t->on_cpu = true;
+	sc->fpu_owner = t;
+	cpu->current = t;
+	return t;
+}
+
+static void sched_start_tick(void) {
+	struct sched_cpu *sc = &sched_cpus[this_cpu()->cpu_number];
+	sc->tick = (struct timer)TIMER_INIT(sched_tick, sc);
+	timer_add(&sc->tick, SCHED_QUANTUM_NS);
+}
+
+static void bsp_idle(void *arg) {
+	(void)arg;
+	for (;;) {
+		bool ran = softirq_run();
+		if (sched_idle() || ran)
+			continue;
+		asm volatile("cli");
+		if (this_cpu()->tasklets == NULL && !this_cpu()->need_resched)
+			idle_wait();
+		asm volatile("sti");
+	}
+}
+
+// Called on the BSP, which carries on as a thread
+void sched_init(void) {
+	uint64_t rflags = cpu_irq_save();
+	struct sched_cpu *sc = &sched_cpus[this_cpu()->cpu_number];
+	sched_adopt("kmain");
+
+	// The idle thread of the BSP needs a stack of its own, it's picked
+	// directly rather than from the queue
+	struct thread *idle = thread_alloc("idle");
+	thread_init_stack(idle, bsp_idle, NULL);
+	idle->state = THREAD_RUNNABLE;
+	idle->pinned = true;
+	idle->cpu = this_cpu()->cpu_number;
+	sc->idle = idle;
+
+	sched_start_tick();
+	cpu_irq_restore(rflags);
+	printf("sched: Scheduler initialized\n");
+}
+
+// Called on each AP, the code running becomes its idle thread
+void sched_cpu_init(void) {
+	uint64_t rflags = cpu_irq_save();
+	struct sched_cpu *sc = &sched_cpus[this_cpu()->cpu_number];
+	sc->idle = sched_adopt("idle");
+	sched_start_tick();
+	cpu_irq_restore(rflags);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHED_ANY_CPU ((size_t)-1)
+
+enum thread_state {
+	THREAD_RUNNABLE,
+	THREAD_RUNNING,
+	THREAD_BLOCKED,
+	THREAD_DEAD
+};
+
+// Kernel thread, the callee saved registers and RFLAGS are on its stack while
+// it's switched out
+struct thread {
+	uint64_t rsp;
+	void *stack;
+	void *fpu_state;
+	uint64_t tid;
+	const char *name;
+	enum thread_state state;
+	// Run queue the thread is on, or the processor it last ran on
+	size_t cpu;
+	// Threads created for a given processor are never stolen
+	bool pinned;
+	// Set until the processor that switched away is off its stack
+	bool on_cpu;
+	struct thread *next;
+	void (*entry)(void *arg);
+	void *arg;
+};
+
+void sched_init(void);
+void sched_cpu_init(void);
+struct thread *thread_create(const char *name, void (*entry)(void *arg),
+							 void *arg, size_t cpu);
+__attribute__((noreturn)) void thread_exit(void);
+struct thread *sched_current(void);
+// Whether the caller is a thread that may block, not an idle loop
+bool sched_can_block(void);
+void sched_yield(void);
+// With interrupts disabled, after setting the state of the current thread to
+// THREAD_BLOCKED and arranging for sched_wake() to be called on it
+void sched_block(void);
+void sched_wake(struct thread *t);
+// Run queued threads from an idle loop, returns whether there were any
+bool sched_idle(void);
+// Called on the way out of an interrupt handler
+void sched_irq_exit(bool interrupts_were_enabled);
+// #NM handler, loads the FPU state of the current thread
+bool sched_fpu_trap(void);
+
+#endif
@@ -0,0 +1,37 @@
+; Copyright 2021 NSG650
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+
+; void sched_switch(uint64_t *prev_rsp, uint64_t next_rsp)
+; Only the registers a C call preserves are saved, everything else is already
+; on the stack of the caller. thread_create lays out the same frame for a new
+; thread.
+global sched_switch
+sched_switch:
+	pushfq
+	push rbx
+	push rbp
+	push r12
+	push r13
+	push r14
+	push r15
+	mov [rdi], rsp
+	mov rsp, rsi
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbp
+	pop rbx
+	popfq
+	ret
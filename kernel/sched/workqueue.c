@@ -0,0 +1,414 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "workqueue.h"
+#include "../cpu/cpu.h"
+#include "../kernel/boottrace.h"
+#include "../kernel/panic.h"
+#include "../klibc/math.h"
+#include "../klibc/printf.h"
+#include "../sys/clock.h"
+#include "sched.h"
+#include <liballoc.h>
+#include <stdint.h>
+
+// Slots of the work stealing deque of each processor, a power of two
+#define WORK_DEQUE_SIZE 256
+// Chunks parallel_for() makes per processor, so that uneven chunks even out
+#define PARALLEL_FOR_CHUNKS 4
+
+// Chase-Lev deque, the owning worker pushes and pops at the bottom and other
+// workers steal from the top
+struct work_deque {
+	int64_t top;
+	int64_t bottom;
+	struct work *items[WORK_DEQUE_SIZE];
+};
+
+struct work_cpu {
+	// Lock-free stacks any processor pushes to and only the worker takes
+	// from, one for work bound to this processor and one for any
+	struct work *pinned;
+	struct work *any;
+	struct work_deque deque;
+	struct thread *worker;
+};
+
+static struct work_cpu work_cpus[MAX_CPUS];
+static size_t next_any_cpu = 0;
+
+static bool deque_push(struct work_deque *d, struct work *w) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if (b - t >= WORK_DEQUE_SIZE)
+		return false;
+
+	__atomic_store_n(&d->items[b & (WORK_DEQUE_SIZE - 1)], w,
+					 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static struct work *deque_pop(struct work_deque *d) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	struct work *w =
+		__atomic_load_n(&d->items[b & (WORK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	// The last item may be stolen at the same time, the top decides
+	if (t == b) {
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+										 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			w = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return w;
+}
+
+static struct work *deque_steal(struct work_deque *d) {
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	struct work *w =
+		__atomic_load_n(&d->items[t & (WORK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+									 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return w;
+}
+
+static void list_push(struct work **list, struct work *w) {
+	w->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(list, &w->next, w, true,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+// Everything pushed so far, oldest first
+static struct work *list_take(struct work **list) {
+	struct work *w = __atomic_exchange_n(list, NULL, __ATOMIC_ACQUIRE);
+	struct work *reversed = NULL;
+	while (w) {
+		struct work *next = w->next;
+		w->next = reversed;
+		reversed = w;
+		w = next;
+	}
+	return reversed;
+}
+
+static void work_run_list(struct work *w) {
+	while (w) {
+		struct work *next = w->next;
+		w->func(w->arg);
+		w = next;
+	}
+}
+
+// Wake the worker of another processor that has nothing to do to steal
+static void work_wake_thief(size_t self) {
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	for (size_t i = 1; i < count; i++) {
+		struct thread *worker = work_cpus[(self + i) % count].worker;
+		if (worker && __atomic_load_n(&worker->state, __ATOMIC_RELAXED) ==
+						  THREAD_BLOCKED) {
+			sched_wake(worker);
+			return;
+		}
+	}
+}
+
+static bool work_pending(struct work_cpu *wc) {
+	return __atomic_load_n(&wc->pinned, __ATOMIC_SEQ_CST) ||
+		   __atomic_load_n(&wc->any, __ATOMIC_SEQ_CST) ||
+		   __atomic_load_n(&wc->deque.bottom, __ATOMIC_SEQ_CST) >
+			   __atomic_load_n(&wc->deque.top, __ATOMIC_SEQ_CST);
+}
+
+static struct work *work_steal(size_t self) {
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	for (size_t i = 1; i < count; i++) {
+		struct work *w = deque_steal(&work_cpus[(self + i) % count].deque);
+		if (w)
+			return w;
+	}
+	return NULL;
+}
+
+// Run what's queued for this processor, or one item stolen from another.
+// False when there was nothing.
+static bool work_run_some(struct work_cpu *wc) {
+	size_t self = wc - work_cpus;
+
+	struct work *pinned = list_take(&wc->pinned);
+	bool ran = pinned != NULL;
+	work_run_list(pinned);
+
+	// Work for anyone goes on the deque where idle workers can take it
+	struct work *any = list_take(&wc->any);
+	bool queued = false;
+	while (any) {
+		struct work *next = any->next;
+		if (deque_push(&wc->deque, any)) {
+			queued = true;
+		} else {
+			any->func(any->arg);
+			ran = true;
+		}
+		any = next;
+	}
+	if (queued)
+		work_wake_thief(self);
+
+	struct work *w = deque_pop(&wc->deque);
+	if (w == NULL)
+		w = work_steal(self);
+	if (w) {
+		w->func(w->arg);
+		return true;
+	}
+	return ran;
+}
+
+static void worker_main(void *arg) {
+	struct work_cpu *wc = arg;
+
+	for (;;) {
+		if (work_run_some(wc))
+			continue;
+
+		// Work submitted after the state is set finds the worker blocked
+		// and wakes it, work submitted before is seen here
+		uint64_t rflags = cpu_irq_save();
+		struct thread *self_thread = wc->worker;
+		enum thread_state blocked = THREAD_BLOCKED;
+		__atomic_store_n(&self_thread->state, THREAD_BLOCKED,
+						 __ATOMIC_SEQ_CST);
+		// Once woken the worker is queued and has to go through the
+		// scheduler, even with work pending
+		if (!work_pending(wc) ||
+			!__atomic_compare_exchange_n(&self_thread->state, &blocked,
+										 THREAD_RUNNING, false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			sched_block();
+		cpu_irq_restore(rflags);
+	}
+}
+
+void workqueue_init(void) {
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < count; i++)
+		work_cpus[i].worker = thread_create("worker", worker_main,
+											&work_cpus[i], i);
+	printf("workqueue: %zu workers started\n", count);
+}
+
+void work_submit(struct work *w, size_t cpu) {
+	struct work_cpu *wc;
+
+	if (cpu == WORK_ANY_CPU) {
+		size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+		wc = &work_cpus[__atomic_fetch_add(&next_any_cpu, 1,
+										   __ATOMIC_RELAXED) %
+						count];
+		list_push(&wc->any, w);
+	} else {
+		wc = &work_cpus[cpu];
+		list_push(&wc->pinned, w);
+	}
+
+	if (wc->worker)
+		sched_wake(wc->worker);
+}
+
+// Count of outstanding work someone waits for
+struct work_done {
+	size_t remaining;
+	// NULL when the waiter is a worker, which keeps running work instead
+	struct thread *waiter;
+};
+
+// Called with interrupts disabled before the work is submitted. A thread
+// other than a worker is marked blocked, so a wake that comes before it
+// blocks isn't lost, and NULL is returned for it.
+static struct work_cpu *work_wait_prepare(struct work_done *done) {
+	struct work_cpu *wc = &work_cpus[this_cpu_read(cpu_number)];
+	if (wc->worker == sched_current()) {
+		done->waiter = NULL;
+		return wc;
+	}
+
+	done->waiter = sched_current();
+	__atomic_store_n(&done->waiter->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+// A worker that waits could sit on the very work it waits for, so it runs
+// work until the count drops instead of blocking. Interrupts are enabled.
+static void work_wait_help(struct work_cpu *wc, struct work_done *done) {
+	while (__atomic_load_n(&done->remaining, __ATOMIC_ACQUIRE))
+		if (!work_run_some(wc))
+			asm volatile("pause");
+}
+
+static void work_done_one(struct work_done *done) {
+	// done lives on the stack of a waiter that may return as soon as the
+	// count drops
+	struct thread *waiter = __atomic_load_n(&done->waiter, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&done->remaining, 1, __ATOMIC_ACQ_REL) == 0 &&
+		waiter)
+		sched_wake(waiter);
+}
+
+struct parallel_for {
+	void (*func)(size_t start, size_t end, void *arg);
+	void *arg;
+	struct work_done done;
+};
+
+struct parallel_for_chunk {
+	struct work work;
+	struct parallel_for *pf;
+	size_t start;
+	size_t end;
+};
+
+static void parallel_for_run(void *arg) {
+	struct parallel_for_chunk *chunk = arg;
+	struct parallel_for *pf = chunk->pf;
+
+	pf->func(chunk->start, chunk->end, pf->arg);
+	work_done_one(&pf->done);
+}
+
+void parallel_for(size_t start, size_t end,
+				  void (*func)(size_t start, size_t end, void *arg),
+				  void *arg) {
+	if (start >= end)
+		return;
+
+	size_t count = __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+	size_t chunks = MIN(end - start, count * PARALLEL_FOR_CHUNKS);
+	size_t size = DIV_ROUNDUP(end - start, chunks);
+	chunks = DIV_ROUNDUP(end - start, size);
+
+	struct parallel_for pf = {
+		.func = func, .arg = arg, .done = {.remaining = chunks}};
+	struct parallel_for_chunk *chunk_array =
+		kmalloc(sizeof(struct parallel_for_chunk) * chunks);
+
+	for (size_t i = 0; i < chunks; i++) {
+		struct parallel_for_chunk *chunk = &chunk_array[i];
+		chunk->work = (struct work)WORK_INIT(parallel_for_run, chunk);
+		chunk->pf = &pf;
+		chunk->start = start + i * size;
+		chunk->end = MIN(chunk->start + size, end);
+	}
+
+	uint64_t rflags = cpu_irq_save();
+	struct work_cpu *wc = work_wait_prepare(&pf.done);
+	for (size_t i = 0; i < chunks; i++)
+		work_submit(&chunk_array[i].work, WORK_ANY_CPU);
+	if (wc == NULL)
+		sched_block();
+	cpu_irq_restore(rflags);
+	if (wc)
+		work_wait_help(wc, &pf.done);
+
+	kfree(chunk_array);
+}
+
+struct work_graph {
+	struct work_task **tasks;
+	size_t count;
+	struct work_done done;
+};
+
+static void work_task_run(void *arg) {
+	struct work_task *task = arg;
+	struct work_graph *graph = task->graph;
+
+	uint64_t start = clock_monotonic_ns();
+	BOOT_PHASE(task->name, task->func());
+	printf("workqueue: %s took %llu us\n", task->name,
+		   (clock_monotonic_ns() - start) / 1000);
+
+	// Tasks depending on this one are counted in done until they finish too
+	for (size_t i = 0; i < graph->count; i++) {
+		struct work_task *next = graph->tasks[i];
+		for (size_t j = 0; j < WORK_TASK_MAX_DEPS; j++)
+			if (next->deps[j] == task &&
+				__atomic_sub_fetch(&next->pending, 1, __ATOMIC_ACQ_REL) == 0)
+				work_submit(&next->work, WORK_ANY_CPU);
+	}
+	work_done_one(&graph->done);
+}
+
+static bool work_graph_has(struct work_graph *graph, struct work_task *task) {
+	for (size_t i = 0; i < graph->count; i++)
+		if (graph->tasks[i] == task)
+			return true;
+	return false;
+}
+
+void work_run_graph(struct work_task **tasks, size_t count) {
+	if (count == 0)
+		return;
+
+	struct work_graph graph = {
+		.tasks = tasks, .count = count, .done = {.remaining = count}};
+
+	for (size_t i = 0; i < count; i++) {
+		struct work_task *task = tasks[i];
+		task->work = (struct work)WORK_INIT(work_task_run, task);
+		task->graph = &graph;
+		task->pending = 0;
+		for (size_t j = 0; j < WORK_TASK_MAX_DEPS; j++) {
+			if (task->deps[j] == NULL)
+				continue;
+			if (!work_graph_has(&graph, task->deps[j])) {
+				printf("workqueue: %s depends on %s outside its graph\n",
+					   task->name, task->deps[j]->name);
+				PANIC("Task graph is incomplete");
+			}
+			task->pending++;
+		}
+	}
+
+	// Tasks without dependencies start everything else as they finish
+	uint64_t rflags = cpu_irq_save();
+	struct work_cpu *wc = work_wait_prepare(&graph.done);
+	for (size_t i = 0; i < count; i++)
+		if (tasks[i]->pending == 0)
+			work_submit(&tasks[i]->work, WORK_ANY_CPU);
+	if (wc == NULL)
+		sched_block();
+	cpu_irq_restore(rflags);
+	if (wc)
+		work_wait_help(wc, &graph.done);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define WORK_ANY_CPU ((size_t)-1)
+
+// Work run by the worker thread of a processor, which may block. Work may be
+// freed or submitted again by its own function.
+struct work {
+	void (*func)(void *arg);
+	void *arg;
+	struct work *next;
+};
+
+#define WORK_INIT(FUNC, ARG) \
+	{ .func = (FUNC), .arg = (ARG), .next = NULL }
+
+#define WORK_TASK_MAX_DEPS 4
+
+struct work_graph;
+
+// Step of a graph run by work_run_graph(), started on any processor once
+// the tasks in deps have finished
+struct work_task {
+	const char *name;
+	void (*func)(void);
+	struct work_task *deps[WORK_TASK_MAX_DEPS];
+	// Set up by work_run_graph()
+	struct work work;
+	struct work_graph *graph;
+	size_t pending;
+};
+
+void workqueue_init(void);
+// Run w on cpu, or on whichever processor gets to it first with WORK_ANY_CPU
+void work_submit(struct work *w, size_t cpu);
+// Split [start, end) into chunks run in parallel by all processors, and wait
+// for them to finish. Only from a thread that may block.
+void parallel_for(size_t start, size_t end,
+				  void (*func)(size_t start, size_t end, void *arg), void *arg);
+// Run the tasks in the order their dependencies allow, as many at once as
+// there are processors, and wait for all of them. Every dependency has to be
+// one of the tasks and they can't depend on each other in a cycle. Only from
+// a thread that may block.
+void work_run_graph(struct work_task **tasks, size_t count);
+
+#endif
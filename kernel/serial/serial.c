@@ -16,10 +16,47 @@
  */
 
 #include "serial.h"
+#include "../cpu/apic.h"
+#include "../cpu/cpu.h"
+#include "../cpu/isr.h"
 #include "../cpu/ports.h"
+#include "../dev/dev.h"
 #include "../klibc/lock.h"
+#include "../klibc/printf.h"
+#include "../klibc/resource.h"
+#include "../sched/sched.h"
+#include <stdbool.h>
+#include <stdint.h>
 
+// Sizes of the transmit and receive rings, powers of two
+#define SERIAL_TX_SIZE 8192
+#define SERIAL_RX_SIZE 1024
+// Bytes the 16550 transmit FIFO takes at once
+#define SERIAL_FIFO_SIZE 16
+
+#define SERIAL_IER_RX (1 << 0)
+#define SERIAL_IER_TX (1 << 1)
+#define SERIAL_LSR_DATA (1 << 0)
+#define SERIAL_LSR_THRE (1 << 5)
+
+// Rings and port state, serial_lock is taken with interrupts disabled
 lock_t serial_lock;
+static char tx_ring[SERIAL_TX_SIZE];
+static size_t tx_head = 0;
+static size_t tx_tail = 0;
+static char rx_ring[SERIAL_RX_SIZE];
+static size_t rx_head = 0;
+static size_t rx_tail = 0;
+// Readers waiting for input, on their own stacks. They're all woken by new
+// bytes and take what's there in turn.
+struct rx_wait {
+	struct thread *thread;
+	struct rx_wait *next;
+};
+static struct rx_wait *rx_waiters = NULL;
+static bool serial_irq_mode = false;
+// Set while the FIFO is being emptied and the THR empty interrupt is on
+static bool tx_busy = false;
 
 void serial_install(void) {
 	port_byte_out(COM1, 0);
@@ -33,24 +70,184 @@ void serial_install(void) {
 }
 
 static bool is_transmit_empty(void) {
-	return port_byte_in(COM1 + 5) & 0x20;
+	return port_byte_in(COM1 + 5) & SERIAL_LSR_THRE;
+}
+
+// With the THR empty the whole FIFO is free. The caller holds serial_lock.
+static void serial_fill_fifo(void) {
+	for (size_t i = 0; i < SERIAL_FIFO_SIZE && tx_tail != tx_head; i++)
+		port_byte_out(COM1, tx_ring[tx_tail++ & (SERIAL_TX_SIZE - 1)]);
+}
+
+static void serial_set_tx_irq(bool enable) {
+	port_byte_out(COM1 + 1, SERIAL_IER_RX | (enable ? SERIAL_IER_TX : 0));
+}
+
+// Queue a byte for the interrupt handler. The caller holds serial_lock.
+static void serial_tx_push(char c) {
+	// A full ring is emptied by polling rather than dropping output
+	while (tx_head - tx_tail == SERIAL_TX_SIZE) {
+		while (!is_transmit_empty())
+			asm volatile("pause");
+		serial_fill_fifo();
+	}
+
+	tx_ring[tx_head++ & (SERIAL_TX_SIZE - 1)] = c;
+
+	// Nothing is being sent, start the FIFO off and let the interrupt
+	// refill it
+	if (!tx_busy && is_transmit_empty()) {
+		serial_fill_fifo();
+		tx_busy = true;
+		serial_set_tx_irq(true);
+	}
 }
 
 void write_serial_char(char word) {
-	while (!is_transmit_empty())
-		;
+	if (!__atomic_load_n(&serial_irq_mode, __ATOMIC_ACQUIRE)) {
+		while (!is_transmit_empty())
+			;
+
+		port_byte_out(COM1, word);
+		return;
+	}
 
-	port_byte_out(COM1, word);
+	uint64_t rflags = lock_irqsave(&serial_lock);
+	serial_tx_push(word);
+	lock_irqrestore(&serial_lock, rflags);
 }
 
 void write_serial(char *word) {
+	while (*word != '\0')
+		write_serial_char(*word++);
+}
+
+void serial_flush(void) {
+	if (!__atomic_load_n(&serial_irq_mode, __ATOMIC_ACQUIRE))
+		return;
+
+	// The lock may be held by a processor that stopped, the ring is read
+	// regardless
+	while (tx_tail != tx_head) {
+		while (!is_transmit_empty())
+			asm volatile("pause");
+		serial_fill_fifo();
+	}
+}
+
+static void serial_interrupt(registers_t *reg) {
+	(void)reg;
 	LOCK(serial_lock);
-	asm volatile("cli");
 
-	while (*word++ != '\0') {
-		write_serial_char(*word);
+	for (;;) {
+		uint8_t iir = port_byte_in(COM1 + 2);
+		if (iir & 1)
+			break;
+
+		switch (iir & 0x0E) {
+			case 0x02:
+				// THR empty
+				if (tx_tail == tx_head) {
+					tx_busy = false;
+					serial_set_tx_irq(false);
+				} else {
+					serial_fill_fifo();
+				}
+				break;
+			case 0x04:
+			case 0x0C:
+				// Received data or a character timeout, bytes that don't fit
+				// the ring are dropped
+				while (port_byte_in(COM1 + 5) & SERIAL_LSR_DATA) {
+					char c = port_byte_in(COM1);
+					if (rx_head - rx_tail < SERIAL_RX_SIZE)
+						rx_ring[rx_head++ & (SERIAL_RX_SIZE - 1)] = c;
+				}
+				for (struct rx_wait *w = rx_waiters, *next; w; w = next) {
+					next = w->next;
+					sched_wake(w->thread);
+				}
+				rx_waiters = NULL;
+				break;
+			case 0x06:
+				port_byte_in(COM1 + 5);
+				break;
+			default:
+				port_byte_in(COM1 + 6);
+				break;
+		}
 	}
 
 	UNLOCK(serial_lock);
-	asm volatile("sti");
+}
+
+// Reads wait for at least one byte when the caller may block
+static ssize_t serial_read(struct resource *this, void *buf, off_t loc,
+						   size_t count) {
+	(void)this;
+	(void)loc;
+	char *out = buf;
+	struct rx_wait wait = {.thread = sched_current()};
+
+	for (;;) {
+		uint64_t rflags = lock_irqsave(&serial_lock);
+		// Still linked when something other than new bytes woke the thread
+		struct rx_wait **link = &rx_waiters;
+		while (*link && *link != &wait)
+			link = &(*link)->next;
+		if (*link)
+			*link = wait.next;
+
+		size_t done = 0;
+		while (done < count && rx_tail != rx_head)
+			out[done++] = rx_ring[rx_tail++ & (SERIAL_RX_SIZE - 1)];
+
+		if (done || !count || !sched_can_block()) {
+			lock_irqrestore(&serial_lock, rflags);
+			return done;
+		}
+
+		wait.next = rx_waiters;
+		rx_waiters = &wait;
+		__atomic_store_n(&wait.thread->state, THREAD_BLOCKED,
+						 __ATOMIC_SEQ_CST);
+		UNLOCK(serial_lock);
+		sched_block();
+		cpu_irq_restore(rflags);
+	}
+}
+
+static ssize_t serial_write(struct resource *this, const void *buf, off_t loc,
+							size_t count) {
+	(void)this;
+	(void)loc;
+	const char *in = buf;
+
+	uint64_t rflags = lock_irqsave(&serial_lock);
+	for (size_t i = 0; i < count; i++)
+		serial_tx_push(in[i]);
+	lock_irqrestore(&serial_lock, rflags);
+	return count;
+}
+
+void serial_init(void) {
+	isr_register_handler(SERIAL_IRQ_VECTOR, serial_interrupt);
+	ioapic_redirect_irq(4, SERIAL_IRQ_VECTOR);
+
+	uint64_t rflags = lock_irqsave(&serial_lock);
+	// Bytes polled out so far leave the FIFO before it's handed over
+	while (!is_transmit_empty())
+		asm volatile("pause");
+	serial_set_tx_irq(false);
+	__atomic_store_n(&serial_irq_mode, true, __ATOMIC_RELEASE);
+	lock_irqrestore(&serial_lock, rflags);
+
+	struct resource *tty = resource_create(sizeof(struct resource));
+	tty->st.st_mode = S_IFCHR | 0620;
+	tty->st.st_nlink = 1;
+	tty->read = serial_read;
+	tty->write = serial_write;
+	dev_add_new(tty, "ttyS0");
+
+	printf("serial: COM1 interrupt driven on vector %d\n", SERIAL_IRQ_VECTOR);
 }
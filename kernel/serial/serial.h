@@ -20,8 +20,17 @@
 
 #define COM1 0x3F8
 
+// COM1 is ISA IRQ 4
+#define SERIAL_IRQ_VECTOR 36
+
+// Polled output from early boot on
 void serial_install(void);
+// Switch to interrupt driven transmit and receive and register /dev/ttyS0.
+// Needs the IOAPIC.
+void serial_init(void);
 void write_serial(char *word);
 void write_serial_char(char word);
+// Write out what's buffered by polling, for a kernel that's going down
+void serial_flush(void);
 
 #endif
@@ -16,7 +16,23 @@
  */
 
 #include "clock.h"
+#include "../cpu/cpu.h"
 #include "../cpu/ports.h"
+#include "../klibc/printf.h"
+#include "hpet.h"
+#include <cpuid.h>
+
+// Counter values are turned into nanoseconds as (value - base) * mult >> 32
+#define CLOCK_SHIFT 32
+
+static bool clock_tsc = false;
+static uint64_t clock_tsc_base = 0;
+static uint64_t clock_tsc_mult = 0;
+static uint64_t clock_hpet_base = 0;
+static uint64_t clock_hpet_mult = 0;
+static uint64_t clock_boot_time = 0;
+static uint64_t clock_tsc_adjust = 0;
+static bool clock_has_tsc_adjust = false;
 
 static uint8_t is_updating(void) {
 	port_byte_out(0x70, 0xA);
@@ -97,3 +113,78 @@ uint64_t get_unix_timestamp(void) {
 
 	return t;
 }
+
+uint64_t clock_monotonic_ns(void) {
+	if (__atomic_load_n(&clock_tsc, __ATOMIC_RELAXED))
+		return ((unsigned __int128)(rdtsc() - clock_tsc_base) *
+				clock_tsc_mult) >>
+			   CLOCK_SHIFT;
+	return ((unsigned __int128)(hpet_counter_value() - clock_hpet_base) *
+			clock_hpet_mult) >>
+		   CLOCK_SHIFT;
+}
+
+uint64_t clock_realtime_ns(void) {
+	return clock_boot_time + clock_monotonic_ns();
+}
+
+bool clock_uses_tsc(void) {
+	return __atomic_load_n(&clock_tsc, __ATOMIC_RELAXED);
+}
+
+// Called by the BSP once the TSC is calibrated
+void clock_init(void) {
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	if (__get_cpuid(7, &a, &b, &c, &d) && (b & CPUID_TSC_ADJUST)) {
+		clock_has_tsc_adjust = true;
+		clock_tsc_adjust = rdmsr(0x3B); // IA32_TSC_ADJUST
+	}
+
+	uint64_t rflags = cpu_irq_save();
+	clock_hpet_base = hpet_counter_value();
+	clock_tsc_base = rdtsc();
+	cpu_irq_restore(rflags);
+
+	clock_hpet_mult = (1000000000ULL << CLOCK_SHIFT) / hpet_frequency();
+	if (cpu_tsc_invariant && cpu_tsc_frequency) {
+		clock_tsc_mult = (1000000000ULL << CLOCK_SHIFT) / cpu_tsc_frequency;
+		clock_tsc = true;
+	}
+
+	// The RTC only counts whole seconds, so is the boot time
+	clock_boot_time = get_unix_timestamp() * 1000000000;
+
+	printf("Clock: Using the %s as clocksource\n", clock_tsc ? "TSC" : "HPET");
+}
+
+// Called by each application processor as it comes up. Firmware usually
+// starts every TSC from the same reset, TSC_ADJUST is copied from the BSP in
+// case it was written on some of them. A TSC more than a millisecond off from
+// where the HPET says it should be can't be trusted, and the HPET takes over.
+void clock_sync_cpu(void) {
+	if (!clock_uses_tsc())
+		return;
+
+	if (clock_has_tsc_adjust && rdmsr(0x3B) != clock_tsc_adjust)
+		wrmsr(0x3B, clock_tsc_adjust);
+
+	uint64_t rflags = cpu_irq_save();
+	uint64_t hpet = hpet_counter_value();
+	uint64_t tsc = rdtsc();
+	cpu_irq_restore(rflags);
+
+	uint64_t hpet_ns = ((unsigned __int128)(hpet - clock_hpet_base) *
+						clock_hpet_mult) >>
+					   CLOCK_SHIFT;
+	uint64_t tsc_ns =
+		((unsigned __int128)(tsc - clock_tsc_base) * clock_tsc_mult) >>
+		CLOCK_SHIFT;
+	uint64_t skew = tsc_ns > hpet_ns ? tsc_ns - hpet_ns : hpet_ns - tsc_ns;
+
+	if (skew > 1000000) {
+		printf("Clock: TSC of processor %d is off by %llu ns, using the "
+			   "HPET\n",
+			   this_cpu()->lapic_id, skew);
+		__atomic_store_n(&clock_tsc, false, __ATOMIC_RELAXED);
+	}
+}
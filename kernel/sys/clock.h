@@ -18,6 +18,7 @@
  * limitations under the License.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define registerB_DataMode (1 << 2)
@@ -37,4 +38,13 @@ struct datetime {
 
 uint64_t get_unix_timestamp(void);
 
+// Nanoseconds since clock_init(), from the TSC when it's invariant and the
+// same on all processors, from the HPET otherwise
+uint64_t clock_monotonic_ns(void);
+// Nanoseconds since the UNIX epoch, the RTC is only read once at boot
+uint64_t clock_realtime_ns(void);
+bool clock_uses_tsc(void);
+void clock_init(void);
+void clock_sync_cpu(void);
+
 #endif
@@ -16,6 +16,7 @@
  */
 
 #include "gdt.h"
+#include "../cpu/cpu.h"
 #include <stdint.h>
 
 struct gdt_desc {
@@ -43,16 +44,17 @@ struct gdt_ptr {
 	uint64_t ptr;
 } __attribute__((packed));
 
+// Every processor has a TSS of its own, as the one loaded is marked busy
 struct gdtr {
 	struct gdt_desc entries[5];
-	struct tss_desc tss;
+	struct tss_desc tss[MAX_CPUS];
 } __attribute__((packed));
 
 struct gdtr gdt = {0};
 struct gdt_ptr gdt_pointer = {0};
 
 extern void gdt_reload(void);
-extern void tss_reload(void);
+extern void tss_reload(uint16_t selector);
 
 void gdt_init(void) {
 	// Kernel code
@@ -69,23 +71,30 @@ void gdt_init(void) {
 	gdt.entries[4].access = 0b11111010;
 	gdt.entries[4].granularity = 0b00100000;
 
-	// TSS
-	gdt.tss.length = 104;
-	gdt.tss.flags1 = 0b10001001;
-
 	// Set the pointer
 	gdt_pointer.limit = sizeof(gdt) - 1;
 	gdt_pointer.ptr = (uint64_t)&gdt;
 
 	gdt_reload();
-	tss_reload();
 }
 
-void gdt_load_tss(size_t addr) {
-	gdt.tss.base_low = (uint16_t)addr;
-	gdt.tss.base_mid = (uint8_t)(addr >> 16);
-	gdt.tss.base_hi = (uint8_t)(addr >> 24);
-	gdt.tss.base_upper32 = (uint32_t)(addr >> 32);
+// Load the GDT built by gdt_init() on an application processor
+void gdt_load(void) {
+	gdt_reload();
+}
+
+// Fill in the TSS descriptor of the processor and load it
+void gdt_load_tss(size_t cpu_number, struct tss *tss) {
+	struct tss_desc *desc = &gdt.tss[cpu_number];
+	uintptr_t addr = (uintptr_t)tss;
+
+	desc->length = sizeof(struct tss) - 1;
+	desc->base_low = (uint16_t)addr;
+	desc->base_mid = (uint8_t)(addr >> 16);
+	desc->flags1 = 0b10001001;
+	desc->flags2 = 0;
+	desc->base_hi = (uint8_t)(addr >> 24);
+	desc->base_upper32 = (uint32_t)(addr >> 32);
 
-	tss_reload();
+	tss_reload(offsetof(struct gdtr, tss) + cpu_number * sizeof(*desc));
 }
@@ -19,8 +19,27 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Task state segment, in long mode only the stack pointers are used
+struct tss {
+	uint32_t reserved;
+	uint64_t rsp[3];
+	uint64_t reserved2;
+	// Stacks the interrupt gates with an IST index switch to, ist[0] is IST1
+	uint64_t ist[7];
+	uint64_t reserved3;
+	uint16_t reserved4;
+	uint16_t iopb;
+} __attribute__((packed));
+
+// Interrupt stacks, set for the exceptions that may come in on a bad stack
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+#define IST_MACHINE_CHECK 3
 
 void gdt_init(void);
-void gdt_load_tss(size_t addr);
+void gdt_load(void);
+void gdt_load_tss(size_t cpu_number, struct tss *tss);
 
 #endif
@@ -68,6 +68,11 @@ void hpet_init(void) {
 	mmoutq(&hpet->general_configuration, 1);
 }
 
+// Counter ticks per second, clk is the tick period in femtoseconds
+uint64_t hpet_frequency(void) {
+	return 1000000000000000 / clk;
+}
+
 uint64_t hpet_counter_value(void) {
 	return mminq(&hpet->main_counter_value);
 }
@@ -21,6 +21,7 @@
 #include <stdint.h>
 
 uint64_t hpet_counter_value(void);
+uint64_t hpet_frequency(void);
 void hpet_init(void);
 void hpet_usleep(uint64_t us);
 
@@ -15,17 +15,26 @@
  */
 
 #include "pci.h"
+#include "../cpu/cpu.h"
+#include "../cpu/irq.h"
+#include "../cpu/isr.h"
 #include "../cpu/ports.h"
 #include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "../mm/slab.h"
 #include "../mm/vmm.h"
 #include "mmio.h"
 #include <stdint.h>
 
-struct pci_device *pci_devices[100];
-int i = 0;
+DYNARRAY_GLOBAL(pci_devices);
 DYNARRAY_GLOBAL(mcfg_entries);
 
+static struct slab_cache pci_device_cache =
+	SLAB_CACHE_INIT("pci_device", struct pci_device, NULL);
+
 static uint32_t (*internal_read)(uint16_t, uint8_t, uint8_t, uint8_t, uint16_t,
 								 uint8_t);
 static void (*internal_write)(uint16_t, uint8_t, uint8_t, uint8_t, uint16_t,
@@ -37,28 +46,40 @@ static uint32_t make_pci_address(uint32_t bus, uint32_t slot, uint32_t function,
 			(1u << 31));
 }
 
+// The address and data ports are a pair, drivers probing in parallel
+// mustn't interleave them
+static lock_t legacy_pci_lock = {0};
+
 static uint32_t legacy_pci_read(uint16_t seg, uint8_t bus, uint8_t slot,
 								uint8_t function, uint16_t offset,
 								uint8_t access_size) {
 	(void)seg;
+	uint32_t value = 0;
+	uint64_t rflags = lock_irqsave(&legacy_pci_lock);
 	port_dword_out(0xCF8, make_pci_address(bus, slot, function, offset));
 	switch (access_size) {
 		case 1:
-			return port_byte_in(0xCFC + (offset & 3));
+			value = port_byte_in(0xCFC + (offset & 3));
+			break;
 		case 2:
-			return port_word_in(0xCFC + (offset & 2));
+			value = port_word_in(0xCFC + (offset & 2));
+			break;
 		case 4:
-			return port_dword_in(0xCFC);
+			value = port_dword_in(0xCFC);
+			break;
 		default:
 			printf("PCI: Unknown access size: %hhu\n", access_size);
-			return 0;
+			break;
 	}
+	lock_irqrestore(&legacy_pci_lock, rflags);
+	return value;
 }
 
 static void legacy_pci_write(uint16_t seg, uint8_t bus, uint8_t slot,
 							 uint8_t function, uint16_t offset, uint32_t value,
 							 uint8_t access_size) {
 	(void)seg;
+	uint64_t rflags = lock_irqsave(&legacy_pci_lock);
 	port_dword_out(0xCF8, make_pci_address(bus, slot, function, offset));
 	switch (access_size) {
 		case 1:
@@ -74,89 +95,112 @@ static void legacy_pci_write(uint16_t seg, uint8_t bus, uint8_t slot,
 			printf("PCI: Unknown access size: %hhu\n", access_size);
 			break;
 	}
+	lock_irqrestore(&legacy_pci_lock, rflags);
+}
+
+// ECAM windows of every bus, built from the MCFG so an access doesn't search
+// the entries. Systems have one segment or a handful.
+struct ecam_segment {
+	uint16_t seg;
+	void *bus_base[256];
+};
+
+DYNARRAY_STATIC(struct ecam_segment *, ecam_segments);
+static struct ecam_segment *last_segment = NULL;
+
+static void ecam_add_entry(struct mcfg_entry *entry) {
+	struct ecam_segment *segment = NULL;
+	for (size_t i = 0; i < ecam_segments.length; i++)
+		if (ecam_segments.storage[i]->seg == entry->seg)
+			segment = ecam_segments.storage[i];
+	if (segment == NULL) {
+		segment = kcalloc(1, sizeof(struct ecam_segment));
+		segment->seg = entry->seg;
+		DYNARRAY_PUSHBACK(ecam_segments, segment);
+	}
+
+	// 1 MiB per bus, mapped uncached whether it's in the lazy direct map of
+	// the low 4 GiB or not
+	size_t size = (entry->end_bus_number - entry->start_bus_number + 1) << 20;
+	vmm_map_range(kernel_pagemap, entry->base + MEM_PHYS_OFFSET, entry->base,
+				  size, 0b11 | VMM_NX | VMM_GLOBAL | VMM_CACHE_UC);
+
+	for (size_t bus = entry->start_bus_number; bus <= entry->end_bus_number;
+		 bus++)
+		segment->bus_base[bus] =
+			(void *)(entry->base + MEM_PHYS_OFFSET) +
+			((bus - entry->start_bus_number) << 20);
+}
+
+static void *ecam_address(uint16_t seg, uint8_t bus, uint8_t slot,
+						  uint8_t function, uint16_t offset) {
+	struct ecam_segment *segment =
+		__atomic_load_n(&last_segment, __ATOMIC_RELAXED);
+	if (segment == NULL || segment->seg != seg) {
+		segment = NULL;
+		for (size_t i = 0; i < ecam_segments.length; i++)
+			if (ecam_segments.storage[i]->seg == seg)
+				segment = ecam_segments.storage[i];
+		if (segment == NULL)
+			return NULL;
+		__atomic_store_n(&last_segment, segment, __ATOMIC_RELAXED);
+	}
+
+	void *base = segment->bus_base[bus];
+	if (base == NULL)
+		return NULL;
+	return base + ((slot << 15) | (function << 12) | offset);
 }
 
 static uint32_t mcfg_pci_read(uint16_t seg, uint8_t bus, uint8_t slot,
 							  uint8_t function, uint16_t offset,
 							  uint8_t access_size) {
-	for (size_t i = 0; i < mcfg_entries.length; i++) {
-		struct mcfg_entry *entry = mcfg_entries.storage[i];
-		if (entry->seg == seg) {
-			if (bus >= entry->start_bus_number &&
-				bus <= entry->end_bus_number) {
-				void *addr =
-					(void *)(((entry->base +
-							   (((bus - entry->start_bus_number) << 20) |
-								(slot << 15) | (function << 12))) |
-							  offset) +
-							 MEM_PHYS_OFFSET);
-				switch (access_size) {
-					case 1: {
-						return mminb(addr);
-					}
-
-					case 2: {
-						return mminw(addr);
-					}
-
-					case 4: {
-						return mmind(addr);
-					}
-
-					default:
-						printf("PCI: Unknown access size: %hhu\n", access_size);
-						break;
-				}
-			}
-		}
+	void *addr = ecam_address(seg, bus, slot, function, offset);
+	if (addr == NULL) {
+		printf("PCI: Tried to read from nonexistent device, "
+			   "%hx:%hhx:%hhx:%hhx\n",
+			   seg, bus, slot, function);
+		return 0;
 	}
 
-	printf("PCI: Tried to read from nonexistent device, %hx:%hhx:%hhx:%hhx\n",
-		   seg, bus, slot, function);
-	return 0;
+	switch (access_size) {
+		case 1:
+			return mminb(addr);
+		case 2:
+			return mminw(addr);
+		case 4:
+			return mmind(addr);
+		default:
+			printf("PCI: Unknown access size: %hhu\n", access_size);
+			return 0;
+	}
 }
 
 static void mcfg_pci_write(uint16_t seg, uint8_t bus, uint8_t slot,
 						   uint8_t function, uint16_t offset, uint32_t value,
 						   uint8_t access_size) {
-	for (size_t i = 0; i < mcfg_entries.length; i++) {
-		struct mcfg_entry *entry = mcfg_entries.storage[i];
-		if (entry->seg == seg) {
-			if (bus >= entry->start_bus_number &&
-				bus <= entry->end_bus_number) {
-				void *addr =
-					(void *)(((entry->base +
-							   (((bus - entry->start_bus_number) << 20) |
-								(slot << 15) | (function << 12))) +
-							  offset) +
-							 MEM_PHYS_OFFSET);
-				switch (access_size) {
-					case 1: {
-						mmoutb(addr, value);
-						break;
-					}
-
-					case 2: {
-						mmoutw(addr, value);
-						break;
-					}
-
-					case 4: {
-						mmoutd(addr, value);
-						break;
-					}
-
-					default:
-						printf("PCI: Unknown access size: %hhu\n", access_size);
-						break;
-				}
-				return;
-			}
-		}
+	void *addr = ecam_address(seg, bus, slot, function, offset);
+	if (addr == NULL) {
+		printf("PCI: Tried to write to nonexistent device, "
+			   "%hx:%hhx:%hhx:%hhx\n",
+			   seg, bus, slot, function);
+		return;
 	}
 
-	printf("PCI: Tried to write to nonexistent device, %hx:%hhx:%hhx:%hhx\n",
-		   seg, bus, slot, function);
+	switch (access_size) {
+		case 1:
+			mmoutb(addr, value);
+			break;
+		case 2:
+			mmoutw(addr, value);
+			break;
+		case 4:
+			mmoutd(addr, value);
+			break;
+		default:
+			printf("PCI: Unknown access size: %hhu\n", access_size);
+			break;
+	}
 }
 
 uint32_t pci_read(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t function,
@@ -169,61 +213,161 @@ void pci_write(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t function,
 	internal_write(seg, bus, slot, function, offset, value, access_size);
 }
 
-uint32_t pci_getvendor(uint8_t bus, uint8_t slot) {
-	return pci_read(0, bus, slot, 0, 0, 2);
+void pci_read_config_block(uint16_t seg, uint8_t bus, uint8_t slot,
+						   uint8_t function, uint16_t offset, void *buf,
+						   size_t len) {
+	uint32_t *out = buf;
+
+	// ECAM has the whole space mapped, one address computation does
+	if (internal_read == mcfg_pci_read) {
+		void *addr = ecam_address(seg, bus, slot, function, offset);
+		if (addr == NULL) {
+			memset(buf, 0xFF, len);
+			return;
+		}
+		for (size_t i = 0; i < len / 4; i++)
+			out[i] = mmind(addr + i * 4);
+		return;
+	}
+
+	for (size_t i = 0; i < len / 4; i++)
+		out[i] = legacy_pci_read(seg, bus, slot, function, offset + i * 4, 4);
 }
-uint32_t pci_getdevice(uint8_t bus, uint8_t slot) {
-	return pci_read(0, bus, slot, 0, 2, 2);
+
+// Walk the capability list in a copy of the first 256 bytes of config space
+static uint8_t find_capability(const uint8_t *config, uint8_t id) {
+	// Status bit 4 says whether there's a capability list
+	if (!(config[0x06] & (1 << 4)))
+		return 0;
+
+	uint8_t off = config[0x34] & ~0x3;
+	// Bounded in case the list loops
+	for (int i = 0; off && i < 48; i++) {
+		if (config[off] == id)
+			return off;
+		off = config[off + 1] & ~0x3;
+	}
+	return 0;
 }
-uint32_t pci_getheadertype(uint8_t bus, uint8_t slot) {
-	return pci_read(0, bus, slot, 0, 0x0E, 2);
+
+uint32_t pci_dev_read(struct pci_device *dev, uint16_t offset,
+					  uint8_t access_size) {
+	return internal_read(dev->seg, dev->bus, dev->device, dev->function,
+						 offset, access_size);
 }
 
-bool pci_checkIfDeviceExists(uint8_t bus, uint8_t device) {
-	uint16_t vendorID = pci_getvendor(bus, device);
-	if (vendorID == 0xFFFF)
-		return false; // Device doesn't exist
-	else
-		return true;
+void pci_dev_write(struct pci_device *dev, uint16_t offset, uint32_t value,
+				   uint8_t access_size) {
+	internal_write(dev->seg, dev->bus, dev->device, dev->function, offset,
+				   value, access_size);
 }
 
-struct pci_device *pci_getDevice(uint8_t bus, uint8_t device) {
-	uint16_t vendorid = pci_getvendor(bus, device);
+static int pci_compare(struct pci_device *a, struct pci_device *b) {
+	uint32_t ka =
+		(uint32_t)a->seg << 16 | a->bus << 8 | a->device << 3 | a->function;
+	uint32_t kb =
+		(uint32_t)b->seg << 16 | b->bus << 8 | b->device << 3 | b->function;
+	return ka < kb ? -1 : ka > kb;
+}
+
+struct pci_device *pci_get_device(uint16_t seg, uint8_t bus, uint8_t device,
+								  uint8_t function) {
+	struct pci_device key = {
+		.seg = seg, .bus = bus, .device = device, .function = function};
+	size_t low = 0, high = pci_devices.length;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int cmp = pci_compare(pci_devices.storage[mid], &key);
+		if (cmp == 0)
+			return pci_devices.storage[mid];
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+// Buses already scanned on the segment being enumerated, so a misconfigured
+// bridge can't make the scan loop
+static uint64_t scanned_buses[256 / 64];
+
+static void pci_scan_bus(uint16_t seg, uint8_t bus);
+
+static void pci_scan_function(uint16_t seg, uint8_t bus, uint8_t device,
+							  uint8_t function) {
+	uint16_t vendorid = pci_read(seg, bus, device, function, 0x00, 2);
 	if (vendorid == 0xFFFF)
-		return NULL; // Device doesn't exist
-	uint16_t deviceid = pci_getdevice(bus, device);
-	uint8_t classCode = pci_read(0, bus, device, 0, 0x0b, 1);
-	uint8_t subclass = pci_read(0, bus, device, 0, 0x0a, 1);
-	uint8_t progintf = pci_read(0, bus, device, 0, 0x09, 1);
-
-	uint16_t headerType = pci_getheadertype(bus, device);
-	uint32_t functionCount = headerType & 0x80 ? 8 : 1;
-	printf("Pci: found device: VendorID: %X DeviceID: %X Class code: %X Sub "
-		   "class: %X progIntf: %X\n",
-		   vendorid, deviceid, classCode, subclass, progintf);
-
-	struct pci_device *pcidevice = alloc(sizeof(struct pci_device));
-	pcidevice->vendorid = vendorid;
-	pcidevice->deviceid = deviceid;
-	pcidevice->classcode = classCode;
-	pcidevice->subclass = subclass;
-	pcidevice->progintf = progintf;
-	pcidevice->bus = bus;
-	pcidevice->device = device;
-	return pcidevice;
+		return;
+
+	// The standard header, then the capabilities after it if there are any
+	uint32_t buf[64] = {0};
+	uint8_t *config = (uint8_t *)buf;
+	pci_read_config_block(seg, bus, device, function, 0, buf, 64);
+	if (config[0x06] & (1 << 4))
+		pci_read_config_block(seg, bus, device, function, 64, buf + 16,
+							  sizeof(buf) - 64);
+
+	struct pci_device *dev = slab_alloc(&pci_device_cache);
+	dev->vendorid = vendorid;
+	dev->deviceid = config[0x02] | config[0x03] << 8;
+	dev->classcode = config[0x0B];
+	dev->subclass = config[0x0A];
+	dev->progintf = config[0x09];
+	dev->seg = seg;
+	dev->bus = bus;
+	dev->device = device;
+	dev->function = function;
+	dev->msi_cap = find_capability(config, PCI_CAP_MSI);
+	dev->msix_cap = find_capability(config, PCI_CAP_MSIX);
+	dev->msix_table = NULL;
+	DYNARRAY_PUSHBACK(pci_devices, dev);
+
+	printf("PCI: %04x:%02x:%02x.%x: VendorID: %X DeviceID: %X Class code: %X "
+		   "Sub class: %X progIntf: %X\n",
+		   seg, bus, device, function, vendorid, dev->deviceid,
+		   dev->classcode, dev->subclass, dev->progintf);
+
+	// PCI-to-PCI bridges, with header type 1, lead on to their secondary bus
+	uint8_t header_type = config[0x0E] & 0x7F;
+	if (header_type == 1 && dev->classcode == 0x06 && dev->subclass == 0x04) {
+		uint8_t secondary = config[0x19];
+		if (secondary != 0)
+			pci_scan_bus(seg, secondary);
+	}
 }
 
-void checkBus(uint8_t bus) {
-	uint8_t device;
+static void pci_scan_device(uint16_t seg, uint8_t bus, uint8_t device) {
+	if (pci_read(seg, bus, device, 0, 0x00, 2) == 0xFFFF)
+		return;
 
-	for (device = 0; device < 32; device++) {
-		struct pci_device *dev = pci_getDevice(bus, device);
-		if (dev != NULL) {
-			dev->id = i;
-			pci_devices[i] = dev;
-			i++;
-		}
+	pci_scan_function(seg, bus, device, 0);
+	if (pci_read(seg, bus, device, 0, 0x0E, 1) & 0x80)
+		for (uint8_t function = 1; function < 8; function++)
+			pci_scan_function(seg, bus, device, function);
+}
+
+static void pci_scan_bus(uint16_t seg, uint8_t bus) {
+	if (scanned_buses[bus / 64] & (1ULL << (bus % 64)))
+		return;
+	scanned_buses[bus / 64] |= 1ULL << (bus % 64);
+
+	for (uint8_t device = 0; device < 32; device++)
+		pci_scan_device(seg, bus, device);
+}
+
+// Every function of the host bridge at 00.0 of the root bus is the root of
+// another bus
+static void pci_scan_segment(uint16_t seg, uint8_t root) {
+	memset(scanned_buses, 0, sizeof(scanned_buses));
+
+	if (!(pci_read(seg, root, 0, 0, 0x0E, 1) & 0x80)) {
+		pci_scan_bus(seg, root);
+		return;
 	}
+	for (uint8_t function = 0; function < 8; function++)
+		if (pci_read(seg, root, 0, function, 0x00, 2) != 0xFFFF)
+			pci_scan_bus(seg, root + function);
 }
 
 void pci_init(void) {
@@ -242,45 +386,49 @@ void pci_init(void) {
 			sizeof(struct mcfg_entry);
 		for (uint64_t i = 0; i < entries; i++) {
 			DYNARRAY_PUSHBACK(mcfg_entries, (void *)&mcfg->entries[i]);
+			ecam_add_entry(&mcfg->entries[i]);
 		}
 
 		internal_read = mcfg_pci_read;
 		internal_write = mcfg_pci_write;
 	}
 
-	// Scan PCI Devices
-	uint8_t function;
-	uint8_t bus;
-
-	uint16_t headerType = pci_getheadertype(0, 0);
-	if ((headerType & 0x80) == 0) {
-		/* Single PCI host controller */
-		checkBus(0);
+	if (mcfg_entries.length == 0) {
+		pci_scan_segment(0, 0);
 	} else {
-		/* Multiple PCI host controllers */
-		for (function = 0; function < 8; function++) {
-			uint32_t vendorID = pci_read(0, 0, 0, function, 0, 2);
-			if (vendorID != 0xFFFF)
-				break;
-			bus = function;
-			checkBus(bus);
+		for (size_t i = 0; i < mcfg_entries.length; i++) {
+			struct mcfg_entry *entry = mcfg_entries.storage[i];
+			pci_scan_segment(entry->seg, entry->start_bus_number);
 		}
 	}
+
+	// Bridges are followed as they're found, sort the table back into address
+	// order for pci_get_device. IDs index the sorted table.
+	for (size_t i = 1; i < pci_devices.length; i++) {
+		struct pci_device *dev = pci_devices.storage[i];
+		size_t j = i;
+		for (; j > 0 && pci_compare(pci_devices.storage[j - 1], dev) > 0; j--)
+			pci_devices.storage[j] = pci_devices.storage[j - 1];
+		pci_devices.storage[j] = dev;
+	}
+	for (size_t i = 0; i < pci_devices.length; i++)
+		pci_devices.storage[i]->id = i;
 }
+
 void pci_read_bar(uint32_t id, uint32_t index, uint32_t *address,
 				  uint32_t *mask) {
-	struct pci_device *dev = pci_devices[id];
+	struct pci_device *dev = pci_devices.storage[id];
 	uint32_t reg = 0x10 + index * sizeof(uint32_t);
 
 	// Get address
-	*address = pci_read(0, dev->bus, dev->device, 0, reg, 4);
+	*address = pci_dev_read(dev, reg, 4);
 
 	// Find the size of the bar
-	pci_write(0, dev->bus, dev->device, 0, reg, 0xffffffff, 4);
-	*mask = pci_read(0, dev->bus, dev->device, 0, reg, 4);
+	pci_dev_write(dev, reg, 0xffffffff, 4);
+	*mask = pci_dev_read(dev, reg, 4);
 
 	// Restore adddress
-	pci_write(0, dev->bus, dev->device, 0, reg, (uint32_t)address, 4);
+	pci_dev_write(dev, reg, *address, 4);
 }
 
 void PciGetBar(struct pci_bar *bar, uint32_t id, uint32_t index) {
@@ -311,3 +459,135 @@ void PciGetBar(struct pci_bar *bar, uint32_t id, uint32_t index) {
 		bar->flags = addressLow & 0xf;
 	}
 }
+
+void *pci_map_bar(struct pci_bar *bar, uint64_t cache) {
+	uintptr_t phys = (uintptr_t)bar->u.address;
+
+	// Mapped over the lazy direct map of the low 4 GiB with the memory type
+	// asked for, above that there's nothing mapped yet
+	uintptr_t base = ALIGN_DOWN(phys, PAGE_SIZE);
+	vmm_map_range(kernel_pagemap, base + MEM_PHYS_OFFSET, base,
+				  ALIGN_UP(phys + bar->size, PAGE_SIZE) - base,
+				  0b11 | VMM_NX | VMM_GLOBAL | cache);
+	return (void *)phys + MEM_PHYS_OFFSET;
+}
+
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id) {
+	uint32_t config[64];
+	pci_read_config_block(dev->seg, dev->bus, dev->device, dev->function, 0,
+						  config, sizeof(config));
+	return find_capability((uint8_t *)config, id);
+}
+
+// Message control of both capabilities. MSI has multiple message capable
+// in bits 1-3, MSI-X the table size minus one in the low 11 bits.
+#define MSI_CONTROL_ENABLE (1 << 0)
+#define MSI_CONTROL_64BIT (1 << 7)
+#define MSIX_CONTROL_MASK (1 << 14)
+#define MSIX_CONTROL_ENABLE (1 << 15)
+
+static struct {
+	pci_irq_handler_t handler;
+	void *arg;
+} irq_handlers[256];
+
+static void pci_irq_dispatch(registers_t *r) {
+	if (irq_handlers[r->isrNumber].handler)
+		irq_handlers[r->isrNumber].handler(irq_handlers[r->isrNumber].arg);
+}
+
+// Messages are edge triggered fixed interrupts, written to the local APIC of
+// the target, which irq_cpu_targetable() must allow
+static uint32_t msi_address(size_t cpu) {
+	return 0xFEE00000 | (cpu_locals[cpu].lapic_id & 0xFF) << 12;
+}
+
+static bool msix_map_table(struct pci_device *dev) {
+	if (dev->msix_table)
+		return true;
+
+	// BIR in the low 3 bits, the offset into that BAR above
+	uint32_t table = pci_dev_read(dev, dev->msix_cap + 4, 4);
+	struct pci_bar bar = {0};
+	PciGetBar(&bar, dev->id, table & 0x7);
+	if (bar.u.address == NULL || (bar.flags & 0x1))
+		return false;
+
+	dev->msix_table = pci_map_bar(&bar, VMM_CACHE_UC) + (table & ~0x7);
+	// Entries come out of reset masked, but firmware may have used them
+	for (size_t i = 0; i < pci_irq_count(dev); i++)
+		mmoutd(dev->msix_table + i * 16 + 12, 1);
+	return true;
+}
+
+size_t pci_irq_count(struct pci_device *dev) {
+	if (dev->msix_cap)
+		return (pci_dev_read(dev, dev->msix_cap + 2, 2) & 0x7FF) + 1;
+	// Several MSI messages would need a block of consecutive vectors, only
+	// the first one is used
+	return dev->msi_cap ? 1 : 0;
+}
+
+void pci_irq_route(struct pci_device *dev, size_t index, uint8_t vector,
+				   size_t cpu) {
+	if (dev->msix_cap) {
+		void *e = dev->msix_table + index * 16;
+		mmoutd(e + 12, 1);
+		mmoutd(e, msi_address(cpu));
+		mmoutd(e + 4, 0);
+		mmoutd(e + 8, vector);
+		mmoutd(e + 12, 0);
+		return;
+	}
+
+	uint8_t cap = dev->msi_cap;
+	uint16_t control = pci_dev_read(dev, cap + 2, 2);
+	pci_dev_write(dev, cap + 4, msi_address(cpu), 4);
+	if (control & MSI_CONTROL_64BIT) {
+		pci_dev_write(dev, cap + 8, 0, 4);
+		pci_dev_write(dev, cap + 12, vector, 2);
+	} else {
+		pci_dev_write(dev, cap + 8, vector, 2);
+	}
+}
+
+int pci_irq_alloc(struct pci_device *dev, size_t index, size_t cpu,
+				  pci_irq_handler_t handler, void *arg) {
+	bool pinned = cpu != IRQ_ANY_CPU;
+	if (!pinned)
+		cpu = irq_target_cpu(this_cpu()->cpu_number);
+	if (index >= pci_irq_count(dev) || cpu >= cpu_count ||
+		!irq_cpu_targetable(cpu))
+		return -1;
+	if (dev->msix_cap && !msix_map_table(dev))
+		return -1;
+
+	int vector = isr_alloc_vector();
+	if (vector < 0)
+		return -1;
+
+	irq_handlers[vector].handler = handler;
+	irq_handlers[vector].arg = arg;
+	isr_register_handler(vector, pci_irq_dispatch);
+	pci_irq_route(dev, index, vector, cpu);
+	irq_register_msi(vector, dev, index, cpu, pinned);
+	return vector;
+}
+
+void pci_irq_enable(struct pci_device *dev) {
+	uint16_t command = pci_dev_read(dev, 0x04, 2);
+	// Interrupt disable, for the legacy pin
+	pci_dev_write(dev, 0x04, command | (1 << 10), 2);
+
+	if (dev->msix_cap) {
+		uint16_t control = pci_dev_read(dev, dev->msix_cap + 2, 2);
+		pci_dev_write(dev, dev->msix_cap + 2,
+					  (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK,
+					  2);
+	} else if (dev->msi_cap) {
+		// One message enabled, multiple message enable stays 0
+		uint16_t control = pci_dev_read(dev, dev->msi_cap + 2, 2);
+		pci_dev_write(dev, dev->msi_cap + 2,
+					  (control & ~(0x7 << 4)) | MSI_CONTROL_ENABLE, 2);
+	}
+}
@@ -19,6 +19,8 @@
 
 #include "../acpi/acpi.h"
 #include "../klibc/dynarray.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct mcfg_entry {
@@ -42,6 +44,11 @@ void pci_write(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t function,
 			   uint16_t offset, uint32_t value, uint8_t access_size);
 uint32_t pci_read(uint16_t seg, uint8_t bus, uint8_t slot, uint8_t function,
 				  uint16_t offset, uint8_t access_size);
+// Copy len bytes of config space from offset, both multiples of 4, in one go.
+// Legacy port I/O only reaches the first 256 bytes.
+void pci_read_config_block(uint16_t seg, uint8_t bus, uint8_t slot,
+						   uint8_t function, uint16_t offset, void *buf,
+						   size_t len);
 
 
 
@@ -56,9 +63,16 @@ typedef struct pci_device
     uint8_t progintf;
 
 	//Device location
+	uint16_t seg;
 	uint8_t bus;
 	uint8_t device;
+	uint8_t function;
 
+	// Capabilities found during enumeration, 0 when missing
+	uint8_t msi_cap;
+	uint8_t msix_cap;
+	// Mapped when the first MSI-X vector is allocated
+	void *msix_table;
 } pci_device;
 typedef struct pci_bar
 {
@@ -71,6 +85,40 @@ typedef struct pci_bar
     uint32_t flags;
 } pci_bar;
 
-extern struct pci_device* pci_devices[100];
+// Every function found, sorted by address. A device's id is its index.
+DYNARRAY_EXTERN(struct pci_device *, pci_devices);
+struct pci_device *pci_get_device(uint16_t seg, uint8_t bus, uint8_t device,
+								  uint8_t function);
+// Config space access to the function dev, through ECAM when the MCFG
+// describes it and the legacy ports otherwise
+uint32_t pci_dev_read(struct pci_device *dev, uint16_t offset,
+					  uint8_t access_size);
+void pci_dev_write(struct pci_device *dev, uint16_t offset, uint32_t value,
+				   uint8_t access_size);
 void PciGetBar(struct pci_bar *bar, uint32_t id, uint32_t index);
+// Map a memory BAR into the direct map with a VMM_CACHE_* memory type
+void *pci_map_bar(struct pci_bar *bar, uint64_t cache);
+// Offset of capability id in the config space of dev, 0 if it doesn't have it
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id);
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+
+// Message signalled interrupts, through MSI-X when the device has it and MSI
+// otherwise. Every message gets its own vector and a processor to go to, so
+// devices with several queues can interrupt each processor separately.
+typedef void (*pci_irq_handler_t)(void *arg);
+
+// How many messages dev can send, 0 if it can only use its interrupt pin
+size_t pci_irq_count(struct pci_device *dev);
+// Allocate a vector for message index, running handler with arg on processor
+// cpu, or on any processor the balancer likes for IRQ_ANY_CPU. Returns the
+// vector or -1. Nothing is delivered before pci_irq_enable.
+int pci_irq_alloc(struct pci_device *dev, size_t index, size_t cpu,
+				  pci_irq_handler_t handler, void *arg);
+// Point message index at vector on processor cpu
+void pci_irq_route(struct pci_device *dev, size_t index, uint8_t vector,
+				   size_t cpu);
+// Switch dev from its interrupt pin to messages
+void pci_irq_enable(struct pci_device *dev);
 #endif
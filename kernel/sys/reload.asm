@@ -16,8 +16,8 @@ gdt_reload:
 	mov ss, eax
 	ret
 
+; void tss_reload(uint16_t selector)
 global tss_reload
 tss_reload:
-	mov ax, 0x2B
-	ltr ax
+	ltr di
 	ret
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer.h"
+#include "../cpu/apic.h"
+#include "../cpu/cpu.h"
+#include "../cpu/idle.h"
+#include "../sched/sched.h"
+#include "clock.h"
+#include <stddef.h>
+
+// Below this a sleep spins, halting and taking the interrupt would overshoot
+#define TIMER_SPIN_NS 20000
+
+static bool timer_ready = false;
+
+// Program the LAPIC timer for the earliest timer of this processor
+static void timer_arm(struct cpu_local *local) {
+	struct timer *first = local->timers;
+	if (first == NULL) {
+		lapic_timer_stop();
+		return;
+	}
+
+	uint64_t now = clock_monotonic_ns();
+	lapic_timer_oneshot(first->deadline > now ? first->deadline - now : 0);
+}
+
+static void timer_interrupt(void) {
+	struct cpu_local *local = this_cpu();
+	struct timer *t;
+
+	// The LAPIC timer may run a bit fast against the clocksource, whatever is
+	// left is armed again
+	while ((t = local->timers) && t->deadline <= clock_monotonic_ns()) {
+		local->timers = t->next;
+		t->pending = false;
+		t->func(t->arg);
+	}
+
+	timer_arm(local);
+}
+
+void timer_init(void) {
+	lapic_timer_set_handler(timer_interrupt);
+	__atomic_store_n(&timer_ready, true, __ATOMIC_RELEASE);
+}
+
+void timer_add(struct timer *t, uint64_t ns) {
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *local = this_cpu();
+
+	t->deadline = clock_monotonic_ns() + ns;
+	t->pending = true;
+
+	struct timer **link = &local->timers;
+	while (*link && (*link)->deadline <= t->deadline)
+		link = &(*link)->next;
+	t->next = *link;
+	*link = t;
+
+	if (local->timers == t)
+		timer_arm(local);
+	cpu_irq_restore(rflags);
+}
+
+bool timer_cancel(struct timer *t) {
+	uint64_t rflags = cpu_irq_save();
+	struct cpu_local *local = this_cpu();
+	bool pending = t->pending;
+
+	if (pending) {
+		struct timer **link = &local->timers;
+		while (*link != t)
+			link = &(*link)->next;
+		*link = t->next;
+		t->pending = false;
+		if (link == &local->timers)
+			timer_arm(local);
+	}
+
+	cpu_irq_restore(rflags);
+	return pending;
+}
+
+static void timer_wake(void *arg) {
+	*(bool *)arg = true;
+}
+
+// A sleeping thread, which other wakes may reach before its timer fires
+struct timer_sleeper {
+	struct thread *thread;
+	bool done;
+};
+
+static void timer_wake_thread(void *arg) {
+	struct timer_sleeper *s = arg;
+	// The sleeper may return as soon as done is set
+	struct thread *thread = s->thread;
+	__atomic_store_n(&s->done, true, __ATOMIC_SEQ_CST);
+	sched_wake(thread);
+}
+
+void timer_sleep_ns(uint64_t ns) {
+	uint64_t rflags;
+	asm volatile("pushfq\n\tpop %0" : "=r"(rflags));
+
+	if (ns < TIMER_SPIN_NS || !(rflags & (1 << 9)) ||
+		!__atomic_load_n(&timer_ready, __ATOMIC_ACQUIRE)) {
+		uint64_t target = clock_monotonic_ns() + ns;
+		while (clock_monotonic_ns() < target)
+			asm volatile("pause");
+		return;
+	}
+
+	// Threads give the processor up, idle loops halt it
+	if (sched_can_block()) {
+		struct timer_sleeper s = {.thread = sched_current()};
+		struct timer t = TIMER_INIT(timer_wake_thread, &s);
+		rflags = cpu_irq_save();
+		timer_add(&t, ns);
+
+		// The timer firing after the state is set finds the thread blocked
+		// and wakes it, firing before is seen here. Until it fires it stays
+		// linked, so only done ends the sleep.
+		while (!__atomic_load_n(&s.done, __ATOMIC_SEQ_CST)) {
+			enum thread_state blocked = THREAD_BLOCKED;
+			__atomic_store_n(&s.thread->state, THREAD_BLOCKED,
+							 __ATOMIC_SEQ_CST);
+			if (!__atomic_load_n(&s.done, __ATOMIC_SEQ_CST) ||
+				!__atomic_compare_exchange_n(&s.thread->state, &blocked,
+											 THREAD_RUNNING, false,
+											 __ATOMIC_ACQ_REL,
+											 __ATOMIC_RELAXED))
+				sched_block();
+		}
+		cpu_irq_restore(rflags);
+		return;
+	}
+
+	volatile bool done = false;
+	struct timer t = TIMER_INIT(timer_wake, (void *)&done);
+	timer_add(&t, ns);
+
+	for (;;) {
+		asm volatile("cli" ::: "memory");
+		if (done)
+			break;
+		idle_wait();
+	}
+	asm volatile("sti" ::: "memory");
+}
+
+void timer_usleep(uint64_t us) {
+	timer_sleep_ns(us * 1000);
+}
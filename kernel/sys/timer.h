@@ -0,0 +1,51 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// One-shot timers on the LAPIC timer of each processor. A timer fires on the
+// processor that added it, from the timer interrupt with interrupts disabled,
+// so the callback must be short and may schedule a tasklet for the rest.
+struct timer {
+	uint64_t deadline; // clock_monotonic_ns()
+	void (*func)(void *arg);
+	void *arg;
+	struct timer *next;
+	bool pending;
+};
+
+#define TIMER_INIT(FUNC, ARG)                                      \
+	{                                                              \
+		.deadline = 0, .func = (FUNC), .arg = (ARG), .next = NULL, \
+		.pending = false                                           \
+	}
+
+void timer_init(void);
+// Fire t ns from now on this processor, t must not be pending
+void timer_add(struct timer *t, uint64_t ns);
+// Only from the processor t was added on, returns whether it was pending
+bool timer_cancel(struct timer *t);
+// Block the thread, or halt in an idle loop, until the time has passed. Short
+// sleeps and those with interrupts disabled or before timer_init() spin on
+// the clocksource instead.
+void timer_sleep_ns(uint64_t ns);
+void timer_usleep(uint64_t us);
+
+#endif
@@ -16,20 +16,38 @@
  */
 
 #include "video.h"
+#include "../dev/dev.h"
+#include "../klibc/alloc.h"
 #include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "../klibc/resource.h"
+#include "../mm/vmm.h"
 #include "../serial/serial.h"
 #define SSFN_CONSOLEBITMAP_TRUECOLOR
 #include "ssfn.h"
+#include <liballoc.h>
 
 int cursor_x = 0, cursor_y = 0;
 
-extern unsigned char fb_font;
+extern unsigned char fb_font[];
 
 uint8_t *fb_addr;
 size_t fb_pitch, fb_bpp;
 uint16_t width_s, height_s;
 lock_t video_lock;
 
+// Once there's memory to allocate it, drawing goes to a copy of the console
+// in normal RAM and only dirty parts are copied out, the framebuffer is
+// never read. The copy is a ring of text rows so scrolling moves top instead
+// of the pixels, and rows is the number of whole text rows on screen.
+static uint8_t *shadow = NULL;
+static size_t shadow_pitch;
+static size_t shadow_top = 0;
+static size_t rows;
+// Dirty rectangle in screen pixels, empty when x0 >= x1
+static size_t dirty_x0, dirty_y0, dirty_x1 = 0, dirty_y1 = 0;
+
 void vid_reset(void) {
 	cursor_x = 0;
 	cursor_y = 0;
@@ -42,46 +60,284 @@ void video_init(struct stivale2_struct_tag_framebuffer *framebuffer) {
 	width_s = framebuffer->framebuffer_width;
 	height_s = framebuffer->framebuffer_height;
 
-	ssfn_src = (ssfn_font_t *)&fb_font;
+	ssfn_src = (ssfn_font_t *)fb_font;
 
 	ssfn_dst.ptr = fb_addr;
 	ssfn_dst.p = fb_pitch;
 	ssfn_dst.w = width_s;
 	ssfn_dst.h = height_s;
 	ssfn_dst.x = ssfn_dst.y = 0;
+
+	rows = height_s / ssfn_src->height;
+}
+
+// Address of screen pixel row y, in the copy when there is one
+static uint8_t *video_row(size_t y) {
+	if (shadow == NULL || y >= rows * ssfn_src->height)
+		return fb_addr + y * fb_pitch;
+
+	size_t row = (y / ssfn_src->height + shadow_top) % rows;
+	return shadow + (row * ssfn_src->height + y % ssfn_src->height) *
+						shadow_pitch;
+}
+
+static void video_mark_dirty(size_t x0, size_t y0, size_t x1, size_t y1) {
+	if (shadow == NULL)
+		return;
+
+	x1 = MIN(x1, width_s);
+	y1 = MIN(y1, height_s);
+	if (dirty_x0 >= dirty_x1) {
+		dirty_x0 = x0;
+		dirty_y0 = y0;
+		dirty_x1 = x1;
+		dirty_y1 = y1;
+		return;
+	}
+
+	dirty_x0 = MIN(dirty_x0, x0);
+	dirty_y0 = MIN(dirty_y0, y0);
+	dirty_x1 = MAX(dirty_x1, x1);
+	dirty_y1 = MAX(dirty_y1, y1);
+}
+
+// ssfn_putc() looks the character up by walking the whole font and decodes
+// its bitmap every time, so glyphs are rendered once into masks and drawn
+// from those. Pixels of fg are the character, pixels of paint also the
+// background it fills when that's not transparent, each 0 or all ones so a
+// row is drawn two pixels at a time. ASCII has a slot per character, other
+// characters share a small cache of the most recent ones.
+#define GLYPH_RECENT 64
+
+struct glyph {
+	uint32_t codepoint;
+	// Columns drawn, an even number
+	size_t width;
+	uint32_t *fg;
+	uint32_t *paint;
+};
+
+static struct glyph *glyph_ascii[128];
+static struct glyph *glyph_recent[GLYPH_RECENT];
+static size_t glyph_cell_width;
+
+// Colors ssfn_putc() renders with, to tell apart which pixels it wrote
+#define GLYPH_MARK_FG 1
+#define GLYPH_MARK_BG 2
+
+static bool glyph_render(struct glyph *glyph, uint32_t c) {
+	size_t pixels = glyph_cell_width * ssfn_src->height;
+	uint32_t *cell = kcalloc(pixels, sizeof(uint32_t));
+	if (cell == NULL)
+		return false;
+
+	ssfn_buf_t saved = ssfn_dst;
+	ssfn_dst = (ssfn_buf_t){.ptr = (uint8_t *)cell,
+							.w = glyph_cell_width,
+							.h = ssfn_src->height,
+							.p = glyph_cell_width * sizeof(uint32_t),
+							.fg = GLYPH_MARK_FG,
+							.bg = GLYPH_MARK_BG};
+	ssfn_putc(c);
+	ssfn_dst = saved;
+
+	glyph->codepoint = c;
+	glyph->width = 0;
+	glyph->fg = cell;
+	glyph->paint = kmalloc(pixels * sizeof(uint32_t));
+	if (glyph->paint == NULL) {
+		kfree(cell);
+		return false;
+	}
+	for (size_t i = 0; i < pixels; i++) {
+		if (cell[i])
+			glyph->width = MAX(glyph->width, i % glyph_cell_width + 1);
+		glyph->paint[i] = cell[i] ? ~0U : 0;
+		cell[i] = cell[i] == GLYPH_MARK_FG ? ~0U : 0;
+	}
+	glyph->width = ALIGN_UP(glyph->width, 2);
+	return true;
+}
+
+static struct glyph *glyph_get(int c) {
+	// Only once there's memory for the cache, c is a codepoint of ssfn_utf8()
+	if (shadow == NULL || c < 0)
+		return NULL;
+
+	struct glyph **slot = (size_t)c < 128 ? &glyph_ascii[c]
+										  : &glyph_recent[c % GLYPH_RECENT];
+	if (*slot && (*slot)->codepoint == (uint32_t)c)
+		return *slot;
+
+	if (*slot == NULL) {
+		*slot = kmalloc(sizeof(struct glyph));
+		if (*slot == NULL)
+			return NULL;
+	} else {
+		kfree((*slot)->fg);
+		kfree((*slot)->paint);
+	}
+	if (!glyph_render(*slot, c)) {
+		kfree(*slot);
+		*slot = NULL;
+		return NULL;
+	}
+	return *slot;
+}
+
+static void glyph_draw(struct glyph *glyph, size_t x, size_t y, uint32_t fg,
+					   uint32_t bg) {
+	size_t width = MIN(glyph->width, (x < width_s ? width_s - x : 0)) & ~1;
+	uint64_t fg64 = (uint64_t)fg << 32 | fg;
+	uint64_t bg64 = (uint64_t)bg << 32 | bg;
+
+	for (size_t row = 0; row < ssfn_src->height; row++) {
+		uint64_t *dst = (uint64_t *)(video_row(y + row) + x * sizeof(uint32_t));
+		uint64_t *cov = (uint64_t *)(glyph->fg + row * glyph_cell_width);
+		// A background of 0 is transparent, as with ssfn_putc()
+		uint64_t *paint =
+			bg ? (uint64_t *)(glyph->paint + row * glyph_cell_width) : cov;
+		for (size_t i = 0; i < width / 2; i++)
+			dst[i] = (dst[i] & ~paint[i]) | (cov[i] & fg64) |
+					 (paint[i] & ~cov[i] & bg64);
+	}
+}
+
+void video_shadow_init(void) {
+	// The bootloader's mapping leaves the memory type to the MTRRs, which
+	// make the framebuffer uncached. Write-combined, the blits of the copy
+	// go out as full bursts.
+	uintptr_t fb_phys = (uintptr_t)fb_addr - MEM_PHYS_OFFSET;
+	uintptr_t base = ALIGN_DOWN(fb_phys, PAGE_SIZE);
+	vmm_map_range(kernel_pagemap, base + MEM_PHYS_OFFSET, base,
+				  ALIGN_UP(fb_phys + fb_pitch * height_s, PAGE_SIZE) - base,
+				  0b11 | VMM_NX | VMM_GLOBAL | VMM_CACHE_WC);
+
+	shadow_pitch = width_s * sizeof(uint32_t);
+	uint8_t *copy = alloc(shadow_pitch * rows * ssfn_src->height);
+	if (copy == NULL)
+		return;
+
+	// The only time the framebuffer is read
+	for (size_t y = 0; y < rows * ssfn_src->height; y++)
+		memcpy(copy + y * shadow_pitch, fb_addr + y * fb_pitch, shadow_pitch);
+
+	// Even, so rows of glyph masks stay 8 byte aligned
+	glyph_cell_width = ALIGN_UP(2 * ssfn_src->width, 2);
+
+	uint64_t rflags = lock_irqsave(&video_lock);
+	shadow = copy;
+	shadow_top = 0;
+	ssfn_dst.ptr = shadow;
+	ssfn_dst.p = shadow_pitch;
+	ssfn_dst.h = rows * ssfn_src->height;
+	lock_irqrestore(&video_lock, rflags);
+}
+
+static size_t fb_size(void) {
+	return fb_pitch * height_s;
+}
+
+static ssize_t fb_read(struct resource *this, void *buf, off_t loc,
+					   size_t count) {
+	(void)this;
+	if (loc < 0 || (size_t)loc >= fb_size())
+		return 0;
+	count = MIN(count, fb_size() - loc);
+	memcpy(buf, fb_addr + loc, count);
+	return count;
+}
+
+// Goes straight to the screen, what the console draws afterwards is copied
+// over it
+static ssize_t fb_write(struct resource *this, const void *buf, off_t loc,
+						size_t count) {
+	(void)this;
+	if (loc < 0 || (size_t)loc >= fb_size())
+		return 0;
+	count = MIN(count, fb_size() - loc);
+	memcpy(fb_addr + loc, buf, count);
+	return count;
+}
+
+// Maps the framebuffer write-combined, offsets count from its start like for
+// fb_read() and fb_write(), so one that doesn't start on a page can't be
+// mapped. Private writable mappings would need copies of device memory, only
+// shared ones can be written.
+static int fb_mmap(struct resource *this, struct pagemap *pagemap,
+				   uint64_t virt, size_t length, off_t loc, int prot,
+				   int flags) {
+	(void)this;
+	uint64_t pte_flags = vmm_mmap_flags(virt, prot, flags);
+	uintptr_t fb_phys = (uintptr_t)fb_addr - MEM_PHYS_OFFSET;
+	size_t size = ALIGN_UP(fb_size(), PAGE_SIZE);
+
+	if (pte_flags == 0 || (pte_flags & VMM_COW) || fb_phys % PAGE_SIZE ||
+		loc < 0 || loc % PAGE_SIZE || (size_t)loc > size ||
+		length > size - loc)
+		return -1;
+
+	return vmm_map_range(pagemap, virt, fb_phys + loc,
+						 ALIGN_UP(length, PAGE_SIZE), pte_flags | VMM_CACHE_WC)
+			   ? 0
+			   : -1;
+}
+
+// Expose the framebuffer as /dev/fb0, devtmpfs has to be mounted
+void video_dev_init(void) {
+	struct resource *res = resource_create(sizeof(struct resource));
+	if (res == NULL)
+		return;
+	res->read = fb_read;
+	res->write = fb_write;
+	res->mmap = fb_mmap;
+	res->st.st_mode = S_IFCHR | 0666;
+	res->st.st_size = fb_size();
+	dev_add_new(res, "fb0");
+}
+
+void video_flush(void) {
+	if (shadow == NULL || dirty_x0 >= dirty_x1)
+		return;
+
+	size_t offset = dirty_x0 * sizeof(uint32_t);
+	size_t len = (dirty_x1 - dirty_x0) * sizeof(uint32_t);
+	for (size_t y = dirty_y0; y < dirty_y1; y++) {
+		uint8_t *src = video_row(y);
+		if (src != fb_addr + y * fb_pitch)
+			memcpy(fb_addr + y * fb_pitch + offset, src + offset, len);
+	}
+
+	dirty_x1 = 0;
 }
 
 void draw_px(int x, int y, uint32_t color) {
-	size_t py = y * fb_pitch;
-	size_t px = x * (fb_bpp / 8);
-	*(uint32_t *)(&fb_addr[px + py]) = color;
+	*(uint32_t *)(video_row(y) + x * (fb_bpp / 8)) = color;
+	video_mark_dirty(x, y, x + 1, y + 1);
+}
+
+static void video_fill_row(size_t y, size_t x, size_t width, uint32_t color) {
+	uint32_t *row = (uint32_t *)video_row(y) + x;
+	for (size_t i = 0; i < width; i++)
+		row[i] = color;
 }
 
 void knewline(void) {
-	for (uint32_t y = ssfn_src->height; y != height_s; ++y) {
-		void *dest =
-			(void *)(((uintptr_t)fb_addr) + (y - ssfn_src->height) * fb_pitch);
-		const void *src = (void *)(((uintptr_t)fb_addr) + y * fb_pitch);
-		memcpy(dest, src, width_s * 4);
-	}
+	cursor_y = rows - 1;
+	cursor_x = 0;
 
-	cursor_y--;
-	cursor_x = 131;
-
-	size_t x = (cursor_x * ssfn_src->width) - ssfn_src->width,
-		   y = cursor_y * ssfn_src->height;
-
-	size_t i, j;
-	while (x >= (2 * ssfn_src->width)) {
-		for (i = 0; i < ssfn_src->height; i++) {
-			for (j = 0; j < ssfn_src->width; j++) {
-				draw_px(x + j, y + i, 0x000000);
-			}
-		}
-		x = (cursor_x * ssfn_src->width) - ssfn_src->width,
-		y = cursor_y * ssfn_src->height;
-		cursor_x--;
+	if (shadow == NULL) {
+		for (size_t y = ssfn_src->height; y < rows * ssfn_src->height; y++)
+			memcpy(fb_addr + (y - ssfn_src->height) * fb_pitch,
+				   fb_addr + y * fb_pitch, width_s * sizeof(uint32_t));
+	} else {
+		// The old top row becomes the new bottom row
+		shadow_top = (shadow_top + 1) % rows;
+		video_mark_dirty(0, 0, width_s, rows * ssfn_src->height);
 	}
+
+	for (size_t y = 0; y < ssfn_src->height; y++)
+		video_fill_row(cursor_y * ssfn_src->height + y, 0, width_s, 0x000000);
 }
 
 void putchar_at(int c, int position_x, int position_y, uint32_t color,
@@ -105,25 +361,25 @@ void putchar_at(int c, int position_x, int position_y, uint32_t color,
 			return;
 	}
 
-	if ((cursor_y * ssfn_src->height) >= height_s) {
+	if ((size_t)position_y >= rows) {
 		knewline();
-		cursor_x--;
-		putchar_at(c, cursor_x, cursor_y, color, bgcolor);
-		cursor_x--;
+		position_y = cursor_y;
 	}
 
-	if (ssfn_dst.fg != color) {
+	size_t x = position_x * ssfn_src->width;
+	size_t y = position_y * ssfn_src->height;
+	struct glyph *glyph = glyph_get(c);
+	if (glyph) {
+		glyph_draw(glyph, x, y, color, bgcolor);
+	} else {
 		ssfn_dst.fg = color;
-	}
-
-	if (ssfn_dst.bg != bgcolor) {
 		ssfn_dst.bg = bgcolor;
+		ssfn_dst.x = x;
+		ssfn_dst.y = (uintptr_t)(video_row(y) - ssfn_dst.ptr) / ssfn_dst.p;
+		ssfn_putc(c);
 	}
-
-	ssfn_dst.x = position_x * ssfn_src->width;
-	ssfn_dst.y = position_y * ssfn_src->height;
-
-	ssfn_putc(c);
+	// Glyphs may be wider than the advance of the font
+	video_mark_dirty(x, y, x + 2 * ssfn_src->width, y + ssfn_src->height);
 
 	if (((cursor_x * ssfn_src->width) + (2 * ssfn_src->width)) >=
 		width_s - (2 * ssfn_src->width)) {
@@ -154,16 +410,16 @@ void kprint_color(char *string, uint32_t color) {
 	while (*string) {
 		putchar_at(*string++, cursor_x, cursor_y, color, 0x000000);
 	}
+	video_flush();
 }
 
 void kprintbgc(char *string, uint32_t fcolor, uint32_t bcolor) {
-	LOCK(video_lock);
-	asm volatile("cli");
+	uint64_t rflags = lock_irqsave(&video_lock);
 	while (*string) {
 		putchar_color(ssfn_utf8(&string), fcolor, bcolor);
 	}
-	UNLOCK(video_lock);
-	asm volatile("sti");
+	video_flush();
+	lock_irqrestore(&video_lock, rflags);
 }
 
 void kprint(char *string) {
@@ -171,21 +427,19 @@ void kprint(char *string) {
 }
 
 void draw_rect(int width, int height, int offx, int offy, uint32_t color) {
-	for (int i = 0; i < width + 1; i++) {
-		for (int j = 0; j < height + 1; j++) {
-			draw_px(i + offx, j + offy, color);
-		}
-	}
+	for (int j = 0; j < height + 1; j++)
+		video_fill_row(j + offy, offx, width + 1, color);
+	video_mark_dirty(offx, offy, offx + width + 1, offy + height + 1);
+	video_flush();
 }
 
 void clear_screen(uint32_t color) {
-	uint32_t x, y;
-
-	for (x = 0; x < width_s; x++) {
-		for (y = 0; y < height_s; y++) {
-			draw_px(x, y, color);
-		}
-	}
+	if (shadow)
+		shadow_top = 0;
+	for (uint32_t y = 0; y < height_s; y++)
+		video_fill_row(y, 0, width_s, color);
+	video_mark_dirty(0, 0, width_s, height_s);
+	video_flush();
 
 	ssfn_dst.bg = color;
 
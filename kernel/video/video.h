@@ -26,6 +26,11 @@
 
 void vid_reset(void);
 void video_init(struct stivale2_struct_tag_framebuffer *framebuffer);
+// Draw to a copy in normal RAM from now on, needs the memory manager
+void video_shadow_init(void);
+void video_dev_init(void);
+// Copy what changed in the copy out to the framebuffer
+void video_flush(void);
 void putchar_color(int c, uint32_t color, uint32_t bgcolor);
 void putcharx(int c);
 void kprint_color(char *string, uint32_t color);